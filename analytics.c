@@ -0,0 +1,414 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "analytics.h"
+#include "utils.h"
+#include "commands/tags.h"
+
+/* Max number of tracked channels. */
+#define ANALYTICS_MAX_CHANNELS 16
+
+/* HyperLogLog precision: 2^14 one-byte registers, about 0.8% standard error. */
+#define HLL_PRECISION 14
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+/* Count-min sketch rows and counters per row. Width must be a power of two. */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 2048
+
+/* Max length of an emote name or login kept in the top lists. */
+#define ANALYTICS_KEY_SIZE 32
+
+typedef struct {
+  char key[ANALYTICS_KEY_SIZE];
+  uint32_t count;                   /* Sketch estimate when the key was last seen. */
+} hitter_t;
+
+/* Count-min sketch with a min-heap of its heaviest keys. */
+typedef struct {
+  uint32_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+  hitter_t heap[ANALYTICS_MAX_TOP];
+  int count;
+} top_t;
+
+typedef struct {
+  char *name;
+  int64_t window;                   /* Current window, as message time / window length. */
+  uint64_t messages;
+  int64_t second;                   /* Current one-second counter. */
+  uint32_t second_messages;
+  uint32_t peak;
+  uint8_t registers[HLL_REGISTERS];
+  top_t emotes;
+  top_t chatters;
+} channel_t;
+
+struct analytics_t {
+  analytics_config_t config;
+  int channels_count;
+  channel_t *channels[ANALYTICS_MAX_CHANNELS];
+};
+
+/** Private **/
+
+static uint64_t hash_key(const char *key, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)key[idx];
+    hash *= 1099511628211ull;
+  }
+
+  // FNV leaves the high bits poorly mixed, HyperLogLog relies on them.
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static void hll_add(channel_t *channel, uint64_t hash) {
+  uint32_t index = hash >> (64 - HLL_PRECISION);
+  // Guard bit keeps the rank bounded when the remaining bits are all zero.
+  uint64_t rest = (hash << HLL_PRECISION) | (1ull << (HLL_PRECISION - 1));
+  uint8_t rank = __builtin_clzll(rest) + 1;
+
+  if (rank > channel->registers[index]) {
+    channel->registers[index] = rank;
+  }
+}
+
+static uint64_t hll_estimate(channel_t *channel) {
+  double sum = 0;
+  int zeros = 0;
+  for (int idx = 0; idx < HLL_REGISTERS; idx++) {
+    sum += ldexp(1.0, -channel->registers[idx]);
+    zeros += channel->registers[idx] == 0;
+  }
+
+  double m = HLL_REGISTERS;
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+  // Linear counting is more accurate while many registers are still empty.
+  if (estimate <= 2.5 * m && zeros > 0) {
+    estimate = m * log(m / zeros);
+  }
+
+  return (uint64_t)(estimate + 0.5);
+}
+
+static void sift_down(top_t *top, int index) {
+  for (;;) {
+    int smallest = index, left = 2 * index + 1, right = left + 1;
+    if (left < top->count && top->heap[left].count < top->heap[smallest].count) {
+      smallest = left;
+    }
+    if (right < top->count && top->heap[right].count < top->heap[smallest].count) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+
+    hitter_t swap = top->heap[index];
+    top->heap[index] = top->heap[smallest];
+    top->heap[smallest] = swap;
+    index = smallest;
+  }
+}
+
+static void sift_up(top_t *top, int index) {
+  while (index > 0 && top->heap[(index - 1) / 2].count > top->heap[index].count) {
+    hitter_t swap = top->heap[index];
+    top->heap[index] = top->heap[(index - 1) / 2];
+    top->heap[(index - 1) / 2] = swap;
+    index = (index - 1) / 2;
+  }
+}
+
+/**
+ * Counts a key in the sketch and keeps it in the heap if it's among the `size` heaviest.
+ **/
+static void top_add(top_t *top, int size, const char *key, size_t length) {
+  if (length == 0 || length >= ANALYTICS_KEY_SIZE) {
+    return;
+  }
+
+  // Rows index with h1 + row * h2, both halves of one hash.
+  uint64_t hash = hash_key(key, length);
+  uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+  uint32_t estimate = UINT32_MAX;
+  for (int row = 0; row < SKETCH_DEPTH; row++) {
+    uint32_t *counter = &top->counters[row][(h1 + row * h2) & (SKETCH_WIDTH - 1)];
+    if (*counter < UINT32_MAX) {
+      (*counter)++;
+    }
+    if (*counter < estimate) {
+      estimate = *counter;
+    }
+  }
+
+  // Estimates only grow, a key already in the heap moves away from the root.
+  for (int idx = 0; idx < top->count; idx++) {
+    if (strncmp(top->heap[idx].key, key, length) == 0 && top->heap[idx].key[length] == '\0') {
+      top->heap[idx].count = estimate;
+      sift_down(top, idx);
+      return;
+    }
+  }
+
+  if (top->count < size) {
+    hitter_t *hitter = &top->heap[top->count];
+    memcpy(hitter->key, key, length);
+    hitter->key[length] = '\0';
+    hitter->count = estimate;
+    sift_up(top, top->count++);
+  } else if (estimate > top->heap[0].count) {
+    memcpy(top->heap[0].key, key, length);
+    top->heap[0].key[length] = '\0';
+    top->heap[0].count = estimate;
+    sift_down(top, 0);
+  }
+}
+
+static int compare_hitters(const void *first, const void *second) {
+  const hitter_t *a = first, *b = second;
+  return a->count < b->count ? 1 : a->count > b->count ? -1 : strcmp(a->key, b->key);
+}
+
+/**
+ * Writes a top list as a JSON array, heaviest first.
+ *
+ * @return: Length written, or -1 if it doesn't fit.
+ **/
+static int write_top(top_t *top, char *buffer, int size) {
+  hitter_t sorted[ANALYTICS_MAX_TOP];
+  char escaped[ANALYTICS_KEY_SIZE * 2];
+
+  memcpy(sorted, top->heap, top->count * sizeof(hitter_t));
+  qsort(sorted, top->count, sizeof(hitter_t), compare_hitters);
+
+  int length = snprintf(buffer, size, "[");
+  for (int idx = 0; idx < top->count && length < size; idx++) {
+    string_quote_escape(sorted[idx].key, escaped, sizeof(escaped));
+    length += snprintf(buffer + length, size - length, "%s{\"name\":\"%s\",\"count\":%u}",
+      idx > 0 ? "," : "", escaped, sorted[idx].count);
+  }
+  if (length < size) {
+    length += snprintf(buffer + length, size - length, "]");
+  }
+
+  return length < size ? length : -1;
+}
+
+static int write_snapshot(analytics_t *analytics, channel_t *channel, char *snapshot) {
+  char emotes[ANALYTICS_SNAPSHOT_SIZE / 2], chatters[ANALYTICS_SNAPSHOT_SIZE / 2];
+  char escaped[128];
+
+  if (write_top(&channel->emotes, emotes, sizeof(emotes) - 256) == -1
+      || write_top(&channel->chatters, chatters, sizeof(chatters) - 256) == -1) {
+    return 0;
+  }
+
+  string_quote_escape(channel->name, escaped, sizeof(escaped));
+  int length = snprintf(
+    snapshot,
+    ANALYTICS_SNAPSHOT_SIZE,
+    "{\"command\":\"ANALYTICS\",\"channel\":\"%s\",\"start\":%lld,\"duration\":%d,\"messages\":%llu,"
+    "\"rate\":%.2f,\"peak_rate\":%u,\"chatters\":%llu,\"top_emotes\":%s,\"top_chatters\":%s}\n",
+    escaped,
+    (long long)channel->window * analytics->config.window_ms,
+    analytics->config.window_ms,
+    (unsigned long long)channel->messages,
+    channel->messages * 1000.0 / analytics->config.window_ms,
+    channel->peak,
+    (unsigned long long)hll_estimate(channel),
+    emotes,
+    chatters
+  );
+
+  return length < ANALYTICS_SNAPSHOT_SIZE ? length : 0;
+}
+
+static channel_t *find_channel(analytics_t *analytics, const char *name) {
+  for (int idx = 0; idx < analytics->channels_count; idx++) {
+    if (strcmp(analytics->channels[idx]->name, name) == 0) {
+      return analytics->channels[idx];
+    }
+  }
+
+  if (analytics->channels_count == ANALYTICS_MAX_CHANNELS) {
+    return NULL;
+  }
+
+  channel_t *channel = calloc(1, sizeof(channel_t));
+  if (channel == NULL || (channel->name = strdup(name)) == NULL) {
+    free(channel);
+    return NULL;
+  }
+
+  analytics->channels[analytics->channels_count++] = channel;
+  return channel;
+}
+
+static void reset_channel(channel_t *channel, int64_t window) {
+  char *name = channel->name;
+  memset(channel, 0, sizeof(channel_t));
+  channel->name = name;
+  channel->window = window;
+}
+
+/**
+ * Time at which a channel's window can be closed without waiting for a message.
+ **/
+static int64_t closing_time(analytics_t *analytics, channel_t *channel) {
+  return (channel->window + 1) * analytics->config.window_ms + ANALYTICS_GRACE_MS;
+}
+
+/**
+ * Skips a number of code points, emote positions count those rather than bytes.
+ **/
+static const char *skip_characters(const char *text, int count) {
+  while (*text != '\0' && count > 0) {
+    text++;
+    while ((*text & 0xc0) == 0x80) {
+      text++;
+    }
+    count--;
+  }
+  return text;
+}
+
+static void add_emotes(analytics_t *analytics, channel_t *channel, irc_message_t *message) {
+  const tags_t *tags = tags_decode(message);
+
+  for (int idx = 0; idx < tags->emotes_count; idx++) {
+    const emote_range_t *emote = &tags->emotes[idx];
+
+    // Named by the text it replaces, the id is the fallback for ranges off the text.
+    const char *start = skip_characters(message->message, emote->start);
+    const char *end = skip_characters(start, emote->end - emote->start + 1);
+    if (emote->end >= emote->start && *start != '\0' && end > start) {
+      top_add(&channel->emotes, analytics->config.top, start, end - start);
+    } else {
+      top_add(&channel->emotes, analytics->config.top, emote->id, emote->id_length);
+    }
+  }
+}
+
+/** Public **/
+
+analytics_t *analytics_init(analytics_config_t *config) {
+  analytics_t *analytics = calloc(1, sizeof(analytics_t));
+  if (analytics == NULL) {
+    return NULL;
+  }
+
+  analytics->config = *config;
+  if (analytics->config.top > ANALYTICS_MAX_TOP) {
+    analytics->config.top = ANALYTICS_MAX_TOP;
+  }
+  return analytics;
+}
+
+int analytics_add(analytics_t *analytics, irc_message_t *message, char *snapshot) {
+  int length = 0;
+
+  if (message->recipient == NULL || message->recipient[0] != '#' || message->message == NULL) {
+    return 0;
+  }
+
+  channel_t *channel = find_channel(analytics, message->recipient);
+  if (channel == NULL) {
+    return 0;
+  }
+
+  int64_t now_ms = tags_decode(message)->sent_ts;
+  if (now_ms < 0) {
+    now_ms = realtime_ms();
+  }
+
+  // Late messages from a closed window count towards the current one.
+  int64_t window = now_ms / analytics->config.window_ms;
+  if (window > channel->window) {
+    if (channel->messages > 0) {
+      length = write_snapshot(analytics, channel, snapshot);
+    }
+    reset_channel(channel, window);
+  }
+
+  int64_t second = now_ms / 1000;
+  if (second > channel->second) {
+    channel->second = second;
+    channel->second_messages = 0;
+  }
+  if (++channel->second_messages > channel->peak) {
+    channel->peak = channel->second_messages;
+  }
+  channel->messages++;
+
+  const char *user_id = tags_value(message, "user-id");
+  if (user_id != NULL) {
+    hll_add(channel, hash_key(user_id, strlen(user_id)));
+  }
+
+  // Sender looks like ":login!login@login.tmi.twitch.tv".
+  if (message->sender != NULL && message->sender[0] == ':') {
+    top_add(&channel->chatters, analytics->config.top, message->sender + 1, strcspn(message->sender + 1, "!"));
+  }
+
+  add_emotes(analytics, channel, message);
+  return length;
+}
+
+int analytics_close(analytics_t *analytics, int64_t now_ms, char *snapshot) {
+  for (int idx = 0; idx < analytics->channels_count; idx++) {
+    channel_t *channel = analytics->channels[idx];
+    if (channel->messages == 0 || closing_time(analytics, channel) > now_ms) {
+      continue;
+    }
+
+    int length = write_snapshot(analytics, channel, snapshot);
+    reset_channel(channel, now_ms / analytics->config.window_ms);
+    if (length > 0) {
+      return length;
+    }
+  }
+
+  return 0;
+}
+
+int analytics_wait_ms(analytics_t *analytics, int64_t now_ms) {
+  int64_t wait = -1;
+
+  for (int idx = 0; idx < analytics->channels_count; idx++) {
+    channel_t *channel = analytics->channels[idx];
+    if (channel->messages == 0) {
+      continue;
+    }
+
+    int64_t delay = closing_time(analytics, channel) - now_ms;
+    if (delay < 0) {
+      delay = 0;
+    }
+    if (wait == -1 || delay < wait) {
+      wait = delay;
+    }
+  }
+
+  return (int)wait;
+}
+
+void analytics_free(analytics_t *analytics) {
+  if (analytics == NULL) {
+    return;
+  }
+
+  for (int idx = 0; idx < analytics->channels_count; idx++) {
+    free(analytics->channels[idx]->name);
+    free(analytics->channels[idx]);
+  }
+  free(analytics);
+}
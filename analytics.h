@@ -0,0 +1,96 @@
+#ifndef ANALYTICS_HEADER
+#define ANALYTICS_HEADER
+
+#include <stdint.h>
+
+#include "irc.h"
+
+/**
+ * Per-channel chat statistics over tumbling windows, in fixed memory.
+ *
+ * For every window a channel gets:
+ *
+ *   - message count, average and peak messages per second, the peak from
+ *     one-second tumbling counters;
+ *   - unique chatters, estimated with a HyperLogLog over `user-id`s;
+ *   - top emotes and top chatters, counted with a count-min sketch each and
+ *     tracked in a min-heap of the heaviest keys.
+ *
+ * Windows follow message time (`tmi-sent-ts`, the local clock when it's
+ * missing), so replays give the same numbers. A window's snapshot is written
+ * when the first message of a later window arrives in the channel, or by
+ * analytics_close() once the window has ended on the local clock, so quiet
+ * channels get theirs too.
+ *
+ * Not thread-safe, messages are expected to come from a single thread.
+ **/
+typedef struct analytics_t analytics_t;
+
+/* Max number of keys in the top emotes and top chatters lists. */
+#define ANALYTICS_MAX_TOP 32
+
+/* How long after its end a window waits for late messages before analytics_close() takes it, in ms. */
+#define ANALYTICS_GRACE_MS 2000
+
+/* Size of the buffer expected for a snapshot. */
+#define ANALYTICS_SNAPSHOT_SIZE 8192
+
+/* Statistics settings. */
+typedef struct analytics_config_t {
+  int window_ms;        // Length of a window.
+  int top;              // Number of top emotes and chatters in snapshots, up to ANALYTICS_MAX_TOP.
+} analytics_config_t;
+
+/**
+ * Creates empty statistics.
+ *
+ * @param config: Settings. Copied.
+ *
+ * @return: New statistics, or NULL if memory can't be allocated.
+ **/
+analytics_t *analytics_init(analytics_config_t *config);
+
+/**
+ * Counts a chat message. If it opens a new window in its channel, the
+ * snapshot of the channel's previous window is written first, as a
+ * single-line JSON record with "command":"ANALYTICS".
+ *
+ * @param analytics: Statistics.
+ * @param message: Chat message. Messages without a channel are ignored.
+ * @param snapshot: Buffer of ANALYTICS_SNAPSHOT_SIZE bytes.
+ *
+ * @return: Length of the snapshot written, 0 if there's none.
+ **/
+int analytics_add(analytics_t *analytics, irc_message_t *message, char *snapshot);
+
+/**
+ * Writes the snapshot of one channel whose window ended at least
+ * ANALYTICS_GRACE_MS before `now_ms`, and starts the channel's next window.
+ * Windows without messages are skipped. Call until it returns 0.
+ *
+ * @param analytics: Statistics.
+ * @param now_ms: Current time in ms since the epoch, INT64_MAX to close all windows.
+ * @param snapshot: Buffer of ANALYTICS_SNAPSHOT_SIZE bytes.
+ *
+ * @return: Length of the snapshot written, 0 if there's none.
+ **/
+int analytics_close(analytics_t *analytics, int64_t now_ms, char *snapshot);
+
+/**
+ * Time until analytics_close() has a window to close.
+ *
+ * @param analytics: Statistics.
+ * @param now_ms: Current time in ms since the epoch.
+ *
+ * @return: Delay in ms, or -1 if no window has messages.
+ **/
+int analytics_wait_ms(analytics_t *analytics, int64_t now_ms);
+
+/**
+ * Frees the statistics.
+ *
+ * @param analytics: Statistics to free.
+ **/
+void analytics_free(analytics_t *analytics);
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "commands/tags.h"
+
+/* Max number of rooms with an open segment at the same time. */
+#define ARCHIVE_MAX_ROOMS 16
+
+/* Record offset of a message by given user. */
+typedef struct {
+  uint64_t user_id;
+  uint32_t offset;
+} posting_t;
+
+/* Open segment of a single room. */
+typedef struct {
+  uint64_t room_id;
+  char path[PATH_MAX];
+  FILE *segment;
+  FILE *times;
+  uint32_t size;
+  uint32_t records;
+  int64_t max_timestamp;
+  posting_t *postings;
+  int postings_count;
+  int postings_capacity;
+} segment_writer_t;
+
+struct archive_t {
+  char dir[PATH_MAX];
+  segment_writer_t rooms[ARCHIVE_MAX_ROOMS];
+  int rooms_count;
+};
+
+/* Read-only mapping of a file. */
+typedef struct {
+  char *data;
+  size_t size;
+} mapping_t;
+
+/** Private **/
+
+/**
+ * Reads a numeric tag value.
+ *
+ * @param tags: Tags string.
+ * @param tag: Tag name.
+ * @param value: Pointer to hold the value.
+ *
+ * @return: 1 if tag is present and not empty, 0 otherwise.
+ **/
+static int tag_number(char *tags, char *tag, uint64_t *value) {
+  char buffer[32] = { 0 };
+  if (tags_get_tag(tags, tag, buffer, sizeof(buffer)) <= 0) {
+    return 0;
+  }
+  *value = strtoull(buffer, NULL, 10);
+  return 1;
+}
+
+/**
+ * Starts a new segment for the room, named after the first record's timestamp.
+ *
+ * @param archive: Archive writer.
+ * @param writer: Room segment writer.
+ * @param timestamp: Timestamp of the first record.
+ *
+ * @return: 0 on success, -1 in case of an error.
+ **/
+static int segment_open(archive_t *archive, segment_writer_t *writer, int64_t timestamp) {
+  char dir[PATH_MAX], path[PATH_MAX + 8];
+  int fd = -1;
+
+  snprintf(dir, sizeof(dir), "%s/%llu", archive->dir, (unsigned long long)writer->room_id);
+  if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  // Timestamps may repeat after a restart, so bump the name until it's unique.
+  for (int attempt = 0; fd == -1 && attempt < 1000; attempt++) {
+    snprintf(writer->path, sizeof(writer->path), "%s/%013lld", dir, (long long)(timestamp + attempt));
+    snprintf(path, sizeof(path), "%s.seg", writer->path);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd == -1 && errno != EEXIST) {
+      return -1;
+    }
+  }
+  if (fd == -1) {
+    return -1;
+  }
+
+  writer->segment = fdopen(fd, "w");
+  snprintf(path, sizeof(path), "%s.tix", writer->path);
+  writer->times = fopen(path, "w");
+  if (writer->segment == NULL || writer->times == NULL) {
+    return -1;
+  }
+
+  fwrite(ARCHIVE_SEGMENT_MAGIC, 1, strlen(ARCHIVE_SEGMENT_MAGIC), writer->segment);
+  writer->size = strlen(ARCHIVE_SEGMENT_MAGIC);
+  writer->records = 0;
+  writer->max_timestamp = INT64_MIN;
+  writer->postings_count = 0;
+  return 0;
+}
+
+static int compare_postings(const void *a, const void *b) {
+  const posting_t *left = a, *right = b;
+  if (left->user_id != right->user_id) {
+    return left->user_id < right->user_id ? -1 : 1;
+  }
+  if (left->offset != right->offset) {
+    return left->offset < right->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+/**
+ * Closes the room's segment and writes its user index next to it.
+ *
+ * @param writer: Room segment writer.
+ **/
+static void segment_close(segment_writer_t *writer) {
+  char path[PATH_MAX + 8], tmp_path[PATH_MAX + 16];
+
+  if (writer->segment == NULL) {
+    return;
+  }
+
+  fclose(writer->segment);
+  fclose(writer->times);
+  writer->segment = NULL;
+  writer->times = NULL;
+
+  qsort(writer->postings, writer->postings_count, sizeof(posting_t), compare_postings);
+
+  // Count distinct users first so the entries can be written in one go.
+  uint32_t users = 0;
+  for (int idx = 0; idx < writer->postings_count; idx++) {
+    if (idx == 0 || writer->postings[idx].user_id != writer->postings[idx - 1].user_id) {
+      users++;
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s.uix", writer->path);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.uix.tmp", writer->path);
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    perror("Failed to write archive user index");
+    return;
+  }
+
+  fwrite(ARCHIVE_USERS_MAGIC, 1, strlen(ARCHIVE_USERS_MAGIC), file);
+  fwrite(&users, sizeof(users), 1, file);
+
+  archive_user_entry_t entry = { 0 };
+  for (int idx = 0; idx < writer->postings_count; idx++) {
+    if (idx > 0 && writer->postings[idx].user_id != entry.user_id) {
+      fwrite(&entry, sizeof(entry), 1, file);
+      entry.first = idx;
+      entry.count = 0;
+    }
+    entry.user_id = writer->postings[idx].user_id;
+    entry.count++;
+  }
+  if (writer->postings_count > 0) {
+    fwrite(&entry, sizeof(entry), 1, file);
+  }
+
+  for (int idx = 0; idx < writer->postings_count; idx++) {
+    fwrite(&writer->postings[idx].offset, sizeof(uint32_t), 1, file);
+  }
+
+  // Index only appears once it's complete.
+  if (fclose(file) == 0) {
+    rename(tmp_path, path);
+  }
+}
+
+static segment_writer_t *room_writer(archive_t *archive, uint64_t room_id) {
+  for (int idx = 0; idx < archive->rooms_count; idx++) {
+    if (archive->rooms[idx].room_id == room_id) {
+      return &archive->rooms[idx];
+    }
+  }
+
+  if (archive->rooms_count == ARCHIVE_MAX_ROOMS) {
+    return NULL;
+  }
+
+  segment_writer_t *writer = &archive->rooms[archive->rooms_count++];
+  writer->room_id = room_id;
+  return writer;
+}
+
+static int map_file(const char *path, mapping_t *mapping) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  mapping->data = NULL;
+  mapping->size = 0;
+
+  if (fd == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+
+  mapping->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping->data == MAP_FAILED) {
+    mapping->data = NULL;
+    return -1;
+  }
+
+  mapping->size = st.st_size;
+  return 0;
+}
+
+static void unmap_file(mapping_t *mapping) {
+  if (mapping->data != NULL) {
+    munmap(mapping->data, mapping->size);
+  }
+}
+
+/**
+ * Decodes a record at given offset.
+ *
+ * @return: Size of the record, or 0 if the offset doesn't hold a complete record.
+ **/
+static uint32_t read_record(mapping_t *segment, uint32_t offset, archive_entry_t *entry) {
+  archive_record_t record;
+
+  if (offset + sizeof(record) > segment->size) {
+    return 0;
+  }
+  memcpy(&record, segment->data + offset, sizeof(record));
+  if (record.size < sizeof(record) || offset + record.size > segment->size) {
+    return 0;
+  }
+
+  const char *data = segment->data + offset + sizeof(record);
+  entry->timestamp = record.timestamp;
+  entry->user_id = record.user_id;
+  entry->room_id = record.room_id;
+  entry->sender = data;
+  entry->sender_size = record.sender_size;
+  entry->command = data + record.sender_size;
+  entry->command_size = record.command_size;
+  entry->text = data + record.sender_size + record.command_size;
+  entry->text_size = record.text_size;
+  return record.size;
+}
+
+/**
+ * Finds the offset to start scanning from: the last index entry whose preceding
+ * records are all older than `from`.
+ **/
+static uint32_t time_lookup(mapping_t *times, int64_t from) {
+  uint32_t offset = strlen(ARCHIVE_SEGMENT_MAGIC);
+  if (times->data == NULL) {
+    return offset;
+  }
+
+  archive_time_entry_t entry;
+  size_t low = 0, high = times->size / sizeof(entry);
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    memcpy(&entry, times->data + middle * sizeof(entry), sizeof(entry));
+    if (entry.timestamp < from) {
+      offset = entry.offset;
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return offset;
+}
+
+/**
+ * Finds user's postings in the user index.
+ *
+ * @return: Pointer to record offsets, or NULL if user has none. Count goes into `count`.
+ **/
+static const char *user_lookup(mapping_t *users, uint64_t user_id, uint32_t *count) {
+  size_t header = strlen(ARCHIVE_USERS_MAGIC) + sizeof(uint32_t);
+  uint32_t total;
+  archive_user_entry_t entry;
+
+  *count = 0;
+  if (users->size < header || memcmp(users->data, ARCHIVE_USERS_MAGIC, strlen(ARCHIVE_USERS_MAGIC)) != 0) {
+    return NULL;
+  }
+  memcpy(&total, users->data + strlen(ARCHIVE_USERS_MAGIC), sizeof(total));
+  if (header + (size_t)total * sizeof(entry) > users->size) {
+    return NULL;
+  }
+
+  const char *entries = users->data + header;
+  const char *postings = entries + total * sizeof(entry);
+  size_t low = 0, high = total;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    memcpy(&entry, entries + middle * sizeof(entry), sizeof(entry));
+    if (entry.user_id == user_id) {
+      if (postings + (size_t)(entry.first + entry.count) * sizeof(uint32_t) > users->data + users->size) {
+        return NULL;
+      }
+      *count = entry.count;
+      return postings + entry.first * sizeof(uint32_t);
+    } else if (entry.user_id < user_id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return NULL;
+}
+
+static int matches(archive_entry_t *entry, archive_query_t *query) {
+  return entry->timestamp >= query->from
+    && entry->timestamp <= query->to
+    && (query->user_id == 0 || entry->user_id == query->user_id);
+}
+
+/**
+ * Runs the query against a single segment.
+ *
+ * @param base: Segment path without extension.
+ *
+ * @return: Number of matching records.
+ **/
+static int query_segment(
+  const char *base,
+  archive_query_t *query,
+  void (*callback)(archive_entry_t *entry, void *context),
+  void *context
+) {
+  char path[PATH_MAX + 8];
+  mapping_t segment, times, users;
+  archive_entry_t entry;
+  int found = 0;
+
+  snprintf(path, sizeof(path), "%s.seg", base);
+  if (map_file(path, &segment) != 0) {
+    return 0;
+  }
+
+  // Time index narrows down where to start looking.
+  snprintf(path, sizeof(path), "%s.tix", base);
+  map_file(path, &times);
+  uint32_t start = time_lookup(&times, query->from), offset, size;
+  unmap_file(&times);
+
+  // Segments closed cleanly have a user index. Otherwise fall back to a time range scan.
+  snprintf(path, sizeof(path), "%s.uix", base);
+  if (query->user_id != 0 && map_file(path, &users) == 0) {
+    uint32_t count, low = 0, high;
+    const char *postings = user_lookup(&users, query->user_id, &count);
+
+    // Postings are sorted by offset, skip the ones before the start.
+    high = count;
+    while (low < high) {
+      uint32_t middle = (low + high) / 2;
+      memcpy(&offset, postings + middle * sizeof(uint32_t), sizeof(offset));
+      if (offset < start) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+
+    for (uint32_t idx = low; idx < count; idx++) {
+      memcpy(&offset, postings + idx * sizeof(uint32_t), sizeof(offset));
+      if (read_record(&segment, offset, &entry) == 0 || entry.timestamp - ARCHIVE_MAX_SKEW_MS > query->to) {
+        break;
+      }
+      if (matches(&entry, query)) {
+        callback(&entry, context);
+        found++;
+      }
+    }
+    unmap_file(&users);
+  } else {
+    offset = start;
+    while ((size = read_record(&segment, offset, &entry)) > 0) {
+      if (entry.timestamp - ARCHIVE_MAX_SKEW_MS > query->to) {
+        break;
+      }
+      if (matches(&entry, query)) {
+        callback(&entry, context);
+        found++;
+      }
+      offset += size;
+    }
+  }
+
+  unmap_file(&segment);
+  return found;
+}
+
+static int segment_filter(const struct dirent *entry) {
+  size_t length = strlen(entry->d_name);
+  return length > 4 && strcmp(entry->d_name + length - 4, ".seg") == 0;
+}
+
+/** Public **/
+
+archive_t *archive_open(const char *dir) {
+  if (mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) {
+    return NULL;
+  }
+
+  archive_t *archive = calloc(1, sizeof(archive_t));
+  snprintf(archive->dir, sizeof(archive->dir), "%s", dir);
+  return archive;
+}
+
+int archive_append(archive_t *archive, irc_message_t *message) {
+  uint64_t room_id, user_id, timestamp;
+
+  if (message->tags == NULL || message->message == NULL || message->command == NULL) {
+    return 0;
+  }
+  if (!tag_number(message->tags, "room-id", &room_id)
+      || !tag_number(message->tags, "user-id", &user_id)
+      || !tag_number(message->tags, "tmi-sent-ts", &timestamp)) {
+    return 0;
+  }
+
+  segment_writer_t *writer = room_writer(archive, room_id);
+  if (writer == NULL) {
+    return -1;
+  }
+
+  // Sender prefix looks like ":nick!user@host", only the nick is kept.
+  const char *sender = message->sender != NULL ? message->sender : "";
+  if (sender[0] == ':') {
+    sender++;
+  }
+  size_t sender_size = strcspn(sender, "!");
+  size_t command_size = strlen(message->command);
+  size_t text_size = strlen(message->message);
+  if (sender_size > UINT8_MAX) sender_size = UINT8_MAX;
+  if (command_size > UINT8_MAX) command_size = UINT8_MAX;
+  if (text_size > UINT16_MAX) text_size = UINT16_MAX;
+
+  archive_record_t record = {
+    .size = sizeof(archive_record_t) + sender_size + command_size + text_size,
+    .timestamp = (int64_t)timestamp,
+    .user_id = user_id,
+    .room_id = room_id,
+    .sender_size = sender_size,
+    .command_size = command_size,
+    .text_size = text_size
+  };
+
+  if (writer->segment != NULL && writer->size + record.size > ARCHIVE_SEGMENT_SIZE) {
+    segment_close(writer);
+  }
+  if (writer->segment == NULL && segment_open(archive, writer, record.timestamp) != 0) {
+    perror("Failed to open archive segment");
+    return -1;
+  }
+
+  if (writer->records % ARCHIVE_INDEX_STRIDE == 0) {
+    archive_time_entry_t entry = { .timestamp = writer->max_timestamp, .offset = writer->size };
+    fwrite(&entry, sizeof(entry), 1, writer->times);
+  }
+
+  fwrite(&record, sizeof(record), 1, writer->segment);
+  fwrite(sender, 1, sender_size, writer->segment);
+  fwrite(message->command, 1, command_size, writer->segment);
+  fwrite(message->message, 1, text_size, writer->segment);
+
+  if (writer->postings_count == writer->postings_capacity) {
+    writer->postings_capacity = writer->postings_capacity == 0 ? 1024 : writer->postings_capacity * 2;
+    writer->postings = realloc(writer->postings, writer->postings_capacity * sizeof(posting_t));
+  }
+  writer->postings[writer->postings_count].user_id = user_id;
+  writer->postings[writer->postings_count].offset = writer->size;
+  writer->postings_count++;
+
+  writer->size += record.size;
+  writer->records++;
+  if (record.timestamp > writer->max_timestamp) {
+    writer->max_timestamp = record.timestamp;
+  }
+
+  return 1;
+}
+
+void archive_flush(archive_t *archive) {
+  for (int idx = 0; idx < archive->rooms_count; idx++) {
+    if (archive->rooms[idx].segment != NULL) {
+      fflush(archive->rooms[idx].segment);
+      fflush(archive->rooms[idx].times);
+    }
+  }
+}
+
+void archive_close(archive_t *archive) {
+  if (archive == NULL) {
+    return;
+  }
+
+  for (int idx = 0; idx < archive->rooms_count; idx++) {
+    segment_close(&archive->rooms[idx]);
+    free(archive->rooms[idx].postings);
+  }
+  free(archive);
+}
+
+int archive_query(
+  const char *dir,
+  archive_query_t *query,
+  void (*callback)(archive_entry_t *entry, void *context),
+  void *context
+) {
+  char room_dir[PATH_MAX], base[PATH_MAX * 2];
+  struct dirent **segments;
+  int found = 0;
+
+  snprintf(room_dir, sizeof(room_dir), "%s/%llu", dir, (unsigned long long)query->room_id);
+  int count = scandir(room_dir, &segments, segment_filter, alphasort);
+  if (count < 0) {
+    return -1;
+  }
+
+  for (int idx = 0; idx < count; idx++) {
+    // Segment covers timestamps from its name up to the next segment's start, plus skew.
+    int64_t first = strtoll(segments[idx]->d_name, NULL, 10);
+    int64_t next = idx + 1 < count ? strtoll(segments[idx + 1]->d_name, NULL, 10) : INT64_MAX;
+    int overlaps = first - ARCHIVE_MAX_SKEW_MS <= query->to
+      && (next == INT64_MAX || next + ARCHIVE_MAX_SKEW_MS >= query->from);
+
+    if (overlaps) {
+      snprintf(base, sizeof(base), "%s/%.*s", room_dir, (int)(strlen(segments[idx]->d_name) - 4), segments[idx]->d_name);
+      found += query_segment(base, query, callback, context);
+    }
+    free(segments[idx]);
+  }
+  free(segments);
+
+  return found;
+}
@@ -0,0 +1,131 @@
+#ifndef ARCHIVE_HEADER
+#define ARCHIVE_HEADER
+
+#include <stdint.h>
+
+#include "irc.h"
+
+/**
+ * Indexed on-disk chat archive.
+ *
+ * Messages are appended to segment files grouped by room:
+ *
+ *   <dir>/<room-id>/<first-ts>.seg  Records: archive_record_t + sender, command, text.
+ *   <dir>/<room-id>/<first-ts>.tix  Time index: archive_time_entry_t every ARCHIVE_INDEX_STRIDE records.
+ *   <dir>/<room-id>/<first-ts>.uix  User index, written when the segment is closed.
+ *
+ * Timestamps are `tmi-sent-ts` values in milliseconds.
+ **/
+
+#define ARCHIVE_SEGMENT_MAGIC "TWARC001"
+#define ARCHIVE_USERS_MAGIC "TWUIX001"
+
+/* Segment is closed and a new one started once it grows past this size. */
+#define ARCHIVE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* Number of records between time index entries. */
+#define ARCHIVE_INDEX_STRIDE 64
+
+/* How far out of order `tmi-sent-ts` values are expected to arrive. */
+#define ARCHIVE_MAX_SKEW_MS 10000
+
+/* Segment record header. */
+typedef struct __attribute__((packed)) archive_record_t {
+  uint32_t size;         // Size of the whole record, header included.
+  int64_t timestamp;
+  uint64_t user_id;
+  uint64_t room_id;
+  uint8_t sender_size;
+  uint8_t command_size;
+  uint16_t text_size;
+} archive_record_t;
+
+/* Time index entry. Timestamp is the max timestamp of all records before the offset. */
+typedef struct __attribute__((packed)) archive_time_entry_t {
+  int64_t timestamp;
+  uint32_t offset;
+} archive_time_entry_t;
+
+/* User index entry. Points to `count` record offsets starting at `first` in the postings array. */
+typedef struct __attribute__((packed)) archive_user_entry_t {
+  uint64_t user_id;
+  uint32_t first;
+  uint32_t count;
+} archive_user_entry_t;
+
+/* Archived message as returned by queries. Strings point into mapped segments and aren't terminated. */
+typedef struct archive_entry_t {
+  int64_t timestamp;
+  uint64_t user_id;
+  uint64_t room_id;
+  const char *sender;
+  int sender_size;
+  const char *command;
+  int command_size;
+  const char *text;
+  int text_size;
+} archive_entry_t;
+
+/* Query parameters. Zero user_id matches any user. */
+typedef struct archive_query_t {
+  uint64_t room_id;
+  uint64_t user_id;
+  int64_t from;
+  int64_t to;
+} archive_query_t;
+
+/* Archive writer. */
+typedef struct archive_t archive_t;
+
+/**
+ * Opens an archive for writing. Creates the directory if needed.
+ *
+ * @param dir: Archive directory.
+ *
+ * @return: Archive writer, or NULL in case of an error.
+ **/
+archive_t *archive_open(const char *dir);
+
+/**
+ * Appends a message to the archive. Messages without `room-id`, `user-id` or
+ * `tmi-sent-ts` tags are skipped.
+ *
+ * @param archive: Archive writer.
+ * @param message: Message to store.
+ *
+ * @return: 1 if message was stored, 0 if skipped, -1 in case of an error.
+ **/
+int archive_append(archive_t *archive, irc_message_t *message);
+
+/**
+ * Flushes buffered records to disk, making them visible to queries.
+ *
+ * @param archive: Archive writer.
+ **/
+void archive_flush(archive_t *archive);
+
+/**
+ * Closes all open segments, writes their user indexes and frees the writer.
+ *
+ * @param archive: Archive writer.
+ **/
+void archive_close(archive_t *archive);
+
+/**
+ * Finds archived messages matching the query, in storage order.
+ *
+ * @param dir: Archive directory.
+ * @param query: Query parameters.
+ * @param callback: Function to call for each matching message.
+ * @param context: Context passed to the callback.
+ *
+ * @return: Number of matching messages, or -1 in case of an error.
+ **/
+int archive_query(
+  const char *dir,
+  archive_query_t *query,
+  void (*callback)(archive_entry_t *entry, void *context),
+  void *context
+);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "irc.h"
+
+/* Number of messages in a slab. */
+#define ARENA_SLAB_MESSAGES 64
+
+/* Default size of a bump allocator chunk. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Number of slabs and chunks kept after a reset. */
+#define ARENA_RESERVE 4
+
+/* Max number of free blocks kept in the pool. Blocks above it go back to the heap. */
+#define MESSAGE_POOL_MAX_FREE 4096
+
+typedef struct arena_slab_t {
+  struct arena_slab_t *next;
+  int used;
+  irc_message_t messages[ARENA_SLAB_MESSAGES];
+} arena_slab_t;
+
+typedef struct arena_chunk_t {
+  struct arena_chunk_t *next;
+  size_t used;
+  size_t size;
+  _Alignas(16) char data[];
+} arena_chunk_t;
+
+struct message_arena_t {
+  arena_slab_t *slabs;
+  arena_slab_t *slab;
+  arena_chunk_t *chunks;
+  arena_chunk_t *chunk;
+};
+
+/* Free block in the pool. */
+typedef struct pool_block_t {
+  struct pool_block_t *next;
+} pool_block_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pool_block_t *free;
+  int free_count;
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/** Private **/
+
+static arena_chunk_t *chunk_new(size_t size) {
+  arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + size);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  chunk->next = NULL;
+  chunk->used = 0;
+  chunk->size = size;
+  return chunk;
+}
+
+/**
+ * Frees everything in a list past the first ARENA_RESERVE elements.
+ * Both slabs and chunks start with a `next` pointer.
+ **/
+static void trim_list(void *head) {
+  struct link { struct link *next; } *node = head, *next;
+
+  for (int idx = 1; node != NULL && idx < ARENA_RESERVE; idx++) {
+    node = node->next;
+  }
+  if (node == NULL) {
+    return;
+  }
+
+  next = node->next;
+  node->next = NULL;
+  while (next != NULL) {
+    node = next;
+    next = node->next;
+    free(node);
+  }
+}
+
+/** Arena **/
+
+message_arena_t *arena_init() {
+  message_arena_t *arena = calloc(1, sizeof(message_arena_t));
+  if (arena == NULL) {
+    return NULL;
+  }
+
+  arena->slabs = calloc(1, sizeof(arena_slab_t));
+  arena->chunks = chunk_new(ARENA_CHUNK_SIZE);
+  if (arena->slabs == NULL || arena->chunks == NULL) {
+    arena_free(arena);
+    return NULL;
+  }
+
+  arena->slab = arena->slabs;
+  arena->chunk = arena->chunks;
+  return arena;
+}
+
+void *arena_alloc(message_arena_t *arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  // Move on to the next chunk, reusing one left from earlier batches if possible.
+  while (arena->chunk->used + size > arena->chunk->size) {
+    if (arena->chunk->next == NULL) {
+      arena_chunk_t *chunk = chunk_new(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+      if (chunk == NULL) {
+        return NULL;
+      }
+      arena->chunk->next = chunk;
+    }
+    arena->chunk = arena->chunk->next;
+    arena->chunk->used = 0;
+  }
+
+  void *pointer = arena->chunk->data + arena->chunk->used;
+  arena->chunk->used += size;
+  memset(pointer, 0, size);
+  return pointer;
+}
+
+void *arena_alloc_message(message_arena_t *arena) {
+  if (arena->slab->used == ARENA_SLAB_MESSAGES) {
+    if (arena->slab->next == NULL) {
+      arena->slab->next = calloc(1, sizeof(arena_slab_t));
+      if (arena->slab->next == NULL) {
+        return NULL;
+      }
+    }
+    arena->slab = arena->slab->next;
+    arena->slab->used = 0;
+  }
+
+  irc_message_t *message = &arena->slab->messages[arena->slab->used++];
+  memset(message, 0, sizeof(irc_message_t));
+  return message;
+}
+
+void arena_reset(message_arena_t *arena) {
+  trim_list(arena->slabs);
+  trim_list(arena->chunks);
+
+  arena->slab = arena->slabs;
+  arena->slab->used = 0;
+  arena->chunk = arena->chunks;
+  arena->chunk->used = 0;
+}
+
+void arena_free(message_arena_t *arena) {
+  if (arena == NULL) {
+    return;
+  }
+
+  while (arena->slabs != NULL) {
+    arena_slab_t *next = arena->slabs->next;
+    free(arena->slabs);
+    arena->slabs = next;
+  }
+  while (arena->chunks != NULL) {
+    arena_chunk_t *next = arena->chunks->next;
+    free(arena->chunks);
+    arena->chunks = next;
+  }
+  free(arena);
+}
+
+/** Pool **/
+
+void *message_pool_get() {
+  pthread_mutex_lock(&pool.lock);
+  pool_block_t *block = pool.free;
+  if (block != NULL) {
+    pool.free = block->next;
+    pool.free_count--;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (block == NULL) {
+    block = malloc(MESSAGE_POOL_BLOCK);
+  }
+  return block;
+}
+
+void message_pool_put(void *pointer) {
+  pool_block_t *block = pointer;
+
+  pthread_mutex_lock(&pool.lock);
+  if (pool.free_count < MESSAGE_POOL_MAX_FREE) {
+    block->next = pool.free;
+    pool.free = block;
+    pool.free_count++;
+    block = NULL;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  free(block);
+}
@@ -0,0 +1,80 @@
+#ifndef ARENA_HEADER
+#define ARENA_HEADER
+
+#include <stddef.h>
+
+/**
+ * Message memory management.
+ *
+ * Message arena: fixed-size slabs of message structures plus a bump allocator
+ * for field bytes. Nothing is freed individually, the whole arena is reset
+ * once a batch of messages is handled, and its memory is reused for the next
+ * batch.
+ *
+ * Message pool: process-wide free list of fixed-size blocks, each holding a
+ * single self-contained message. Used for copies that outlive a batch, e.g.
+ * ones handed over to another thread.
+ **/
+
+/* Size of a pool block. Fits the message structure and all fields of the longest line. */
+#define MESSAGE_POOL_BLOCK 2560
+
+typedef struct message_arena_t message_arena_t;
+
+/**
+ * Creates a new arena.
+ *
+ * @return: A new arena, or NULL if memory can't be allocated.
+ **/
+message_arena_t *arena_init();
+
+/**
+ * Allocates a zeroed chunk of memory from the arena.
+ *
+ * @param arena: Arena.
+ * @param size: Number of bytes.
+ *
+ * @return: Pointer valid until the next reset.
+ **/
+void *arena_alloc(message_arena_t *arena, size_t size);
+
+/**
+ * Allocates a zeroed message structure from the arena's slabs.
+ *
+ * @param arena: Arena.
+ *
+ * @return: Pointer valid until the next reset.
+ **/
+void *arena_alloc_message(message_arena_t *arena);
+
+/**
+ * Releases everything allocated since the last reset. Memory is kept for
+ * reuse, except for chunks above a small reserve, so a single huge batch
+ * doesn't pin memory forever.
+ *
+ * @param arena: Arena.
+ **/
+void arena_reset(message_arena_t *arena);
+
+/**
+ * Frees the arena and all memory it holds.
+ *
+ * @param arena: Arena.
+ **/
+void arena_free(message_arena_t *arena);
+
+/**
+ * Takes a block of MESSAGE_POOL_BLOCK bytes from the pool. Thread-safe.
+ *
+ * @return: Pointer to the block, or NULL if memory can't be allocated.
+ **/
+void *message_pool_get();
+
+/**
+ * Returns a block to the pool. Thread-safe.
+ *
+ * @param block: Block taken with message_pool_get.
+ **/
+void message_pool_put(void *block);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "../irc.h"
+#include "../prefilter.h"
+#include "../json.h"
+#include "../utils.h"
+#include "../commands/tags.h"
+
+/**
+ * Microbenchmarks for the hot path of the relay: message parsing, tag lookup,
+ * quote escaping and JSON serialization. Every benchmark runs over the same
+ * corpus of raw IRC lines and prints a single line in a fixed format:
+ *
+ *   BENCH <name> msgs=<count> ns/msg=<float> allocs/msg=<float> bytes/cycle=<float>
+ *
+ * Names are padded to 12 characters and must fit in them to keep the columns.
+ *
+ * "bytes" is the amount of input handed to the benchmarked function, so numbers
+ * are comparable between commits as long as the corpus stays the same.
+ **/
+
+/* Version of the output format. Bump when fields change. */
+#define BENCH_FORMAT_VERSION 1
+
+/* Default number of passes over the corpus. */
+#define DEFAULT_ROUNDS 20000
+
+/* Max number of lines in a corpus. */
+#define MAX_LINES 1024
+
+/** Allocation counting **/
+
+/* Number of heap allocations made since the last reset. */
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+/** Corpus **/
+
+typedef struct {
+  int count;
+  char *data;
+  char *lines[MAX_LINES];
+  int sizes[MAX_LINES];
+  irc_message_t *messages[MAX_LINES];
+} corpus_t;
+
+/**
+ * Loads corpus file and splits it into lines. Each line keeps its trailing
+ * "\r\n", same as it would come from the socket.
+ *
+ * @param path: Path to the corpus file.
+ * @param corpus: Corpus to fill.
+ *
+ * @return: 0 on success, -1 on error.
+ **/
+static int corpus_load(const char *path, corpus_t *corpus) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror("Failed to open corpus");
+    return -1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  corpus->data = malloc(size + 1);
+  if (fread(corpus->data, 1, size, file) != (size_t)size) {
+    perror("Failed to read corpus");
+    fclose(file);
+    return -1;
+  }
+  corpus->data[size] = '\0';
+  fclose(file);
+
+  char *line = corpus->data;
+  while (*line != '\0' && corpus->count < MAX_LINES) {
+    char *end = strchr(line, '\n');
+    if (end == NULL) {
+      break;
+    }
+    corpus->lines[corpus->count] = line;
+    corpus->sizes[corpus->count] = end - line + 1;
+    corpus->messages[corpus->count] = irc_parse_message(line, end - line);
+    corpus->count++;
+    line = end + 1;
+  }
+
+  return 0;
+}
+
+/** Measurement **/
+
+typedef struct {
+  struct timespec started;
+  uint64_t cycles;
+  unsigned long allocations;
+} probe_t;
+
+static uint64_t cycles_now() {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void probe_start(probe_t *probe) {
+  allocations = 0;
+  clock_gettime(CLOCK_MONOTONIC, &probe->started);
+  probe->cycles = cycles_now();
+}
+
+/**
+ * Stops the measurement and prints the result line.
+ *
+ * @param probe: Probe started with probe_start.
+ * @param name: Benchmark name.
+ * @param messages: Number of processed messages.
+ * @param bytes: Number of processed input bytes.
+ **/
+static void probe_report(probe_t *probe, const char *name, unsigned long messages, unsigned long bytes) {
+  struct timespec now;
+  uint64_t cycles = cycles_now() - probe->cycles;
+  unsigned long allocs = allocations;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double ns = (now.tv_sec - probe->started.tv_sec) * 1e9 + (now.tv_nsec - probe->started.tv_nsec);
+  if (messages == 0) {
+    messages = 1;
+  }
+
+  printf("BENCH %-12s msgs=%lu ns/msg=%.1f allocs/msg=%.2f ", name, messages, ns / messages, (double)allocs / messages);
+  if (cycles > 0) {
+    printf("bytes/cycle=%.3f\n", (double)bytes / cycles);
+  } else {
+    printf("bytes/cycle=n/a\n");
+  }
+}
+
+/* Keeps the compiler from throwing away benchmarked results. */
+static volatile int sink = 0;
+
+/** Benchmarks **/
+
+static void bench_parse(corpus_t *corpus, int rounds) {
+  irc_t *irc = irc_init(-1);
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      irc_feed(irc, corpus->lines[idx], corpus->sizes[idx]);
+      irc_message_t *message = irc_pop_message(irc);
+      if (message != NULL) {
+        sink += message->command != NULL;
+        irc_message_free(message);
+      }
+      bytes += corpus->sizes[idx];
+      messages++;
+    }
+  }
+  probe_report(&probe, "parse", messages, bytes);
+
+  free(irc);
+}
+
+static void bench_parse_arena(corpus_t *corpus, int rounds) {
+  irc_t *irc = irc_init(-1);
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  irc_use_arena(irc);
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      irc_feed(irc, corpus->lines[idx], corpus->sizes[idx]);
+      irc_message_t *message = irc_pop_message(irc);
+      if (message != NULL) {
+        sink += message->command != NULL;
+        irc_message_free(message);
+      }
+      bytes += corpus->sizes[idx];
+      messages++;
+    }
+    irc_reset_arena(irc);
+  }
+  probe_report(&probe, "parse-arena", messages, bytes);
+
+  irc_free(irc);
+}
+
+static void bench_parse_prefilter(corpus_t *corpus, int rounds) {
+  prefilter_config_t config = { .drop = "JOIN,PART,ROOMSTATE,USERSTATE,CLEARMSG" };
+  prefilter_t *prefilter = prefilter_init(&config);
+  irc_t *irc = irc_init(-1);
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  irc_use_arena(irc);
+  irc_set_prefilter(irc, prefilter);
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      irc_feed(irc, corpus->lines[idx], corpus->sizes[idx]);
+      irc_message_t *message = irc_pop_message(irc);
+      if (message != NULL) {
+        sink += message->command != NULL;
+        irc_message_free(message);
+      }
+      bytes += corpus->sizes[idx];
+      messages++;
+    }
+    irc_reset_arena(irc);
+  }
+  probe_report(&probe, "parse-skip", messages, bytes);
+
+  free(irc);
+  prefilter_free(prefilter);
+}
+
+static void bench_clone(corpus_t *corpus, int rounds) {
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      irc_message_t *copy = irc_message_clone(corpus->messages[idx]);
+      sink += copy->command != NULL;
+      irc_message_free(copy);
+      bytes += corpus->sizes[idx];
+      messages++;
+    }
+  }
+  probe_report(&probe, "clone", messages, bytes);
+}
+
+static void bench_tags(corpus_t *corpus, int rounds) {
+  char value[128];
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      char *tags = corpus->messages[idx]->tags;
+      if (tags == NULL) {
+        continue;
+      }
+      sink += tags_get_tag(tags, "display-name", value, sizeof(value));
+      sink += tags_tag_contains(tags, "badges", "moderator");
+      bytes += strlen(tags);
+      messages++;
+    }
+  }
+  probe_report(&probe, "tags", messages, bytes);
+}
+
+static void bench_tags_decode(corpus_t *corpus, int rounds) {
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      irc_message_t *message = corpus->messages[idx];
+      if (message->tags == NULL) {
+        continue;
+      }
+      // Drop the cached copy so every round decodes from scratch.
+      free(atomic_exchange(&message->cache, NULL));
+      const char *display_name = tags_value(message, "display-name");
+      sink += display_name != NULL ? display_name[0] : 0;
+      sink += tags_has_badge(message, BADGE_MODERATOR);
+      bytes += strlen(message->tags);
+      messages++;
+    }
+  }
+  probe_report(&probe, "tags-decode", messages, bytes);
+}
+
+static void bench_escape(corpus_t *corpus, int rounds) {
+  char output[JSON_BUFFER_SIZE];
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      char *text = corpus->messages[idx]->message;
+      if (text == NULL) {
+        continue;
+      }
+      string_quote_escape(text, output, sizeof(output));
+      sink += output[0];
+      bytes += strlen(text);
+      messages++;
+    }
+  }
+  probe_report(&probe, "escape", messages, bytes);
+}
+
+static void bench_serialize(corpus_t *corpus, int rounds) {
+  char output[JSON_BUFFER_SIZE];
+  unsigned long messages = 0, bytes = 0;
+  probe_t probe;
+
+  probe_start(&probe);
+  for (int round = 0; round < rounds; round++) {
+    for (int idx = 0; idx < corpus->count; idx++) {
+      output[0] = '\0';
+      serialize_message(corpus->messages[idx], output);
+      sink += output[0];
+      bytes += corpus->sizes[idx];
+      messages++;
+    }
+  }
+  probe_report(&probe, "serialize", messages, bytes);
+}
+
+/** Main **/
+
+int main(int argc, char **argv) {
+  const char *path = "corpus.txt";
+  int rounds = DEFAULT_ROUNDS;
+
+  if (argc > 1) {
+    path = argv[1];
+  }
+  if (argc > 2) {
+    rounds = atoi(argv[2]);
+  }
+
+  static corpus_t corpus = { 0 };
+  if (corpus_load(path, &corpus) != 0) {
+    return 1;
+  }
+
+  unsigned long total = 0;
+  for (int idx = 0; idx < corpus.count; idx++) {
+    total += corpus.sizes[idx];
+  }
+
+  printf("# bench-format=%d corpus=%s lines=%d bytes=%lu rounds=%d\n", BENCH_FORMAT_VERSION, path, corpus.count, total, rounds);
+  bench_parse(&corpus, rounds);
+  bench_parse_arena(&corpus, rounds);
+  bench_parse_prefilter(&corpus, rounds);
+  bench_clone(&corpus, rounds);
+  bench_tags(&corpus, rounds);
+  bench_tags_decode(&corpus, rounds);
+  bench_escape(&corpus, rounds);
+  bench_serialize(&corpus, rounds);
+
+  return 0;
+}
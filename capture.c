@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+
+struct capture_t {
+  int fd;
+  uint32_t connections;
+};
+
+struct replay_t {
+  char *data;
+  size_t size;
+  size_t offset;
+  int version;
+};
+
+/* Record header of the first version, without connection ids. */
+typedef struct __attribute__((packed)) {
+  uint64_t timestamp;
+  uint32_t size;
+} capture_record_v1_t;
+
+/** Private **/
+
+static int append_record(capture_t *capture, uint32_t connection, uint32_t flags, const char *data, int size) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  capture_record_t record = {
+    .timestamp = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec,
+    .size = size,
+    .connection = connection,
+    .flags = flags
+  };
+
+  // Header and data go in one write, so O_APPEND keeps records intact.
+  struct iovec parts[2] = {
+    { .iov_base = &record, .iov_len = sizeof(record) },
+    { .iov_base = (void *)data, .iov_len = size }
+  };
+
+  if (writev(capture->fd, parts, 2) != sizeof(record) + size) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Writer **/
+
+capture_t *capture_open(const char *path) {
+  int fd = open(path, O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  // New segment gets a header, an existing one must have the same, or replay couldn't read the records.
+  struct stat st;
+  char magic[sizeof(CAPTURE_MAGIC) - 1];
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  } else if (st.st_size == 0) {
+    if (write(fd, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != strlen(CAPTURE_MAGIC)) {
+      close(fd);
+      return NULL;
+    }
+  } else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  capture_t *capture = calloc(1, sizeof(capture_t));
+  capture->fd = fd;
+  return capture;
+}
+
+uint32_t capture_start(capture_t *capture) {
+  uint32_t connection = __atomic_fetch_add(&capture->connections, 1, __ATOMIC_RELAXED);
+  append_record(capture, connection, CAPTURE_START, NULL, 0);
+  return connection;
+}
+
+int capture_write(capture_t *capture, uint32_t connection, const char *data, int size) {
+  return append_record(capture, connection, 0, data, size);
+}
+
+void capture_close(capture_t *capture) {
+  if (capture == NULL) {
+    return;
+  }
+
+  close(capture->fd);
+  free(capture);
+}
+
+/** Reader **/
+
+replay_t *replay_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < strlen(CAPTURE_MAGIC)) {
+    close(fd);
+    return NULL;
+  }
+
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  int version = 2;
+  if (memcmp(data, CAPTURE_MAGIC_V1, strlen(CAPTURE_MAGIC_V1)) == 0) {
+    version = 1;
+  } else if (memcmp(data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+    fprintf(stderr, "Not a capture file: %s\n", path);
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  // Records are read front to back exactly once.
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  replay_t *replay = calloc(1, sizeof(replay_t));
+  replay->data = data;
+  replay->size = st.st_size;
+  replay->offset = strlen(CAPTURE_MAGIC);
+  replay->version = version;
+  return replay;
+}
+
+int replay_next(replay_t *replay, const char **data, int *size, uint64_t *timestamp, uint32_t *connection, uint32_t *flags) {
+  capture_record_t record = { 0 };
+  size_t header = replay->version == 1 ? sizeof(capture_record_v1_t) : sizeof(capture_record_t);
+
+  if (replay->offset + header > replay->size) {
+    return 0;
+  }
+
+  // First version headers are a prefix of the current ones.
+  memcpy(&record, replay->data + replay->offset, header);
+  if (replay->offset + header + record.size > replay->size) {
+    return 0;
+  }
+
+  *data = replay->data + replay->offset + header;
+  *size = record.size;
+  *timestamp = record.timestamp;
+  *connection = record.connection;
+  *flags = record.flags;
+  replay->offset += header + record.size;
+  return 1;
+}
+
+void replay_close(replay_t *replay) {
+  if (replay == NULL) {
+    return;
+  }
+
+  munmap(replay->data, replay->size);
+  free(replay);
+}
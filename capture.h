@@ -0,0 +1,110 @@
+#ifndef CAPTURE_HEADER
+#define CAPTURE_HEADER
+
+#include <stdint.h>
+
+/**
+ * Raw IRC stream capture.
+ *
+ * A capture segment is a file starting with CAPTURE_MAGIC followed by records.
+ * Each record is a capture_record_t header and `size` bytes of data exactly as
+ * they were received from the socket.
+ *
+ * Several connections can record into one segment. Each connection gets its
+ * own id when it starts recording, marked by an empty CAPTURE_START record,
+ * and its chunks only continue each other's lines. A reconnect is a new
+ * connection.
+ *
+ * Segments of the first version (CAPTURE_MAGIC_V1) have no connection ids and
+ * are read as a single connection.
+ **/
+
+#define CAPTURE_MAGIC "TWCAP002"
+#define CAPTURE_MAGIC_V1 "TWCAP001"
+
+/* Record flag: the connection starts, no data. */
+#define CAPTURE_START 1
+
+/* On-disk record header. */
+typedef struct __attribute__((packed)) capture_record_t {
+  uint64_t timestamp;  // Receive time, nanoseconds since epoch.
+  uint32_t size;       // Size of the data following the header.
+  uint32_t connection; // Id of the receiving connection within the segment.
+  uint32_t flags;
+} capture_record_t;
+
+/* Capture writer. */
+typedef struct capture_t capture_t;
+
+/* Capture reader. */
+typedef struct replay_t replay_t;
+
+/**
+ * Opens a capture segment for appending. Creates the file if needed.
+ *
+ * @param path: Path to the segment file.
+ *
+ * @return: Capture writer, or NULL in case of an error. An existing file
+ * that doesn't start with CAPTURE_MAGIC is refused with EINVAL.
+ **/
+capture_t *capture_open(const char *path);
+
+/**
+ * Starts recording a new connection. Can be called from any thread.
+ *
+ * @param capture: Capture writer.
+ *
+ * @return: Id of the connection, for capture_write().
+ **/
+uint32_t capture_start(capture_t *capture);
+
+/**
+ * Appends a chunk of received data to the capture, stamped with current time.
+ *
+ * @param capture: Capture writer.
+ * @param connection: Id of the receiving connection, see capture_start().
+ * @param data: Received data.
+ * @param size: Size of the data.
+ *
+ * @return: 0 on success, -1 in case of an error.
+ **/
+int capture_write(capture_t *capture, uint32_t connection, const char *data, int size);
+
+/**
+ * Closes the capture segment and frees the writer.
+ *
+ * @param capture: Capture writer.
+ **/
+void capture_close(capture_t *capture);
+
+/**
+ * Maps a capture segment into memory for reading.
+ *
+ * @param path: Path to the segment file.
+ *
+ * @return: Capture reader, or NULL in case of an error.
+ **/
+replay_t *replay_open(const char *path);
+
+/**
+ * Returns the next record from the segment. Data points directly into the mapping.
+ *
+ * @param replay: Capture reader.
+ * @param data: Pointer to hold record data.
+ * @param size: Pointer to hold data size.
+ * @param timestamp: Pointer to hold receive timestamp in nanoseconds.
+ * @param connection: Pointer to hold the receiving connection id.
+ * @param flags: Pointer to hold record flags, e.g. CAPTURE_START.
+ *
+ * @return: 1 if a record was read, 0 at the end of the segment or on a truncated record.
+ **/
+int replay_next(replay_t *replay, const char **data, int *size, uint64_t *timestamp, uint32_t *connection, uint32_t *flags);
+
+/**
+ * Unmaps the segment and frees the reader.
+ *
+ * @param replay: Capture reader.
+ **/
+void replay_close(replay_t *replay);
+
+#endif
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 
 #include "socket.h"
 #include "irc.h"
@@ -15,14 +16,23 @@
 #include "debug.h"
 #include "dbus.h"
 #include "utils.h"
-
-/** Commands **/
-
-COMMAND(hi)
-
-void register_commands() {
-	REGISTER(hi)
-}
+#include "json.h"
+#include "capture.h"
+#include "archive.h"
+#include "dedup.h"
+#include "commands/tags.h"
+#include "pipeline.h"
+#include "filter.h"
+#include "flood.h"
+#include "history.h"
+#include "search.h"
+#include "analytics.h"
+#include "prefilter.h"
+#include "pool.h"
+#include "sink.h"
+#include "journal.h"
+#include "inbox.h"
+#include "script.h"
 
 /** Signal handling **/
 
@@ -38,6 +48,26 @@ static void signal_handler(int signal) {
 	terminate = 1;
 }
 
+/* Indicates that filter rules and scripts should be reloaded. */
+static volatile int reload_requested = 0;
+
+/**
+ * SIGHUP handler.
+ *
+ * @param signal: Received signal.
+ **/
+static void reload_handler(int signal) {
+	reload_requested = 1;
+}
+
+/** Capture **/
+
+/* Raw stream capture shared by all connections, if enabled. */
+static capture_t *capture = NULL;
+
+/* Raw line classifier shared by all connections, if any lines are dropped unparsed. */
+static prefilter_t *prefilter = NULL;
+
 /** Private **/
 
 /**
@@ -51,7 +81,7 @@ static void signal_handler(int signal) {
 irc_message_t *get_next_message(irc_t *irc);
 
 /**
- * Attempts to connect to a server and join a channel.
+ * Connects to a server and starts logging in, without waiting for the replies.
  *
  * @param server: Host name.
  * @param port: Port number.
@@ -59,42 +89,34 @@ irc_message_t *get_next_message(irc_t *irc);
  * @param password: Password string.
  * @param channel: Channel to join.
  *
- * @return IRC client or NULL.
+ * @return IRC client to drive with irc_handshake(), or NULL.
  **/
-irc_t *do_connect(char *server, int port, char *user, char *password, char *channel);
+irc_t *start_connect(char *server, int port, char *user, char *password, char *channel);
 
 /**
- * Prints the message to stdout.
+ * Connects the sender accounts that are due, see pool_due_account(). Their
+ * handshakes go on in pool_handle_fds().
  *
- * @param file: File handle to output into.
- * @param message: Message to print.
+ * @param pool: Sender accounts.
+ * @param server: Host name.
+ * @param port: Port number.
+ * @param channel: Channel to join.
  **/
-void output_message(int file, irc_message_t *message);
+void connect_senders(pool_t *pool, char *server, int port, char *channel);
 
 /**
- * Sends the message to the DBUS.
+ * Serializes the message and writes it to the output.
  *
- * @param server: DBUS connection holder.
- * @param message: Message to send.
+ * @param output: Output sink.
+ * @param message: Message to print.
  **/
-void send_message_to_dbus(dbus_server_t *server, irc_message_t *message);
+void output_message(sink_t *output, irc_message_t *message);
 
 /**
  * Prints out usage info to STDERR.
  **/
 void print_usage();
 
-/**
- * Reads a line from given file descriptor.
- *
- * @param buffer: Buffer to write into.
- * @param size: Max amount of bytes to read.
- * @param fd: File descriptor to read from.
- *
- * @return: Number of bytes read.
- **/
-int read_line(char *buffer, int size, int fd);
-
 /**
  * Sets up signal handling.
  *
@@ -118,21 +140,339 @@ void transform_incoming_message(char *in, char *out, int outsize, char *channel)
 char const * const IN_FIFO_PATH = "/tmp/twitch-bot-in";
 char const * const OUT_FIFO_PATH = "/tmp/twitch-bot-out";
 
+/* Default overflow file for the spill output policy. */
+char const * const SPILL_PATH = "/tmp/twitch-bot-spill";
+
 /* DBUS connection settings. */
 char const * const DBUS_NAME = "ru.aint.twitch.chat";
 char const * const DBUS_INTERFACE = "ru.aint.twitch.signal";
 char const * const DBUS_SIGNAL = "Command";
 char const * const DBUS_OUT_SIGNAL = "Message";
+char const * const DBUS_OUT_BATCH_SIGNAL = "Messages";
+char const * const DBUS_OUT_TYPED_SIGNAL = "ChatMessage";
+char const * const DBUS_OUT_PATH = "/ru/aint/twitch/signal";
+
+/* Default sender account budget per rate period, and lines waiting for budget, see --senders. */
+int const SENDER_RATE = 20;
+int const SENDER_RATE_PERIOD_MS = 30000;
+int const SENDER_QUEUE_LIMIT = 1024;
+
+/* Max number of Lua instructions per script handler call, see --script. */
+int const SCRIPT_BUDGET = 100000;
 
 /* Input message buffer size. */
 int const INPUT_BUFFER_SIZE = 1024;
 
+/* Lines queued per input producer, and the window of the optional rate limit, see --input-rate. */
+int const INPUT_QUEUE_LIMIT = 64;
+int const INPUT_RATE_PERIOD_MS = 30000;
+
+/* Size of the buffer collecting commands from DBus signals before writing them to IRC. */
+#define OUTBOUND_BUFFER_SIZE 8192
+
+/* Max number of redundant connections. */
+#define MAX_CONNECTIONS 4
+
+/* Delay before reconnecting after a failed attempt, doubling up to the max, and how long logging in may take. */
+int const CONNECT_RETRY_MIN_MS = 1000;
+int const CONNECT_RETRY_MAX_MS = 60000;
+int const HANDSHAKE_TIMEOUT_MS = 10000;
+
+/* Max number of recorded connections parsed side by side during replay. */
+#define REPLAY_STREAMS (MAX_CONNECTIONS * 2)
+
+/* Number of remembered message ids, and for how long, when running redundant connections. */
+int const DEDUP_CAPACITY = 1 << 17;
+int const DEDUP_TTL_MS = 120000;
+
+/* Chatters remembered per channel by flood detection, and its thresholds besides the rate. */
+int const FLOOD_CAPACITY = 1 << 18;
+int const FLOOD_REPEAT_LIMIT = 3;
+int const FLOOD_WAVE_LIMIT = 5;
+
+/* Size of each channel's history ring, see --history. */
+#define HISTORY_CHANNEL_SIZE (8 * 1024 * 1024)
+
+/* Default memory limit of the search index, see --search. */
+int const SEARCH_MEMORY_MB = 64;
+
+/* Number of top emotes and chatters in analytics snapshots, see --analytics. */
+int const ANALYTICS_TOP = 10;
+
+/* Journal segment size, and default retention, see --journal. */
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+int const JOURNAL_MAX_SIZE_MB = 1024;
+int const JOURNAL_MAX_AGE_HOURS = 24 * 7;
+
+/* Output queue size, max size of its overflow file, and how often its counters are reported. */
+#define OUTPUT_QUEUE_SIZE (4 * 1024 * 1024)
+#define OUTPUT_SPILL_SIZE ((size_t)1024 * 1024 * 1024)
+int const OUTPUT_REPORT_MS = 60000;
+
+/* Capacity of each pipeline queue, and how often the pipeline reports its state. */
+int const PIPELINE_QUEUE_CAPACITY = 1 << 16;
+int const PIPELINE_REPORT_MS = 60000;
+
 typedef enum {
 	IO_FIFO,
 	IO_STD,
 	IO_DBUS
 } io_t;
 
+/* Output state shared by the live and replay loops. */
+typedef struct {
+	io_t io_type;
+	sink_t *output;
+	dbus_server_t *dbus;
+	int dbus_batch;
+	int dbus_typed;
+	archive_t *archive;
+	dedup_t *dedup;
+	filter_t *filter;
+	flood_t *flood;
+	int flood_timeout;
+	history_t *history;
+	search_t *search;
+	analytics_t *analytics;
+	journal_t *journal;
+	script_t *script;
+	irc_t *outbound;
+	irc_t *primary;
+	char *user;
+} relay_t;
+
+/* Recorded connection being replayed. */
+typedef struct {
+	uint32_t connection;
+	uint64_t started;
+	irc_t *irc;
+} replay_stream_t;
+
+/* Connection chat is read from, logged in and reconnected within the main loop. */
+typedef struct {
+	irc_t *irc;             // NULL while waiting for the next attempt.
+	int joined;             // Handshake is over, messages are relayed.
+	int64_t handshake_until;
+	int64_t retry_at;
+	int retry_delay;
+} connection_t;
+
+/**
+ * Connects a reader connection and starts its handshake. A failed attempt
+ * schedules the next one.
+ *
+ * @param connection: Connection without a client.
+ * @param server: Host name.
+ * @param port: Port number.
+ * @param user: Username to identify self.
+ * @param password: Password string.
+ * @param channel: Channel to join.
+ **/
+void open_connection(connection_t *connection, char *server, int port, char *user, char *password, char *channel);
+
+/**
+ * Closes a reader connection and schedules reconnecting it: right away if it
+ * was joined, after a growing delay if it was a failed attempt.
+ *
+ * @param connection: Connection, without a client after a failed connect.
+ * @param now: Monotonic time in ms.
+ **/
+void drop_connection(connection_t *connection, int64_t now);
+
+/**
+ * Moves a reader connection's handshake along once its socket is readable.
+ * Once joined, the connection gets its message arena and the prefilter.
+ *
+ * @param connection: Connection in its handshake.
+ *
+ * @return: 1 once joined, 0 while the handshake goes on, -1 if it failed.
+ **/
+int advance_connection(connection_t *connection);
+
+/**
+ * Returns how long until a reader connection is due to reconnect, or its
+ * handshake runs out of time.
+ *
+ * @param connections: Reader connections.
+ * @param count: Number of connections.
+ * @param now: Monotonic time in ms.
+ *
+ * @return: Milliseconds to wait, or -1 if nothing is pending.
+ **/
+int connections_wait_ms(connection_t *connections, int count, int64_t now);
+
+/* Commands from a batch of DBus signals, written to IRC at once. */
+typedef struct {
+	irc_t *irc;
+	char *channel;
+	char buffer[OUTBOUND_BUFFER_SIZE];
+	int size;
+	int count;
+} outbound_batch_t;
+
+/**
+ * Turns an input DBus signal into an IRC command and adds it to the outbound batch.
+ *
+ * @param signal: Signal contents.
+ * @param context: Outbound batch.
+ **/
+void queue_dbus_command(const char *signal, void *context);
+
+/**
+ * Writes collected commands to IRC and empties the batch.
+ *
+ * @param batch: Outbound batch.
+ **/
+void send_outbound_batch(outbound_batch_t *batch);
+
+/**
+ * Runs a chat message through the moderation filter. Matches are annotated on
+ * the message, and timeouts and bans are sent to the channel, unless the sender
+ * is a moderator or the broadcaster.
+ *
+ * @param relay: Output state.
+ * @param irc: Connection to send moderation commands through.
+ * @param message: PRIVMSG to check.
+ **/
+void apply_filter(relay_t *relay, irc_t *irc, irc_message_t *message);
+
+/**
+ * Runs a chat message through flood detection. Verdicts are annotated on the
+ * message, and the sender is timed out if flood timeouts are enabled, unless
+ * they're a moderator or the broadcaster.
+ *
+ * @param relay: Output state.
+ * @param irc: Connection to send moderation commands through.
+ * @param message: PRIVMSG to check.
+ **/
+void apply_flood(relay_t *relay, irc_t *irc, irc_message_t *message);
+
+/**
+ * Sends the message to the DBUS as a signal with separate sender, command,
+ * channel and message arguments, followed by the tags as a dictionary.
+ *
+ * @param server: DBUS connection holder.
+ * @param message: Message to send.
+ **/
+void send_typed_message_to_dbus(dbus_server_t *server, irc_message_t *message);
+
+/**
+ * Sends the message to the DBUS, either as a signal of its own or as part of
+ * the next batch.
+ *
+ * @param relay: Output state.
+ * @param message: Message to send.
+ **/
+void send_message_to_dbus(relay_t *relay, irc_message_t *message);
+
+/**
+ * Checks whether a message was already delivered by another redundant connection.
+ * Messages with an `id` tag are checked against recently seen ids, the rest are
+ * only taken from the primary connection.
+ *
+ * @param relay: Output state.
+ * @param irc: IRC client the message came from.
+ * @param message: Message to check.
+ *
+ * @return: 1 if message should be skipped, 0 otherwise.
+ **/
+int is_duplicate(relay_t *relay, irc_t *irc, irc_message_t *message);
+
+/**
+ * Dispatches a message received from IRC: answers PINGs, runs commands and
+ * sends everything else to the selected output.
+ *
+ * @param relay: Output state.
+ * @param irc: IRC client the message came from.
+ * @param message: Message to handle.
+ **/
+void handle_message(relay_t *relay, irc_t *irc, irc_message_t *message);
+
+/**
+ * First half of handle_message: drops duplicates, answers PINGs and runs commands.
+ *
+ * @param irc: IRC client the message came from.
+ * @param message: Message to handle.
+ * @param context: Output state.
+ *
+ * @return: 1 if the message should go to the output, 0 otherwise.
+ **/
+int dispatch_message(irc_t *irc, irc_message_t *message, void *context);
+
+/**
+ * Second half of handle_message: sends the message to the archive and selected output.
+ *
+ * @param message: Message to output.
+ * @param context: Output state.
+ **/
+void sink_message(irc_message_t *message, void *context);
+
+/**
+ * Numbers a channel message, serializes it, keeps it in the history and indexes it for search.
+ *
+ * @param relay: Output state.
+ * @param message: Message to record. Gets a `seq` annotation.
+ * @param buffer: Buffer of JSON_BUFFER_SIZE bytes to serialize the message into.
+ **/
+void record_history(relay_t *relay, irc_message_t *message, char *buffer);
+
+/**
+ * Flushes buffered outputs after a batch of messages.
+ *
+ * @param context: Output state.
+ **/
+void flush_outputs(void *context);
+
+/**
+ * Writes the snapshots of analytics windows that ended without a later message.
+ * Runs on the same thread as sink_message().
+ *
+ * @param context: Output state.
+ **/
+void tick_outputs(void *context);
+
+/**
+ * Writes the snapshots of analytics windows that ended by a given time to the journal and the output.
+ *
+ * @param relay: Output state.
+ * @param now_ms: Time in ms since the epoch, INT64_MAX to close all windows.
+ **/
+void close_analytics(relay_t *relay, int64_t now_ms);
+
+/**
+ * Parses a comma-separated list of CPU ids for pipeline stages.
+ *
+ * @param list: List like "0,2,3". Missing or negative entries mean no pinning.
+ * @param cpus: Array of PIPELINE_STAGES entries to fill.
+ **/
+void parse_cpu_list(char *list, int *cpus);
+
+/**
+ * Finds the replay client of a recorded connection, or gives it a fresh one if
+ * the connection is new or starts over. Takes the place of the connection
+ * that started first when all are in use.
+ *
+ * @param streams: REPLAY_STREAMS connections being replayed.
+ * @param connection: Recorded connection id.
+ * @param start: Whether the record starts the connection.
+ * @param started: Counter of started connections, to tell which is oldest.
+ *
+ * @return: Client to feed the connection's data to.
+ **/
+irc_t *replay_stream(replay_stream_t *streams, uint32_t connection, int start, uint64_t *started);
+
+/**
+ * Feeds a capture segment through the same parse, dispatch and output path as
+ * the live connection. Outgoing commands are dropped.
+ *
+ * @param relay: Output state.
+ * @param path: Path to the capture segment.
+ * @param paced: Reproduce recorded timing if set, otherwise replay as fast as possible.
+ *
+ * @return: 0 on success, -1 if capture could not be opened.
+ **/
+int replay_capture(relay_t *relay, const char *path, int paced);
+
 /** Main **/
 
 int main(int argc, char **argv) {
@@ -140,7 +480,35 @@ int main(int argc, char **argv) {
 	int port = 6667;
 	io_t io_type = IO_STD;
 
-	char *user, *password, *channel, *io;
+	char *user, *password, *channel;
+	char *capture_path = NULL, *replay_path = NULL, *archive_path = NULL, *filter_path = NULL, *log_path = NULL, *history_path = NULL;
+	char *spill_path = (char *)SPILL_PATH;
+	char *journal_path = NULL;
+	char *input_socket_path = NULL;
+	char *script_path = NULL;
+	int script_budget = SCRIPT_BUDGET;
+	int input_rate = 0;
+	int journal_max_size = JOURNAL_MAX_SIZE_MB;
+	int journal_max_age = JOURNAL_MAX_AGE_HOURS;
+	int search_window = 0;
+	int search_memory = SEARCH_MEMORY_MB;
+	int analytics_window = 0;
+	prefilter_config_t prefilter_config = { 0 };
+	pool_config_t pool_config = {
+		.strategy = POOL_LEAST_LOADED,
+		.rate = SENDER_RATE,
+		.rate_period_ms = SENDER_RATE_PERIOD_MS,
+		.queue_limit = SENDER_QUEUE_LIMIT
+	};
+	int output_policy = -1;
+	int replay_paced = 1;
+	int connections_count = 1;
+	int use_pipeline = 0;
+	int dbus_batch = 0;
+	int dbus_typed = 0;
+	int flood_rate = 0;
+	int flood_timeout = 0;
+	int cpus[PIPELINE_STAGES] = { -1, -1, -1 };
 	if (argc < 4) {
 		print_usage();
 		exit(0);
@@ -158,30 +526,307 @@ int main(int argc, char **argv) {
 			} else if (strcmp("-d", argv[idx]) == 0) {
 				io_type = IO_DBUS;
 			} else if (strcmp("--debug", argv[idx]) == 0) {
-				printf("chaning log level\n");
 				LOG_LEVEL = LOG_LEVEL_DEBUG;
+			} else if (strcmp("--capture", argv[idx]) == 0 && idx + 1 < argc) {
+				capture_path = argv[++idx];
+			} else if (strcmp("--replay", argv[idx]) == 0 && idx + 1 < argc) {
+				replay_path = argv[++idx];
+			} else if (strcmp("--replay-fast", argv[idx]) == 0) {
+				replay_paced = 0;
+			} else if (strcmp("--archive", argv[idx]) == 0 && idx + 1 < argc) {
+				archive_path = argv[++idx];
+			} else if (strcmp("--redundant", argv[idx]) == 0 && idx + 1 < argc) {
+				connections_count = atoi(argv[++idx]);
+				if (connections_count < 1 || connections_count > MAX_CONNECTIONS) {
+					fprintf(stderr, "Number of connections must be between 1 and %d\n", MAX_CONNECTIONS);
+					exit(-1);
+				}
+			} else if (strcmp("--pipeline", argv[idx]) == 0) {
+				use_pipeline = 1;
+			} else if (strcmp("--pin", argv[idx]) == 0 && idx + 1 < argc) {
+				parse_cpu_list(argv[++idx], cpus);
+			} else if (strcmp("--dbus-batch", argv[idx]) == 0 && idx + 1 < argc) {
+				dbus_batch = atoi(argv[++idx]);
+				if (dbus_batch < 1) {
+					fprintf(stderr, "DBus batch size must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--dbus-typed", argv[idx]) == 0) {
+				dbus_typed = 1;
+			} else if (strcmp("--filter", argv[idx]) == 0 && idx + 1 < argc) {
+				filter_path = argv[++idx];
+			} else if (strcmp("--flood", argv[idx]) == 0 && idx + 1 < argc) {
+				flood_rate = atoi(argv[++idx]);
+				if (flood_rate < 1) {
+					fprintf(stderr, "Flood rate must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--flood-timeout", argv[idx]) == 0 && idx + 1 < argc) {
+				flood_timeout = atoi(argv[++idx]);
+			} else if (strcmp("--log", argv[idx]) == 0 && idx + 1 < argc) {
+				log_path = argv[++idx];
+			} else if (strcmp("--history", argv[idx]) == 0 && idx + 1 < argc) {
+				history_path = argv[++idx];
+			} else if (strcmp("--search", argv[idx]) == 0 && idx + 1 < argc) {
+				search_window = atoi(argv[++idx]);
+				if (search_window < 1) {
+					fprintf(stderr, "Search window must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--search-memory", argv[idx]) == 0 && idx + 1 < argc) {
+				search_memory = atoi(argv[++idx]);
+				if (search_memory < 1) {
+					fprintf(stderr, "Search memory must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--analytics", argv[idx]) == 0 && idx + 1 < argc) {
+				analytics_window = atoi(argv[++idx]);
+				if (analytics_window < 1) {
+					fprintf(stderr, "Analytics window must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--drop", argv[idx]) == 0 && idx + 1 < argc) {
+				prefilter_config.drop = argv[++idx];
+			} else if (strcmp("--usernotice", argv[idx]) == 0 && idx + 1 < argc) {
+				prefilter_config.usernotice = argv[++idx];
+			} else if (strcmp("--block-users", argv[idx]) == 0 && idx + 1 < argc) {
+				prefilter_config.blocked_path = argv[++idx];
+			} else if (strcmp("--senders", argv[idx]) == 0 && idx + 1 < argc) {
+				pool_config.accounts_path = argv[++idx];
+			} else if (strcmp("--sender-strategy", argv[idx]) == 0 && idx + 1 < argc) {
+				pool_config.strategy = pool_strategy_parse(argv[++idx]);
+				if ((int)pool_config.strategy == -1) {
+					fprintf(stderr, "Sender strategy must be least-loaded or affinity\n");
+					exit(-1);
+				}
+			} else if (strcmp("--sender-rate", argv[idx]) == 0 && idx + 1 < argc) {
+				pool_config.rate = atoi(argv[++idx]);
+				if (pool_config.rate < 1) {
+					fprintf(stderr, "Sender rate must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--output-policy", argv[idx]) == 0 && idx + 1 < argc) {
+				output_policy = sink_policy_parse(argv[++idx]);
+				if (output_policy == -1) {
+					fprintf(stderr, "Output policy must be one of drop-oldest, drop-newest, block or spill\n");
+					exit(-1);
+				}
+			} else if (strcmp("--output-spill", argv[idx]) == 0 && idx + 1 < argc) {
+				spill_path = argv[++idx];
+			} else if (strcmp("--journal", argv[idx]) == 0 && idx + 1 < argc) {
+				journal_path = argv[++idx];
+			} else if (strcmp("--journal-max-size", argv[idx]) == 0 && idx + 1 < argc) {
+				journal_max_size = atoi(argv[++idx]);
+			} else if (strcmp("--journal-max-age", argv[idx]) == 0 && idx + 1 < argc) {
+				journal_max_age = atoi(argv[++idx]);
+			} else if (strcmp("--server", argv[idx]) == 0 && idx + 1 < argc) {
+				server = argv[++idx];
+			} else if (strcmp("--port", argv[idx]) == 0 && idx + 1 < argc) {
+				port = atoi(argv[++idx]);
+				if (port < 1 || port > 65535) {
+					fprintf(stderr, "Port must be between 1 and 65535\n");
+					exit(-1);
+				}
+			} else if (strcmp("--input-socket", argv[idx]) == 0 && idx + 1 < argc) {
+				input_socket_path = argv[++idx];
+			} else if (strcmp("--script", argv[idx]) == 0 && idx + 1 < argc) {
+				script_path = argv[++idx];
+			} else if (strcmp("--script-budget", argv[idx]) == 0 && idx + 1 < argc) {
+				script_budget = atoi(argv[++idx]);
+				if (script_budget < 1) {
+					fprintf(stderr, "Script budget must be positive\n");
+					exit(-1);
+				}
+			} else if (strcmp("--input-rate", argv[idx]) == 0 && idx + 1 < argc) {
+				input_rate = atoi(argv[++idx]);
+				if (input_rate < 0) {
+					fprintf(stderr, "Input rate can't be negative\n");
+					exit(-1);
+				}
 			}
 		}
 	}
 
-	// Register commands.
-	register_commands();
+	if (dbus_typed && dbus_batch > 0) {
+		fprintf(stderr, "Typed DBus signals can't be batched\n");
+		exit(-1);
+	}
 
-	LOG(LOG_LEVEL_DEBUG, "DEBUG: Connecting to IRC\n");
+	if (use_pipeline && connections_count > 1) {
+		fprintf(stderr, "Pipeline mode works with a single connection\n");
+		exit(-1);
+	}
 
-	// Connect.
-	irc_t *irc = do_connect(server, port, user, password, channel);
-	if (irc == NULL) {
+	if (search_window > 0 && history_path == NULL) {
+		fprintf(stderr, "Search is served on the history socket, it needs --history\n");
 		exit(-1);
 	}
 
+	// Log messages are formatted and written on a separate thread, away from the output.
+	int log_fd = STDERR_FILENO;
+	if (log_path != NULL) {
+		log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (log_fd == -1) {
+			perror("Failed to open log file");
+			exit(-1);
+		}
+	}
+	if (log_start(log_fd) == -1) {
+		fprintf(stderr, "Failed to start the logger, logging synchronously\n");
+	}
+
+	// Lines dropped before parsing.
+	if (prefilter_config.drop != NULL || prefilter_config.usernotice != NULL || prefilter_config.blocked_path != NULL) {
+		prefilter = prefilter_init(&prefilter_config);
+		if (prefilter == NULL) {
+			exit(-1);
+		}
+	}
+
+	// Raw stream capture.
+	if (capture_path != NULL) {
+		capture = capture_open(capture_path);
+		if (capture == NULL) {
+			perror("Failed to open capture file");
+			exit(-1);
+		}
+	}
+
+	// Chat archive.
+	archive_t *archive = NULL;
+	if (archive_path != NULL) {
+		archive = archive_open(archive_path);
+		if (archive == NULL) {
+			perror("Failed to open archive");
+			exit(-1);
+		}
+	}
+
+	// Moderation filter.
+	filter_t *filter = NULL;
+	if (filter_path != NULL) {
+		filter = filter_init(filter_path);
+		if (filter == NULL) {
+			fprintf(stderr, "Failed to load filter rules\n");
+			exit(-1);
+		}
+	}
+
+	// Lua command scripts.
+	script_t *script = NULL;
+	if (script_path != NULL) {
+		script = script_init(script_path, script_budget);
+		if (script == NULL) {
+			fprintf(stderr, "Failed to load the script\n");
+			exit(-1);
+		}
+	}
+
+	// Flood detection.
+	flood_t *flood = NULL;
+	if (flood_rate > 0) {
+		flood_config_t flood_config = {
+			.capacity = FLOOD_CAPACITY,
+			.rate_limit = flood_rate,
+			.repeat_limit = FLOOD_REPEAT_LIMIT,
+			.wave_limit = FLOOD_WAVE_LIMIT
+		};
+		flood = flood_init(&flood_config);
+		if (flood == NULL) {
+			perror("Failed to set up flood detection");
+			exit(-1);
+		}
+	}
+
+	// Recent records for subscribers catching up.
+	history_t *history = NULL;
+	if (history_path != NULL) {
+		history = history_init(history_path, HISTORY_CHANNEL_SIZE);
+		if (history == NULL) {
+			perror("Failed to create history socket");
+			exit(-1);
+		}
+	}
+
+	// Index of recent records by word, queried through the history socket.
+	search_t *search = NULL;
+	if (search_window > 0) {
+		search_config_t search_config = {
+			.window = search_window,
+			.max_memory = (size_t)search_memory * 1024 * 1024
+		};
+		search = search_init(&search_config);
+		if (search == NULL) {
+			perror("Failed to create search index");
+			exit(-1);
+		}
+		history_set_search(history, search);
+	}
+
+	// Channel statistics, written to the output as snapshot records.
+	analytics_t *analytics = NULL;
+	if (analytics_window > 0) {
+		analytics_config_t analytics_config = {
+			.window_ms = analytics_window * 1000,
+			.top = ANALYTICS_TOP
+		};
+		analytics = analytics_init(&analytics_config);
+		if (analytics == NULL) {
+			perror("Failed to set up analytics");
+			exit(-1);
+		}
+	}
+
+	// Durable copy of the output for consumers that resume where they left off.
+	journal_t *journal = NULL;
+	if (journal_path != NULL) {
+		journal_config_t journal_config = {
+			.segment_size = JOURNAL_SEGMENT_SIZE,
+			.max_size = (size_t)(journal_max_size > 0 ? journal_max_size : 0) * 1024 * 1024,
+			.max_age = (int64_t)(journal_max_age > 0 ? journal_max_age : 0) * 3600
+		};
+		journal = journal_open(journal_path, &journal_config);
+		if (journal == NULL) {
+			perror("Failed to open journal");
+			exit(-1);
+		}
+	}
+
+	// Connect, logging in goes on in the main loop. Replay runs without a connection.
+	connection_t connections[MAX_CONNECTIONS] = { 0 };
+	irc_t *irc = NULL;
+	int logged_in = 0;
+	if (replay_path == NULL) {
+		for (int idx = 0; idx < connections_count; idx++) {
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Connecting to IRC (connection %d)\n", idx);
+			open_connection(&connections[idx], server, port, user, password, channel);
+			if (connections[idx].irc == NULL) {
+				exit(-1);
+			}
+		}
+	}
+
+	// Outgoing chat spread over sender accounts, the connections above only read.
+	pool_t *pool = NULL;
+	if (pool_config.accounts_path != NULL && replay_path == NULL) {
+		pool = pool_init(&pool_config);
+		if (pool == NULL) {
+			fprintf(stderr, "Failed to load sender accounts\n");
+			exit(-1);
+		}
+		connect_senders(pool, server, port, channel);
+	}
+
+	// Redundant connections deliver the same messages.
+	dedup_t *dedup = NULL;
+	if (connections_count > 1) {
+		dedup = dedup_init(DEDUP_CAPACITY, DEDUP_TTL_MS);
+	}
+
 	// Message buffer.
 	irc_message_t *message = NULL;
 
-	// Dbus buffer.
-	char *dbus_message = NULL;
-
-	// I/O buffer.
+	// Line taken from the input.
 	char input_buffer[INPUT_BUFFER_SIZE];
 
 	// Incoming command buffer.
@@ -218,10 +863,42 @@ int main(int argc, char **argv) {
 			perror("Failed to establish a connection to DBUS");
 			exit(-1);
 		}
+		if (dbus_batch > 0 && dbus_server_enable_batch(dbus, DBUS_OUT_PATH, DBUS_INTERFACE, DBUS_OUT_BATCH_SIGNAL, dbus_batch) == -1) {
+			perror("Failed to set up DBus batching");
+			exit(-1);
+		}
+	}
+
+	// Output never blocks the relay, unless asked to. Replay has no connection to keep alive.
+	if (output_policy == -1) {
+		output_policy = replay_path != NULL ? SINK_BLOCK : SINK_DROP_OLDEST;
+	}
+	sink_t *output = sink_init(output_fd, OUTPUT_QUEUE_SIZE, output_policy, spill_path, OUTPUT_SPILL_SIZE);
+	if (output == NULL) {
+		perror("Failed to set up the output");
+		exit(-1);
+	}
+	int64_t output_reported_at = monotonic_ms();
+
+	// Lines from the STD/FIFO input and socket producers share one queue, and the rate limit if asked for.
+	inbox_config_t inbox_config = {
+		.line_size = INPUT_BUFFER_SIZE,
+		.queue_limit = INPUT_QUEUE_LIMIT,
+		.rate = input_rate,
+		.rate_period = INPUT_RATE_PERIOD_MS
+	};
+	inbox_t *inbox = inbox_init(input_socket_path, &inbox_config);
+	if (inbox == NULL) {
+		perror("Failed to set up the input socket");
+		exit(-1);
+	}
+	if (inbox_add_fd(inbox, input_fd, io_type == IO_FIFO ? "fifo" : "stdin", 1) == -1) {
+		perror("Failed to set up the input");
+		exit(-1);
 	}
 
 	// We want to wait for either command input or socket data.
-	fd_set readfds;
+	fd_set readfds, writefds;
 
 	// Add signal interruptors.
 	sigset_t orig_mask;
@@ -233,44 +910,186 @@ int main(int argc, char **argv) {
 		.tv_nsec = 0
 	};
 
+	relay_t relay = {
+		.io_type = io_type,
+		.output = output,
+		.dbus = dbus,
+		.dbus_batch = dbus_batch,
+		.dbus_typed = dbus_typed,
+		.archive = archive,
+		.dedup = dedup,
+		.filter = filter,
+		.flood = flood,
+		.flood_timeout = flood_timeout,
+		.history = history,
+		.search = search,
+		.analytics = analytics,
+		.journal = journal,
+		.script = script,
+		.outbound = pool != NULL ? pool_client(pool) : NULL,
+		.primary = irc,
+		.user = user
+	};
+
+	// Replay instead of the live loop. Signals stay unblocked so it can be interrupted.
+	if (replay_path != NULL) {
+		sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+		replay_capture(&relay, replay_path, replay_paced);
+		terminate = 1;
+	}
+
+	// Threaded pipeline takes over reading the connection.
+	pipeline_t *pipeline = NULL;
+	pipeline_config_t pipeline_config = {
+		.dispatch = dispatch_message,
+		.sink = sink_message,
+		.flush = flush_outputs,
+		.tick = tick_outputs,
+		.context = &relay,
+		.queue_capacity = PIPELINE_QUEUE_CAPACITY
+	};
+	memcpy(pipeline_config.cpus, cpus, sizeof(cpus));
+	int64_t pipeline_reported_at = monotonic_ms();
+
 	LOG(LOG_LEVEL_DEBUG, "DEBUG: Entering the main loop\n");
 
 	// Main loop (will interrupt on SIGTERM or SIGINT (CTRL+C))
-	int reconnect = 0;
 	while (terminate == 0) {
-		if (reconnect) {
-			LOG(LOG_LEVEL_DEBUG, "DEBUG: Reconnecting\n");
-			irc_free(irc);
-			irc = do_connect(server, port, user, password, channel);
-			if (irc == NULL) {
+		// Lost connection stops the pipeline, it's restarted after reconnect.
+		if (pipeline != NULL && (pipeline_is_running(pipeline) == 0 || relay.primary == NULL || irc_is_connected(relay.primary) == 0)) {
+			pipeline_stop(pipeline);
+			pipeline = NULL;
+		}
+
+		// Bring back dropped connections once they're due, a dead one only holds the loop up for its connect.
+		// Stop if none of them is left and none has ever logged in, the credentials won't work.
+		int64_t now = monotonic_ms();
+		int alive = 0;
+		irc = NULL;
+		for (int idx = 0; idx < connections_count; idx++) {
+			connection_t *connection = &connections[idx];
+			if (connection->irc != NULL && (irc_is_connected(connection->irc) == 0
+					|| (!connection->joined && now >= connection->handshake_until))) {
+				LOG(LOG_LEVEL_ERROR, "Connection %d %s\n", idx, connection->joined ? "lost" : "failed to log in");
+				drop_connection(connection, now);
+			}
+			if (connection->irc == NULL && now >= connection->retry_at) {
+				LOG(LOG_LEVEL_DEBUG, "DEBUG: Reconnecting (connection %d)\n", idx);
+				open_connection(connection, server, port, user, password, channel);
+			}
+			if (irc == NULL && connection->joined) {
+				irc = connection->irc;
+			}
+			alive += connection->irc != NULL;
+			logged_in |= connection->joined;
+		}
+		if (alive == 0 && !logged_in) {
+			break;
+		}
+
+		// Outgoing commands go through the first joined connection, or the senders. Until then they wait.
+		relay.primary = irc;
+		irc_t *outbound = relay.outbound != NULL ? relay.outbound : irc;
+		if (pool != NULL) {
+			connect_senders(pool, server, port, channel);
+		}
+
+		if (use_pipeline && pipeline == NULL && irc != NULL) {
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Starting the pipeline\n");
+			pipeline = pipeline_start(irc, &pipeline_config);
+			if (pipeline == NULL) {
+				perror("Failed to start the pipeline");
 				break;
 			}
-			reconnect = 0;
 		}
 
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+
+		// IRC input streams, and handshakes. Pipeline reads its connection on its own.
+		int maxfd = -1;
+		for (int idx = 0; idx < connections_count; idx++) {
+			int irc_fd = connections[idx].irc != NULL ? irc_get_fd(connections[idx].irc) : -1;
+			if (irc_fd >= 0 && (pipeline == NULL || !connections[idx].joined)) {
+				FD_SET(irc_fd, &readfds);
+				maxfd = var_max_int(&maxfd, &irc_fd, NULL);
+			}
+		}
 
-		// IRC input stream.
-		int irc_fd = irc_get_fd(irc);
-		FD_SET(irc_fd, &readfds);
-
-		// STD/FIFO input stream.
-		FD_SET(input_fd, &readfds);
+		// STD/FIFO input stream and socket producers.
+		int inbox_fd = inbox_fill_fds(inbox, &readfds);
+		maxfd = var_max_int(&maxfd, &inbox_fd, NULL);
 
-		// DBUS input stream.
-		int dbus_fd = -1;
+		// DBUS input stream, and output while signals are waiting to be written.
+		int dbus_fd = -1, dbus_write_fd = -1;
 		if (dbus != NULL) {
-			dbus_fd = dbus_server_get_fd(dbus);
-			FD_SET(dbus_fd, &readfds);
+			// Commands wait in the bus until a connection can take them.
+			dbus_fd = outbound != NULL ? dbus_server_get_fd(dbus) : -1;
+			if (dbus_fd >= 0) {
+				FD_SET(dbus_fd, &readfds);
+			}
+			// Reading can be off while signals still wait to go out, the write fd comes from its own watch.
+			dbus_write_fd = dbus_server_get_write_fd(dbus);
+			if (dbus_write_fd >= 0) {
+				FD_SET(dbus_write_fd, &writefds);
+			}
 		}
 
-		int maxfd = var_max_int(&irc_fd, &dbus_fd, &input_fd, NULL);
+		maxfd = var_max_int(&maxfd, &dbus_fd, &dbus_write_fd, NULL);
 
-		timeout.tv_sec = 20;
+		// Output, while records are queued for a slow reader.
+		int output_write_fd = -1;
+		if (sink_wants_write(output)) {
+			output_write_fd = sink_get_fd(output);
+			FD_SET(output_write_fd, &writefds);
+			maxfd = var_max_int(&maxfd, &output_write_fd, NULL);
+		}
+
+		// History subscribers.
+		if (history != NULL) {
+			int history_fd = history_fill_fds(history, &readfds, &writefds);
+			maxfd = var_max_int(&maxfd, &history_fd, NULL);
+		}
+
+		// Sender connections, only read to keep them alive.
+		if (pool != NULL) {
+			int pool_fd = pool_fill_fds(pool, &readfds);
+			maxfd = var_max_int(&maxfd, &pool_fd, NULL);
+		}
+
+		// Pipeline needs to be checked for a lost connection more often.
+		timeout.tv_sec = pipeline != NULL ? 1 : 20;
 		timeout.tv_nsec = 0;
 
-		int activity = pselect(maxfd + 1, &readfds, NULL, NULL, &timeout, &orig_mask);
-		if (activity == -1) {
+		// Wake up when the rate limit lets the next queued line out.
+		int inbox_wait = inbox_wait_ms(inbox);
+		if (inbox_wait >= 0 && inbox_wait < timeout.tv_sec * 1000) {
+			timeout.tv_sec = inbox_wait / 1000;
+			timeout.tv_nsec = (inbox_wait % 1000) * 1000000L;
+		}
+		int connect_wait = connections_wait_ms(connections, connections_count, monotonic_ms());
+		if (connect_wait >= 0 && connect_wait < timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000L) {
+			timeout.tv_sec = connect_wait / 1000;
+			timeout.tv_nsec = (connect_wait % 1000) * 1000000L;
+		}
+		int pool_wait = pool != NULL ? pool_wait_ms(pool) : -1;
+		if (pool_wait >= 0 && pool_wait < timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000L) {
+			timeout.tv_sec = pool_wait / 1000;
+			timeout.tv_nsec = (pool_wait % 1000) * 1000000L;
+		}
+		// Without the pipeline, analytics windows of quiet channels are closed here.
+		int analytics_wait = analytics != NULL && pipeline == NULL ? analytics_wait_ms(analytics, realtime_ms()) : -1;
+		if (analytics_wait >= 0 && analytics_wait < timeout.tv_sec * 1000 + timeout.tv_nsec / 1000000L) {
+			timeout.tv_sec = analytics_wait / 1000;
+			timeout.tv_nsec = (analytics_wait % 1000) * 1000000L;
+		}
+
+		int activity = pselect(maxfd + 1, &readfds, &writefds, NULL, &timeout, &orig_mask);
+		if (activity == -1 && errno == EINTR) {
+			// Interrupted by a signal, nothing is ready.
+			FD_ZERO(&readfds);
+			FD_ZERO(&writefds);
+		} else if (activity == -1) {
 			perror("Error while waiting for the input");
 			break;
 		} else if (activity == 0) {
@@ -282,73 +1101,143 @@ int main(int argc, char **argv) {
 			break;
 		}
 
-		if (FD_ISSET(input_fd, &readfds)) {
-			LOG(LOG_LEVEL_DEBUG, "DEBUG: Incoming message\n");
-			memset(input_buffer, 0, INPUT_BUFFER_SIZE);
-			if ((read_line(input_buffer, sizeof(input_buffer), input_fd)) != -1) {
-				transform_incoming_message(input_buffer, command, INPUT_BUFFER_SIZE, channel);
-				irc_command(irc, "%s\n", command);
+		if (reload_requested) {
+			reload_requested = 0;
+			if (filter != NULL && filter_reload(filter) == -1) {
+				fprintf(stderr, "Filter reload is already running\n");
 			}
+			if (script != NULL && script_reload(script) == -1) {
+				fprintf(stderr, "Script reload failed, keeping the old handlers\n");
+			}
+		}
+
+		inbox_handle_fds(inbox, &readfds);
+		while (outbound != NULL && inbox_next(inbox, input_buffer, INPUT_BUFFER_SIZE)) {
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Incoming message\n");
+			transform_incoming_message(input_buffer, command, INPUT_BUFFER_SIZE, channel);
+			irc_command(outbound, "%s\n", command);
 		}
 
-		if (FD_ISSET(irc_fd, &readfds)) {
-			LOG(LOG_LEVEL_DEBUG, "DEBUG: Got some data in the socket\n");
+		for (int idx = 0; idx < connections_count; idx++) {
+			connection_t *connection = &connections[idx];
+			int irc_fd = connection->irc != NULL ? irc_get_fd(connection->irc) : -1;
+			if (irc_fd < 0 || !FD_ISSET(irc_fd, &readfds)) {
+				continue;
+			}
+
+			// Lines that came with the end of the handshake are read right away.
+			if (!connection->joined && advance_connection(connection) != 1) {
+				continue;
+			}
+			if (pipeline != NULL) {
+				continue;
+			}
+
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Got some data in the socket (connection %d)\n", idx);
 			do {
-				message = irc_next_message(irc);
+				message = irc_next_message(connection->irc);
 				if (message == NULL) {
 					LOG(LOG_LEVEL_DEBUG, "DEBUG: No more message\n");
 				} else {
 					LOG(LOG_LEVEL_DEBUG, "DEBUG: Got new message\n");
-					// Parse the message
-					// Ignore PING, pipe everything else to the output.
-					if (strcmp(message->command, "PRIVMSG") == 0) {
-						if (io_type == IO_DBUS && dbus != NULL) {
-							LOG(LOG_LEVEL_DEBUG, "DEBUG: Sending message to DBus\n");
-							send_message_to_dbus(dbus, message);
-						} else {
-							output_message(output_fd, message);
-							command_handle_message(irc, message);
-						}
-					} else if (strcmp(message->command, "PING") == 0) {
-						irc_command(irc, "PONG %s", user);
-					} else {
-						output_message(output_fd, message);
-					}
+					handle_message(&relay, connection->irc, message);
 
 					// Free message memory.
 					irc_message_free(message);
 				}
 			} while (message != NULL);
+
+			flush_outputs(&relay);
+
+			// All messages of the batch are handled, recycle their memory.
+			irc_reset_arena(connection->irc);
+		}
+
+		if (pipeline == NULL) {
+			tick_outputs(&relay);
+		}
+
+		if (output_write_fd >= 0 && FD_ISSET(output_write_fd, &writefds)) {
+			sink_flush(output);
+		}
+
+		if (dbus_write_fd >= 0 && FD_ISSET(dbus_write_fd, &writefds)) {
+			dbus_server_handle_write(dbus);
 		}
 
-		if (FD_ISSET(dbus_fd, &readfds)) {
-			LOG(LOG_LEVEL_DEBUG, "DEBUG: Got incoming DBUS signal\n");
-			dbus_server_get_signal(dbus, &dbus_message);
-			if (dbus_message != NULL) {
-				transform_incoming_message(dbus_message, command, INPUT_BUFFER_SIZE, channel);
-				irc_command(irc, "%s\n", command);
-			} else {
+		if (dbus_fd >= 0 && FD_ISSET(dbus_fd, &readfds)) {
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Got incoming DBUS signals\n");
+			outbound_batch_t batch = { .irc = outbound, .channel = channel, .size = 0, .count = 0 };
+			if (dbus_server_get_signals(dbus, queue_dbus_command, &batch) == 0) {
 				LOG(LOG_LEVEL_DEBUG, "DEBUG: Failed to read DBUS signal\n");
 			}
-			dbus_message = NULL;
+			send_outbound_batch(&batch);
+		}
+
+		if (history != NULL) {
+			history_handle_fds(history, &readfds, &writefds);
 		}
 
-		if (irc_is_connected(irc) == 0) {
-			reconnect = 1;
+		if (pool != NULL) {
+			pool_handle_fds(pool, &readfds);
 		}
+
+		if (pipeline != NULL && monotonic_ms() - pipeline_reported_at > PIPELINE_REPORT_MS) {
+			pipeline_report(pipeline, stderr);
+			pipeline_reported_at = monotonic_ms();
+		}
+
+		if (monotonic_ms() - output_reported_at > OUTPUT_REPORT_MS) {
+			sink_report(output, stderr);
+			if (search != NULL) {
+				search_report(search, stderr);
+			}
+			if (prefilter != NULL) {
+				prefilter_report(prefilter, stderr);
+			}
+			if (pool != NULL) {
+				pool_report(pool, stderr);
+			}
+			output_reported_at = monotonic_ms();
+		}
+	}
+
+	// Let queued messages drain before the outputs are closed.
+	if (pipeline != NULL) {
+		pipeline_stop(pipeline);
 	}
 
 	// Clean up.
-	if (irc != NULL) {
-		int irc_fd = irc_get_fd(irc);
-		if (irc_fd > 0) {
-			sock_close(irc_fd);
+	for (int idx = 0; idx < connections_count; idx++) {
+		if (connections[idx].irc != NULL) {
+			int irc_fd = irc_get_fd(connections[idx].irc);
+			if (irc_fd > 0) {
+				sock_close(irc_fd);
+			}
+			irc_free(connections[idx].irc);
 		}
-		irc_free(irc);
 	}
 	if (dbus != NULL) {
 		dbus_server_deinit(dbus);
 	}
+	pool_free(pool);
+	capture_close(capture);
+	prefilter_free(prefilter);
+	dedup_free(dedup);
+	archive_close(archive);
+	filter_free(filter);
+	flood_free(flood);
+	history_free(history);
+	search_free(search);
+	analytics_free(analytics);
+	journal_close(journal);
+	inbox_free(inbox);
+	script_free(script);
+	sink_free(output);
+	log_stop();
+	if (log_fd != STDERR_FILENO) {
+		close(log_fd);
+	}
 
 	// Close the streams.
 	fprintf(stdout, "%d", EOF);
@@ -370,124 +1259,571 @@ irc_message_t *get_next_message(irc_t *irc) {
 	return message;
 }
 
-irc_message_t *wait_for_next_message(irc_t *irc) {
-	irc_message_t *message = irc_wait_for_next_message(irc);
-	if (message == NULL) {
-		perror("Failed to wait for the next message.");
-		exit(-1);
+void open_connection(connection_t *connection, char *server, int port, char *user, char *password, char *channel) {
+	int64_t now = monotonic_ms();
+
+	connection->irc = start_connect(server, port, user, password, channel);
+	connection->joined = 0;
+	if (connection->irc == NULL) {
+		drop_connection(connection, now);
+		return;
 	}
-	return message;
+
+	// Handshake lines are captured too, replay goes through the same steps.
+	irc_set_capture(connection->irc, capture);
+	connection->handshake_until = now + HANDSHAKE_TIMEOUT_MS;
+}
+
+void drop_connection(connection_t *connection, int64_t now) {
+	if (connection->irc != NULL) {
+		irc_free(connection->irc);
+		connection->irc = NULL;
+	}
+
+	// A connection that worked is brought back right away, failed attempts back off.
+	if (connection->joined) {
+		connection->joined = 0;
+		connection->retry_delay = 0;
+		connection->retry_at = now;
+		return;
+	}
+
+	connection->retry_delay = connection->retry_delay > 0 ? connection->retry_delay * 2 : CONNECT_RETRY_MIN_MS;
+	if (connection->retry_delay > CONNECT_RETRY_MAX_MS) {
+		connection->retry_delay = CONNECT_RETRY_MAX_MS;
+	}
+	connection->retry_at = now + connection->retry_delay;
+}
+
+int advance_connection(connection_t *connection) {
+	int joined = irc_handshake(connection->irc);
+	if (joined != 1) {
+		return joined;
+	}
+
+	// From now on messages only live until the end of a batch.
+	if (irc_use_arena(connection->irc) == -1) {
+		fprintf(stderr, "Failed to allocate message arena, using the heap\n");
+	}
+
+	// The handshake is over, unwanted lines can be dropped unparsed.
+	irc_set_prefilter(connection->irc, prefilter);
+
+	connection->joined = 1;
+	connection->retry_delay = 0;
+	return 1;
 }
 
-irc_t *do_connect(char *server, int port, char *user, char *password, char *channel) {
-	// Connect to socket.
+int connections_wait_ms(connection_t *connections, int count, int64_t now) {
+	int64_t wait = -1;
+
+	for (int idx = 0; idx < count; idx++) {
+		int64_t at = connections[idx].irc == NULL ? connections[idx].retry_at
+			: !connections[idx].joined ? connections[idx].handshake_until
+			: -1;
+		if (at == -1) {
+			continue;
+		}
+		if (at < now) {
+			at = now;
+		}
+		if (wait == -1 || at - now < wait) {
+			wait = at - now;
+		}
+	}
+
+	return (int)wait;
+}
+
+irc_t *start_connect(char *server, int port, char *user, char *password, char *channel) {
 	int socket_fd = sock_connect(server, port);
 	if (socket_fd == -1) {
 		perror("Failed to connect to server");
 		return NULL;
 	}
 
-	// Initialize IRC.
 	irc_t *irc = irc_init(socket_fd);
 	if (irc == NULL) {
 		perror("Failed to create IRC client");
+		close(socket_fd);
 		return NULL;
 	}
 
-	// Command buffer.
-	irc_message_t *message = NULL;
+	if (irc_start_handshake(irc, user, password, channel) == -1) {
+		perror("Failed to log in");
+		irc_free(irc);
+		return NULL;
+	}
+
+	return irc;
+}
+
+void connect_senders(pool_t *pool, char *server, int port, char *channel) {
+	const char *login, *password;
+	int index;
+
+	// A failed attempt pushes the account's retry back, so each is tried once per call.
+	while ((index = pool_due_account(pool, &login, &password)) != -1) {
+		LOG(LOG_LEVEL_DEBUG, "DEBUG: Connecting sender %s\n", login);
+		pool_set_connection(pool, index, start_connect(server, port, (char *)login, (char *)password, channel));
+	}
+}
+
+int is_duplicate(relay_t *relay, irc_t *irc, irc_message_t *message) {
+	char id[64];
+
+	if (relay->dedup == NULL || message->command_id == IRC_CMD_PING) {
+		return 0;
+	}
+
+	if (message->tags != NULL && tags_get_tag(message->tags, "id", id, sizeof(id)) > 0) {
+		return dedup_check(relay->dedup, id, strlen(id), monotonic_ms());
+	}
+
+	return irc != relay->primary;
+}
+
+void handle_message(relay_t *relay, irc_t *irc, irc_message_t *message) {
+	if (dispatch_message(irc, message, relay)) {
+		sink_message(message, relay);
+	}
+}
+
+int dispatch_message(irc_t *irc, irc_message_t *message, void *context) {
+	relay_t *relay = context;
+
+	// Redundant connections deliver everything more than once, first one wins.
+	if (is_duplicate(relay, irc, message)) {
+		return 0;
+	}
+
+	// Ignore PING, pipe everything else to the output.
+	if (message->command_id == IRC_CMD_PING) {
+		irc_command(irc, "PONG %s", relay->user);
+		return 0;
+	}
+
+	if (message->command_id == IRC_CMD_PRIVMSG && relay->filter != NULL) {
+		apply_filter(relay, irc, message);
+	}
+
+	if (message->command_id == IRC_CMD_PRIVMSG && relay->flood != NULL) {
+		apply_flood(relay, irc, message);
+	}
+
+	if (message->command_id == IRC_CMD_PRIVMSG && relay->io_type != IO_DBUS) {
+		command_handle_message(relay->outbound != NULL ? relay->outbound : irc, message);
+	}
+
+	if (message->command_id == IRC_CMD_PRIVMSG && relay->script != NULL) {
+		script_handle_message(relay->script, relay->outbound != NULL ? relay->outbound : irc, message);
+	}
+
+	return 1;
+}
+
+void apply_filter(relay_t *relay, irc_t *irc, irc_message_t *message) {
+	filter_verdict_t verdict;
+	char login[64];
 
-	// Send NICK and PASS, wait for MOTDEND message.
-	irc_command(irc, "PASS %s", password);
-	irc_command(irc, "NICK %s", user);
-	irc_command(irc, "USER %s", user);
+	if (message->message == NULL || filter_check(relay->filter, message->message, &verdict) == 0) {
+		return;
+	}
 
-	LOG(LOG_LEVEL_DEBUG, "DEBUG: Waiting for RPL_WELCOME\n");
-	for (int found = 0; found < 1; ) {
-		message = wait_for_next_message(irc);
-		if (strcmp(message->command, "001") == 0) {
-			found = 1;
+	irc_message_annotate(message, "filter", verdict.label);
+
+	if (verdict.action == FILTER_FLAG
+		|| tags_has_badge(message, BADGE_MODERATOR)
+		|| tags_has_badge(message, BADGE_BROADCASTER)) {
+		return;
+	}
+
+	// Sender looks like ":login!login@login.tmi.twitch.tv".
+	if (message->sender == NULL || sscanf(message->sender, ":%63[^!]", login) != 1) {
+		return;
+	}
+
+	if (verdict.action == FILTER_BAN) {
+		irc_command(irc, "PRIVMSG %s :/ban %s filter rule %d", message->recipient, login, verdict.line);
+	} else {
+		irc_command(irc, "PRIVMSG %s :/timeout %s %d filter rule %d", message->recipient, login, verdict.duration, verdict.line);
+	}
+}
+
+void apply_flood(relay_t *relay, irc_t *irc, irc_message_t *message) {
+	char login[64];
+	const char *user_id = tags_value(message, "user-id");
+
+	if (message->message == NULL || message->recipient == NULL || user_id == NULL) {
+		return;
+	}
+
+	// Message time keeps replays deterministic, local clock is only a fallback.
+	int64_t now_ms = tags_decode(message)->sent_ts;
+	if (now_ms < 0) {
+		now_ms = monotonic_ms();
+	}
+
+	flood_verdict_t verdict = flood_check(relay->flood, message->recipient, strtoull(user_id, NULL, 10), message->message, now_ms);
+	if (verdict == FLOOD_NONE) {
+		return;
+	}
+
+	irc_message_annotate(message, "flood", flood_verdict_name(verdict));
+
+	if (relay->flood_timeout <= 0
+		|| tags_has_badge(message, BADGE_MODERATOR)
+		|| tags_has_badge(message, BADGE_BROADCASTER)) {
+		return;
+	}
+
+	if (message->sender == NULL || sscanf(message->sender, ":%63[^!]", login) != 1) {
+		return;
+	}
+
+	irc_command(irc, "PRIVMSG %s :/timeout %s %d flood (%s)", message->recipient, login, relay->flood_timeout, flood_verdict_name(verdict));
+}
+
+void sink_message(irc_message_t *message, void *context) {
+	relay_t *relay = context;
+
+	// A closed window's snapshot goes out before the message that closed it.
+	if (relay->analytics != NULL && message->command_id == IRC_CMD_PRIVMSG) {
+		char snapshot[ANALYTICS_SNAPSHOT_SIZE];
+		int length = analytics_add(relay->analytics, message, snapshot);
+		if (length > 0) {
+			if (relay->journal != NULL) {
+				journal_append(relay->journal, snapshot, length);
+			}
+			sink_write(relay->output, snapshot, length);
 		}
-		irc_message_free(message);
 	}
 
-	LOG(LOG_LEVEL_DEBUG, "DEBUG: Sending CAPs\n");
-	irc_command(irc, "CAP REQ :twitch.tv/tags twitch.tv/commands");
-	for (int found = 0; found < 1; ) {
-		message = wait_for_next_message(irc);
-		if (strcmp(message->command, "CAP") == 0) {
-			found = 1;
+	// Serialized once for the history, the journal and the output.
+	char buffer[JSON_BUFFER_SIZE] = { 0 };
+	if (relay->history != NULL && message->recipient != NULL && message->recipient[0] == '#') {
+		record_history(relay, message, buffer);
+	}
+	if (relay->journal != NULL) {
+		if (buffer[0] == '\0') {
+			serialize_message(message, buffer);
+		}
+		if (buffer[0] != '\0' && journal_append(relay->journal, buffer, strlen(buffer)) == 0) {
+			LOG(LOG_LEVEL_ERROR, "Failed to append a record to the journal\n");
 		}
-		irc_message_free(message);
 	}
 
-	// Send JOIN message, wait for NICK list end response.
-	LOG(LOG_LEVEL_DEBUG, "DEBUG: Joining the channel #%s\n", channel);
-	irc_command(irc, "JOIN #%s", channel);
-	for (int joined = 0; joined < 1; ) {
-		message = wait_for_next_message(irc);
-		if (strcmp(message->command, "366") == 0) {
-			joined = 1;
+	if (message->command_id == IRC_CMD_PRIVMSG) {
+		if (relay->archive != NULL) {
+			archive_append(relay->archive, message);
+		}
+		if (relay->io_type == IO_DBUS && relay->dbus != NULL) {
+			LOG(LOG_LEVEL_DEBUG, "DEBUG: Sending message to DBus\n");
+			send_message_to_dbus(relay, message);
+			return;
 		}
-		irc_message_free(message);
 	}
 
-	return irc;
+	if (buffer[0] != '\0') {
+		sink_write(relay->output, buffer, strlen(buffer));
+	} else {
+		output_message(relay->output, message);
+	}
 }
 
-void serialize_message(irc_message_t *message, char *buffer) {
-	char escaped_message[2048] = { 0 };
+void record_history(relay_t *relay, irc_message_t *message, char *buffer) {
+	char seq[24];
 
-	if (message->sender == NULL || message->tags == NULL || message->message == NULL) {
-		return;
+	// Subscribers resume from the last sequence number they've seen.
+	snprintf(seq, sizeof(seq), "%llu", (unsigned long long)history_next_seq(relay->history));
+	irc_message_annotate(message, "seq", seq);
+
+	serialize_message(message, buffer);
+	if (buffer[0] != '\0') {
+		uint64_t appended = history_append(relay->history, message->recipient, buffer, strlen(buffer));
+		if (appended != 0 && relay->search != NULL) {
+			search_add(relay->search, appended, message->message);
+		}
+	}
+}
+
+void flush_outputs(void *context) {
+	relay_t *relay = context;
+
+	if (relay->archive != NULL) {
+		archive_flush(relay->archive);
+	}
+	if (relay->dbus != NULL) {
+		dbus_server_flush(relay->dbus);
+	}
+	if (relay->history != NULL) {
+		history_flush(relay->history);
+	}
+	if (relay->journal != NULL) {
+		journal_flush(relay->journal);
+	}
+	sink_flush(relay->output);
+}
+
+void tick_outputs(void *context) {
+	relay_t *relay = context;
+
+	if (relay->analytics != NULL) {
+		close_analytics(relay, realtime_ms());
+	}
+}
+
+void close_analytics(relay_t *relay, int64_t now_ms) {
+	char snapshot[ANALYTICS_SNAPSHOT_SIZE];
+	int length, closed = 0;
+
+	while ((length = analytics_close(relay->analytics, now_ms, snapshot)) > 0) {
+		if (relay->journal != NULL) {
+			journal_append(relay->journal, snapshot, length);
+		}
+		sink_write(relay->output, snapshot, length);
+		closed++;
+	}
+
+	if (closed > 0) {
+		flush_outputs(relay);
+	}
+}
+
+void parse_cpu_list(char *list, int *cpus) {
+	char *token, *pointer = list;
+
+	for (int idx = 0; idx < PIPELINE_STAGES; idx++) {
+		token = strsep(&pointer, ",");
+		cpus[idx] = (token != NULL && *token != '\0') ? atoi(token) : -1;
+	}
+}
+
+irc_t *replay_stream(replay_stream_t *streams, uint32_t connection, int start, uint64_t *started) {
+	replay_stream_t *stream = NULL;
+	for (int idx = 0; idx < REPLAY_STREAMS && stream == NULL; idx++) {
+		if (streams[idx].irc != NULL && streams[idx].connection == connection) {
+			stream = &streams[idx];
+		}
+	}
+	if (stream != NULL && !start) {
+		return stream->irc;
+	}
+
+	for (int idx = 0; idx < REPLAY_STREAMS && stream == NULL; idx++) {
+		if (streams[idx].irc == NULL) {
+			stream = &streams[idx];
+		}
+	}
+	for (int idx = 0; idx < REPLAY_STREAMS && stream == NULL; idx++) {
+		if (idx == 0 || streams[idx].started < stream->started) {
+			stream = &streams[idx];
+		}
+	}
+
+	// Whatever was left of the old connection's buffer ends with it.
+	if (stream->irc != NULL) {
+		irc_free(stream->irc);
+	}
+	stream->irc = irc_init(-1);
+	irc_use_arena(stream->irc);
+	irc_set_prefilter(stream->irc, prefilter);
+	stream->connection = connection;
+	stream->started = (*started)++;
+	return stream->irc;
+}
+
+int replay_capture(relay_t *relay, const char *path, int paced) {
+	replay_t *replay = replay_open(path);
+	if (replay == NULL) {
+		perror("Failed to open capture for replay");
+		return -1;
+	}
+
+	replay_stream_t streams[REPLAY_STREAMS] = { 0 };
+	uint64_t started_count = 0;
+	irc_message_t *message = NULL;
+	const char *data;
+	int size;
+	uint32_t connection, flags;
+	uint64_t timestamp, first = 0;
+	unsigned long records = 0, messages = 0, bytes = 0;
+	struct timespec started, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	while (terminate == 0 && replay_next(replay, &data, &size, &timestamp, &connection, &flags)) {
+		if (first == 0) {
+			first = timestamp;
+		}
+
+		// Sleep until the record is due relative to the first one.
+		if (paced) {
+			uint64_t due = (uint64_t)started.tv_sec * 1000000000ull + started.tv_nsec + (timestamp - first);
+			struct timespec until = {
+				.tv_sec = due / 1000000000ull,
+				.tv_nsec = due % 1000000000ull
+			};
+			if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0 && terminate) {
+				break;
+			}
+		}
+
+		// Each recorded connection is parsed on its own, so their partial lines never mix.
+		irc_t *irc = replay_stream(streams, connection, flags & CAPTURE_START, &started_count);
+
+		// Duplicates without an id are taken from the connection that started first, like the live relay does.
+		replay_stream_t *primary = NULL;
+		for (int idx = 0; idx < REPLAY_STREAMS; idx++) {
+			if (streams[idx].irc != NULL && (primary == NULL || streams[idx].started < primary->started)) {
+				primary = &streams[idx];
+			}
+		}
+		relay->primary = primary->irc;
+
+		// Records can be larger than the client buffer, so feed and drain in turns.
+		while (size > 0) {
+			int fed = irc_feed(irc, data, size);
+			int drained = 0;
+			data += fed;
+			size -= fed;
+			bytes += fed;
+
+			while ((message = irc_pop_message(irc)) != NULL) {
+				handle_message(relay, irc, message);
+				irc_message_free(message);
+				messages++;
+				drained++;
+			}
+			irc_reset_arena(irc);
+
+			// A full buffer without a newline would stop the rest of the capture from getting in.
+			if (fed == 0 && drained == 0) {
+				fprintf(stderr, "Replay: line does not fit into the buffer, dropping it\n");
+				irc_discard_partial(irc);
+			}
+		}
+
+		flush_outputs(relay);
+		records++;
 	}
 
-	int len = sprintf(buffer, "{\"tags\":\"%s\",\"sender\":\"%s\"", message->tags, message->sender);
-	if (message->command != NULL)
-		len = len + sprintf(buffer+len, ",\"command\":\"%s\"", message->command);
+	// No later message will close the last windows, message time can't be compared to the local clock.
+	if (relay->analytics != NULL) {
+		close_analytics(relay, INT64_MAX);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+	fprintf(
+		stderr,
+		"Replayed %lu records, %lu messages, %lu bytes in %.3fs (%.0f msg/s)\n",
+		records,
+		messages,
+		bytes,
+		elapsed,
+		elapsed > 0 ? messages / elapsed : 0
+	);
 
-	// Quote-escape message first, then append it to the output.
-	string_quote_escape(message->message, escaped_message, 2034 - len);
-	sprintf(buffer+len, ",\"message\":\"%s\"}\n", escaped_message);
+	relay->primary = NULL;
+	for (int idx = 0; idx < REPLAY_STREAMS; idx++) {
+		if (streams[idx].irc != NULL) {
+			irc_free(streams[idx].irc);
+		}
+	}
+	replay_close(replay);
+	return 0;
 }
 
-void send_message_to_dbus(dbus_server_t *server, irc_message_t *message) {
-	char buffer[2048] = { 0 };
+void send_typed_message_to_dbus(dbus_server_t *server, irc_message_t *message) {
+	// Decoded once per message and cached on it, values come unescaped.
+	const tags_t *tags = tags_decode(message);
+
+	const char *fields[] = { message->sender, message->command, message->recipient, message->message };
+	dbus_server_send_typed_signal(
+		server,
+		DBUS_OUT_PATH,
+		DBUS_INTERFACE,
+		DBUS_OUT_TYPED_SIGNAL,
+		fields,
+		4,
+		(const char *const *)tags->keys,
+		(const char *const *)tags->values,
+		tags->count
+	);
+}
+
+void send_message_to_dbus(relay_t *relay, irc_message_t *message) {
+	char buffer[JSON_BUFFER_SIZE] = { 0 };
+
+	if (relay->dbus_typed) {
+		send_typed_message_to_dbus(relay->dbus, message);
+		return;
+	}
+
 	serialize_message(message, buffer);
+	if (relay->dbus_batch > 0) {
+		dbus_server_queue_batch(relay->dbus, buffer);
+		return;
+	}
 	dbus_server_send_signal(
-		server,
-		"/ru/aint/twitch/signal",
+		relay->dbus,
+		DBUS_OUT_PATH,
 		DBUS_INTERFACE,
 		DBUS_OUT_SIGNAL,
 		buffer
 	);
 }
 
-void output_message(int file, irc_message_t *message) {
-	char buffer[2048] = { 0 };
+void output_message(sink_t *output, irc_message_t *message) {
+	char buffer[JSON_BUFFER_SIZE] = { 0 };
 	serialize_message(message, buffer);
-	write(file, buffer, strlen(buffer));
+	if (buffer[0] != '\0') {
+		sink_write(output, buffer, strlen(buffer));
+	}
 }
 
 void print_usage() {
 	fprintf(
 		stderr,
-		"Usage: twitch-bot <user> <password> <channel> [-f|-s|-d]\n  -f: Use named pipes instead of STD for input and output.\n  -s: [Default] Use standard input/output pipes for input and output.\n	-d: Use DBUS to send and receive chat messages and commands.\n"
+		"Usage: twitch-bot <user> <password> <channel> [-f|-s|-d] [options]\n  -f: Use named pipes instead of STD for input and output.\n  -s: [Default] Use standard input/output pipes for input and output.\n	-d: Use DBUS to send and receive chat messages and commands.\n"
+		"  --capture <file>: Append raw IRC stream with receive timestamps to a capture file.\n"
+		"  --replay <file>: Feed a capture file through the relay instead of connecting.\n"
+		"  --replay-fast: Replay as fast as possible instead of the recorded pacing.\n"
+		"  --archive <dir>: Store chat messages in an indexed archive, see tools/archive-query.\n"
+		"  --redundant <n>: Keep n connections joined to the channel and relay whichever delivers first.\n"
+		"  --pipeline: Read, parse and output messages on separate threads.\n"
+		"  --pin <r,p,s>: Pin pipeline reader, parser and sink threads to given CPUs.\n"
+		"  --dbus-batch <n>: Send DBus messages in batches of up to n per signal.\n"
+		"  --dbus-typed: Send DBus messages as typed signals instead of JSON strings.\n"
+		"  --filter <file>: Check chat messages against moderation rules, reloaded on SIGHUP.\n"
+		"  --flood <n>: Flag users sending more than n messages in 10 seconds, repeating themselves or joining copypasta waves.\n"
+		"  --flood-timeout <seconds>: Also time out flagged users.\n"
+		"  --log <file>: Write log messages to a file instead of stderr.\n"
+		"  --history <socket>: Keep recent records per channel and serve them to subscribers on a Unix socket.\n"
+		"  --search <minutes>: Index the last minutes of chat by word for search requests on the history socket.\n"
+		"  --search-memory <MB>: Memory limit of the search index, 64 by default.\n"
+		"  --analytics <seconds>: Output message rates, unique chatters, top emotes and top chatters per channel for windows of this length.\n"
+		"  --drop <commands>: Drop lines with these commands unparsed, e.g. JOIN,PART,ROOMSTATE,USERSTATE,CLEARMSG.\n"
+		"  --usernotice <types>: Only keep USERNOTICE lines of these msg-ids, e.g. sub,resub,raid.\n"
+		"  --block-users <file>: Drop lines from the user ids listed in the file, one per line.\n"
+		"  --output-policy <policy>: What to do when the output reader falls behind: drop-oldest (default), drop-newest, block or spill.\n"
+		"  --output-spill <file>: Overflow file for the spill policy, /tmp/twitch-bot-spill by default.\n"
+		"  --journal <dir>: Append output records to a durable journal, see tools/journal-read.\n"
+		"  --journal-max-size <MB>: Delete the oldest journal segments past this total size, 1024 by default, 0 to keep them.\n"
+		"  --journal-max-age <hours>: Delete journal segments older than this, 168 by default, 0 to keep them.\n"
+		"  --server <host>: IRC server to connect to, irc.chat.twitch.tv by default.\n"
+		"  --port <port>: IRC server port, 6667 by default.\n"
+		"  --input-socket <path>: Accept chat lines from several producers on a Unix socket.\n"
+		"  --input-rate <n>: Send at most n lines from the input and input socket per 30 seconds, no limit by default.\n"
+		"  --senders <file>: Send outgoing chat through the accounts listed in the file, a \"<login> <password>\" line each.\n"
+		"  --sender-strategy <strategy>: How lines pick a sender: least-loaded (default) or affinity, by channel.\n"
+		"  --sender-rate <n>: Max chat lines per sender account per 30 seconds, 20 by default.\n"
+		"  --script <path>: Run chat commands from a Lua script, reloaded on SIGHUP. Runs in LuaJIT's interpreter with the JIT off. Needs a WITH_LUAJIT build.\n"
+		"  --script-budget <n>: Max Lua instructions per script handler call, 100000 by default.\n"
 	);
 }
 
-int read_line(char *buffer, int size, int fd) {
-	char c;
-	int counter = 0;
-	while ((read(fd, &c, 1) != 0) && counter < size) {
-		if (c == '\n') {
-			break;
-		}
-		buffer[counter++] = c;
-	}
-	return counter;
-}
-
 void setup_signals(sigset_t *sigset) {
 	// Setup signal interrupts.
 	sigset_t mask;
@@ -503,10 +1839,16 @@ void setup_signals(sigset_t *sigset) {
 		perror("Failed to setup SIGINT listener.");
 		exit(1);
 	}
+	act.sa_handler = reload_handler;
+	if (sigaction(SIGHUP, &act, 0)) {
+		perror("Failed to setup SIGHUP listener.");
+		exit(1);
+	}
 
 	sigemptyset (&mask);
 	sigaddset (&mask, SIGTERM);
 	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGHUP);
 
 	if (sigprocmask(SIG_BLOCK, &mask, sigset) < 0) {
 		perror ("Failed to sigprocmask");
@@ -514,6 +1856,45 @@ void setup_signals(sigset_t *sigset) {
 	}
 }
 
+void queue_dbus_command(const char *signal, void *context) {
+	outbound_batch_t *batch = context;
+	char command[INPUT_BUFFER_SIZE];
+
+	transform_incoming_message((char *)signal, command, INPUT_BUFFER_SIZE, batch->channel);
+
+	// A signal is a single chat line, it must not smuggle in extra IRC commands.
+	for (char *pointer = command; *pointer != '\0'; pointer++) {
+		if (*pointer == '\r' || *pointer == '\n') {
+			*pointer = ' ';
+		}
+	}
+
+	int length = strlen(command);
+	if (batch->size + length + 2 >= OUTBOUND_BUFFER_SIZE) {
+		send_outbound_batch(batch);
+	}
+
+	memcpy(batch->buffer + batch->size, command, length);
+	memcpy(batch->buffer + batch->size + length, "\r\n", 2);
+	batch->size += length + 2;
+	batch->count++;
+}
+
+void send_outbound_batch(outbound_batch_t *batch) {
+	if (batch->size == 0) {
+		return;
+	}
+
+	LOG(LOG_LEVEL_DEBUG, "DEBUG: Sending %d commands from DBus\n", batch->count);
+	batch->buffer[batch->size] = '\0';
+	if (irc_send_literal(batch->irc, batch->buffer) == -1) {
+		perror("Failed to send commands from DBus");
+	}
+
+	batch->size = 0;
+	batch->count = 0;
+}
+
 void transform_incoming_message(char *in, char *out, int outsize, char *channel) {
 	memset(out, 0, outsize);
 	snprintf(out, outsize - 1, "PRIVMSG #%s :%s", channel, in);
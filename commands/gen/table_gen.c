@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+/**
+ * Generates the command dispatch table from command sources.
+ *
+ * A command is any file defining `void xxx_handle(irc_t *, irc_message_t *)`.
+ * It may also define `int xxx_match(irc_message_t *)` and declare a trigger,
+ * the first word of chat messages it reacts to, with `TRIGGER(xxx, "word")`.
+ * Triggered commands are placed into a table indexed by a perfect hash of the
+ * trigger, commands without one are checked against every message.
+ *
+ * Usage: table_gen <file.c>... > table.h
+ **/
+
+#define MAX_COMMANDS 256
+#define NAME_SIZE 64
+#define TRIGGER_SIZE 64
+#define LINE_SIZE 1024
+
+/* Gives up looking for a perfect hash seed after this many attempts and grows the table. */
+#define MAX_SEEDS 100000
+
+/* Largest table tried before giving up on a perfect hash. */
+#define MAX_TABLE_SIZE 65536
+
+typedef struct {
+  char name[NAME_SIZE];
+  char trigger[TRIGGER_SIZE];
+  int has_match;
+  int has_handle;
+} command_t;
+
+static command_t commands[MAX_COMMANDS];
+static int commands_count = 0;
+
+/** Private **/
+
+/* Must stay in sync with trigger_hash() in list.c. */
+static uint32_t trigger_hash(const char *str, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)str[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static command_t *find_command(const char *name) {
+  for (int idx = 0; idx < commands_count; idx++) {
+    if (strcmp(commands[idx].name, name) == 0) {
+      return &commands[idx];
+    }
+  }
+
+  if (commands_count == MAX_COMMANDS) {
+    fprintf(stderr, "Too many commands\n");
+    exit(1);
+  }
+
+  command_t *command = &commands[commands_count++];
+  snprintf(command->name, NAME_SIZE, "%s", name);
+  return command;
+}
+
+/**
+ * Takes the identifier ending right before `suffix` in a function definition line.
+ *
+ * @return: 1 if the line defines such a function, 0 otherwise.
+ **/
+static int function_name(const char *line, const char *type, const char *suffix, char *name) {
+  size_t type_length = strlen(type);
+  if (strncmp(line, type, type_length) != 0) {
+    return 0;
+  }
+
+  const char *start = line + type_length;
+  const char *end = strstr(start, suffix);
+  if (end == NULL || end == start) {
+    return 0;
+  }
+
+  for (const char *pointer = start; pointer < end; pointer++) {
+    if (!isalnum((unsigned char)*pointer) && *pointer != '_') {
+      return 0;
+    }
+  }
+
+  snprintf(name, NAME_SIZE, "%.*s", (int)(end - start), start);
+  return 1;
+}
+
+static void scan_file(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    exit(1);
+  }
+
+  char line[LINE_SIZE], name[NAME_SIZE], trigger[TRIGGER_SIZE];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (function_name(line, "void ", "_handle(irc_t", name)) {
+      find_command(name)->has_handle = 1;
+    } else if (function_name(line, "int ", "_match(irc_message_t", name)) {
+      find_command(name)->has_match = 1;
+    } else if (sscanf(line, "TRIGGER(%63[a-zA-Z0-9_], \"%63[^\"]\")", name, trigger) == 2) {
+      snprintf(find_command(name)->trigger, TRIGGER_SIZE, "%s", trigger);
+    }
+  }
+
+  fclose(file);
+}
+
+/**
+ * Looks for a seed mapping every trigger to its own slot.
+ *
+ * @return: 1 if a seed was found, 0 otherwise.
+ **/
+static int find_seed(uint32_t size, uint32_t *seed) {
+  char used[size];
+
+  for (uint32_t attempt = 0; attempt < MAX_SEEDS; attempt++) {
+    int collision = 0;
+    memset(used, 0, size);
+
+    for (int idx = 0; idx < commands_count && !collision; idx++) {
+      if (commands[idx].trigger[0] == '\0') {
+        continue;
+      }
+      uint32_t slot = trigger_hash(commands[idx].trigger, strlen(commands[idx].trigger), attempt) & (size - 1);
+      collision = used[slot];
+      used[slot] = 1;
+    }
+
+    if (!collision) {
+      *seed = attempt;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void print_entry(command_t *command) {
+  printf(
+    "{ \"%s\", %zu, %s%s, %s_handle }",
+    command->trigger,
+    strlen(command->trigger),
+    command->has_match ? command->name : "NULL",
+    command->has_match ? "_match" : "",
+    command->name
+  );
+}
+
+/** Main **/
+
+int main(int argc, char **argv) {
+  for (int idx = 1; idx < argc; idx++) {
+    scan_file(argv[idx]);
+  }
+
+  // Commands without a handler aren't commands, e.g. a helper defining a matcher.
+  int count = 0, triggered = 0;
+  for (int idx = 0; idx < commands_count; idx++) {
+    if (!commands[idx].has_handle) {
+      continue;
+    }
+    if (!commands[idx].has_match && commands[idx].trigger[0] == '\0') {
+      fprintf(stderr, "Command %s needs %s_match or a TRIGGER\n", commands[idx].name, commands[idx].name);
+      return 1;
+    }
+    triggered += commands[idx].trigger[0] != '\0';
+    commands[count++] = commands[idx];
+  }
+  commands_count = count;
+
+  // No seed separates equal triggers.
+  for (int idx = 0; idx < commands_count; idx++) {
+    for (int other = idx + 1; other < commands_count && commands[idx].trigger[0] != '\0'; other++) {
+      if (strcmp(commands[idx].trigger, commands[other].trigger) == 0) {
+        fprintf(stderr, "Trigger %s used by %s and %s\n", commands[idx].trigger, commands[idx].name, commands[other].name);
+        return 1;
+      }
+    }
+  }
+
+  uint32_t size = 1, seed = 0;
+  while (size < (uint32_t)triggered * 2) {
+    size <<= 1;
+  }
+  while (!find_seed(size, &seed)) {
+    if (size >= MAX_TABLE_SIZE) {
+      fprintf(stderr, "No perfect hash for the triggers within %d slots\n", MAX_TABLE_SIZE);
+      return 1;
+    }
+    size <<= 1;
+  }
+
+  printf("/* Generated by gen/table_gen from command sources, do not edit. */\n\n");
+  for (int idx = 0; idx < commands_count; idx++) {
+    if (commands[idx].has_match) {
+      printf("extern int %s_match(irc_message_t *);\n", commands[idx].name);
+    }
+    printf("extern void %s_handle(irc_t *, irc_message_t *);\n", commands[idx].name);
+  }
+
+  printf("\n#define COMMAND_TABLE_SIZE %u\n", size);
+  printf("#define COMMAND_TABLE_SEED %uu\n\n", seed);
+
+  printf("static const command_entry_t COMMAND_TABLE[COMMAND_TABLE_SIZE] = {\n");
+  for (int idx = 0; idx < commands_count; idx++) {
+    command_t *command = &commands[idx];
+    if (command->trigger[0] == '\0') {
+      continue;
+    }
+    printf("  [%u] = ", trigger_hash(command->trigger, strlen(command->trigger), seed) & (size - 1));
+    print_entry(command);
+    printf(",\n");
+  }
+  printf("};\n\n");
+
+  printf("static const command_entry_t COMMAND_MATCHERS[] = {\n");
+  for (int idx = 0; idx < commands_count; idx++) {
+    if (commands[idx].trigger[0] == '\0') {
+      printf("  ");
+      print_entry(&commands[idx]);
+      printf(",\n");
+    }
+  }
+  printf("  { NULL, 0, NULL, NULL }\n};\n");
+
+  return 0;
+}
@@ -5,6 +5,8 @@
 #include "tags.h"
 #include "../irc.h"
 
+TRIGGER(hi, "$hi")
+
 int hi_match(irc_message_t *message) {
   if (strcmp("$hi", message->message) == 0) {
     return 1;
@@ -14,8 +16,10 @@ int hi_match(irc_message_t *message) {
 }
 
 void hi_handle(irc_t *irc, irc_message_t *message) {
-  char display_name[128] =  { 0 };
-  tags_get_tag(message->tags, "display-name", display_name, sizeof(display_name));
+  const char *display_name = tags_value(message, "display-name");
+  if (display_name == NULL) {
+    display_name = "";
+  }
 
   irc_command(irc, "PRIVMSG %s :hi, @%s", message->recipient, display_name);
 }
@@ -1,29 +1,47 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "list.h"
 
-/** 
- * Command handler struct.
- * Matcher function checks whether given IRC message should be handled by the command.
- * Handler function takes current IRC connection, the message that was matched, and
- * does the handling, whatever that might be.
+/**
+ * Command table entry.
+ * Trigger is the first word of messages the command reacts to, or NULL if the
+ * matcher has to check every message. Matcher function checks whether given
+ * IRC message should be handled by the command, NULL means the trigger is
+ * enough. Handler function takes current IRC connection, the message that was
+ * matched, and does the handling, whatever that might be.
 **/
 typedef struct {
+  const char *trigger;
+  size_t trigger_length;
   int (*matcher)(irc_message_t*);
   void (*handler)(irc_t *, irc_message_t *);
-} command_handler_t;
+} command_entry_t;
 
-/**
- * List of commands holder.
- */
-typedef struct {
-  int size;
-  command_handler_t **commands;
-} command_list_t;
+/* Generated from command sources at build time, see gen/table_gen.c. */
+#include "table.h"
+
+/** Private **/
 
-/** Global state **/
+/* Must stay in sync with trigger_hash() in gen/table_gen.c. */
+static uint32_t trigger_hash(const char *str, size_t length, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)str[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int run_command(const command_entry_t *command, irc_t *irc, irc_message_t *message) {
+  if (command->matcher != NULL && command->matcher(message) != 1) {
+    return 0;
+  }
 
-static command_list_t commands = { 0 };
+  command->handler(irc, message);
+  return 1;
+}
 
 /** Public **/
 
@@ -38,33 +56,24 @@ static command_list_t commands = { 0 };
 int command_handle_message(irc_t *irc, irc_message_t *message) {
   int found = 0;
 
-  for (int idx = 0; idx < commands.size; idx++) {
-    if (commands.commands[idx]->matcher(message) == 1) {
-      commands.commands[idx]->handler(irc, message);
-      found = 1;
-    }
+  if (message->message == NULL) {
+    return 0;
   }
 
-  return found;
-}
-
-/**
- * Register a new command handler.
- *
- * @param matcher: Function that checks if command matches given message.
- * @param handler: Function that handles messages that were matched successfully.
- */
-void register_command_handler(int (*matcher)(irc_message_t*), void (*handler)(irc_t *, irc_message_t *)) {
-  command_handler_t *command = calloc(1, sizeof(command_handler_t));
-  command->matcher = matcher;
-  command->handler = handler;
+  // Triggered commands: a single slot to check for the first word.
+  size_t length = strcspn(message->message, " ");
+  uint32_t slot = trigger_hash(message->message, length, COMMAND_TABLE_SEED) & (COMMAND_TABLE_SIZE - 1);
+  const command_entry_t *command = &COMMAND_TABLE[slot];
+  if (command->trigger != NULL
+      && command->trigger_length == length
+      && memcmp(command->trigger, message->message, length) == 0) {
+    found |= run_command(command, irc, message);
+  }
 
-  if (commands.commands == NULL) {
-    commands.commands = malloc(1 * sizeof(command_handler_t*));
-  } else {
-    commands.commands = realloc(commands.commands, commands.size + 1);
+  // Commands with matchers only.
+  for (command = COMMAND_MATCHERS; command->handler != NULL; command++) {
+    found |= run_command(command, irc, message);
   }
 
-  commands.commands[commands.size] = command;
-  commands.size = commands.size + 1;
+  return found;
 }
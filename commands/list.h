@@ -14,29 +14,12 @@
 int command_handle_message(irc_t *irc, irc_message_t *message);
 
 /**
- * Register a new command handler.
- *
- * @param matcher: Function that checks if command matches given message.
- * @param handler: Function that handles messages that were matched successfully.
- */
-void register_command_handler(
-  int (*matcher)(irc_message_t*),
-  void (*handler)(irc_t *, irc_message_t *)
-);
-
-/** 
- * Helper macro to register a new command. Takes command name and expects its functions to
- * have names commandname__match and commandname_handle.
+ * Declares the first word of chat messages a command reacts to. Expands to
+ * nothing: the build scans command sources for it and generates the dispatch
+ * table in `table.h`. Takes command name and the trigger word, e.g.
+ * `TRIGGER(hi, "$hi")`. The command's `xxx_match`, if defined, is still
+ * called to confirm the match.
  **/
-#define REGISTER(command) register_command_handler(command ## _match, command ## _handle);
-
-/**
- * Helper macro to export command's functions to a source file as `extern` functions. 
- * Takes command name and expects its functions to have names commandname__match 
- * and commandname_handle.
- */
-#define COMMAND(command) \
-  extern int command ## _match(irc_message_t *); \
-  extern void command ## _handle(irc_t *, irc_message_t *);
+#define TRIGGER(command, word)
 
 #endif
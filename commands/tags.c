@@ -4,6 +4,26 @@
 
 #include "tags.h"
 
+/* Tag names of badge_t kinds, in the same order. */
+static const char *const BADGE_NAMES[BADGE_KINDS] = {
+  "broadcaster",
+  "moderator",
+  "vip",
+  "subscriber",
+  "founder",
+  "staff",
+  "admin",
+  "global_mod",
+  "partner",
+  "turbo",
+  "premium",
+  "bits",
+  "artist-badge"
+};
+
+/* Decoded set for messages without tags. */
+static const tags_t EMPTY_TAGS = { .sent_ts = -1 };
+
 /** Private **/
 
 int str_prefix(char *str, char *substr) {
@@ -30,6 +50,114 @@ int min_int(int a, int b) {
   }
 }
 
+/**
+ * Upper bound of emote ranges in a tags string. Each range has a dash.
+ **/
+static int count_ranges(const char *tags) {
+  const char *value = strstr(tags, "emotes=");
+  int count = 0;
+
+  // Make sure it's not the tail of another tag name.
+  while (value != NULL && value != tags && value[-1] != ';' && value[-1] != '@') {
+    value = strstr(value + 1, "emotes=");
+  }
+  if (value == NULL) {
+    return 0;
+  }
+
+  for (value += 7; *value != '\0' && *value != ';'; value++) {
+    count += *value == '-';
+  }
+  return count;
+}
+
+/**
+ * Parses badges value, e.g. "moderator/1,subscriber/12".
+ **/
+static void decode_badges(tags_t *decoded, const char *value) {
+  while (*value != '\0') {
+    const char *slash = strchr(value, '/');
+    const char *comma = strchr(value, ',');
+    if (comma == NULL) {
+      comma = value + strlen(value);
+    }
+    int name_length = (slash != NULL && slash < comma ? slash : comma) - value;
+
+    for (int kind = 0; kind < BADGE_KINDS; kind++) {
+      if ((int)strlen(BADGE_NAMES[kind]) == name_length && strncmp(BADGE_NAMES[kind], value, name_length) == 0) {
+        decoded->badges |= 1u << kind;
+        decoded->badge_versions[kind] = slash != NULL && slash < comma ? atoi(slash + 1) : 0;
+        break;
+      }
+    }
+
+    value = *comma == ',' ? comma + 1 : comma;
+  }
+}
+
+/**
+ * Parses emotes value, e.g. "25:0-4,12-16/1902:6-10".
+ **/
+static void decode_emotes(tags_t *decoded, const char *value, int max) {
+  while (*value != '\0') {
+    const char *colon = strchr(value, ':');
+    if (colon == NULL) {
+      return;
+    }
+    const char *pointer = colon + 1;
+
+    // Ranges of one emote go until the next slash.
+    while (*pointer != '\0' && *pointer != '/' && decoded->emotes_count < max) {
+      char *end;
+      emote_range_t *range = &decoded->emotes[decoded->emotes_count];
+      range->id = value;
+      range->id_length = colon - value;
+      range->start = strtol(pointer, &end, 10);
+      if (*end != '-') {
+        return;
+      }
+      range->end = strtol(end + 1, &end, 10);
+      decoded->emotes_count++;
+
+      pointer = *end == ',' ? end + 1 : end;
+    }
+
+    value = pointer;
+    if (*value == '/') {
+      value++;
+    } else if (*value != '\0') {
+      return;
+    }
+  }
+}
+
+/**
+ * Builds decoded tags into a block sized by tags_decode().
+ **/
+static void fill_tags(irc_message_t *message, void *data) {
+  tags_t *decoded = data;
+  int ranges = count_ranges(message->tags);
+  char *strings = (char *)(decoded->emotes + ranges);
+
+  memset(decoded, 0, sizeof(tags_t));
+  decoded->sent_ts = -1;
+  strcpy(strings, message->tags);
+
+  decoded->count = tags_split(strings, decoded->keys, decoded->values, TAGS_MAX);
+  for (int idx = 0; idx < decoded->count; idx++) {
+    char *key = decoded->keys[idx], *value = decoded->values[idx];
+    tags_unescape(value, value, strlen(value) + 1);
+
+    if (strcmp(key, "badges") == 0) {
+      decode_badges(decoded, value);
+    } else if (strcmp(key, "emotes") == 0) {
+      decode_emotes(decoded, value, ranges);
+    } else if (strcmp(key, "tmi-sent-ts") == 0 && value[0] != '\0') {
+      decoded->sent_ts = strtoll(value, NULL, 10);
+    }
+  }
+}
+
 /** Public **/
 
 /**
@@ -47,19 +175,25 @@ int tags_get_tag(char *input, char *tag, char *output, int size) {
   int length = strlen(input), value_length = 0;
   char *token = NULL, *string, *pointer;
 
+  int tag_length = strlen(tag);
+
   string = malloc(length * sizeof(char) + 1);
   pointer = string;
   memcpy(string, input, length + 1);
-  string[length + 1] = '\0';
+  if (pointer[0] == '@') {
+    pointer += 1;
+  }
 
+  // Only the whole tag name matches, "emote" is not "emotes".
   while ((token = strsep(&pointer, ";")) != NULL) {
-    if (str_prefix(token, tag)) {
+    if (str_prefix(token, tag) && token[tag_length] == '=') {
       char *value = strchr(token, '=');
       if (value != NULL) {
         value += 1;
         value_length = min_int(strlen(value), size - 1);
-        strncpy(output, value, value_length);
-        output[value_length + 1] = '\0';
+        memcpy(output, value, value_length);
+        output[value_length] = '\0';
+        free(string);
         return value_length;
       }
     }
@@ -94,3 +228,134 @@ int tags_tag_contains(char *input, char *tag, char *substring) {
   }
 }
 
+
+/**
+ * Splits a tags string in place into tag names and raw values.
+ *
+ * @param input: Tags string, with or without the leading '@'. Gets modified.
+ * @param keys: Array to hold pointers to tag names.
+ * @param values: Array to hold pointers to tag values. Tags without a value get an empty string.
+ * @param max: Size of the arrays.
+ *
+ * @return: Number of tags found.
+ **/
+int tags_split(char *input, char **keys, char **values, int max) {
+  char *token, *pointer = input;
+  int count = 0;
+
+  if (pointer[0] == '@') {
+    pointer += 1;
+  }
+
+  while (count < max && (token = strsep(&pointer, ";")) != NULL) {
+    if (token[0] == '\0') {
+      continue;
+    }
+
+    char *value = strchr(token, '=');
+    if (value != NULL) {
+      *value++ = '\0';
+    } else {
+      value = token + strlen(token);
+    }
+
+    keys[count] = token;
+    values[count] = value;
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * Decodes the message tags on the first call and caches the result on the message.
+ *
+ * @param message: Message to decode.
+ *
+ * @return: Decoded tags, valid as long as the message. Messages without tags,
+ * or ones that can't be decoded, give an empty set.
+ **/
+const tags_t *tags_decode(irc_message_t *message) {
+  if (message->tags == NULL) {
+    return &EMPTY_TAGS;
+  }
+
+  const tags_t *cached = atomic_load_explicit(&message->cache, memory_order_acquire);
+  if (cached != NULL) {
+    return cached;
+  }
+
+  size_t size = sizeof(tags_t)
+    + count_ranges(message->tags) * sizeof(emote_range_t)
+    + strlen(message->tags) + 1;
+  const tags_t *decoded = irc_message_cache(message, size, fill_tags);
+  return decoded != NULL ? decoded : &EMPTY_TAGS;
+}
+
+/**
+ * Checks if the message sender has a badge.
+ *
+ * @param message: Message to check.
+ * @param badge: Badge kind.
+ *
+ * @return: 1 if the badge is present, 0 if not.
+ **/
+int tags_has_badge(irc_message_t *message, badge_t badge) {
+  return (tags_decode(message)->badges >> badge) & 1;
+}
+
+/**
+ * Gets an unescaped tag value from the decoded tags.
+ *
+ * @param message: Message to check.
+ * @param tag: Tag name.
+ *
+ * @return: Tag value valid as long as the message, or NULL if there's no such tag.
+ **/
+const char *tags_value(irc_message_t *message, const char *tag) {
+  const tags_t *decoded = tags_decode(message);
+
+  for (int idx = 0; idx < decoded->count; idx++) {
+    if (strcmp(decoded->keys[idx], tag) == 0) {
+      return decoded->values[idx];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Reverts IRCv3 tag value escaping.
+ *
+ * @param input: Escaped value.
+ * @param output: Buffer for the unescaped value. Can be the same as input.
+ * @param size: Size of the output buffer.
+ *
+ * @return: Length of the unescaped value.
+ **/
+int tags_unescape(const char *input, char *output, int size) {
+  int length = 0;
+
+  while (*input != '\0' && length < size - 1) {
+    char symbol = *input++;
+    if (symbol == '\\') {
+      switch (*input) {
+        case ':': symbol = ';'; break;
+        case 's': symbol = ' '; break;
+        case 'r': symbol = '\r'; break;
+        case 'n': symbol = '\n'; break;
+        case '\0': break;
+        default: symbol = *input; break;
+      }
+      // A lone backslash at the end is dropped.
+      if (*input == '\0') {
+        break;
+      }
+      input++;
+    }
+    output[length++] = symbol;
+  }
+
+  output[length] = '\0';
+  return length;
+}
@@ -1,6 +1,51 @@
 #ifndef TAGS_HEADER
 #define TAGS_HEADER
 
+#include <stdint.h>
+
+#include "../irc.h"
+
+/* Max number of tags in a message. Twitch sends up to about 25. */
+#define TAGS_MAX 32
+
+/* Badges with a bit of their own in tags_t.badges. */
+typedef enum {
+  BADGE_BROADCASTER,
+  BADGE_MODERATOR,
+  BADGE_VIP,
+  BADGE_SUBSCRIBER,
+  BADGE_FOUNDER,
+  BADGE_STAFF,
+  BADGE_ADMIN,
+  BADGE_GLOBAL_MOD,
+  BADGE_PARTNER,
+  BADGE_TURBO,
+  BADGE_PREMIUM,
+  BADGE_BITS,
+  BADGE_ARTIST,
+  BADGE_KINDS
+} badge_t;
+
+/* Position of a single emote in the message text, inclusive. */
+typedef struct emote_range_t {
+  const char *id;       /* Not NUL-terminated, see id_length. */
+  int id_length;
+  int start;
+  int end;
+} emote_range_t;
+
+/* Tags of a message decoded into typed values. */
+typedef struct tags_t {
+  uint32_t badges;                    /* Bitset of badge_t. */
+  int badge_versions[BADGE_KINDS];    /* Badge version, e.g. months or bits tier. 0 if not numeric. */
+  int64_t sent_ts;                    /* tmi-sent-ts in ms, -1 if missing. */
+  int count;
+  char *keys[TAGS_MAX];
+  char *values[TAGS_MAX];             /* Unescaped values. */
+  int emotes_count;
+  emote_range_t emotes[];
+} tags_t;
+
 /**
  * Gets value of the specified tag from a tags string.
  *
@@ -22,4 +67,57 @@ int tags_get_tag(char *input, char *tag, char *output, int size);
  **/
 int tags_tag_contains(char *input, char *tag, char *substring);
 
+/**
+ * Splits a tags string in place into tag names and raw values.
+ *
+ * @param input: Tags string, with or without the leading '@'. Gets modified.
+ * @param keys: Array to hold pointers to tag names.
+ * @param values: Array to hold pointers to tag values. Tags without a value get an empty string.
+ * @param max: Size of the arrays.
+ *
+ * @returns: Number of tags found.
+ **/
+int tags_split(char *input, char **keys, char **values, int max);
+
+/**
+ * Decodes the message tags on the first call and caches the result on the message.
+ *
+ * @param message: Message to decode.
+ *
+ * @returns: Decoded tags, valid as long as the message. Messages without tags,
+ * or ones that can't be decoded, give an empty set.
+ **/
+const tags_t *tags_decode(irc_message_t *message);
+
+/**
+ * Checks if the message sender has a badge.
+ *
+ * @param message: Message to check.
+ * @param badge: Badge kind.
+ *
+ * @returns: 1 if the badge is present, 0 if not.
+ **/
+int tags_has_badge(irc_message_t *message, badge_t badge);
+
+/**
+ * Gets an unescaped tag value from the decoded tags.
+ *
+ * @param message: Message to check.
+ * @param tag: Tag name.
+ *
+ * @returns: Tag value valid as long as the message, or NULL if there's no such tag.
+ **/
+const char *tags_value(irc_message_t *message, const char *tag);
+
+/**
+ * Reverts IRCv3 tag value escaping: \: is ";", \s is " ", \\ is "\", \r and \n are CR and LF.
+ *
+ * @param input: Escaped value.
+ * @param output: Buffer for the unescaped value. Can be the same as input.
+ * @param size: Size of the output buffer.
+ *
+ * @returns: Length of the unescaped value.
+ **/
+int tags_unescape(const char *input, char *output, int size);
+
 #endif
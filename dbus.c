@@ -2,20 +2,47 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dbus.h"
+#include "debug.h"
+
+/* Signals queued above this many bytes are dropped instead of growing the queue further. */
+#define DBUS_MAX_OUTGOING (16 * 1024 * 1024)
+
+/* Size of the buffer for a sanitized copy of a string argument. Fits a whole IRC line. */
+#define DBUS_SCRATCH_SIZE 2048
+
+/* Messages collected for the next batched signal. */
+typedef struct dbus_batch_t {
+  const char *path;
+  const char *interface;
+  const char *name;
+  int max_count;
+  int count;
+  char *data;           /* NUL-separated message strings. */
+  size_t used;
+  size_t size;
+  const char **items;   /* Filled in from data right before sending. */
+} dbus_batch_t;
 
 struct dbus_server_t {
   DBusConnection *conn;
-  DBusWatch *watch;
+  DBusWatch *read_watch;
+  DBusWatch *write_watch;
   int fd;
   const char *interface;
   const char *type;
+  dbus_batch_t batch;
+  unsigned long dropped;
 };
 
 dbus_bool_t add_watch(DBusWatch *w, void *data);
 void remove_watch(DBusWatch *w, void *data);
 void toggle_watch(DBusWatch *w, void *data);
+static int is_congested(dbus_server_t *server);
+static void send_batch(dbus_server_t *server, dbus_batch_t *batch);
+static const char *utf8_string(const char *string, char *scratch, size_t size);
 
 /** Interface **/
 
@@ -23,6 +50,9 @@ dbus_server_t *dbus_server_init(const char *dest, const char *interface, const c
   DBusConnection *conn;
   DBusError err;
 
+  // Pipeline mode sends signals from its sink thread.
+  dbus_threads_init_default();
+
   // Initialize the error struct
   dbus_error_init(&err);
 
@@ -56,10 +86,11 @@ dbus_server_t *dbus_server_init(const char *dest, const char *interface, const c
   }
 
   // Initialize and return an instance of a server.
-  dbus_server_t *server = malloc(sizeof(dbus_server_t));
+  dbus_server_t *server = calloc(1, sizeof(dbus_server_t));
   if (server == NULL) {
     return NULL; // Failed to allocate enough memory
   }
+  server->fd = -1;
 
   // Set match functions.
   if (!dbus_connection_set_watch_functions(conn, add_watch, remove_watch, toggle_watch, server, NULL)) {
@@ -79,50 +110,151 @@ void dbus_server_deinit(dbus_server_t *server) {
     return;
   }
 
+  // Last chance to deliver whatever is queued, blocking is fine on the way out.
+  dbus_server_flush(server);
+  dbus_connection_flush(server->conn);
+
+  if (server->dropped > 0) {
+    fprintf(stderr, "DBUS: Dropped %lu signals, the bus was not keeping up.\n", server->dropped);
+  }
+
+  free(server->batch.data);
+  free(server->batch.items);
   free(server);
 }
 
 int dbus_server_get_fd(dbus_server_t *server) {
+  // libdbus turns reading off while its incoming queue is full.
+  if (server->read_watch == NULL || !dbus_watch_get_enabled(server->read_watch)) {
+    return -1;
+  }
   return server->fd;
 }
 
-void dbus_server_get_signal(dbus_server_t *server, char **signal) {
-  if (server->watch == NULL) { return; }
-  dbus_watch_handle(server->watch, DBUS_WATCH_READABLE);
+int dbus_server_get_write_fd(dbus_server_t *server) {
+  if (server->write_watch == NULL || !dbus_watch_get_enabled(server->write_watch)) {
+    return -1;
+  }
+  return dbus_watch_get_unix_fd(server->write_watch);
+}
+
+int dbus_server_enable_batch(
+  dbus_server_t *server,
+  const char *path,
+  const char *interface,
+  const char *name,
+  int max_count
+) {
+  dbus_batch_t *batch = &server->batch;
+
+  batch->items = calloc(max_count, sizeof(char *));
+  if (batch->items == NULL) {
+    return -1;
+  }
+
+  batch->path = path;
+  batch->interface = interface;
+  batch->name = name;
+  batch->max_count = max_count;
+  return 0;
+}
+
+void dbus_server_queue_batch(dbus_server_t *server, const char *message) {
+  dbus_batch_t *batch = &server->batch;
+  size_t length = strlen(message) + 1;
 
-  DBusDispatchStatus dispatch_rc = dbus_connection_get_dispatch_status(server->conn);
-  if (DBUS_DISPATCH_DATA_REMAINS != dispatch_rc) {
-    fprintf(stderr, "ERROR recv no message in queue\n");
+  if (batch->max_count == 0) {
     return;
   }
 
-  while(DBUS_DISPATCH_DATA_REMAINS == dispatch_rc) {
-    DBusMessage* msg = dbus_connection_pop_message(server->conn);
-    if (msg == NULL) {
-      fprintf(stderr, "ERROR recv pending check FAILED: remains but no message borrowed.\n");
+  if (batch->used + length > batch->size) {
+    size_t size = batch->size > 0 ? batch->size : 4096;
+    while (size < batch->used + length) {
+      size *= 2;
+    }
+    char *data = realloc(batch->data, size);
+    if (data == NULL) {
+      server->dropped++;
       return;
     }
+    batch->data = data;
+    batch->size = size;
+  }
+
+  memcpy(batch->data + batch->used, message, length);
+  batch->used += length;
+  batch->count++;
+
+  if (batch->count == batch->max_count) {
+    dbus_server_flush(server);
+  }
+}
 
+int dbus_server_flush(dbus_server_t *server) {
+  dbus_batch_t *batch = &server->batch;
+
+  if (batch->count > 0) {
+    const char *pointer = batch->data;
+    for (int idx = 0; idx < batch->count; idx++) {
+      batch->items[idx] = pointer;
+      pointer += strlen(pointer) + 1;
+    }
+    send_batch(server, batch);
+    batch->count = 0;
+    batch->used = 0;
+  }
+
+  // Push out whatever the socket takes right now, the rest waits for the write watch.
+  if (dbus_server_wants_write(server)) {
+    dbus_server_handle_write(server);
+  }
+
+  return dbus_connection_has_messages_to_send(server->conn) ? 1 : 0;
+}
+
+int dbus_server_wants_write(dbus_server_t *server) {
+  return server->write_watch != NULL && dbus_watch_get_enabled(server->write_watch);
+}
+
+void dbus_server_handle_write(dbus_server_t *server) {
+  DBusWatch *watch = server->write_watch;
+  if (watch != NULL && dbus_watch_get_enabled(watch)) {
+    dbus_watch_handle(watch, DBUS_WATCH_WRITABLE);
+  }
+}
+
+int dbus_server_get_signals(dbus_server_t *server, dbus_signal_callback_t callback, void *context) {
+  int count = 0;
+
+  if (server->read_watch == NULL) { return 0; }
+  dbus_watch_handle(server->read_watch, DBUS_WATCH_READABLE);
+
+  // Everything read from the socket in one go is dispatched now, not on the next wakeup.
+  DBusMessage *msg;
+  while ((msg = dbus_connection_pop_message(server->conn)) != NULL) {
     const char *iface = dbus_message_get_interface(msg);
     const char *member = dbus_message_get_member(msg);
     if (dbus_message_is_signal(msg, server->interface, server->type)) {
       DBusMessageIter args;
+      const char *signal = NULL;
       if (!dbus_message_iter_init(msg, &args)) {
-        fprintf(stderr, "No arguments in a message\n");
+        LOG(LOG_LEVEL_DEBUG, "DEBUG: DBUS: No arguments in a message\n");
       } else if (DBUS_TYPE_STRING != dbus_message_iter_get_arg_type(&args)) {
-        fprintf(stderr, "Expecting string for an argument\n");
+        LOG(LOG_LEVEL_DEBUG, "DEBUG: DBUS: Expecting string for an argument\n");
       } else {
-        fprintf(stderr, "Found a message %s, %s, returning\n", iface, member);
-        dbus_message_iter_get_basic(&args, signal);
-        return;
+        // The string belongs to the message, so it's only valid until the unref below.
+        dbus_message_iter_get_basic(&args, &signal);
+        callback(signal, context);
+        count++;
       }
     } else {
-      fprintf(stderr, "Unsupported message type: %s, %s\n", iface, member);
+      LOG(LOG_LEVEL_DEBUG, "DEBUG: DBUS: Unsupported message type: %s, %s\n", iface, member);
     }
 
     dbus_message_unref(msg);
-    dispatch_rc = dbus_connection_get_dispatch_status(server->conn);
   }
+
+  return count;
 }
 
 void dbus_server_send_signal(
@@ -135,6 +267,10 @@ void dbus_server_send_signal(
   DBusMessage *msg;
   DBusMessageIter args;
 
+  if (is_congested(server)) {
+    return;
+  }
+
   msg = dbus_message_new_signal(
     path,
     interface,
@@ -153,42 +289,201 @@ void dbus_server_send_signal(
     return;
   }
 
-  int id = 0;
-  if (!dbus_connection_send(server->conn, msg, &id)) {
+  // Only queues the signal and writes what the socket takes without blocking.
+  // The rest goes out from dbus_server_flush() or the write watch.
+  if (!dbus_connection_send(server->conn, msg, NULL)) {
     fprintf(stderr, "DBUS: Failed to send the signal.\n");
-    dbus_message_unref(msg);
+  }
+
+  dbus_message_unref(msg);
+}
+
+void dbus_server_send_typed_signal(
+  dbus_server_t *server,
+  const char *path,
+  const char *interface,
+  const char *name,
+  const char *const *fields,
+  int fields_count,
+  const char *const *keys,
+  const char *const *values,
+  int pairs_count
+) {
+  DBusMessage *msg;
+  DBusMessageIter args, dict, entry;
+  char scratch[DBUS_SCRATCH_SIZE];
+
+  if (is_congested(server)) {
     return;
   }
 
-  dbus_connection_flush(server->conn);
+  msg = dbus_message_new_signal(path, interface, name);
+  if (msg == NULL) {
+    fprintf(stderr, "DBUS: Failed to allocate a message.\n");
+    return;
+  }
+
+  dbus_message_iter_init_append(msg, &args);
+  for (int idx = 0; idx < fields_count; idx++) {
+    const char *field = utf8_string(fields[idx], scratch, sizeof(scratch));
+    if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &field)) {
+      goto append_failed;
+    }
+  }
+
+  if (!dbus_message_iter_open_container(
+    &args,
+    DBUS_TYPE_ARRAY,
+    DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    &dict
+  )) {
+    goto append_failed;
+  }
+  for (int idx = 0; idx < pairs_count; idx++) {
+    const char *key = utf8_string(keys[idx], scratch, sizeof(scratch));
+    int ok = dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry)
+      && dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    const char *value = utf8_string(values[idx], scratch, sizeof(scratch));
+    ok = ok
+      && dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &value)
+      && dbus_message_iter_close_container(&dict, &entry);
+    if (!ok) {
+      dbus_message_iter_abandon_container(&args, &dict);
+      goto append_failed;
+    }
+  }
+  if (!dbus_message_iter_close_container(&args, &dict)) {
+    goto append_failed;
+  }
+
+  if (!dbus_connection_send(server->conn, msg, NULL)) {
+    fprintf(stderr, "DBUS: Failed to send the signal.\n");
+  }
+  dbus_message_unref(msg);
+  return;
+
+append_failed:
+  fprintf(stderr, "DBUS: Failed to append message body.\n");
   dbus_message_unref(msg);
 }
 
 /** Private **/
 
-dbus_bool_t add_watch(DBusWatch *w, void *data) {
-  if (!dbus_watch_get_enabled(w)) {
-    return TRUE;
+/**
+ * libdbus aborts on strings that aren't valid UTF-8, and IRC lines can be cut
+ * in the middle of a character. Such strings are sent with non-ASCII bytes
+ * replaced instead.
+ *
+ * @param string: String to check, NULL is sent as an empty string.
+ * @param scratch: Buffer for the replacement.
+ * @param size: Size of the buffer.
+ *
+ * @return: The string itself if it's valid, or its sanitized copy in scratch.
+ **/
+static const char *utf8_string(const char *string, char *scratch, size_t size) {
+  if (string == NULL) {
+    return "";
+  }
+  if (dbus_validate_utf8(string, NULL)) {
+    return string;
+  }
+
+  size_t idx = 0;
+  for (; string[idx] != '\0' && idx < size - 1; idx++) {
+    scratch[idx] = (unsigned char)string[idx] < 0x80 ? string[idx] : '?';
+  }
+  scratch[idx] = '\0';
+  return scratch;
+}
+
+/**
+ * Checks whether the outgoing queue is too long to take another signal.
+ * Counts the signal as dropped if so.
+ **/
+static int is_congested(dbus_server_t *server) {
+  if (dbus_connection_get_outgoing_size(server->conn) < DBUS_MAX_OUTGOING) {
+    return 0;
+  }
+
+  if (server->dropped++ == 0) {
+    fprintf(stderr, "DBUS: Outgoing queue is full, dropping signals.\n");
   }
+  return 1;
+}
+
+/**
+ * Sends collected messages as a single signal with an array of strings.
+ **/
+static void send_batch(dbus_server_t *server, dbus_batch_t *batch) {
+  DBusMessage *msg;
+  DBusMessageIter args, array;
 
+  if (is_congested(server)) {
+    server->dropped += batch->count - 1;
+    return;
+  }
+
+  msg = dbus_message_new_signal(batch->path, batch->interface, batch->name);
+  if (msg == NULL) {
+    fprintf(stderr, "DBUS: Failed to allocate a message.\n");
+    return;
+  }
+
+  dbus_message_iter_init_append(msg, &args);
+  if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &array)) {
+    fprintf(stderr, "DBUS: Failed to append message body.\n");
+    dbus_message_unref(msg);
+    return;
+  }
+  for (int idx = 0; idx < batch->count; idx++) {
+    if (!dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &batch->items[idx])) {
+      fprintf(stderr, "DBUS: Failed to append message body.\n");
+      dbus_message_iter_abandon_container(&args, &array);
+      dbus_message_unref(msg);
+      return;
+    }
+  }
+  dbus_message_iter_close_container(&args, &array);
+
+  if (!dbus_connection_send(server->conn, msg, NULL)) {
+    fprintf(stderr, "DBUS: Failed to send the signal.\n");
+  }
+
+  dbus_message_unref(msg);
+}
+
+/**
+ * libdbus hands out separate watches for reading and writing. The read watch
+ * is off while the incoming queue is full, the write one is only enabled
+ * while outgoing data is queued.
+ **/
+dbus_bool_t add_watch(DBusWatch *w, void *data) {
   dbus_server_t *server = (dbus_server_t *)data;
-  int fd = dbus_watch_get_unix_fd(w);
-  server->watch = w;
-  server->fd = fd;
+  unsigned int flags = dbus_watch_get_flags(w);
+
+  if (flags & DBUS_WATCH_READABLE) {
+    server->read_watch = w;
+    server->fd = dbus_watch_get_unix_fd(w);
+  }
+  if (flags & DBUS_WATCH_WRITABLE) {
+    server->write_watch = w;
+  }
 
   return TRUE;
 }
 
 void remove_watch(DBusWatch *w, void *data) {
   dbus_server_t *server = (dbus_server_t *)data;
-  server->fd = -1;
-  server->watch = NULL;
+
+  if (w == server->read_watch) {
+    server->fd = -1;
+    server->read_watch = NULL;
+  }
+  if (w == server->write_watch) {
+    server->write_watch = NULL;
+  }
 }
 
 void toggle_watch(DBusWatch *w, void *data) {
-  if (dbus_watch_get_enabled(w)) {
-    add_watch(w, data);
-  } else {
-    remove_watch(w, data);
-  }
+  // Enabled state is checked whenever a watch is used.
 }
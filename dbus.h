@@ -7,9 +7,17 @@ dbus_server_t *dbus_server_init(const char *dest, const char *interface, const c
 
 void dbus_server_deinit(dbus_server_t *server);
 
+/* Fd to wait for input on, or -1 while libdbus doesn't take any more. */
 int dbus_server_get_fd(dbus_server_t *server);
 
-void dbus_server_get_signal(dbus_server_t *server, char **signal);
+/* Fd to wait on for writing queued signals, or -1 if nothing is queued. */
+int dbus_server_get_write_fd(dbus_server_t *server);
+
+/* Called for every received input signal. The string is only valid during the call. */
+typedef void (*dbus_signal_callback_t)(const char *signal, void *context);
+
+/* Dispatches all queued input signals. Returns the number of signals passed to the callback. */
+int dbus_server_get_signals(dbus_server_t *server, dbus_signal_callback_t callback, void *context);
 
 void dbus_server_send_signal(
   dbus_server_t *server,
@@ -19,4 +27,36 @@ void dbus_server_send_signal(
   const char *message
 );
 
+/* Sends a signal with string arguments followed by an a{ss} dictionary built from keys and values. */
+void dbus_server_send_typed_signal(
+  dbus_server_t *server,
+  const char *path,
+  const char *interface,
+  const char *name,
+  const char *const *fields,
+  int fields_count,
+  const char *const *keys,
+  const char *const *values,
+  int pairs_count
+);
+
+/* Collects messages queued with dbus_server_queue_batch() into signals carrying an array of strings. */
+int dbus_server_enable_batch(
+  dbus_server_t *server,
+  const char *path,
+  const char *interface,
+  const char *name,
+  int max_count
+);
+
+void dbus_server_queue_batch(dbus_server_t *server, const char *message);
+
+/* Sends the pending batch and writes queued signals without blocking. Returns 1 if some are still queued. */
+int dbus_server_flush(dbus_server_t *server);
+
+/* Whether queued signals are waiting for the DBus fd to become writable. */
+int dbus_server_wants_write(dbus_server_t *server);
+
+void dbus_server_handle_write(dbus_server_t *server);
+
 #endif
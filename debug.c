@@ -1,14 +1,519 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "debug.h"
 
 int LOG_LEVEL = LOG_LEVEL_ERROR;
 
+/* Size of each thread's ring of log records. Must be a power of two. */
+#define LOG_RING_SIZE (256 * 1024)
+
+/* Max size of a single record, and of a string argument kept in it. */
+#define LOG_RECORD_MAX 4096
+#define LOG_STRING_MAX 512
+
+/* How long the logger thread sleeps when all rings are empty. */
+#define LOG_IDLE_NS 2000000
+
+/* Formatted lines are collected into a buffer of this size before writing. */
+#define LOG_OUTPUT_SIZE 16384
+
+/* Records are aligned so that padding at the end of a ring always fits a header. */
+#define LOG_ALIGN 16
+
+typedef enum {
+  ARG_NONE,
+  ARG_INT,
+  ARG_DOUBLE,
+  ARG_POINTER,
+  ARG_STRING
+} arg_kind_t;
+
+/* Conversion spec of a format string. */
+typedef struct {
+  const char *start;
+  int length;
+  int star_width;
+  int star_precision;
+  int precision;          /* Literal precision, -1 if none. */
+  char modifier[3];
+  char conversion;
+  arg_kind_t kind;
+} spec_t;
+
+/* Record header, followed by the arguments. A record without a format pads the ring end. */
+typedef struct {
+  uint32_t size;
+  const char *fmt;
+} record_t;
+
+/* Ring states. A ring whose thread exited is handed to the next new thread once it's drained. */
+typedef enum {
+  RING_ACTIVE,
+  RING_RETIRED,
+  RING_FREE
+} ring_state_t;
+
+/* Ring of records written by one thread and read by the logger thread. */
+typedef struct log_ring_t {
+  _Atomic uint64_t head;
+  char head_padding[56];
+  _Atomic uint64_t tail;
+  char tail_padding[56];
+  _Atomic int state;
+  struct log_ring_t *next;
+  char data[LOG_RING_SIZE];
+} log_ring_t;
+
+/* Rings of all threads that logged something, as many as were alive at once. */
+static log_ring_t *_Atomic rings = NULL;
+static __thread log_ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+
+static atomic_int running = 0;
+static atomic_int stopping = 0;
+static atomic_ulong dropped = 0;
+static pthread_t logger;
+static int log_fd = 2;
+
+/** Private **/
+
+/**
+ * Parses a conversion spec.
+ *
+ * @param pointer: Pointer to the '%' starting the spec.
+ * @param spec: Spec to fill.
+ *
+ * @return: Pointer right after the spec.
+ **/
+static const char *parse_spec(const char *pointer, spec_t *spec) {
+  memset(spec, 0, sizeof(spec_t));
+  spec->start = pointer++;
+  spec->precision = -1;
+
+  while (*pointer != '\0' && strchr("-+ #0'", *pointer) != NULL) {
+    pointer++;
+  }
+
+  if (*pointer == '*') {
+    spec->star_width = 1;
+    pointer++;
+  }
+  while (isdigit((unsigned char)*pointer)) {
+    pointer++;
+  }
+
+  if (*pointer == '.') {
+    pointer++;
+    if (*pointer == '*') {
+      spec->star_precision = 1;
+      pointer++;
+    } else {
+      spec->precision = 0;
+      while (isdigit((unsigned char)*pointer)) {
+        spec->precision = spec->precision * 10 + (*pointer++ - '0');
+      }
+    }
+  }
+
+  for (int idx = 0; idx < 2 && *pointer != '\0' && strchr("hlLqjzt", *pointer) != NULL; idx++) {
+    spec->modifier[idx] = *pointer++;
+  }
+
+  spec->conversion = *pointer;
+  if (*pointer != '\0') {
+    pointer++;
+  }
+  spec->length = pointer - spec->start;
+
+  switch (spec->conversion) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+      spec->kind = ARG_INT;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      spec->kind = ARG_DOUBLE;
+      break;
+    case 'p': case 'n':
+      spec->kind = ARG_POINTER;
+      break;
+    case 's':
+      spec->kind = ARG_STRING;
+      break;
+    default:
+      spec->kind = ARG_NONE;
+  }
+
+  return pointer;
+}
+
+static int64_t read_int(va_list *args, spec_t *spec) {
+  if (spec->modifier[0] == 'l' && spec->modifier[1] == 'l') {
+    return va_arg(*args, long long);
+  }
+
+  switch (spec->modifier[0]) {
+    case 'l': return va_arg(*args, long);
+    case 'q': return va_arg(*args, long long);
+    case 'j': return va_arg(*args, intmax_t);
+    case 'z': return va_arg(*args, size_t);
+    case 't': return va_arg(*args, ptrdiff_t);
+    default: return va_arg(*args, int);
+  }
+}
+
+/**
+ * Copies raw arguments of a log call into a record.
+ *
+ * @return: Size of the record, or 0 if the arguments don't fit.
+ **/
+static uint32_t encode_record(char *record, const char *fmt, va_list *args) {
+  size_t size = sizeof(record_t);
+  const char *pointer = fmt;
+
+  while ((pointer = strchr(pointer, '%')) != NULL) {
+    spec_t spec;
+    pointer = parse_spec(pointer, &spec);
+
+    int64_t values[2];
+    int stars = 0;
+    if (spec.star_width) {
+      values[stars++] = va_arg(*args, int);
+    }
+    int precision = spec.precision;
+    if (spec.star_precision) {
+      precision = va_arg(*args, int);
+      values[stars++] = precision;
+    }
+
+    if (size + (stars + 1) * sizeof(int64_t) > LOG_RECORD_MAX) {
+      return 0;
+    }
+    memcpy(record + size, values, stars * sizeof(int64_t));
+    size += stars * sizeof(int64_t);
+
+    if (spec.kind == ARG_INT) {
+      int64_t value = read_int(args, &spec);
+      memcpy(record + size, &value, sizeof(value));
+      size += sizeof(value);
+    } else if (spec.kind == ARG_DOUBLE) {
+      double value = spec.modifier[0] == 'L' ? (double)va_arg(*args, long double) : va_arg(*args, double);
+      memcpy(record + size, &value, sizeof(value));
+      size += sizeof(value);
+    } else if (spec.kind == ARG_POINTER) {
+      void *value = va_arg(*args, void *);
+      memcpy(record + size, &value, sizeof(value));
+      size += sizeof(int64_t);
+    } else if (spec.kind == ARG_STRING) {
+      const char *value = va_arg(*args, const char *);
+      if (value == NULL) {
+        value = "(null)";
+      }
+      size_t limit = precision >= 0 && precision < LOG_STRING_MAX ? (size_t)precision : LOG_STRING_MAX;
+      uint64_t length = strnlen(value, limit);
+      if (size + sizeof(length) + length + 1 > LOG_RECORD_MAX) {
+        return 0;
+      }
+      memcpy(record + size, &length, sizeof(length));
+      memcpy(record + size + sizeof(length), value, length);
+      record[size + sizeof(length) + length] = '\0';
+      size += (sizeof(length) + length + 1 + 7) & ~(size_t)7;
+    }
+  }
+
+  size = (size + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+  if (size > LOG_RECORD_MAX) {
+    return 0;
+  }
+
+  record_t header = { .size = size, .fmt = fmt };
+  memcpy(record, &header, sizeof(header));
+  return size;
+}
+
+/**
+ * Thread exit destructor: the logger drains the ring and frees it for reuse.
+ **/
+static void retire_ring(void *ring) {
+  thread_ring = NULL;
+  atomic_store_explicit(&((log_ring_t *)ring)->state, RING_RETIRED, memory_order_release);
+}
+
+static log_ring_t *get_ring() {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  // Threads come and go with reconnects and reloads, their drained rings are taken over.
+  log_ring_t *ring = NULL;
+  for (log_ring_t *free_ring = atomic_load(&rings); free_ring != NULL && ring == NULL; free_ring = free_ring->next) {
+    int state = RING_FREE;
+    if (atomic_compare_exchange_strong(&free_ring->state, &state, RING_ACTIVE)) {
+      ring = free_ring;
+    }
+  }
+
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL) {
+      return NULL;
+    }
+
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+  }
+
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+/**
+ * Appends a record to the ring. Owning thread only.
+ *
+ * @return: 0 on success, -1 if the ring is full.
+ **/
+static int ring_push(log_ring_t *ring, const char *record, uint32_t size) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint64_t offset = head & (LOG_RING_SIZE - 1);
+  uint64_t contiguous = LOG_RING_SIZE - offset;
+  uint64_t needed = size + (contiguous < size ? contiguous : 0);
+
+  if (LOG_RING_SIZE - (head - tail) < needed) {
+    return -1;
+  }
+
+  // Records don't wrap around, the rest of the ring is skipped instead.
+  if (contiguous < size) {
+    record_t padding = { .size = contiguous, .fmt = NULL };
+    memcpy(ring->data + offset, &padding, sizeof(padding));
+    head += contiguous;
+    offset = 0;
+  }
+
+  memcpy(ring->data + offset, record, size);
+  atomic_store_explicit(&ring->head, head + size, memory_order_release);
+  return 0;
+}
+
+/**
+ * Formats a record the same way printf would have.
+ *
+ * @return: Length of the formatted text.
+ **/
+static int format_record(const char *record, char *out, int size) {
+  const record_t *header = (const record_t *)record;
+  const char *args = record + sizeof(record_t);
+  const char *pointer = header->fmt, *percent;
+  char text[64];
+  int length = 0;
+
+  while (length < size - 1 && (percent = strchr(pointer, '%')) != NULL) {
+    length += snprintf(out + length, size - length, "%.*s", (int)(percent - pointer), pointer);
+    if (length >= size - 1) {
+      break;
+    }
+
+    // Specs too long to copy are left out, but their arguments are still skipped.
+    spec_t spec;
+    pointer = parse_spec(percent, &spec);
+    int text_length = spec.length < (int)sizeof(text) ? spec.length : 0;
+    memcpy(text, spec.start, text_length);
+    text[text_length] = '\0';
+
+    int stars[2], count = 0;
+    for (int idx = 0; idx < spec.star_width + spec.star_precision; idx++) {
+      int64_t value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      stars[count++] = value;
+    }
+
+    char *target = out + length;
+    size_t left = size - length;
+    int written = 0;
+
+// Formats a single argument along with its '*' width and precision.
+#define FORMAT_ARG(value) \
+    (count == 2 ? snprintf(target, left, text, stars[0], stars[1], value) \
+      : count == 1 ? snprintf(target, left, text, stars[0], value) \
+      : snprintf(target, left, text, value))
+
+    if (spec.kind == ARG_NONE) {
+      written = spec.conversion == '%' ? snprintf(target, left, "%%") : 0;
+    } else if (spec.kind == ARG_INT) {
+      int64_t value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      if ((spec.modifier[0] == 'l' && spec.modifier[1] == 'l') || spec.modifier[0] == 'q') {
+        written = FORMAT_ARG((long long)value);
+      } else if (spec.modifier[0] == 'l') {
+        written = FORMAT_ARG((long)value);
+      } else if (spec.modifier[0] == 'j') {
+        written = FORMAT_ARG((intmax_t)value);
+      } else if (spec.modifier[0] == 'z') {
+        written = FORMAT_ARG((size_t)value);
+      } else if (spec.modifier[0] == 't') {
+        written = FORMAT_ARG((ptrdiff_t)value);
+      } else {
+        written = FORMAT_ARG((int)value);
+      }
+    } else if (spec.kind == ARG_DOUBLE) {
+      double value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = spec.modifier[0] == 'L' ? FORMAT_ARG((long double)value) : FORMAT_ARG(value);
+    } else if (spec.kind == ARG_POINTER) {
+      void *value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(int64_t);
+      // %n would write into memory of a call that already returned.
+      written = spec.conversion == 'p' ? FORMAT_ARG(value) : 0;
+    } else if (spec.kind == ARG_STRING) {
+      uint64_t string_length;
+      memcpy(&string_length, args, sizeof(string_length));
+      written = FORMAT_ARG(args + sizeof(string_length));
+      args += (sizeof(string_length) + string_length + 1 + 7) & ~(size_t)7;
+    }
+
+#undef FORMAT_ARG
+
+    if (written > 0) {
+      length += written;
+    }
+  }
+
+  if (length < size - 1) {
+    length += snprintf(out + length, size - length, "%s", pointer);
+  }
+  return length < size ? length : size - 1;
+}
+
+/**
+ * Formats and writes out everything queued in the rings.
+ *
+ * @return: Number of records written.
+ **/
+static int drain_rings() {
+  char output[LOG_OUTPUT_SIZE];
+  int used = 0, count = 0;
+
+  for (log_ring_t *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+    // Read before the head, so a retired ring has nothing past it.
+    int state = atomic_load_explicit(&ring->state, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail < head) {
+      const char *record = ring->data + (tail & (LOG_RING_SIZE - 1));
+      const record_t *header = (const record_t *)record;
+
+      if (header->fmt != NULL) {
+        if (LOG_OUTPUT_SIZE - used < LOG_RECORD_MAX) {
+          write(log_fd, output, used);
+          used = 0;
+        }
+        used += format_record(record, output + used, LOG_OUTPUT_SIZE - used);
+        count++;
+      }
+      tail += header->size;
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    if (state == RING_RETIRED) {
+      atomic_store_explicit(&ring->state, RING_FREE, memory_order_release);
+    }
+  }
+
+  if (used > 0) {
+    write(log_fd, output, used);
+  }
+  return count;
+}
+
+static void *logger_main(void *context) {
+  struct timespec idle = { .tv_sec = 0, .tv_nsec = LOG_IDLE_NS };
+
+  while (!atomic_load(&stopping)) {
+    if (drain_rings() == 0) {
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  drain_rings();
+  return NULL;
+}
+
+/** Public **/
+
 void LOG(int level, char *fmt, ...) {
   if (level >= LOG_LEVEL) {
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+
+    if (atomic_load_explicit(&running, memory_order_acquire)) {
+      char record[LOG_RECORD_MAX] __attribute__((aligned(LOG_ALIGN)));
+      log_ring_t *ring = get_ring();
+      uint32_t size = encode_record(record, fmt, &args);
+      if (ring == NULL || size == 0 || ring_push(ring, record, size) == -1) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      }
+    } else {
+      vfprintf(stderr, fmt, args);
+    }
+
     va_end(args);
   }
 }
+
+int log_start(int fd) {
+  if (atomic_load(&running)) {
+    return -1;
+  }
+
+  log_fd = fd;
+  atomic_store(&stopping, 0);
+  if (pthread_key_create(&ring_key, retire_ring) != 0) {
+    return -1;
+  }
+  if (pthread_create(&logger, NULL, logger_main, NULL) != 0) {
+    pthread_key_delete(ring_key);
+    return -1;
+  }
+
+  atomic_store(&running, 1);
+  return 0;
+}
+
+void log_stop() {
+  if (!atomic_load(&running)) {
+    return;
+  }
+
+  atomic_store(&running, 0);
+  atomic_store(&stopping, 1);
+  pthread_join(logger, NULL);
+
+  // Threads exiting later must not retire freed rings.
+  pthread_key_delete(ring_key);
+
+  unsigned long count = atomic_load(&dropped);
+  if (count > 0) {
+    dprintf(log_fd, "Logger dropped %lu messages\n", count);
+  }
+
+  log_ring_t *ring = atomic_exchange(&rings, NULL);
+  while (ring != NULL) {
+    log_ring_t *next = ring->next;
+    free(ring);
+    ring = next;
+  }
+  thread_ring = NULL;
+}
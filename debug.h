@@ -8,4 +8,31 @@
 
 extern int LOG_LEVEL;
 
+/**
+ * Logs a message if its level is enabled.
+ *
+ * Once the logger is started, the call doesn't format anything: it copies the
+ * format string pointer and raw arguments into the calling thread's ring, and
+ * the logger thread formats them later. String arguments are copied, up to
+ * 512 bytes each. If the ring is full, the message is dropped and counted.
+ * Before the logger is started, messages are written to stderr right away.
+ *
+ * @param level: Message level.
+ * @param fmt: printf-style format. Must be a string literal or otherwise outlive the logger.
+ **/
 void LOG(int level, char *fmt, ...);
+
+/**
+ * Starts the logger thread writing formatted messages to a file descriptor.
+ *
+ * @param fd: Descriptor to write to, e.g. 2 for stderr. Not owned by the logger.
+ *
+ * @return: 0 on success, -1 if the thread can't be started.
+ **/
+int log_start(int fd);
+
+/**
+ * Writes out pending messages and stops the logger thread. Other threads must
+ * be done logging by then.
+ **/
+void log_stop();
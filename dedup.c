@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "dedup.h"
+
+/* Max number of slots checked for a single key. */
+#define DEDUP_MAX_PROBE 32
+
+typedef struct {
+  uint64_t hash;   // 0 marks a slot that was never used.
+  int64_t seen_at;
+} dedup_slot_t;
+
+struct dedup_t {
+  dedup_slot_t *slots;
+  uint64_t mask;
+  int ttl_ms;
+};
+
+/** Private **/
+
+/* FNV-1a, with zero remapped since it marks empty slots. */
+static uint64_t hash_key(const char *key, int size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (int idx = 0; idx < size; idx++) {
+    hash ^= (unsigned char)key[idx];
+    hash *= 1099511628211ull;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+/** Public **/
+
+dedup_t *dedup_init(int capacity, int ttl_ms) {
+  uint64_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  dedup_t *dedup = calloc(1, sizeof(dedup_t));
+  if (dedup == NULL) {
+    return NULL;
+  }
+
+  dedup->slots = calloc(size, sizeof(dedup_slot_t));
+  if (dedup->slots == NULL) {
+    free(dedup);
+    return NULL;
+  }
+
+  dedup->mask = size - 1;
+  dedup->ttl_ms = ttl_ms;
+  return dedup;
+}
+
+int dedup_check(dedup_t *dedup, const char *key, int size, int64_t now_ms) {
+  uint64_t hash = hash_key(key, size);
+  dedup_slot_t *target = NULL;
+  int64_t target_age = INT64_MIN;
+
+  // Expired slots don't end the probe: a live key could have been placed past them.
+  for (int probe = 0; probe < DEDUP_MAX_PROBE; probe++) {
+    dedup_slot_t *slot = &dedup->slots[(hash + probe) & dedup->mask];
+    int64_t age = slot->hash == 0 ? INT64_MAX : now_ms - slot->seen_at;
+
+    if (slot->hash == hash && age <= dedup->ttl_ms) {
+      return 1;
+    }
+
+    // Free and expired slots are the oldest, otherwise evict the oldest entry in the window.
+    if (age > target_age) {
+      target = slot;
+      target_age = age;
+    }
+
+    if (slot->hash == 0) {
+      break;
+    }
+  }
+
+  target->hash = hash;
+  target->seen_at = now_ms;
+  return 0;
+}
+
+void dedup_free(dedup_t *dedup) {
+  if (dedup == NULL) {
+    return;
+  }
+
+  free(dedup->slots);
+  free(dedup);
+}
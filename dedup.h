@@ -0,0 +1,44 @@
+#ifndef DEDUP_HEADER
+#define DEDUP_HEADER
+
+#include <stdint.h>
+
+/**
+ * Time-bounded set of recently seen keys.
+ *
+ * Keys are stored as 64-bit hashes in an open-addressing table with bounded
+ * probing. Entries older than the TTL are treated as free slots, so memory
+ * stays fixed no matter how long the set lives.
+ **/
+typedef struct dedup_t dedup_t;
+
+/**
+ * Creates a new set.
+ *
+ * @param capacity: Number of slots, rounded up to a power of two.
+ * @param ttl_ms: How long keys are remembered, in milliseconds.
+ *
+ * @return: A new set, or NULL if memory can't be allocated.
+ **/
+dedup_t *dedup_init(int capacity, int ttl_ms);
+
+/**
+ * Checks whether key was seen within the TTL, and remembers it if not.
+ *
+ * @param dedup: Set to check.
+ * @param key: Key bytes.
+ * @param size: Key size.
+ * @param now_ms: Current time in milliseconds.
+ *
+ * @return: 1 if the key is a duplicate, 0 if it's new.
+ **/
+int dedup_check(dedup_t *dedup, const char *key, int size, int64_t now_ms);
+
+/**
+ * Frees the set.
+ *
+ * @param dedup: Set to free.
+ **/
+void dedup_free(dedup_t *dedup);
+
+#endif
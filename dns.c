@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+
+#include "dns.h"
+#include "utils.h"
+
+/* Max number of cached names. */
+#define DNS_CACHE_SIZE 16
+
+/* Max length of a host name, including the terminator. */
+#define DNS_HOST_SIZE 256
+
+/* Entries are refreshed in the background during the last 1/DNS_REFRESH_SHARE of their TTL. */
+#define DNS_REFRESH_SHARE 10
+
+/* Size of the buffer for res_query() answers. */
+#define DNS_ANSWER_SIZE 4096
+
+/* Cached name. */
+typedef struct {
+  char host[DNS_HOST_SIZE];         /* Empty if the entry is unused. */
+  dns_address_t addresses[DNS_MAX_ADDRESSES];
+  int count;                        /* 0 until the name was resolved once. */
+  int64_t expires;                  /* Monotonic time the addresses are good until. */
+  int ttl;                          /* Seconds the addresses were good for when resolved. */
+  int64_t used;                     /* Last lookup, the least recently used entry is replaced first. */
+  int resolving;                    /* A resolver thread is running for the name. */
+  int error;                        /* getaddrinfo() error of the last attempt, 0 if it succeeded. */
+} dns_entry_t;
+
+static dns_entry_t cache[DNS_CACHE_SIZE];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/** Private **/
+
+/**
+ * Sets up the condition variable to time out on the monotonic clock, which
+ * the rest of the relay keeps time with.
+ **/
+static void init_cache() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cache_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Skips a possibly compressed domain name in a DNS message.
+ *
+ * @param at: Start of the name.
+ * @param end: End of the message.
+ *
+ * @return: Pointer past the name, or NULL if the message is malformed.
+ **/
+static const unsigned char *skip_name(const unsigned char *at, const unsigned char *end) {
+  while (at < end) {
+    if (*at == 0) {
+      return at + 1;
+    }
+
+    // A pointer to a name elsewhere ends this one.
+    if ((*at & 0xc0) == 0xc0) {
+      return at + 2 <= end ? at + 2 : NULL;
+    }
+
+    at += 1 + *at;
+  }
+
+  return NULL;
+}
+
+/**
+ * Looks up the smallest TTL of the records a name resolves through.
+ *
+ * @param host: Host name.
+ * @param type: Record type, ns_t_a or ns_t_aaaa.
+ *
+ * @return: TTL in seconds, or -1 if there's no answer.
+ **/
+static int query_ttl(const char *host, int type) {
+  unsigned char answer[DNS_ANSWER_SIZE];
+  int length = res_query(host, ns_c_in, type, answer, sizeof(answer));
+  if (length < HFIXEDSZ) {
+    return -1;
+  }
+
+  const unsigned char *end = answer + (length < (int)sizeof(answer) ? length : (int)sizeof(answer));
+  int questions = (answer[4] << 8) | answer[5];
+  int answers = (answer[6] << 8) | answer[7];
+  const unsigned char *at = answer + HFIXEDSZ;
+
+  for (int idx = 0; idx < questions && at; idx++) {
+    at = skip_name(at, end);
+    at = at && at + QFIXEDSZ <= end ? at + QFIXEDSZ : NULL;
+  }
+
+  // CNAMEs on the way count too, the addresses are only as good as the shortest-lived record.
+  int ttl = -1;
+  for (int idx = 0; idx < answers && at; idx++) {
+    at = skip_name(at, end);
+    if (!at || at + RRFIXEDSZ > end) {
+      break;
+    }
+
+    int record_ttl = (int)(((uint32_t)at[4] << 24) | (at[5] << 16) | (at[6] << 8) | at[7]) & INT32_MAX;
+    int rdlength = (at[8] << 8) | at[9];
+    if (ttl == -1 || record_ttl < ttl) {
+      ttl = record_ttl;
+    }
+
+    at += RRFIXEDSZ + rdlength;
+  }
+
+  return ttl;
+}
+
+/**
+ * Finds the cache entry of a name. Called with the cache locked.
+ *
+ * @param host: Host name.
+ *
+ * @return: Entry, or NULL if the name isn't cached.
+ **/
+static dns_entry_t *find_entry(const char *host) {
+  for (int idx = 0; idx < DNS_CACHE_SIZE; idx++) {
+    if (cache[idx].host[0] && strcmp(cache[idx].host, host) == 0) {
+      return &cache[idx];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Background resolver. Publishes the addresses as soon as getaddrinfo()
+ * returns, then looks up their TTL, which may take much longer if the name
+ * doesn't come from DNS and the name servers have to time out first.
+ *
+ * @param arg: Host name, freed by the thread.
+ **/
+static void *resolve_thread(void *arg) {
+  char *host = arg;
+  struct addrinfo hints, *res = NULL, *rp;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+
+  dns_address_t addresses[DNS_MAX_ADDRESSES];
+  int count = 0;
+  int error = getaddrinfo(host, NULL, &hints, &res);
+  if (error == 0) {
+    for (rp = res; rp && count < DNS_MAX_ADDRESSES; rp = rp->ai_next) {
+      if ((rp->ai_family != AF_INET && rp->ai_family != AF_INET6) || rp->ai_addrlen > sizeof(struct sockaddr_storage)) {
+        continue;
+      }
+
+      addresses[count].family = rp->ai_family;
+      addresses[count].length = rp->ai_addrlen;
+      memcpy(&addresses[count].address, rp->ai_addr, rp->ai_addrlen);
+      count++;
+    }
+    freeaddrinfo(res);
+
+    if (count == 0) {
+      error = EAI_NONAME;
+    }
+  }
+
+  pthread_mutex_lock(&cache_mutex);
+  dns_entry_t *entry = find_entry(host);
+  if (entry) {
+    entry->resolving = 0;
+    entry->error = error;
+    if (error == 0) {
+      memcpy(entry->addresses, addresses, count * sizeof(dns_address_t));
+      entry->count = count;
+      entry->ttl = DNS_DEFAULT_TTL;
+      entry->expires = monotonic_ms() + entry->ttl * 1000;
+    } else if (entry->count > 0) {
+      // Keep serving the stale addresses for a while instead of retrying on every lookup.
+      entry->expires = monotonic_ms() + DNS_MIN_TTL * 1000;
+    }
+  }
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_mutex);
+
+  if (error == 0) {
+    struct in6_addr numeric;
+    int ttl;
+    if (inet_pton(AF_INET, host, &numeric) == 1 || inet_pton(AF_INET6, host, &numeric) == 1) {
+      ttl = DNS_MAX_TTL;
+    } else {
+      int ttl4 = query_ttl(host, ns_t_a);
+      int ttl6 = query_ttl(host, ns_t_aaaa);
+      ttl = ttl4 == -1 || (ttl6 != -1 && ttl6 < ttl4) ? ttl6 : ttl4;
+    }
+
+    if (ttl != -1) {
+      ttl = ttl < DNS_MIN_TTL ? DNS_MIN_TTL : ttl > DNS_MAX_TTL ? DNS_MAX_TTL : ttl;
+
+      pthread_mutex_lock(&cache_mutex);
+      entry = find_entry(host);
+      if (entry && !entry->resolving && entry->error == 0 && entry->expires != 0) {
+        entry->ttl = ttl;
+        entry->expires = monotonic_ms() + ttl * 1000;
+      }
+      pthread_mutex_unlock(&cache_mutex);
+    }
+  }
+
+  free(host);
+  return NULL;
+}
+
+/**
+ * Starts a resolver thread for an entry. Called with the cache locked.
+ *
+ * @param entry: Cache entry.
+ *
+ * @return: 0 if the thread was started, -1 otherwise.
+ **/
+static int start_resolving(dns_entry_t *entry) {
+  char *host = strdup(entry->host);
+  if (!host) {
+    return -1;
+  }
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int error = pthread_create(&thread, &attr, resolve_thread, host);
+  pthread_attr_destroy(&attr);
+
+  if (error != 0) {
+    fprintf(stderr, "Failed to start resolver thread: %s\n", strerror(error));
+    free(host);
+    return -1;
+  }
+
+  entry->resolving = 1;
+  return 0;
+}
+
+/**
+ * Copies cached addresses out with the port filled in.
+ *
+ * @param entry: Cache entry.
+ * @param port: Port number.
+ * @param addresses: Array to copy to.
+ * @param max: Size of the array.
+ *
+ * @return: Number of addresses copied.
+ **/
+static int copy_addresses(dns_entry_t *entry, int port, dns_address_t *addresses, int max) {
+  int count = entry->count < max ? entry->count : max;
+
+  for (int idx = 0; idx < count; idx++) {
+    addresses[idx] = entry->addresses[idx];
+    if (addresses[idx].family == AF_INET) {
+      ((struct sockaddr_in *)&addresses[idx].address)->sin_port = htons(port);
+    } else {
+      ((struct sockaddr_in6 *)&addresses[idx].address)->sin6_port = htons(port);
+    }
+  }
+
+  return count;
+}
+
+/** Public **/
+
+int dns_resolve(const char *host, int port, dns_address_t *addresses, int max, int timeout) {
+  if (strlen(host) >= DNS_HOST_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  pthread_once(&cache_once, init_cache);
+  pthread_mutex_lock(&cache_mutex);
+
+  int64_t now = monotonic_ms();
+  dns_entry_t *entry = find_entry(host);
+  if (!entry) {
+    // Replace the least recently used name, unless it's still being resolved.
+    for (int idx = 0; idx < DNS_CACHE_SIZE; idx++) {
+      if (!cache[idx].resolving && (!entry || cache[idx].used < entry->used)) {
+        entry = &cache[idx];
+      }
+    }
+
+    if (!entry) {
+      pthread_mutex_unlock(&cache_mutex);
+      errno = EAGAIN;
+      return -1;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->host, host);
+  }
+  entry->used = now;
+
+  if (entry->count > 0 && now < entry->expires) {
+    // Refresh ahead of expiry so lookups never have to wait for a name in use.
+    if (!entry->resolving && entry->expires - now < (int64_t)entry->ttl * 1000 / DNS_REFRESH_SHARE) {
+      start_resolving(entry);
+    }
+
+    int count = copy_addresses(entry, port, addresses, max);
+    pthread_mutex_unlock(&cache_mutex);
+    return count;
+  }
+
+  if (!entry->resolving && start_resolving(entry) == -1) {
+    pthread_mutex_unlock(&cache_mutex);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  struct timespec deadline;
+  int64_t deadline_ms = now + timeout;
+  deadline.tv_sec = deadline_ms / 1000;
+  deadline.tv_nsec = (deadline_ms % 1000) * 1000000;
+
+  while (entry->resolving && strcmp(entry->host, host) == 0) {
+    if (pthread_cond_timedwait(&cache_cond, &cache_mutex, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+
+  // Stale addresses are better than none if the resolver failed or is slow.
+  int count = -1;
+  if (strcmp(entry->host, host) == 0 && entry->count > 0) {
+    count = copy_addresses(entry, port, addresses, max);
+  } else if (strcmp(entry->host, host) == 0 && entry->error != 0 && !entry->resolving) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", host, gai_strerror(entry->error));
+    errno = ENOENT;
+  } else {
+    errno = ETIMEDOUT;
+  }
+
+  pthread_mutex_unlock(&cache_mutex);
+  return count;
+}
+
+void dns_invalidate(const char *host) {
+  pthread_mutex_lock(&cache_mutex);
+  dns_entry_t *entry = find_entry(host);
+  if (entry) {
+    entry->expires = 0;
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
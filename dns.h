@@ -0,0 +1,53 @@
+#ifndef DNS_HEADER
+#define DNS_HEADER
+
+#include <sys/socket.h>
+
+/**
+ * Cached host name resolution.
+ *
+ * Names are resolved with getaddrinfo() on a background thread, so a slow
+ * resolver never holds up more than the caller that's waiting for it. Results
+ * are kept for the TTL of the A/AAAA records, or DNS_DEFAULT_TTL seconds for
+ * names that don't come from DNS (e.g. /etc/hosts). Entries close to expiring
+ * are refreshed in the background while the old addresses keep being served,
+ * and expired ones are still used if refreshing them fails.
+ **/
+
+/* Max number of addresses kept per name. */
+#define DNS_MAX_ADDRESSES 16
+
+/* TTL used for names without DNS records, and the bounds TTLs are clamped to, in seconds. */
+#define DNS_DEFAULT_TTL 60
+#define DNS_MIN_TTL 5
+#define DNS_MAX_TTL 3600
+
+/* Resolved address. */
+typedef struct dns_address_t {
+  int family;
+  socklen_t length;
+  struct sockaddr_storage address;
+} dns_address_t;
+
+/**
+ * Resolves a host name, from the cache if possible.
+ *
+ * @param host: Host name or numeric address.
+ * @param port: Port number to put into the addresses.
+ * @param addresses: Array to hold the addresses, in the order getaddrinfo() returned them.
+ * @param max: Size of the array.
+ * @param timeout: How long to wait for the resolver in milliseconds, if nothing is cached.
+ *
+ * @return: Number of addresses, or -1 if the name can't be resolved in time.
+ **/
+int dns_resolve(const char *host, int port, dns_address_t *addresses, int max, int timeout);
+
+/**
+ * Marks cached addresses as expired, e.g. after none of them accepted a
+ * connection. The next dns_resolve() waits for fresh ones.
+ *
+ * @param host: Host name.
+ **/
+void dns_invalidate(const char *host);
+
+#endif
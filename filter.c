@@ -0,0 +1,483 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "filter.h"
+#include "debug.h"
+
+/* Max length of a rules file line. */
+#define FILTER_LINE_SIZE 1024
+
+/* Pattern prefix marking a regular expression. */
+#define FILTER_REGEX_PREFIX "re:"
+
+typedef struct {
+  filter_action_t action;
+  int duration;
+  int line;
+  int severity;       /* Precomputed order of actions, higher wins. */
+  char *pattern;
+} filter_rule_t;
+
+/* Compiled rules. Immutable once built, replaced as a whole on reload. */
+typedef struct {
+  filter_rule_t *rules;
+  int rules_count;
+
+  // Aho-Corasick automaton over byte classes. Bytes that appear in no phrase
+  // share class 0, which keeps the transition table small.
+  uint8_t classes[256];
+  int classes_count;
+  int32_t *delta;       /* states * classes_count transitions. */
+  int32_t *best;        /* Strongest rule ending at each state, -1 if none. */
+  int states;
+
+  // Regular expressions, with a combined one to rule out most texts at once.
+  regex_t *regexes;
+  int *regex_rules;
+  int regex_count;
+  regex_t combined;
+  int has_combined;
+} filter_set_t;
+
+struct filter_t {
+  char *path;
+  filter_set_t *_Atomic current;
+
+  // Checks running in each epoch. A replaced set is freed once both epochs
+  // have drained after the swap.
+  atomic_int epoch;
+  atomic_int readers[2];
+
+  pthread_t builder;
+  int has_builder;
+  atomic_int building;
+};
+
+/** Private **/
+
+static int severity(filter_action_t action, int duration) {
+  switch (action) {
+    case FILTER_BAN: return INT_MAX;
+    case FILTER_TIMEOUT: return duration > 0 ? duration : 1;
+    default: return 0;
+  }
+}
+
+static void free_set(filter_set_t *set) {
+  if (set == NULL) {
+    return;
+  }
+
+  for (int idx = 0; idx < set->rules_count; idx++) {
+    free(set->rules[idx].pattern);
+  }
+  for (int idx = 0; idx < set->regex_count; idx++) {
+    regfree(&set->regexes[idx]);
+  }
+  if (set->has_combined) {
+    regfree(&set->combined);
+  }
+  free(set->rules);
+  free(set->regexes);
+  free(set->regex_rules);
+  free(set->delta);
+  free(set->best);
+  free(set);
+}
+
+/**
+ * Parses a single rules file line.
+ *
+ * @return: 1 if a rule was parsed, 0 for empty lines and comments, -1 on errors.
+ **/
+static int parse_rule(char *line, filter_rule_t *rule) {
+  char *pointer = line, *action;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  while (isspace((unsigned char)*pointer)) {
+    pointer++;
+  }
+  if (*pointer == '\0' || *pointer == '#') {
+    return 0;
+  }
+
+  action = strsep(&pointer, " \t");
+  if (pointer == NULL) {
+    return -1;
+  }
+
+  rule->duration = 0;
+  if (strcmp(action, "flag") == 0) {
+    rule->action = FILTER_FLAG;
+  } else if (strcmp(action, "ban") == 0) {
+    rule->action = FILTER_BAN;
+  } else if (strcmp(action, "timeout") == 0) {
+    rule->action = FILTER_TIMEOUT;
+    rule->duration = strtol(pointer, &pointer, 10);
+    if (rule->duration <= 0) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+
+  while (isspace((unsigned char)*pointer)) {
+    pointer++;
+  }
+  if (*pointer == '\0') {
+    return -1;
+  }
+
+  rule->severity = severity(rule->action, rule->duration);
+  rule->pattern = strdup(pointer);
+  return rule->pattern != NULL ? 1 : -1;
+}
+
+static int is_regex(filter_rule_t *rule) {
+  return strncmp(rule->pattern, FILTER_REGEX_PREFIX, strlen(FILTER_REGEX_PREFIX)) == 0;
+}
+
+/**
+ * Picks the stronger of two rules, either can be -1.
+ **/
+static int stronger(filter_set_t *set, int rule, int other) {
+  if (rule < 0) {
+    return other;
+  }
+  if (other < 0) {
+    return rule;
+  }
+  return set->rules[other].severity > set->rules[rule].severity ? other : rule;
+}
+
+/**
+ * Builds the Aho-Corasick automaton from literal rules.
+ **/
+static int build_automaton(filter_set_t *set) {
+  int total = 1;
+
+  // Byte classes: one per distinct lowercase byte, uppercase shares it.
+  set->classes_count = 1;
+  for (int idx = 0; idx < set->rules_count; idx++) {
+    if (is_regex(&set->rules[idx])) {
+      continue;
+    }
+    for (unsigned char *byte = (unsigned char *)set->rules[idx].pattern; *byte != '\0'; byte++) {
+      unsigned char lower = tolower(*byte);
+      if (set->classes[lower] == 0) {
+        if (set->classes_count == 256) {
+          return -1;
+        }
+        set->classes[lower] = set->classes_count++;
+        set->classes[toupper(lower)] = set->classes[lower];
+      }
+      total++;
+    }
+  }
+
+  int width = set->classes_count;
+  set->delta = malloc((size_t)total * width * sizeof(int32_t));
+  set->best = malloc((size_t)total * sizeof(int32_t));
+  int32_t *fail = malloc((size_t)total * sizeof(int32_t));
+  int32_t *queue = malloc((size_t)total * sizeof(int32_t));
+  if (set->delta == NULL || set->best == NULL || fail == NULL || queue == NULL) {
+    free(fail);
+    free(queue);
+    return -1;
+  }
+  memset(set->delta, 0xff, (size_t)total * width * sizeof(int32_t));
+  memset(set->best, 0xff, (size_t)total * sizeof(int32_t));
+  set->states = 1;
+
+  // Trie.
+  for (int idx = 0; idx < set->rules_count; idx++) {
+    if (is_regex(&set->rules[idx])) {
+      continue;
+    }
+    int state = 0;
+    for (unsigned char *byte = (unsigned char *)set->rules[idx].pattern; *byte != '\0'; byte++) {
+      int32_t *next = &set->delta[state * width + set->classes[*byte]];
+      if (*next < 0) {
+        *next = set->states++;
+      }
+      state = *next;
+    }
+    set->best[state] = stronger(set, set->best[state], idx);
+  }
+
+  // Failure links in BFS order, turning the trie into a full transition table.
+  int head = 0, tail = 0;
+  for (int class = 0; class < width; class++) {
+    int32_t *next = &set->delta[class];
+    if (*next < 0) {
+      *next = 0;
+    } else {
+      fail[*next] = 0;
+      queue[tail++] = *next;
+    }
+  }
+  while (head < tail) {
+    int state = queue[head++];
+    set->best[state] = stronger(set, set->best[state], set->best[fail[state]]);
+    for (int class = 0; class < width; class++) {
+      int32_t *next = &set->delta[state * width + class];
+      int fallback = set->delta[fail[state] * width + class];
+      if (*next < 0) {
+        *next = fallback;
+      } else {
+        fail[*next] = fallback;
+        queue[tail++] = *next;
+      }
+    }
+  }
+
+  free(fail);
+  free(queue);
+  return 0;
+}
+
+/**
+ * Compiles regex rules, and a combined alternation of all of them.
+ **/
+static int build_regexes(filter_set_t *set) {
+  size_t combined_size = 1;
+
+  for (int idx = 0; idx < set->rules_count; idx++) {
+    if (is_regex(&set->rules[idx])) {
+      set->regex_count++;
+      combined_size += strlen(set->rules[idx].pattern) + 3;
+    }
+  }
+  if (set->regex_count == 0) {
+    return 0;
+  }
+
+  set->regexes = calloc(set->regex_count, sizeof(regex_t));
+  set->regex_rules = calloc(set->regex_count, sizeof(int));
+  char *combined = calloc(combined_size, 1);
+  if (set->regexes == NULL || set->regex_rules == NULL || combined == NULL) {
+    free(combined);
+    return -1;
+  }
+
+  int count = 0;
+  for (int idx = 0; idx < set->rules_count; idx++) {
+    if (!is_regex(&set->rules[idx])) {
+      continue;
+    }
+    const char *pattern = set->rules[idx].pattern + strlen(FILTER_REGEX_PREFIX);
+    if (regcomp(&set->regexes[count], pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB) != 0) {
+      fprintf(stderr, "Filter: invalid regex on line %d: %s\n", set->rules[idx].line, pattern);
+      set->regex_count = count;
+      free(combined);
+      return -1;
+    }
+    set->regex_rules[count++] = idx;
+
+    if (count > 1) {
+      strcat(combined, "|");
+    }
+    strcat(combined, "(");
+    strcat(combined, pattern);
+    strcat(combined, ")");
+  }
+
+  // Not fatal: without it every regex is simply checked on its own.
+  set->has_combined = count > 1 && regcomp(&set->combined, combined, REG_EXTENDED | REG_ICASE | REG_NOSUB) == 0;
+  free(combined);
+  return 0;
+}
+
+static filter_set_t *load_set(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open filter rules");
+    return NULL;
+  }
+
+  filter_set_t *set = calloc(1, sizeof(filter_set_t));
+  char line[FILTER_LINE_SIZE];
+  int capacity = 0, line_number = 0;
+
+  while (set != NULL && fgets(line, sizeof(line), file) != NULL) {
+    filter_rule_t rule;
+    line_number++;
+
+    int parsed = parse_rule(line, &rule);
+    if (parsed == 0) {
+      continue;
+    } else if (parsed < 0) {
+      fprintf(stderr, "Filter: skipping invalid rule on line %d\n", line_number);
+      continue;
+    }
+
+    if (set->rules_count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 64;
+      filter_rule_t *rules = realloc(set->rules, capacity * sizeof(filter_rule_t));
+      if (rules == NULL) {
+        free(rule.pattern);
+        free_set(set);
+        set = NULL;
+        break;
+      }
+      set->rules = rules;
+    }
+    rule.line = line_number;
+    set->rules[set->rules_count++] = rule;
+  }
+  fclose(file);
+
+  if (set == NULL || build_automaton(set) == -1 || build_regexes(set) == -1) {
+    fprintf(stderr, "Filter: failed to compile rules from %s\n", path);
+    free_set(set);
+    return NULL;
+  }
+
+  LOG(LOG_LEVEL_DEBUG, "DEBUG: Filter: %d rules, %d states, %d byte classes, %d regexes\n",
+    set->rules_count, set->states, set->classes_count, set->regex_count);
+  return set;
+}
+
+/**
+ * Replaces the current rule set and frees the old one once no check can be using it.
+ **/
+static void swap_set(filter_t *filter, filter_set_t *set) {
+  filter_set_t *old = atomic_exchange(&filter->current, set);
+
+  // Checks that started before the swap may still hold the old set. A check
+  // counts itself under the epoch it read, which can be stale by the time it
+  // does, so both counters are drained. Each is flipped away first, so checks
+  // starting meanwhile don't keep it busy.
+  for (int round = 0; round < 2; round++) {
+    int epoch = atomic_fetch_add(&filter->epoch, 1) & 1;
+    while (atomic_load(&filter->readers[epoch]) > 0) {
+      usleep(100);
+    }
+  }
+
+  free_set(old);
+}
+
+static void *build_thread(void *data) {
+  filter_t *filter = data;
+
+  filter_set_t *set = load_set(filter->path);
+  if (set != NULL) {
+    swap_set(filter, set);
+    fprintf(stderr, "Filter: reloaded %d rules from %s\n", set->rules_count, filter->path);
+  }
+
+  atomic_store(&filter->building, 0);
+  return NULL;
+}
+
+static void fill_verdict(filter_set_t *set, int rule, filter_verdict_t *verdict) {
+  filter_rule_t *matched = &set->rules[rule];
+
+  verdict->action = matched->action;
+  verdict->duration = matched->duration;
+  verdict->line = matched->line;
+  strncpy(verdict->label, matched->pattern, FILTER_LABEL_SIZE - 1);
+  verdict->label[FILTER_LABEL_SIZE - 1] = '\0';
+}
+
+/** Public **/
+
+filter_t *filter_init(const char *path) {
+  filter_t *filter = calloc(1, sizeof(filter_t));
+  if (filter == NULL) {
+    return NULL;
+  }
+
+  filter->path = strdup(path);
+  filter_set_t *set = filter->path != NULL ? load_set(path) : NULL;
+  if (set == NULL) {
+    free(filter->path);
+    free(filter);
+    return NULL;
+  }
+
+  atomic_init(&filter->current, set);
+  atomic_init(&filter->epoch, 0);
+  atomic_init(&filter->readers[0], 0);
+  atomic_init(&filter->readers[1], 0);
+  atomic_init(&filter->building, 0);
+  return filter;
+}
+
+int filter_reload(filter_t *filter) {
+  if (atomic_exchange(&filter->building, 1)) {
+    return -1;
+  }
+
+  // Previous builder is done, collect it.
+  if (filter->has_builder) {
+    pthread_join(filter->builder, NULL);
+    filter->has_builder = 0;
+  }
+
+  if (pthread_create(&filter->builder, NULL, build_thread, filter) != 0) {
+    atomic_store(&filter->building, 0);
+    return -1;
+  }
+
+  filter->has_builder = 1;
+  return 0;
+}
+
+int filter_check(filter_t *filter, const char *text, filter_verdict_t *verdict) {
+  int epoch = atomic_load(&filter->epoch) & 1;
+  atomic_fetch_add(&filter->readers[epoch], 1);
+  filter_set_t *set = atomic_load(&filter->current);
+
+  // Literal phrases, single pass. Nothing beats a ban, so stop at the first one.
+  int best = -1, width = set->classes_count, state = 0;
+  for (const unsigned char *byte = (const unsigned char *)text; *byte != '\0'; byte++) {
+    state = set->delta[state * width + set->classes[*byte]];
+    if (set->best[state] >= 0) {
+      best = stronger(set, best, set->best[state]);
+      if (set->rules[best].action == FILTER_BAN) {
+        break;
+      }
+    }
+  }
+
+  // Regexes, only looked at one by one when the combined one matches.
+  if (set->regex_count > 0 && (best < 0 || set->rules[best].action != FILTER_BAN)
+      && (!set->has_combined || regexec(&set->combined, text, 0, NULL, 0) == 0)) {
+    for (int idx = 0; idx < set->regex_count; idx++) {
+      if (regexec(&set->regexes[idx], text, 0, NULL, 0) == 0) {
+        best = stronger(set, best, set->regex_rules[idx]);
+      }
+    }
+  }
+
+  if (best >= 0) {
+    fill_verdict(set, best, verdict);
+  }
+
+  atomic_fetch_sub(&filter->readers[epoch], 1);
+  return best >= 0;
+}
+
+void filter_free(filter_t *filter) {
+  if (filter == NULL) {
+    return;
+  }
+
+  if (filter->has_builder) {
+    pthread_join(filter->builder, NULL);
+  }
+
+  free_set(atomic_load(&filter->current));
+  free(filter->path);
+  free(filter);
+}
@@ -0,0 +1,78 @@
+#ifndef FILTER_HEADER
+#define FILTER_HEADER
+
+/**
+ * Moderation filter matching chat text against a list of banned phrases.
+ *
+ * Literal phrases are compiled into a single Aho-Corasick automaton, so the
+ * text is scanned once no matter how many phrases there are. Patterns written
+ * as `re:<regex>` are POSIX extended regular expressions, checked together
+ * through one combined regex first. Matching ignores ASCII case.
+ *
+ * Rules file has one rule per line, `<action> <pattern>`:
+ *
+ *   # comment
+ *   flag spoiler
+ *   timeout 600 buy followers
+ *   ban re:^(free|cheap) v-?bucks
+ *
+ * Reloading compiles the file on a background thread and swaps the new rule
+ * set in once it's ready. Checks keep using the old set until then.
+ **/
+typedef struct filter_t filter_t;
+
+typedef enum {
+  FILTER_FLAG,
+  FILTER_TIMEOUT,
+  FILTER_BAN
+} filter_action_t;
+
+/* Max length of a rule label kept in a verdict. */
+#define FILTER_LABEL_SIZE 64
+
+/* Strongest rule matching a text. */
+typedef struct filter_verdict_t {
+  filter_action_t action;
+  int duration;                     /* Timeout length in seconds. */
+  int line;                         /* Line of the rule in the rules file. */
+  char label[FILTER_LABEL_SIZE];    /* Rule pattern, possibly truncated. */
+} filter_verdict_t;
+
+/**
+ * Loads rules from a file.
+ *
+ * @param path: Path to the rules file.
+ *
+ * @return: A new filter, or NULL if the file can't be loaded.
+ **/
+filter_t *filter_init(const char *path);
+
+/**
+ * Starts reloading rules from the same file on a background thread.
+ *
+ * @param filter: Filter to reload.
+ *
+ * @return: 0 if reload was started, -1 if one is still running or the thread can't be started.
+ **/
+int filter_reload(filter_t *filter);
+
+/**
+ * Checks text against the rules. Safe to call from several threads and during reloads.
+ *
+ * @param filter: Filter.
+ * @param text: Text to check.
+ * @param verdict: Filled with the strongest matching rule. Ban beats timeout,
+ * longer timeout beats shorter, anything beats flag.
+ *
+ * @return: 1 if any rule matched, 0 otherwise.
+ **/
+int filter_check(filter_t *filter, const char *text, filter_verdict_t *verdict);
+
+/**
+ * Waits for a running reload and frees the filter.
+ *
+ * @param filter: Filter to free.
+ **/
+void filter_free(filter_t *filter);
+
+#endif
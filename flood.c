@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "flood.h"
+
+/* Sliding window length, in one-second buckets. */
+#define FLOOD_WINDOW_S 10
+
+/* Number of recent message hashes kept per user. */
+#define FLOOD_HASHES 4
+
+/* Max number of slots checked for a single user. */
+#define FLOOD_MAX_PROBE 16
+
+/* Users not seen for this long are treated as free slots. */
+#define FLOOD_TTL_MS (6 * FLOOD_WINDOW_S * 1000)
+
+/* Max number of tracked channels. */
+#define FLOOD_MAX_CHANNELS 16
+
+/* Slots of the channel-wide table of recent texts. */
+#define FLOOD_WAVE_SLOTS 4096
+
+/* Shorter texts (after normalization) are never counted as a wave, emote spam is fine. */
+#define FLOOD_WAVE_MIN_LENGTH 16
+
+/* Invisible character (U+E0000) some clients append to get around duplicate message checks. */
+#define FLOOD_BYPASS_CHAR "\xf3\xa0\x80\x80"
+
+typedef struct {
+  uint64_t user;                    /* 0 marks a slot that was never used. */
+  int64_t seen_at;
+  uint32_t second;                  /* Second of the newest bucket. */
+  uint8_t counts[FLOOD_WINDOW_S];   /* Messages per second, saturating. */
+  uint8_t hash_pos;
+  uint8_t repeats;
+  uint32_t hashes[FLOOD_HASHES];
+} flood_user_t;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t second;
+  uint32_t users;
+} flood_wave_t;
+
+typedef struct {
+  char *name;
+  flood_user_t *users;
+  flood_wave_t *waves;
+} flood_channel_t;
+
+struct flood_t {
+  flood_config_t config;
+  uint64_t mask;
+  int channels_count;
+  flood_channel_t channels[FLOOD_MAX_CHANNELS];
+};
+
+/** Private **/
+
+static uint64_t hash_user(uint64_t user) {
+  user ^= user >> 33;
+  user *= 0xff51afd7ed558ccdull;
+  user ^= user >> 33;
+  return user;
+}
+
+/**
+ * Hashes text ignoring case, whitespace and duplicate bypass characters.
+ *
+ * @param text: Message text.
+ * @param length: Filled with the number of bytes hashed.
+ *
+ * @return: FNV-1a hash, never 0.
+ **/
+static uint32_t hash_text(const char *text, int *length) {
+  uint32_t hash = 2166136261u;
+  int bypass_length = strlen(FLOOD_BYPASS_CHAR);
+
+  *length = 0;
+  while (*text != '\0') {
+    if (strncmp(text, FLOOD_BYPASS_CHAR, bypass_length) == 0) {
+      text += bypass_length;
+      continue;
+    }
+    unsigned char byte = *text++;
+    if (isspace(byte)) {
+      continue;
+    }
+    hash ^= tolower(byte);
+    hash *= 16777619u;
+    (*length)++;
+  }
+
+  return hash == 0 ? 1 : hash;
+}
+
+static flood_channel_t *find_channel(flood_t *flood, const char *name) {
+  for (int idx = 0; idx < flood->channels_count; idx++) {
+    if (strcmp(flood->channels[idx].name, name) == 0) {
+      return &flood->channels[idx];
+    }
+  }
+
+  if (flood->channels_count == FLOOD_MAX_CHANNELS) {
+    return NULL;
+  }
+
+  flood_channel_t *channel = &flood->channels[flood->channels_count];
+  channel->name = strdup(name);
+  channel->users = calloc(flood->mask + 1, sizeof(flood_user_t));
+  channel->waves = calloc(FLOOD_WAVE_SLOTS, sizeof(flood_wave_t));
+  if (channel->name == NULL || channel->users == NULL || channel->waves == NULL) {
+    free(channel->name);
+    free(channel->users);
+    free(channel->waves);
+    memset(channel, 0, sizeof(flood_channel_t));
+    return NULL;
+  }
+
+  flood->channels_count++;
+  return channel;
+}
+
+/**
+ * Finds the user's entry, or takes over a free, expired or least recently seen one.
+ **/
+static flood_user_t *find_user(flood_t *flood, flood_channel_t *channel, uint64_t user, int64_t now_ms) {
+  uint64_t index = hash_user(user);
+  flood_user_t *victim = NULL;
+  int victim_free = 0;
+
+  for (int probe = 0; probe < FLOOD_MAX_PROBE; probe++) {
+    flood_user_t *entry = &channel->users[(index + probe) & flood->mask];
+    if (entry->user == user) {
+      return entry;
+    }
+
+    if (victim_free) {
+      continue;
+    }
+    if (entry->user == 0 || now_ms - entry->seen_at > FLOOD_TTL_MS) {
+      victim = entry;
+      victim_free = 1;
+    } else if (victim == NULL || entry->seen_at < victim->seen_at) {
+      victim = entry;
+    }
+  }
+
+  memset(victim, 0, sizeof(flood_user_t));
+  victim->user = user;
+  return victim;
+}
+
+/**
+ * Counts a message in the user's window.
+ *
+ * @return: Number of messages within the window, including this one.
+ **/
+static int count_message(flood_user_t *entry, uint32_t second) {
+  // Slide the window forward, clearing buckets that fell out of it.
+  if (second > entry->second) {
+    uint32_t gap = second - entry->second;
+    for (uint32_t step = 1; step <= gap && step <= FLOOD_WINDOW_S; step++) {
+      entry->counts[(entry->second + step) % FLOOD_WINDOW_S] = 0;
+    }
+    entry->second = second;
+  }
+
+  // Late messages still count as long as they're within the window.
+  if (entry->second - second < FLOOD_WINDOW_S) {
+    uint8_t *count = &entry->counts[second % FLOOD_WINDOW_S];
+    if (*count < UINT8_MAX) {
+      (*count)++;
+    }
+  }
+
+  int total = 0;
+  for (int idx = 0; idx < FLOOD_WINDOW_S; idx++) {
+    total += entry->counts[idx];
+  }
+  return total;
+}
+
+/**
+ * Remembers the text hash for the user.
+ *
+ * @return: 1 if the user sent the same text recently, 0 otherwise.
+ **/
+static int remember_hash(flood_user_t *entry, uint32_t hash) {
+  int repeated = 0;
+  for (int idx = 0; idx < FLOOD_HASHES; idx++) {
+    if (entry->hashes[idx] == hash) {
+      repeated = 1;
+      break;
+    }
+  }
+
+  entry->repeats = repeated ? entry->repeats + (entry->repeats < UINT8_MAX) : 0;
+  entry->hashes[entry->hash_pos] = hash;
+  entry->hash_pos = (entry->hash_pos + 1) % FLOOD_HASHES;
+  return repeated;
+}
+
+/**
+ * Counts a user sending the text in the channel-wide table.
+ *
+ * @return: Number of users who sent it within the window.
+ **/
+static uint32_t count_wave(flood_channel_t *channel, uint32_t hash, uint32_t second) {
+  flood_wave_t *wave = &channel->waves[hash & (FLOOD_WAVE_SLOTS - 1)];
+
+  if (wave->hash != hash || second - wave->second >= FLOOD_WINDOW_S) {
+    wave->hash = hash;
+    wave->second = second;
+    wave->users = 0;
+  }
+
+  return ++wave->users;
+}
+
+/** Public **/
+
+flood_t *flood_init(flood_config_t *config) {
+  uint64_t size = 1;
+  while (size < config->capacity) {
+    size <<= 1;
+  }
+
+  flood_t *flood = calloc(1, sizeof(flood_t));
+  if (flood == NULL) {
+    return NULL;
+  }
+
+  flood->config = *config;
+  flood->mask = size - 1;
+  return flood;
+}
+
+flood_verdict_t flood_check(flood_t *flood, const char *channel_name, uint64_t user_id, const char *text, int64_t now_ms) {
+  flood_channel_t *channel = find_channel(flood, channel_name);
+  if (channel == NULL || user_id == 0) {
+    return FLOOD_NONE;
+  }
+
+  flood_user_t *entry = find_user(flood, channel, user_id, now_ms);
+  uint32_t second = now_ms / 1000;
+  int length;
+  uint32_t hash = hash_text(text, &length);
+
+  entry->seen_at = now_ms;
+  int total = count_message(entry, second);
+  int repeated = remember_hash(entry, hash);
+
+  // Users repeating themselves are already counted in the wave.
+  uint32_t users = 0;
+  if (!repeated && length >= FLOOD_WAVE_MIN_LENGTH) {
+    users = count_wave(channel, hash, second);
+  }
+
+  if (total > flood->config.rate_limit) {
+    return FLOOD_RATE;
+  }
+  if (entry->repeats >= flood->config.repeat_limit) {
+    return FLOOD_REPEAT;
+  }
+  if (users > flood->config.wave_limit) {
+    return FLOOD_WAVE;
+  }
+  return FLOOD_NONE;
+}
+
+const char *flood_verdict_name(flood_verdict_t verdict) {
+  switch (verdict) {
+    case FLOOD_RATE: return "rate";
+    case FLOOD_REPEAT: return "repeat";
+    case FLOOD_WAVE: return "wave";
+    default: return "none";
+  }
+}
+
+void flood_free(flood_t *flood) {
+  if (flood == NULL) {
+    return;
+  }
+
+  for (int idx = 0; idx < flood->channels_count; idx++) {
+    free(flood->channels[idx].name);
+    free(flood->channels[idx].users);
+    free(flood->channels[idx].waves);
+  }
+  free(flood);
+}
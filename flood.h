@@ -0,0 +1,73 @@
+#ifndef FLOOD_HEADER
+#define FLOOD_HEADER
+
+#include <stdint.h>
+
+/**
+ * Per-user flood and spam detection.
+ *
+ * Each channel has an open-addressing table keyed by user id. An entry holds
+ * per-second message counters over a short sliding window and a small ring of
+ * hashes of the user's last messages. Probing is bounded, and a full probe
+ * window evicts its least recently seen user, so memory stays fixed no matter
+ * how many people chat.
+ *
+ * A channel-wide table of recent message hashes catches the same text coming
+ * from many users at once (copypasta and bot waves).
+ **/
+typedef struct flood_t flood_t;
+
+typedef enum {
+  FLOOD_NONE = 0,
+  FLOOD_RATE,       /* User sent too many messages within the window. */
+  FLOOD_REPEAT,     /* User keeps sending the same text. */
+  FLOOD_WAVE        /* Many users send the same text. */
+} flood_verdict_t;
+
+/* Detection thresholds. */
+typedef struct flood_config_t {
+  int capacity;         /* Users remembered per channel, rounded up to a power of two. */
+  int rate_limit;       /* Max messages per user within the window. */
+  int repeat_limit;     /* Max times a user can repeat one of their recent messages. */
+  int wave_limit;       /* Max distinct users sending the same text within the window. */
+} flood_config_t;
+
+/**
+ * Creates a new detector.
+ *
+ * @param config: Thresholds, copied.
+ *
+ * @return: A new detector, or NULL if memory can't be allocated.
+ **/
+flood_t *flood_init(flood_config_t *config);
+
+/**
+ * Records a message and checks it against the thresholds.
+ *
+ * @param flood: Detector.
+ * @param channel: Channel name.
+ * @param user_id: Numeric user id, non-zero.
+ * @param text: Message text.
+ * @param now_ms: Message time in milliseconds.
+ *
+ * @return: The first threshold exceeded, or FLOOD_NONE.
+ **/
+flood_verdict_t flood_check(flood_t *flood, const char *channel, uint64_t user_id, const char *text, int64_t now_ms);
+
+/**
+ * Returns a short name of a verdict, e.g. for output records.
+ *
+ * @param verdict: Verdict.
+ *
+ * @return: Static string.
+ **/
+const char *flood_verdict_name(flood_verdict_t verdict);
+
+/**
+ * Frees the detector.
+ *
+ * @param flood: Detector to free.
+ **/
+void flood_free(flood_t *flood);
+
+#endif
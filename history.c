@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "history.h"
+#include "search.h"
+#include "debug.h"
+
+/* Max number of channels and of records kept per channel. */
+#define HISTORY_MAX_CHANNELS 16
+#define HISTORY_MAX_RECORDS 65536
+
+/* Max number of connected subscribers, and length of their request line. */
+#define HISTORY_MAX_SUBSCRIBERS 32
+#define HISTORY_REQUEST_SIZE 128
+
+/* Max number of records in a search response, the newest ones are kept. */
+#define HISTORY_SEARCH_RESULTS 1000
+
+/* Position of a record in the channel's byte stream. */
+typedef struct {
+  uint64_t seq;
+  uint64_t offset;
+} history_entry_t;
+
+/**
+ * Channel ring. Positions are offsets in the endless stream of records, the
+ * ring holds bytes [tail, head) and records [first, last) of it.
+ **/
+typedef struct {
+  char *name;
+  char *data;
+  uint64_t head;
+  uint64_t tail;
+  history_entry_t *entries;
+  uint64_t first;
+  uint64_t last;
+} history_channel_t;
+
+typedef struct {
+  int fd;
+  int live;                         /* Request was handled, records are being sent. */
+  history_channel_t *channel;       /* NULL until the requested channel, or the first one, appears. */
+  char channel_name[64];            /* Requested channel, empty for the first one. */
+  uint64_t position;                /* Next byte of the channel stream to send. */
+  char request[HISTORY_REQUEST_SIZE];
+  int request_size;
+  char *response;                   /* Search results, the subscriber is disconnected once they're sent. */
+  size_t response_size;
+  size_t response_sent;
+} subscriber_t;
+
+struct history_t {
+  int listen_fd;
+  char *socket_path;
+  size_t channel_size;
+  pthread_mutex_t lock;
+  search_t *search;
+  uint64_t next_seq;
+  int channels_count;
+  history_channel_t channels[HISTORY_MAX_CHANNELS];
+  int subscribers_count;
+  subscriber_t subscribers[HISTORY_MAX_SUBSCRIBERS];
+};
+
+/** Private **/
+
+static history_channel_t *find_channel(history_t *history, const char *name, int create) {
+  for (int idx = 0; idx < history->channels_count; idx++) {
+    if (strcmp(history->channels[idx].name, name) == 0) {
+      return &history->channels[idx];
+    }
+  }
+
+  if (!create || history->channels_count == HISTORY_MAX_CHANNELS) {
+    return NULL;
+  }
+
+  history_channel_t *channel = &history->channels[history->channels_count];
+  channel->name = strdup(name);
+  channel->data = malloc(history->channel_size);
+  channel->entries = malloc(HISTORY_MAX_RECORDS * sizeof(history_entry_t));
+  if (channel->name == NULL || channel->data == NULL || channel->entries == NULL) {
+    free(channel->name);
+    free(channel->data);
+    free(channel->entries);
+    memset(channel, 0, sizeof(history_channel_t));
+    return NULL;
+  }
+
+  history->channels_count++;
+  return channel;
+}
+
+/**
+ * Finds the stream offset of the last `count` records.
+ **/
+static uint64_t find_last(history_channel_t *channel, uint64_t count) {
+  uint64_t first = channel->last - channel->first > count ? channel->last - count : channel->first;
+  return first < channel->last ? channel->entries[first % HISTORY_MAX_RECORDS].offset : channel->head;
+}
+
+/**
+ * Finds the index of the first record with a sequence number larger than `seq`.
+ **/
+static uint64_t find_after(history_channel_t *channel, uint64_t seq) {
+  // Sequence numbers only grow, so records can be bisected.
+  uint64_t low = channel->first, high = channel->last;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    if (channel->entries[middle % HISTORY_MAX_RECORDS].seq <= seq) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+/**
+ * Finds the stream offset of the first record with a sequence number larger than `seq`.
+ **/
+static uint64_t find_since(history_channel_t *channel, uint64_t seq) {
+  uint64_t index = find_after(channel, seq);
+  return index < channel->last ? channel->entries[index % HISTORY_MAX_RECORDS].offset : channel->head;
+}
+
+/**
+ * Appends the record with the given sequence number to the subscriber's
+ * response, if the channel still holds it.
+ *
+ * @return: 1 if the record was found, 0 if not, -1 if memory can't be allocated.
+ **/
+static int append_record(history_t *history, subscriber_t *subscriber, history_channel_t *channel, uint64_t seq) {
+  uint64_t index = find_after(channel, seq - 1);
+  if (index >= channel->last || channel->entries[index % HISTORY_MAX_RECORDS].seq != seq) {
+    return 0;
+  }
+
+  uint64_t start = channel->entries[index % HISTORY_MAX_RECORDS].offset;
+  uint64_t end = index + 1 < channel->last ? channel->entries[(index + 1) % HISTORY_MAX_RECORDS].offset : channel->head;
+  size_t length = end - start;
+
+  char *response = realloc(subscriber->response, subscriber->response_size + length);
+  if (response == NULL) {
+    return -1;
+  }
+  subscriber->response = response;
+
+  size_t offset = start % history->channel_size;
+  size_t contiguous = history->channel_size - offset < length ? history->channel_size - offset : length;
+  memcpy(response + subscriber->response_size, channel->data + offset, contiguous);
+  memcpy(response + subscriber->response_size + contiguous, channel->data, length - contiguous);
+  subscriber->response_size += length;
+  return 1;
+}
+
+/**
+ * Handles a search request: looks up matching records in the index and
+ * prepares them as the response.
+ *
+ * @return: 0 on success, -1 if the request is invalid.
+ **/
+static int handle_search(history_t *history, subscriber_t *subscriber) {
+  char name[64] = { 0 }, query[HISTORY_REQUEST_SIZE] = { 0 };
+  int minutes = 0, offset = 0;
+
+  if (history->search == NULL
+      || sscanf(subscriber->request, "%*s %d %n", &minutes, &offset) < 1 || offset == 0 || minutes < 0) {
+    return -1;
+  }
+
+  // A word starting with '#' picks the channel, the others make the query.
+  char *save = NULL;
+  for (char *word = strtok_r(subscriber->request + offset, " ", &save); word != NULL; word = strtok_r(NULL, " ", &save)) {
+    if (word[0] == '#') {
+      snprintf(name, sizeof(name), "%s", word);
+    } else {
+      strcat(query, word);
+      strcat(query, " ");
+    }
+  }
+
+  uint64_t *seqs = malloc(HISTORY_SEARCH_RESULTS * sizeof(uint64_t));
+  subscriber->response = malloc(1);
+  if (seqs == NULL || subscriber->response == NULL) {
+    free(seqs);
+    return -1;
+  }
+
+  int count = search_query(history->search, query, minutes, seqs, HISTORY_SEARCH_RESULTS);
+  if (count == -1) {
+    free(seqs);
+    return -1;
+  }
+
+  history_channel_t *only = name[0] != '\0' ? find_channel(history, name, 0) : NULL;
+  for (int idx = 0; idx < count; idx++) {
+    if (name[0] != '\0') {
+      if (only != NULL && append_record(history, subscriber, only, seqs[idx]) == -1) {
+        break;
+      }
+      continue;
+    }
+
+    // Records of all channels share the sequence numbers, each is in exactly one.
+    for (int channel = 0; channel < history->channels_count; channel++) {
+      if (append_record(history, subscriber, &history->channels[channel], seqs[idx]) != 0) {
+        break;
+      }
+    }
+  }
+
+  free(seqs);
+  return 0;
+}
+
+/**
+ * Handles a request line.
+ *
+ * @return: 0 on success, -1 if the request is invalid.
+ **/
+static int handle_request(history_t *history, subscriber_t *subscriber) {
+  char verb[16] = { 0 }, name[64] = { 0 };
+  unsigned long long value = 0;
+
+  int fields = sscanf(subscriber->request, "%15s %llu %63s", verb, &value, name);
+  if (strcmp(verb, "search") == 0) {
+    return handle_search(history, subscriber);
+  } else if (strcmp(verb, "live") == 0) {
+    fields = sscanf(subscriber->request, "%15s %63s", verb, name);
+    value = 0;
+  } else if (fields < 2 || (strcmp(verb, "last") != 0 && strcmp(verb, "since") != 0)) {
+    return -1;
+  }
+
+  // Channels are only created by appends, a name nobody writes to mustn't take a slot.
+  if (name[0] != '\0') {
+    strcpy(subscriber->channel_name, name);
+    subscriber->channel = find_channel(history, name, 0);
+  } else if (history->channels_count > 0) {
+    subscriber->channel = &history->channels[0];
+  }
+
+  // Everything appended to a channel that doesn't exist yet is new to the subscriber.
+  history_channel_t *channel = subscriber->channel;
+  if (channel == NULL) {
+    subscriber->position = 0;
+  } else if (strcmp(verb, "live") == 0) {
+    subscriber->position = channel->head;
+  } else if (strcmp(verb, "last") == 0) {
+    subscriber->position = find_last(channel, value);
+  } else {
+    subscriber->position = find_since(channel, value);
+  }
+
+  subscriber->live = 1;
+  return 0;
+}
+
+/**
+ * Writes as much of the subscriber's pending records as the socket takes.
+ *
+ * @return: 0 on success, -1 if the subscriber should be disconnected.
+ **/
+static int flush_subscriber(history_t *history, subscriber_t *subscriber) {
+  if (subscriber->response != NULL) {
+    while (subscriber->response_sent < subscriber->response_size) {
+      ssize_t sent = send(subscriber->fd, subscriber->response + subscriber->response_sent,
+        subscriber->response_size - subscriber->response_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (sent == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      }
+      subscriber->response_sent += sent;
+    }
+    return -1;
+  }
+
+  if (!subscriber->live) {
+    return 0;
+  }
+
+  if (subscriber->channel == NULL) {
+    history_channel_t *channel = subscriber->channel_name[0] != '\0'
+      ? find_channel(history, subscriber->channel_name, 0)
+      : history->channels_count > 0 ? &history->channels[0] : NULL;
+    if (channel == NULL) {
+      return 0;
+    }
+    subscriber->channel = channel;
+    subscriber->position = channel->tail;
+  }
+
+  history_channel_t *channel = subscriber->channel;
+  if (subscriber->position < channel->tail) {
+    LOG(LOG_LEVEL_DEBUG, "DEBUG: History subscriber %d fell behind, disconnecting\n", subscriber->fd);
+    return -1;
+  }
+
+  while (subscriber->position < channel->head) {
+    size_t size = history->channel_size;
+    size_t offset = subscriber->position % size;
+    size_t pending = channel->head - subscriber->position;
+    size_t contiguous = size - offset < pending ? size - offset : pending;
+
+    struct iovec parts[2] = {
+      { .iov_base = channel->data + offset, .iov_len = contiguous },
+      { .iov_base = channel->data, .iov_len = pending - contiguous }
+    };
+    struct msghdr header = { .msg_iov = parts, .msg_iovlen = pending > contiguous ? 2 : 1 };
+
+    ssize_t sent = sendmsg(subscriber->fd, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent == -1) {
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    subscriber->position += sent;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the subscriber's request, or notices the subscriber leaving.
+ *
+ * @return: 0 on success, -1 if the subscriber should be disconnected.
+ **/
+static int read_subscriber(history_t *history, subscriber_t *subscriber) {
+  char discard[256];
+
+  // Anything sent after the request is ignored.
+  if (subscriber->live || subscriber->response != NULL) {
+    ssize_t received = recv(subscriber->fd, discard, sizeof(discard), MSG_DONTWAIT);
+    return received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK) ? -1 : 0;
+  }
+
+  int space = HISTORY_REQUEST_SIZE - 1 - subscriber->request_size;
+  ssize_t received = recv(subscriber->fd, subscriber->request + subscriber->request_size, space, MSG_DONTWAIT);
+  if (received == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+  if (received == 0) {
+    return -1;
+  }
+
+  subscriber->request_size += received;
+  subscriber->request[subscriber->request_size] = '\0';
+
+  char *newline = strchr(subscriber->request, '\n');
+  if (newline == NULL) {
+    return subscriber->request_size == HISTORY_REQUEST_SIZE - 1 ? -1 : 0;
+  }
+  *newline = '\0';
+
+  if (handle_request(history, subscriber) == -1) {
+    dprintf(subscriber->fd, "error: expected \"last <n>\", \"since <seq>\", \"live\" or \"search <minutes> <words>\"\n");
+    return -1;
+  }
+
+  return flush_subscriber(history, subscriber);
+}
+
+static void remove_subscriber(history_t *history, int index) {
+  close(history->subscribers[index].fd);
+  free(history->subscribers[index].response);
+  history->subscribers[index] = history->subscribers[--history->subscribers_count];
+}
+
+static void accept_subscriber(history_t *history) {
+  int fd = accept4(history->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  if (history->subscribers_count == HISTORY_MAX_SUBSCRIBERS) {
+    LOG(LOG_LEVEL_ERROR, "Too many history subscribers, refusing a new one\n");
+    close(fd);
+    return;
+  }
+
+  subscriber_t *subscriber = &history->subscribers[history->subscribers_count++];
+  memset(subscriber, 0, sizeof(subscriber_t));
+  subscriber->fd = fd;
+}
+
+/** Public **/
+
+history_t *history_init(const char *socket_path, size_t channel_size) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  history_t *history = calloc(1, sizeof(history_t));
+  if (history == NULL) {
+    return NULL;
+  }
+
+  history->socket_path = strdup(socket_path);
+  history->channel_size = channel_size;
+  history->next_seq = 1;
+  pthread_mutex_init(&history->lock, NULL);
+
+  unlink(socket_path);
+  history->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (history->listen_fd == -1
+      || bind(history->listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+      || listen(history->listen_fd, HISTORY_MAX_SUBSCRIBERS) == -1) {
+    if (history->listen_fd != -1) {
+      close(history->listen_fd);
+    }
+    pthread_mutex_destroy(&history->lock);
+    free(history->socket_path);
+    free(history);
+    return NULL;
+  }
+
+  return history;
+}
+
+void history_set_search(history_t *history, search_t *search) {
+  pthread_mutex_lock(&history->lock);
+  history->search = search;
+  pthread_mutex_unlock(&history->lock);
+}
+
+uint64_t history_next_seq(history_t *history) {
+  pthread_mutex_lock(&history->lock);
+  uint64_t seq = history->next_seq;
+  pthread_mutex_unlock(&history->lock);
+  return seq;
+}
+
+uint64_t history_append(history_t *history, const char *name, const char *record, size_t length) {
+  if (length == 0 || length > history->channel_size) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&history->lock);
+
+  history_channel_t *channel = find_channel(history, name, 1);
+  if (channel == NULL) {
+    pthread_mutex_unlock(&history->lock);
+    return 0;
+  }
+
+  // Drop the oldest records until the new one fits.
+  while (channel->head + length - channel->tail > history->channel_size
+      || channel->last - channel->first == HISTORY_MAX_RECORDS) {
+    channel->first++;
+    channel->tail = channel->first < channel->last
+      ? channel->entries[channel->first % HISTORY_MAX_RECORDS].offset
+      : channel->head;
+  }
+
+  size_t offset = channel->head % history->channel_size;
+  size_t contiguous = history->channel_size - offset < length ? history->channel_size - offset : length;
+  memcpy(channel->data + offset, record, contiguous);
+  memcpy(channel->data, record + contiguous, length - contiguous);
+
+  uint64_t seq = history->next_seq++;
+  channel->entries[channel->last % HISTORY_MAX_RECORDS] = (history_entry_t){ .seq = seq, .offset = channel->head };
+  channel->last++;
+  channel->head += length;
+
+  pthread_mutex_unlock(&history->lock);
+  return seq;
+}
+
+void history_flush(history_t *history) {
+  pthread_mutex_lock(&history->lock);
+  for (int idx = history->subscribers_count - 1; idx >= 0; idx--) {
+    if (flush_subscriber(history, &history->subscribers[idx]) == -1) {
+      remove_subscriber(history, idx);
+    }
+  }
+  pthread_mutex_unlock(&history->lock);
+}
+
+int history_fill_fds(history_t *history, fd_set *readfds, fd_set *writefds) {
+  pthread_mutex_lock(&history->lock);
+
+  int maxfd = history->listen_fd;
+  FD_SET(history->listen_fd, readfds);
+
+  for (int idx = 0; idx < history->subscribers_count; idx++) {
+    subscriber_t *subscriber = &history->subscribers[idx];
+    FD_SET(subscriber->fd, readfds);
+    if ((subscriber->live && subscriber->channel != NULL && subscriber->position < subscriber->channel->head)
+        || subscriber->response != NULL) {
+      FD_SET(subscriber->fd, writefds);
+    }
+    if (subscriber->fd > maxfd) {
+      maxfd = subscriber->fd;
+    }
+  }
+
+  pthread_mutex_unlock(&history->lock);
+  return maxfd;
+}
+
+void history_handle_fds(history_t *history, fd_set *readfds, fd_set *writefds) {
+  pthread_mutex_lock(&history->lock);
+
+  for (int idx = history->subscribers_count - 1; idx >= 0; idx--) {
+    subscriber_t *subscriber = &history->subscribers[idx];
+    int result = 0;
+    if (FD_ISSET(subscriber->fd, readfds)) {
+      result = read_subscriber(history, subscriber);
+    }
+    if (result == 0 && FD_ISSET(subscriber->fd, writefds)) {
+      result = flush_subscriber(history, subscriber);
+    }
+    if (result == -1) {
+      remove_subscriber(history, idx);
+    }
+  }
+
+  // New subscribers are added after the loop, their sockets weren't selected yet.
+  if (FD_ISSET(history->listen_fd, readfds)) {
+    accept_subscriber(history);
+  }
+
+  pthread_mutex_unlock(&history->lock);
+}
+
+void history_free(history_t *history) {
+  if (history == NULL) {
+    return;
+  }
+
+  while (history->subscribers_count > 0) {
+    remove_subscriber(history, history->subscribers_count - 1);
+  }
+  close(history->listen_fd);
+  unlink(history->socket_path);
+
+  for (int idx = 0; idx < history->channels_count; idx++) {
+    free(history->channels[idx].name);
+    free(history->channels[idx].data);
+    free(history->channels[idx].entries);
+  }
+
+  pthread_mutex_destroy(&history->lock);
+  free(history->socket_path);
+  free(history);
+}
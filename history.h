@@ -0,0 +1,117 @@
+#ifndef HISTORY_HEADER
+#define HISTORY_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "search.h"
+
+/**
+ * Recent output records per channel, with catch-up for late subscribers.
+ *
+ * Each channel keeps its serialized records back to back in a byte ring of a
+ * fixed size, with the oldest records dropped to make room. Every record gets
+ * a sequence number, increasing across all channels.
+ *
+ * Subscribers connect to a Unix socket and send one request line:
+ *
+ *   last <n> [#channel]       Last n records, then the live feed.
+ *   since <seq> [#channel]    Records after the given sequence number, then the live feed.
+ *   live [#channel]           Live feed only.
+ *
+ * Without a channel, the first channel that got a record is used. Catch-up
+ * goes out in a single write where possible, and the live feed continues
+ * from the same ring. Subscribers are written to without blocking; one that
+ * falls behind by more than the ring holds is disconnected.
+ *
+ * With a search index attached, a subscriber can also look up records instead:
+ *
+ *   search <minutes> <words...> [#channel]
+ *
+ * Records of the last given minutes (0 for all the index holds) that contain
+ * every word are sent, oldest first, and the subscriber is disconnected. At
+ * most the newest 1000 matches are looked up, and records the rings already
+ * dropped are left out.
+ *
+ * Appending and flushing can happen on another thread than the socket handling.
+ **/
+typedef struct history_t history_t;
+
+/**
+ * Creates the history and starts listening for subscribers.
+ *
+ * @param socket_path: Path of the Unix socket to create. Existing file is replaced.
+ * @param channel_size: Size of each channel's ring in bytes.
+ *
+ * @return: A new history, or NULL if the socket can't be created.
+ **/
+history_t *history_init(const char *socket_path, size_t channel_size);
+
+/**
+ * Attaches the index search requests are answered from. Records aren't added
+ * to it by the history, see search_add().
+ *
+ * @param history: History.
+ * @param search: Index, or NULL to turn searching off.
+ **/
+void history_set_search(history_t *history, search_t *search);
+
+/**
+ * Returns the sequence number the next record will get.
+ *
+ * @param history: History.
+ *
+ * @return: Sequence number.
+ **/
+uint64_t history_next_seq(history_t *history);
+
+/**
+ * Appends a serialized record to a channel's ring. The record should be the
+ * one returned by history_next_seq(). Subscribers get it on the next flush.
+ *
+ * @param history: History.
+ * @param channel: Channel name.
+ * @param record: Serialized record, including the trailing newline.
+ * @param length: Length of the record.
+ *
+ * @return: Sequence number of the record, or 0 if it's larger than the ring.
+ **/
+uint64_t history_append(history_t *history, const char *channel, const char *record, size_t length);
+
+/**
+ * Writes pending records to subscribers, without blocking.
+ *
+ * @param history: History.
+ **/
+void history_flush(history_t *history);
+
+/**
+ * Adds the listening socket and subscriber sockets to the sets for select().
+ *
+ * @param history: History.
+ * @param readfds: Set of descriptors to check for reading.
+ * @param writefds: Set of descriptors to check for writing, for subscribers with pending records.
+ *
+ * @return: Largest descriptor added, or -1.
+ **/
+int history_fill_fds(history_t *history, fd_set *readfds, fd_set *writefds);
+
+/**
+ * Accepts subscribers, reads their requests and writes pending records for
+ * sockets that select() marked as ready.
+ *
+ * @param history: History.
+ * @param readfds: Descriptors ready for reading.
+ * @param writefds: Descriptors ready for writing.
+ **/
+void history_handle_fds(history_t *history, fd_set *readfds, fd_set *writefds);
+
+/**
+ * Disconnects subscribers, removes the socket and frees the history.
+ *
+ * @param history: History to free.
+ **/
+void history_free(history_t *history);
+
+#endif
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "inbox.h"
+#include "debug.h"
+#include "utils.h"
+
+/* Max number of producers, including the ones added by descriptor. */
+#define INBOX_MAX_PRODUCERS 32
+
+/* Max length of a producer name, including the terminator. */
+#define INBOX_NAME_SIZE 32
+
+/* Max producer weight. */
+#define INBOX_MAX_WEIGHT 100
+
+/* Virtual time a line of a producer with weight 1 takes. */
+#define INBOX_LINE_COST (1 << 20)
+
+typedef struct {
+  char *line;
+  uint64_t finish;                  /* Virtual finish time, lines are taken in its order. */
+} queued_line_t;
+
+typedef struct {
+  int fd;
+  int owned;                        /* Accepted by the inbox, closed when the producer leaves. */
+  int greeted;                      /* Introduced itself, following lines are messages. */
+  int closed;                       /* Input ended, the producer leaves once its queue is empty. */
+  int discarding;                   /* Skipping the rest of a line that was too long. */
+  char name[INBOX_NAME_SIZE];
+  int weight;
+  char *buffer;                     /* Partial line, and complete ones that don't fit the queue yet. */
+  int buffered;
+  queued_line_t *queue;             /* Ring of config.queue_limit lines. */
+  int queue_head;
+  int queue_count;
+  uint64_t last_finish;             /* Virtual finish time of the producer's last queued line. */
+  uint64_t taken;
+  uint64_t dropped;
+} producer_t;
+
+struct inbox_t {
+  int listen_fd;
+  char *socket_path;
+  inbox_config_t config;
+  uint64_t virtual_time;            /* Finish time of the line taken last. */
+  int64_t *sent;                    /* Ring of the times the last config.rate lines were let out. */
+  int sent_next;
+  int sent_count;
+  int producers_count;
+  producer_t producers[INBOX_MAX_PRODUCERS];
+};
+
+/** Private **/
+
+static producer_t *add_producer(inbox_t *inbox, int fd, int owned, const char *name, int weight) {
+  if (inbox->producers_count == INBOX_MAX_PRODUCERS) {
+    return NULL;
+  }
+
+  producer_t *producer = &inbox->producers[inbox->producers_count];
+  memset(producer, 0, sizeof(producer_t));
+  producer->buffer = malloc(inbox->config.line_size);
+  producer->queue = malloc(inbox->config.queue_limit * sizeof(queued_line_t));
+  if (producer->buffer == NULL || producer->queue == NULL) {
+    free(producer->buffer);
+    free(producer->queue);
+    return NULL;
+  }
+
+  producer->fd = fd;
+  producer->owned = owned;
+  producer->weight = weight;
+  snprintf(producer->name, INBOX_NAME_SIZE, "%s", name);
+  inbox->producers_count++;
+  return producer;
+}
+
+static void remove_producer(inbox_t *inbox, int index) {
+  producer_t *producer = &inbox->producers[index];
+  LOG(LOG_LEVEL_DEBUG, "DEBUG: Producer %s left after %llu lines, %llu dropped\n",
+    producer->name, (unsigned long long)producer->taken, (unsigned long long)producer->dropped);
+
+  for (int idx = 0; idx < producer->queue_count; idx++) {
+    free(producer->queue[(producer->queue_head + idx) % inbox->config.queue_limit].line);
+  }
+  free(producer->queue);
+  free(producer->buffer);
+  if (producer->owned) {
+    close(producer->fd);
+  }
+
+  inbox->producers[index] = inbox->producers[--inbox->producers_count];
+}
+
+/**
+ * Handles a complete line: the greeting of a new producer, or a message to queue.
+ *
+ * @return: 0 on success, -1 if the producer should be disconnected.
+ **/
+static int handle_line(inbox_t *inbox, producer_t *producer, char *line, int length) {
+  if (length > 0 && line[length - 1] == '\r') {
+    line[--length] = '\0';
+  }
+
+  if (!producer->greeted) {
+    char name[INBOX_NAME_SIZE] = { 0 };
+    int weight = 1;
+    if (sscanf(line, "hello %31s %d", name, &weight) < 1 || weight < 1 || weight > INBOX_MAX_WEIGHT) {
+      dprintf(producer->fd, "error: expected \"hello <name> [weight]\", weight between 1 and %d\n", INBOX_MAX_WEIGHT);
+      return -1;
+    }
+
+    memcpy(producer->name, name, INBOX_NAME_SIZE);
+    producer->weight = weight;
+    producer->greeted = 1;
+    LOG(LOG_LEVEL_DEBUG, "DEBUG: Producer %s joined with weight %d\n", producer->name, producer->weight);
+    return 0;
+  }
+
+  if (length == 0) {
+    return 0;
+  }
+
+  char *copy = malloc(length + 1);
+  if (copy == NULL) {
+    producer->dropped++;
+    return 0;
+  }
+  memcpy(copy, line, length + 1);
+
+  // An idle producer starts over at the current virtual time instead of catching up.
+  uint64_t start = producer->last_finish > inbox->virtual_time ? producer->last_finish : inbox->virtual_time;
+  producer->last_finish = start + INBOX_LINE_COST / producer->weight;
+
+  int slot = (producer->queue_head + producer->queue_count) % inbox->config.queue_limit;
+  producer->queue[slot] = (queued_line_t){ .line = copy, .finish = producer->last_finish };
+  producer->queue_count++;
+  return 0;
+}
+
+/**
+ * Moves complete lines from the producer's buffer to its queue, while there's room.
+ *
+ * @return: 0 on success, -1 if the producer should be disconnected.
+ **/
+static int frame_lines(inbox_t *inbox, producer_t *producer) {
+  int start = 0;
+  while (producer->queue_count < inbox->config.queue_limit || !producer->greeted) {
+    char *line = producer->buffer + start;
+    char *newline = memchr(line, '\n', producer->buffered - start);
+    if (newline == NULL) {
+      break;
+    }
+
+    *newline = '\0';
+    start += newline - line + 1;
+    if (producer->discarding) {
+      producer->discarding = 0;
+    } else if (handle_line(inbox, producer, line, newline - line) == -1) {
+      return -1;
+    }
+  }
+
+  memmove(producer->buffer, producer->buffer + start, producer->buffered - start);
+  producer->buffered -= start;
+
+  // A line longer than the buffer is dropped, up to its newline.
+  if (producer->buffered == inbox->config.line_size - 1 && memchr(producer->buffer, '\n', producer->buffered) == NULL) {
+    if (!producer->discarding) {
+      LOG(LOG_LEVEL_DEBUG, "DEBUG: Producer %s sent a line that is too long, dropping it\n", producer->name);
+      producer->dropped++;
+    }
+    producer->discarding = 1;
+    producer->buffered = 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads what the producer sent.
+ *
+ * @return: 0 on success, -1 if the producer should be disconnected.
+ **/
+static int read_producer(inbox_t *inbox, producer_t *producer) {
+  int space = inbox->config.line_size - 1 - producer->buffered;
+  ssize_t received = read(producer->fd, producer->buffer + producer->buffered, space);
+  if (received == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 0;
+    }
+    received = 0;
+  }
+
+  if (received == 0) {
+    // The last line may lack its newline.
+    producer->closed = 1;
+    if (producer->buffered > 0) {
+      producer->buffer[producer->buffered++] = '\n';
+    }
+  }
+
+  producer->buffered += received;
+  return frame_lines(inbox, producer);
+}
+
+static void accept_producer(inbox_t *inbox) {
+  int fd = accept4(inbox->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+
+  if (add_producer(inbox, fd, 1, "?", 1) == NULL) {
+    LOG(LOG_LEVEL_ERROR, "Too many input producers, refusing a new one\n");
+    close(fd);
+  }
+}
+
+/** Public **/
+
+inbox_t *inbox_init(const char *socket_path, inbox_config_t *config) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (socket_path != NULL && strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  inbox_t *inbox = calloc(1, sizeof(inbox_t));
+  if (inbox == NULL) {
+    return NULL;
+  }
+
+  inbox->config = *config;
+  inbox->listen_fd = -1;
+  if (inbox->config.rate > 0) {
+    inbox->sent = calloc(inbox->config.rate, sizeof(int64_t));
+    if (inbox->sent == NULL) {
+      free(inbox);
+      return NULL;
+    }
+  }
+
+  if (socket_path == NULL) {
+    return inbox;
+  }
+
+  strcpy(address.sun_path, socket_path);
+  inbox->socket_path = strdup(socket_path);
+
+  unlink(socket_path);
+  inbox->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (inbox->listen_fd == -1
+      || bind(inbox->listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+      || listen(inbox->listen_fd, INBOX_MAX_PRODUCERS) == -1) {
+    if (inbox->listen_fd != -1) {
+      close(inbox->listen_fd);
+    }
+    free(inbox->socket_path);
+    free(inbox->sent);
+    free(inbox);
+    return NULL;
+  }
+
+  return inbox;
+}
+
+int inbox_add_fd(inbox_t *inbox, int fd, const char *name, int weight) {
+  producer_t *producer = add_producer(inbox, fd, 0, name, weight);
+  if (producer == NULL) {
+    return -1;
+  }
+
+  producer->greeted = 1;
+  return 0;
+}
+
+int inbox_fill_fds(inbox_t *inbox, fd_set *readfds) {
+  int maxfd = inbox->listen_fd;
+  if (inbox->listen_fd != -1) {
+    FD_SET(inbox->listen_fd, readfds);
+  }
+
+  // Producers with a full queue wait, and their writes block once the socket buffer fills up.
+  for (int idx = 0; idx < inbox->producers_count; idx++) {
+    producer_t *producer = &inbox->producers[idx];
+    if (producer->closed || producer->queue_count == inbox->config.queue_limit) {
+      continue;
+    }
+    FD_SET(producer->fd, readfds);
+    if (producer->fd > maxfd) {
+      maxfd = producer->fd;
+    }
+  }
+
+  return maxfd;
+}
+
+void inbox_handle_fds(inbox_t *inbox, fd_set *readfds) {
+  for (int idx = inbox->producers_count - 1; idx >= 0; idx--) {
+    producer_t *producer = &inbox->producers[idx];
+    if (producer->closed || !FD_ISSET(producer->fd, readfds)) {
+      continue;
+    }
+    if (read_producer(inbox, producer) == -1 || (producer->closed && producer->queue_count == 0)) {
+      remove_producer(inbox, idx);
+    }
+  }
+
+  // New producers are added after the loop, their sockets weren't selected yet.
+  if (inbox->listen_fd != -1 && FD_ISSET(inbox->listen_fd, readfds)) {
+    accept_producer(inbox);
+  }
+}
+
+int inbox_next(inbox_t *inbox, char *line, int size) {
+  if (inbox_wait_ms(inbox) != 0) {
+    return 0;
+  }
+
+  int next = -1;
+  for (int idx = 0; idx < inbox->producers_count; idx++) {
+    producer_t *producer = &inbox->producers[idx];
+    if (producer->queue_count > 0
+        && (next == -1 || producer->queue[producer->queue_head].finish < inbox->producers[next].queue[inbox->producers[next].queue_head].finish)) {
+      next = idx;
+    }
+  }
+
+  producer_t *producer = &inbox->producers[next];
+  queued_line_t *queued = &producer->queue[producer->queue_head];
+  snprintf(line, size, "%s", queued->line);
+  free(queued->line);
+  inbox->virtual_time = queued->finish;
+  producer->queue_head = (producer->queue_head + 1) % inbox->config.queue_limit;
+  producer->queue_count--;
+  producer->taken++;
+
+  if (inbox->config.rate > 0) {
+    inbox->sent[inbox->sent_next] = monotonic_ms();
+    inbox->sent_next = (inbox->sent_next + 1) % inbox->config.rate;
+    if (inbox->sent_count < inbox->config.rate) {
+      inbox->sent_count++;
+    }
+  }
+
+  // Room in the queue lets in lines that arrived while it was full.
+  frame_lines(inbox, producer);
+  if (producer->closed && producer->queue_count == 0) {
+    remove_producer(inbox, next);
+  }
+
+  return 1;
+}
+
+int inbox_wait_ms(inbox_t *inbox) {
+  int queued = 0;
+  for (int idx = 0; idx < inbox->producers_count && !queued; idx++) {
+    queued = inbox->producers[idx].queue_count > 0;
+  }
+
+  if (!queued) {
+    return -1;
+  }
+
+  if (inbox->config.rate == 0 || inbox->sent_count == 0) {
+    return 0;
+  }
+
+  // Lines are spread over the window, so a burst from one producer can't use it up before others get a turn.
+  int64_t now = monotonic_ms();
+  int last = (inbox->sent_next + inbox->config.rate - 1) % inbox->config.rate;
+  int64_t wait = inbox->sent[last] + inbox->config.rate_period / inbox->config.rate - now;
+
+  // Once the ring is full, the next slot holds the oldest line of the window.
+  if (inbox->sent_count == inbox->config.rate) {
+    int64_t window_wait = inbox->sent[inbox->sent_next] + inbox->config.rate_period - now;
+    wait = window_wait > wait ? window_wait : wait;
+  }
+
+  return wait > 0 ? (int)wait : 0;
+}
+
+void inbox_free(inbox_t *inbox) {
+  if (inbox == NULL) {
+    return;
+  }
+
+  while (inbox->producers_count > 0) {
+    remove_producer(inbox, inbox->producers_count - 1);
+  }
+
+  if (inbox->listen_fd != -1) {
+    close(inbox->listen_fd);
+    unlink(inbox->socket_path);
+  }
+  free(inbox->socket_path);
+  free(inbox->sent);
+  free(inbox);
+}
@@ -0,0 +1,110 @@
+#ifndef INBOX_HEADER
+#define INBOX_HEADER
+
+#include <sys/select.h>
+
+/**
+ * Outgoing chat lines from several producers, shared fairly under one rate limit.
+ *
+ * Producers connect to a Unix socket and introduce themselves with one line:
+ *
+ *   hello <name> [weight]
+ *
+ * Every following line is a chat message. Lines are framed per connection, so
+ * producers writing at the same time never mix their messages. Other inputs,
+ * like the standard input, can be added as producers without the greeting.
+ *
+ * Each producer has a queue of limited length. While it's full, its socket
+ * isn't read, and the producer blocks on its own writes instead of crowding
+ * out the others. Queued lines are taken in weighted fair order: every line
+ * gets a virtual finish time, one over the producer's weight after the later
+ * of the producer's previous line and the line taken last, and the earliest
+ * one goes next. A producer with weight 2 gets twice the share of a producer
+ * with weight 1 while both have lines waiting, and idle producers don't
+ * build up credit.
+ *
+ * If a rate limit is set, lines are let out no faster than it: at most `rate`
+ * lines in any window of `rate_period` milliseconds, and evenly spaced within
+ * the window, so a burst doesn't use it up before other producers get a turn.
+ **/
+typedef struct inbox_t inbox_t;
+
+/* Inbox settings. */
+typedef struct inbox_config_t {
+  int line_size;        // Max length of a line, including the terminator. Longer lines are dropped.
+  int queue_limit;      // Lines queued per producer before it's no longer read.
+  int rate;             // Lines let out per period, 0 for no limit.
+  int rate_period;      // Rate limit window in milliseconds.
+} inbox_config_t;
+
+/**
+ * Creates the inbox and starts listening for producers.
+ *
+ * @param socket_path: Path of the Unix socket to create, NULL for none. Existing file is replaced.
+ * @param config: Inbox settings. Copied.
+ *
+ * @return: A new inbox, or NULL if the socket can't be created.
+ **/
+inbox_t *inbox_init(const char *socket_path, inbox_config_t *config);
+
+/**
+ * Adds an already open descriptor as a producer, e.g. the standard input. It
+ * needs no greeting and isn't closed by the inbox; reading stops at its end.
+ *
+ * @param inbox: Inbox.
+ * @param fd: Descriptor to read lines from.
+ * @param name: Producer name.
+ * @param weight: Producer weight.
+ *
+ * @return: 0 on success, -1 if there are too many producers.
+ **/
+int inbox_add_fd(inbox_t *inbox, int fd, const char *name, int weight);
+
+/**
+ * Adds the listening socket and the producers with room in their queues to
+ * the set for select().
+ *
+ * @param inbox: Inbox.
+ * @param readfds: Set of descriptors to check for reading.
+ *
+ * @return: Largest descriptor added, or -1.
+ **/
+int inbox_fill_fds(inbox_t *inbox, fd_set *readfds);
+
+/**
+ * Accepts producers and queues the lines of sockets that select() marked as ready.
+ *
+ * @param inbox: Inbox.
+ * @param readfds: Descriptors ready for reading.
+ **/
+void inbox_handle_fds(inbox_t *inbox, fd_set *readfds);
+
+/**
+ * Takes the next line in fair order, if the rate limit lets it out now.
+ *
+ * @param inbox: Inbox.
+ * @param line: Buffer for the line, without the newline.
+ * @param size: Size of the buffer. Longer lines are truncated.
+ *
+ * @return: 1 if a line was taken, 0 otherwise.
+ **/
+int inbox_next(inbox_t *inbox, char *line, int size);
+
+/**
+ * Returns how long until inbox_next() can let out a line.
+ *
+ * @param inbox: Inbox.
+ *
+ * @return: Milliseconds to wait, 0 if a line can go now, -1 if nothing is queued.
+ **/
+int inbox_wait_ms(inbox_t *inbox);
+
+/**
+ * Disconnects producers, removes the socket and frees the inbox. Lines still
+ * queued are dropped.
+ *
+ * @param inbox: Inbox to free.
+ **/
+void inbox_free(inbox_t *inbox);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+/* Number of table slots. Table is never more than half full, so probing always ends. */
+#define INTERN_SLOTS (1 << 16)
+#define INTERN_MAX_STRINGS (INTERN_SLOTS / 2)
+
+/* Longer strings are unlikely to repeat, and aren't interned. */
+#define INTERN_MAX_LENGTH 128
+
+/* Strings are packed into chunks of this size, chained through their first bytes. */
+#define INTERN_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+  uint32_t id;
+  _Atomic uint32_t value;
+  uint32_t hash;
+  uint32_t length;
+  char str[];
+} intern_entry_t;
+
+static intern_entry_t *_Atomic slots[INTERN_SLOTS];
+static atomic_uint count;
+
+/* Inserts and the chunk they allocate from are guarded by the lock. */
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *chunk = NULL;
+static size_t chunk_used = INTERN_CHUNK_SIZE;
+
+/** Private **/
+
+static uint32_t hash_string(const char *str, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)str[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Looks the string up in the table.
+ *
+ * @param slot: Filled with the empty slot ending the probe if the string isn't found.
+ *
+ * @return: Entry of the string, or NULL if it isn't interned.
+ **/
+static intern_entry_t *find_entry(const char *str, size_t length, uint32_t hash, uint32_t *slot) {
+  for (uint32_t idx = hash & (INTERN_SLOTS - 1); ; idx = (idx + 1) & (INTERN_SLOTS - 1)) {
+    intern_entry_t *entry = atomic_load_explicit(&slots[idx], memory_order_acquire);
+    if (entry == NULL) {
+      *slot = idx;
+      return NULL;
+    }
+    if (entry->hash == hash && entry->length == length && memcmp(entry->str, str, length) == 0) {
+      return entry;
+    }
+  }
+}
+
+/**
+ * Allocates an entry from the current chunk, starting a new one if needed.
+ **/
+static intern_entry_t *alloc_entry(size_t length) {
+  size_t size = (sizeof(intern_entry_t) + length + 1 + 7) & ~(size_t)7;
+
+  if (chunk_used + size > INTERN_CHUNK_SIZE) {
+    char *next = malloc(INTERN_CHUNK_SIZE);
+    if (next == NULL) {
+      return NULL;
+    }
+    *(char **)next = chunk;
+    chunk = next;
+    chunk_used = sizeof(char *);
+  }
+
+  intern_entry_t *entry = (intern_entry_t *)(chunk + chunk_used);
+  chunk_used += size;
+  return entry;
+}
+
+/** Public **/
+
+const char *intern(const char *str, size_t length) {
+  if (length > INTERN_MAX_LENGTH) {
+    return NULL;
+  }
+
+  uint32_t hash = hash_string(str, length);
+  uint32_t slot;
+  intern_entry_t *entry = find_entry(str, length, hash, &slot);
+  if (entry != NULL) {
+    return entry->str;
+  }
+
+  pthread_mutex_lock(&insert_lock);
+
+  // Another thread could have added it in the meantime.
+  entry = find_entry(str, length, hash, &slot);
+  if (entry == NULL && atomic_load(&count) < INTERN_MAX_STRINGS) {
+    entry = alloc_entry(length);
+    if (entry != NULL) {
+      entry->id = atomic_load(&count) + 1;
+      atomic_init(&entry->value, 0);
+      entry->hash = hash;
+      entry->length = length;
+      memcpy(entry->str, str, length);
+      entry->str[length] = '\0';
+      atomic_store_explicit(&slots[slot], entry, memory_order_release);
+      atomic_fetch_add(&count, 1);
+    }
+  }
+
+  pthread_mutex_unlock(&insert_lock);
+  return entry != NULL ? entry->str : NULL;
+}
+
+uint32_t intern_id(const char *interned) {
+  const intern_entry_t *entry = (const intern_entry_t *)(interned - offsetof(intern_entry_t, str));
+  return entry->id;
+}
+
+void intern_set_value(const char *interned, uint32_t value) {
+  intern_entry_t *entry = (intern_entry_t *)(interned - offsetof(intern_entry_t, str));
+  atomic_store_explicit(&entry->value, value, memory_order_release);
+}
+
+uint32_t intern_value(const char *interned) {
+  intern_entry_t *entry = (intern_entry_t *)(interned - offsetof(intern_entry_t, str));
+  return atomic_load_explicit(&entry->value, memory_order_acquire);
+}
+
+uint32_t intern_count() {
+  return atomic_load(&count);
+}
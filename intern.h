@@ -0,0 +1,64 @@
+#ifndef INTERN_HEADER
+#define INTERN_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Process-wide table of interned strings.
+ *
+ * Strings that repeat on almost every line (commands and channel names) are
+ * stored once and shared by all messages. Interned strings are never freed,
+ * and each one gets a small id, numbered from 1 in the order strings were
+ * first interned, so equal strings can be compared as integers. A string can
+ * also carry a value set by its owner, like the id of a known command.
+ *
+ * Lookups don't take any locks, inserts are serialized. The table has a fixed
+ * capacity: once it's full, intern() returns NULL and callers keep their own copy.
+ **/
+
+/**
+ * Returns the shared copy of a string, adding it to the table if needed.
+ *
+ * @param str: String to intern, doesn't need to be terminated.
+ * @param length: Length of the string.
+ *
+ * @return: Shared terminated copy, or NULL if the string is too long or the table is full.
+ **/
+const char *intern(const char *str, size_t length);
+
+/**
+ * Returns the id of an interned string.
+ *
+ * @param interned: Pointer returned by intern().
+ *
+ * @return: Id of the string, starting from 1.
+ **/
+uint32_t intern_id(const char *interned);
+
+/**
+ * Attaches a value to an interned string. Meant to be set up before the
+ * string is looked up by other threads.
+ *
+ * @param interned: Pointer returned by intern().
+ * @param value: Value to attach.
+ **/
+void intern_set_value(const char *interned, uint32_t value);
+
+/**
+ * Returns the value attached to an interned string.
+ *
+ * @param interned: Pointer returned by intern().
+ *
+ * @return: Value set with intern_set_value(), 0 if there's none.
+ **/
+uint32_t intern_value(const char *interned);
+
+/**
+ * Returns the number of interned strings.
+ *
+ * @return: Number of strings in the table.
+ **/
+uint32_t intern_count();
+
+#endif
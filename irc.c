@@ -5,10 +5,15 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "socket.h"
 #include "irc.h"
 #include "debug.h"
+#include "capture.h"
+#include "arena.h"
+#include "intern.h"
+#include "prefilter.h"
 
 #define BUFFER_SIZE 2048
 #define MESSAGE_SIZE 1024
@@ -17,11 +22,124 @@
 struct irc_t {
   int socket_fd;
   int connected;
+  capture_t *capture;
+  uint32_t capture_connection;
+  prefilter_t *prefilter;
+  irc_outbound_t outbound;
+  void *outbound_context;
+  message_arena_t *arena;
+  pthread_mutex_t send_lock;
+  int discarding;                   /* Rest of an overlong line is still to come and gets dropped. */
+  int handshake;                    /* Reply the login handshake waits for, see handshake_step_t. */
+  char *channel;                    /* Channel the handshake joins, without the '#'. */
   char buffer[BUFFER_SIZE];
 };
 
+/* Steps of the login handshake, named by the reply each waits for. */
+typedef enum {
+  HANDSHAKE_DONE = 0,               /* Over, or never started. */
+  HANDSHAKE_WELCOME,
+  HANDSHAKE_CAP,
+  HANDSHAKE_NAMES_END
+} handshake_step_t;
+
+/* Names of irc_command_id_t commands, in the same order. */
+static const char *const COMMAND_NAMES[IRC_COMMANDS] = {
+  NULL,
+  "PRIVMSG",
+  "PING",
+  "PONG",
+  "JOIN",
+  "PART",
+  "CAP",
+  "NOTICE",
+  "USERNOTICE",
+  "CLEARCHAT",
+  "CLEARMSG",
+  "ROOMSTATE",
+  "USERSTATE",
+  "GLOBALUSERSTATE",
+  "WHISPER",
+  "RECONNECT",
+  "001",
+  "366"
+};
+
+static pthread_once_t commands_once = PTHREAD_ONCE_INIT;
+
 /** Private **/
 
+/**
+ * Interns known command names with their command id as the value.
+ **/
+static void intern_commands() {
+  for (int idx = 1; idx < IRC_COMMANDS; idx++) {
+    const char *interned = intern(COMMAND_NAMES[idx], strlen(COMMAND_NAMES[idx]));
+    if (interned != NULL) {
+      intern_set_value(interned, idx);
+    }
+  }
+}
+
+/**
+ * Resolves the id of a message's command.
+ *
+ * @param message: Parsed message.
+ *
+ * @return: Id of the command, or IRC_CMD_OTHER.
+ **/
+static irc_command_id_t command_id(irc_message_t *message) {
+  if (!(message->interned & IRC_INTERNED_COMMAND)) {
+    return IRC_CMD_OTHER;
+  }
+
+  uint32_t id = intern_value(message->command);
+  return id < IRC_COMMANDS ? id : IRC_CMD_OTHER;
+}
+
+/**
+ * Removes the first line from client's buffer.
+ *
+ * @param irc: IRC client.
+ * @param cr_index: Pointer to the newline symbol ending the line.
+ */
+void shift_buffer(irc_t *irc, char *cr_index) {
+  char *ptr = irc->buffer;
+  int length = cr_index - ptr + 1;
+  int rest = BUFFER_SIZE - length;
+  memmove(ptr, ptr + length, rest);
+  memset(ptr + rest, '\0', length);
+}
+
+/**
+ * Finds the next line of the buffer the prefilter lets through, dropping the ones before it.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Pointer to the newline ending the line, or NULL if the buffer holds no complete line.
+ **/
+static char *next_line(irc_t *irc) {
+  char *cr_index;
+
+  if (irc->discarding) {
+    cr_index = strchr(irc->buffer, '\n');
+    if (cr_index == NULL) {
+      memset(irc->buffer, '\0', BUFFER_SIZE);
+      return NULL;
+    }
+    shift_buffer(irc, cr_index);
+    irc->discarding = 0;
+  }
+
+  while ((cr_index = strchr(irc->buffer, '\n')) != NULL) {
+    if (irc->prefilter == NULL || prefilter_accept(irc->prefilter, irc->buffer, cr_index - irc->buffer)) {
+      return cr_index;
+    }
+    shift_buffer(irc, cr_index);
+  }
+  return NULL;
+}
+
 /**
  * Processes client's buffer and extracts a message from it.
  *
@@ -31,15 +149,113 @@ struct irc_t {
  * @returns: Pointer to a newly allocated IRC message.
  */
 irc_message_t *process_buffer(irc_t *irc, char *cr_index) {
+  irc_message_t *message = irc_parse_message_in(irc->buffer, cr_index - irc->buffer, irc->arena);
+  shift_buffer(irc, cr_index);
+  return message;
+}
+
+/**
+ * Copies a parsed field out of the line being parsed.
+ *
+ * @param arena: Arena to allocate from, or NULL to allocate on the heap.
+ * @param token: Field contents.
+ *
+ * @return: Pointer to the copy.
+ **/
+static char *copy_field(message_arena_t *arena, const char *token) {
+  size_t length = strlen(token);
+  char *field = arena != NULL ? arena_alloc(arena, length + 1) : calloc(length + 1, sizeof(char));
+  if (field != NULL) {
+    memcpy(field, token, length);
+  }
+  return field;
+}
+
+/**
+ * Points a parsed field to the shared interned string, or copies it if it
+ * can't be interned.
+ *
+ * @param message: Message being parsed.
+ * @param arena: Arena to allocate a copy from, or NULL to allocate on the heap.
+ * @param token: Field contents.
+ * @param flag: IRC_INTERNED_* flag of the field.
+ *
+ * @return: Pointer to the field.
+ **/
+static char *intern_field(irc_message_t *message, message_arena_t *arena, const char *token, int flag) {
+  const char *shared = intern(token, strlen(token));
+  if (shared == NULL) {
+    return copy_field(arena, token);
+  }
+
+  message->interned |= flag;
+  return (char *)shared;
+}
+
+/**
+ * Frees annotations of a message, unless they live in its arena or pool block.
+ *
+ * @param message: Message.
+ **/
+static void release_annotations(irc_message_t *message) {
+  char *annotations = message->annotations;
+
+  if (annotations == NULL || message->origin == IRC_MESSAGE_ARENA) {
+    return;
+  }
+  if (message->origin == IRC_MESSAGE_POOL
+      && annotations >= (char *)message && annotations < (char *)message + MESSAGE_POOL_BLOCK) {
+    return;
+  }
+
+  free(annotations);
+}
+
+/** Public **/
+
+/**
+ * Parses a single raw IRC line into a message structure.
+ *
+ * @param line: Raw line, not including the trailing newline.
+ * @param size: Length of the line in bytes.
+ *
+ * @return: Pointer to a newly allocated IRC message.
+ **/
+irc_message_t *irc_parse_message(char *line, int size) {
+  return irc_parse_message_in(line, size, NULL);
+}
+
+/**
+ * Parses a single raw IRC line into a message allocated from an arena.
+ *
+ * @param line: Raw line, not including the trailing newline.
+ * @param size: Length of the line in bytes.
+ * @param arena: Arena to allocate from, or NULL to allocate on the heap.
+ *
+ * @return: Pointer to the parsed IRC message.
+ **/
+irc_message_t *irc_parse_message_in(char *line, int size, message_arena_t *arena) {
   char message_str[BUFFER_SIZE] = { 0 };
-  int size;
   char *token, *pointer;
 
+  pthread_once(&commands_once, intern_commands);
+
   // We got a message, let's parse.
-  irc_message_t *message = calloc(1, sizeof(struct irc_message_t));
+  // A full arena that can't grow leaves the whole message to the heap.
+  irc_message_t *message = arena != NULL ? arena_alloc_message(arena) : NULL;
+  if (message != NULL) {
+    message->origin = IRC_MESSAGE_ARENA;
+    message->arena = arena;
+  } else {
+    arena = NULL;
+    message = calloc(1, sizeof(struct irc_message_t));
+    message->origin = IRC_MESSAGE_HEAP;
+  }
 
-  size = cr_index - irc->buffer;
-  strncpy(message_str, irc->buffer, size);
+  if (size > BUFFER_SIZE - 1) {
+    size = BUFFER_SIZE - 1;
+  }
+  memcpy(message_str, line, size);
   message_str[size] = '\0';
 
   token = NULL;
@@ -48,42 +264,35 @@ irc_message_t *process_buffer(irc_t *irc, char *cr_index) {
   // Handle PING
   if (strstr(pointer, "PING") != NULL) {
      token = strsep(&pointer, " ");
-     message->command = calloc(strlen(token) + 1, sizeof(char));
-     memcpy(message->command, token, strlen(token));
+     message->command = intern_field(message, arena, token, IRC_INTERNED_COMMAND);
 
      token = strsep(&pointer, "\0");
-     message->sender = calloc(strlen(token) + 1, sizeof(char));
-     memcpy(message->sender, token, strlen(token));
+     message->sender = copy_field(arena, token);
   } else {
     // TAGS
     if (message_str[0] == '@') {
       token = strsep(&pointer, " ");
       if (token != NULL) {
-        message->tags = calloc(strlen(token) + 1, sizeof(char));
-        memcpy(message->tags, token, strlen(token));
+        message->tags = copy_field(arena, token);
       }
     }
 
-    // SENDER
+    // SENDER. Differs per chatter, interning it would fill the table with one-off logins.
     token = strsep(&pointer, " ");
     if (token != NULL) {
-      message->sender = calloc(strlen(token) + 1, sizeof(char));
-      memcpy(message->sender, token, strlen(token));
+      message->sender = copy_field(arena, token);
     }
 
     // COMMAND
     token = strsep(&pointer, " ");
     if (token != NULL) {
-      message->command = calloc(strlen(token) + 1, sizeof(char));
-      memcpy(message->command, token, strlen(token));
+      message->command = intern_field(message, arena, token, IRC_INTERNED_COMMAND);
     }
 
     // RECIPIENT
     token = strsep(&pointer, " \r");
     if (token != NULL) {
-      message->recipient = calloc(strlen(token), sizeof(char));
-      memcpy(message->recipient, token, strlen(token) - 1);
-      message->recipient[strlen(token)] = '\0';
+      message->recipient = intern_field(message, arena, token, IRC_INTERNED_RECIPIENT);
     }
 
     // MESSAGE
@@ -93,27 +302,95 @@ irc_message_t *process_buffer(irc_t *irc, char *cr_index) {
       if (trimmed[0] == ':') {
         trimmed += 1;
       }
-      message->message = calloc(strlen(trimmed) + 1, sizeof(char));
-      memcpy(message->message, trimmed, strlen(trimmed));
+      message->message = copy_field(arena, trimmed);
     }
   }
 
-  // Shift buffer.
-  char *ptr = irc->buffer;
-  int length = cr_index - ptr + 1;
-  int rest = BUFFER_SIZE - length;
-  memcpy(ptr, ptr + length, rest);
-  memset(ptr + rest, '\0', length);
-
+  message->command_id = command_id(message);
   return message;
 }
 
-/** Public **/
+/**
+ * Copies a message into a single refcounted pool block, which is independent
+ * from any arena and can be passed to other threads.
+ *
+ * @param message: Message to copy.
+ *
+ * @return: Pointer to the copy with one reference, or NULL if memory can't be allocated.
+ **/
+irc_message_t *irc_message_clone(irc_message_t *message) {
+  char *const *fields[] = {
+    &message->tags, &message->sender, &message->command, &message->recipient, &message->message,
+    &message->annotations
+  };
+  int flags[6] = { 0, 0, IRC_INTERNED_COMMAND, IRC_INTERNED_RECIPIENT, 0, 0 };
+  size_t lengths[6], total = sizeof(irc_message_t);
+  for (int idx = 0; idx < 6; idx++) {
+    if (message->interned & flags[idx]) {
+      continue;
+    }
+    lengths[idx] = *fields[idx] != NULL ? strlen(*fields[idx]) : 0;
+    total += lengths[idx] + 1;
+  }
+
+  // Parsed lines are capped at BUFFER_SIZE, so this only trips on hand-built messages.
+  if (total > MESSAGE_POOL_BLOCK) {
+    return NULL;
+  }
+
+  irc_message_t *copy = message_pool_get();
+  if (copy == NULL) {
+    return NULL;
+  }
+  memset(copy, 0, sizeof(irc_message_t));
+  copy->origin = IRC_MESSAGE_POOL;
+  copy->command_id = message->command_id;
+  copy->interned = message->interned;
+  atomic_init(&copy->refs, 1);
+
+  char **copy_fields[] = {
+    &copy->tags, &copy->sender, &copy->command, &copy->recipient, &copy->message, &copy->annotations
+  };
+  char *data = (char *)(copy + 1);
+  for (int idx = 0; idx < 6; idx++) {
+    // Interned strings are shared as they are.
+    if (message->interned & flags[idx]) {
+      *copy_fields[idx] = *fields[idx];
+      continue;
+    }
+    if (*fields[idx] == NULL) {
+      continue;
+    }
+    memcpy(data, *fields[idx], lengths[idx] + 1);
+    *copy_fields[idx] = data;
+    data += lengths[idx] + 1;
+  }
+
+  return copy;
+}
+
+/**
+ * Takes another reference to a message. Arena and heap messages are cloned,
+ * since they can't be shared.
+ *
+ * @param message: Message to reference.
+ *
+ * @return: Message to release with irc_message_free once done.
+ **/
+irc_message_t *irc_message_ref(irc_message_t *message) {
+  if (message->origin != IRC_MESSAGE_POOL) {
+    return irc_message_clone(message);
+  }
+
+  atomic_fetch_add_explicit(&message->refs, 1, memory_order_relaxed);
+  return message;
+}
 
 /**
  * Creates a new IRC client instance.
  *
- * @param connection: Socket file descriptor.
+ * @param connection: Socket file descriptor, or -1 for an offline client that
+ * is only fed through irc_feed() and drops outgoing commands.
  *
  * @return: A new client instance.
  **/
@@ -121,6 +398,7 @@ irc_t *irc_init(int connection) {
   struct irc_t *irc = calloc(1, sizeof(irc_t));
   irc->socket_fd = connection;
   irc->connected = 1;
+  pthread_mutex_init(&irc->send_lock, NULL);
   return irc;
 }
 
@@ -156,7 +434,20 @@ int irc_command(irc_t *irc, const char *fmt, ...) {
   *outp++ = '\r';
   *outp++ = '\n';
 
+  if (irc->outbound != NULL) {
+    return irc->outbound(irc->outbound_context, outb, n + 2);
+  }
+
+  // Offline clients (e.g. replaying a capture) have nowhere to send to.
+  if (irc->socket_fd < 0) {
+    LOG(LOG_LEVEL_DEBUG, "DEBUG: offline, dropping command: %.*s", n + 2, outb);
+    return n + 2;
+  }
+
+  // Commands can come from several threads in pipeline mode.
+  pthread_mutex_lock(&irc->send_lock);
   int sent = sock_send(irc->socket_fd, outb, n + 2);
+  pthread_mutex_unlock(&irc->send_lock);
   if (sent > 0) {
     return sent;
   } else {
@@ -166,7 +457,14 @@ int irc_command(irc_t *irc, const char *fmt, ...) {
 }
 
 int irc_send_literal(irc_t *irc, char *str) {
-  return sock_send(irc->socket_fd, str, strlen(str));
+  if (irc->outbound != NULL) {
+    return irc->outbound(irc->outbound_context, str, strlen(str));
+  }
+
+  pthread_mutex_lock(&irc->send_lock);
+  int sent = sock_send(irc->socket_fd, str, strlen(str));
+  pthread_mutex_unlock(&irc->send_lock);
+  return sent;
 }
 
 irc_message_t *irc_wait_for_next_message(irc_t *irc) {
@@ -184,13 +482,98 @@ irc_message_t *irc_wait_for_next_message(irc_t *irc) {
     }
 
     int current_size = strlen(irc->buffer);
-    sock_block_receive(irc->socket_fd, irc->buffer+current_size, BUFFER_SIZE - current_size - 1);
+    int readbytes = sock_block_receive(irc->socket_fd, irc->buffer+current_size, BUFFER_SIZE - current_size - 1);
+    if (readbytes <= 0) {
+      // Closed by the server, a timeout or a line that doesn't fit, none of them gets better by waiting.
+      irc->connected = 0;
+      return NULL;
+    }
+    if (irc->capture != NULL) {
+      capture_write(irc->capture, irc->capture_connection, irc->buffer+current_size, readbytes);
+    }
     cr_index = strchr(irc->buffer, '\n');
   }
 
   return process_buffer(irc, cr_index);
 }
 
+/**
+ * Starts logging in and joining a channel, without waiting for the replies.
+ *
+ * @param irc: IRC client.
+ * @param user: Login.
+ * @param password: OAuth token, with the "oauth:" prefix.
+ * @param channel: Channel to join, without the '#'.
+ *
+ * @return: 0 on success, -1 if the commands can't be sent.
+ **/
+int irc_start_handshake(irc_t *irc, const char *user, const char *password, const char *channel) {
+  free(irc->channel);
+  irc->channel = strdup(channel);
+  if (irc->channel == NULL) {
+    return -1;
+  }
+
+  // Replies are waited for one at a time, the next command goes out with irc_handshake().
+  if (irc_command(irc, "PASS %s", password) == -1
+      || irc_command(irc, "NICK %s", user) == -1
+      || irc_command(irc, "USER %s", user) == -1) {
+    return -1;
+  }
+
+  LOG(LOG_LEVEL_DEBUG, "DEBUG: Waiting for RPL_WELCOME\n");
+  irc->handshake = HANDSHAKE_WELCOME;
+  return 0;
+}
+
+/**
+ * Reads what the socket has without blocking and moves the handshake along.
+ * Lines after the end of the handshake stay in the buffer.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: 1 once the channel is joined, 0 while replies are pending, -1 if
+ * the server refused the login or the connection is lost.
+ **/
+int irc_handshake(irc_t *irc) {
+  irc_message_t *message;
+  int result = 0;
+
+  if (irc->handshake == HANDSHAKE_DONE) {
+    return 1;
+  }
+  if (irc_receive(irc) < 0) {
+    return -1;
+  }
+
+  while (result == 0 && irc->handshake != HANDSHAKE_DONE && (message = irc_pop_message(irc)) != NULL) {
+    if (message->command_id == IRC_CMD_PING) {
+      result = irc_command(irc, "PONG :%s", message->message != NULL ? message->message : "tmi.twitch.tv") == -1 ? -1 : 0;
+    } else if (message->command_id == IRC_CMD_NOTICE && irc->handshake == HANDSHAKE_WELCOME) {
+      // Twitch explains a refused login ("Login authentication failed") and hangs up.
+      LOG(LOG_LEVEL_ERROR, "Login refused: %s\n", message->message != NULL ? message->message : "");
+      result = -1;
+    } else if (message->command_id == IRC_CMD_WELCOME && irc->handshake == HANDSHAKE_WELCOME) {
+      LOG(LOG_LEVEL_DEBUG, "DEBUG: Sending CAPs\n");
+      irc->handshake = HANDSHAKE_CAP;
+      result = irc_command(irc, "CAP REQ :twitch.tv/tags twitch.tv/commands") == -1 ? -1 : 0;
+    } else if (message->command_id == IRC_CMD_CAP && irc->handshake == HANDSHAKE_CAP) {
+      LOG(LOG_LEVEL_DEBUG, "DEBUG: Joining the channel #%s\n", irc->channel);
+      irc->handshake = HANDSHAKE_NAMES_END;
+      result = irc_command(irc, "JOIN #%s", irc->channel) == -1 ? -1 : 0;
+    } else if (message->command_id == IRC_CMD_NAMES_END && irc->handshake == HANDSHAKE_NAMES_END) {
+      irc->handshake = HANDSHAKE_DONE;
+    }
+    irc_message_free(message);
+  }
+
+  if (result == -1) {
+    irc->connected = 0;
+    return -1;
+  }
+  return irc->handshake == HANDSHAKE_DONE ? 1 : 0;
+}
+
 /**
  * Reads new data from IRC connection and checks if there's a new message ready in the buffer.
  *
@@ -199,27 +582,270 @@ irc_message_t *irc_wait_for_next_message(irc_t *irc) {
  * @return: Pointer to a new message, or NULL if there's no message yet.
  */
 irc_message_t *irc_next_message(irc_t *irc) {
-  char *cr_index;
+  if (irc_receive(irc) >= 0) {
+    LOG(LOG_LEVEL_DEBUG, "DEBUG: buffer contents: %s\n", irc->buffer);
+    return irc_pop_message(irc);
+  }
 
+  return NULL;
+}
+
+/**
+ * Reads whatever data is available in the socket into the client's buffer without blocking.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Number of bytes read, 0 if there was nothing to read, -1 if connection is lost.
+ **/
+int irc_receive(irc_t *irc) {
   int current_size = strlen(irc->buffer);
-  int readbytes = sock_receive(irc->socket_fd, irc->buffer+current_size, BUFFER_SIZE - current_size - 1);
+  int space = BUFFER_SIZE - current_size - 1;
+
+  // A full buffer without a newline would never be read from again.
+  if (space == 0 && strchr(irc->buffer, '\n') == NULL) {
+    LOG(LOG_LEVEL_ERROR, "Dropping a line longer than %d bytes\n", BUFFER_SIZE - 1);
+    irc_discard_partial(irc);
+    current_size = 0;
+    space = BUFFER_SIZE - 1;
+  }
 
-  if (readbytes >= 0 || (readbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
-    LOG(LOG_LEVEL_DEBUG, "DEBUG: buffer contents: %s\n", irc->buffer);
-    // Commands are delimited by newline symbol.
-    cr_index = strchr(irc->buffer, '\n');
+  int readbytes = sock_receive(irc->socket_fd, irc->buffer+current_size, space);
 
-    if (cr_index == NULL) {
-      return NULL;
+  if (readbytes > 0) {
+    if (irc->capture != NULL) {
+      capture_write(irc->capture, irc->capture_connection, irc->buffer+current_size, readbytes);
     }
+    return readbytes;
+  } else if (readbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  } else if (readbytes == 0 && space == 0) {
+    return 0;
+  }
 
-    return process_buffer(irc, cr_index);
-  } else if (readbytes == -1) {
-    LOG(LOG_LEVEL_DEBUG, "DEBUG: disconnected\n");
-    irc->connected = 0;
+  // Either an error, or an orderly shutdown from the server.
+  LOG(LOG_LEVEL_DEBUG, "DEBUG: disconnected\n");
+  irc->connected = 0;
+  return -1;
+}
+
+/**
+ * Extracts the next complete raw line from the client's buffer, if there is one.
+ *
+ * @param irc: IRC client.
+ * @param line: Buffer to copy the line into, without the trailing newline.
+ * @param size: Size of the line buffer. Longer lines are truncated.
+ *
+ * @return: Length of the line, or -1 if the buffer holds no complete line.
+ **/
+int irc_pop_line(irc_t *irc, char *line, int size) {
+  char *cr_index = next_line(irc);
+  if (cr_index == NULL) {
+    return -1;
   }
 
-  return NULL;
+  int length = cr_index - irc->buffer;
+  if (length > size) {
+    length = size;
+  }
+  memcpy(line, irc->buffer, length);
+  shift_buffer(irc, cr_index);
+  return length;
+}
+
+/**
+ * Drops the incomplete line held in the client's buffer, and the rest of it
+ * up to the next newline once it arrives.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Number of bytes dropped from the buffer.
+ **/
+int irc_discard_partial(irc_t *irc) {
+  // Reads don't terminate what they append, the buffer relies on being zeroed past its contents.
+  int dropped = strlen(irc->buffer);
+  memset(irc->buffer, '\0', BUFFER_SIZE);
+  irc->discarding = 1;
+  return dropped;
+}
+
+/**
+ * Appends raw data to the client's buffer without touching the socket.
+ *
+ * @param irc: IRC client.
+ * @param data: Raw IRC data.
+ * @param size: Size of the data.
+ *
+ * @return: Number of bytes actually appended. Can be less than size if the buffer is full.
+ **/
+int irc_feed(irc_t *irc, const char *data, int size) {
+  int current_size = strlen(irc->buffer);
+  int space = BUFFER_SIZE - current_size - 1;
+  if (size > space) {
+    size = space;
+  }
+
+  memcpy(irc->buffer + current_size, data, size);
+  irc->buffer[current_size + size] = '\0';
+  return size;
+}
+
+/**
+ * Extracts the next complete message from the client's buffer, if there is one.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Pointer to a new message, or NULL if the buffer holds no complete line.
+ **/
+irc_message_t *irc_pop_message(irc_t *irc) {
+  // Commands are delimited by newline symbol.
+  char *cr_index = next_line(irc);
+  if (cr_index == NULL) {
+    return NULL;
+  }
+
+  return process_buffer(irc, cr_index);
+}
+
+/**
+ * Makes messages popped from the client come from a per-connection arena.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: 0 on success, -1 if the arena can't be allocated.
+ **/
+int irc_use_arena(irc_t *irc) {
+  if (irc->arena == NULL) {
+    irc->arena = arena_init();
+  }
+  return irc->arena != NULL ? 0 : -1;
+}
+
+/**
+ * Releases all arena messages popped from the client since the last reset.
+ *
+ * @param irc: IRC client.
+ **/
+void irc_reset_arena(irc_t *irc) {
+  if (irc->arena != NULL) {
+    arena_reset(irc->arena);
+  }
+}
+
+/**
+ * Attaches a note to the message that outputs include next to the message fields.
+ *
+ * @param message: Message to annotate.
+ * @param key: Note name.
+ * @param value: Note value. ';' and '=' are replaced with spaces.
+ *
+ * @return: 0 on success, -1 if memory can't be allocated.
+ **/
+int irc_message_annotate(irc_message_t *message, const char *key, const char *value) {
+  size_t old_length = message->annotations != NULL ? strlen(message->annotations) : 0;
+  size_t key_length = strlen(key), value_length = strlen(value);
+  size_t size = old_length + 1 + key_length + 1 + value_length + 1;
+
+  char *annotations = message->origin == IRC_MESSAGE_ARENA ? arena_alloc(message->arena, size) : malloc(size);
+  if (annotations == NULL) {
+    return -1;
+  }
+
+  char *pointer = annotations;
+  if (old_length > 0) {
+    memcpy(pointer, message->annotations, old_length);
+    pointer += old_length;
+    *pointer++ = ';';
+  }
+  memcpy(pointer, key, key_length);
+  pointer += key_length;
+  *pointer++ = '=';
+  for (size_t idx = 0; idx < value_length; idx++) {
+    *pointer++ = value[idx] == ';' || value[idx] == '=' ? ' ' : value[idx];
+  }
+  *pointer = '\0';
+
+  release_annotations(message);
+  message->annotations = annotations;
+  return 0;
+}
+
+/**
+ * Returns data derived from the message, building it on the first call.
+ *
+ * @param message: Message.
+ * @param size: Number of bytes to allocate on the first call.
+ * @param fill: Builds the data into the allocated memory.
+ *
+ * @return: Cached data, or NULL if memory can't be allocated.
+ **/
+void *irc_message_cache(irc_message_t *message, size_t size, void (*fill)(irc_message_t *message, void *data)) {
+  void *cached = atomic_load_explicit(&message->cache, memory_order_acquire);
+  if (cached != NULL) {
+    return cached;
+  }
+
+  void *data = message->origin == IRC_MESSAGE_ARENA ? arena_alloc(message->arena, size) : malloc(size);
+  if (data == NULL) {
+    return NULL;
+  }
+  fill(message, data);
+
+  // A pooled message can be shared between threads, the first one to finish wins.
+  if (!atomic_compare_exchange_strong_explicit(&message->cache, &cached, data, memory_order_acq_rel, memory_order_acquire)) {
+    if (message->origin != IRC_MESSAGE_ARENA) {
+      free(data);
+    }
+    return cached;
+  }
+
+  return data;
+}
+
+/**
+ * Makes the client drop raw lines the classifier rejects, before they're parsed.
+ *
+ * @param irc: IRC client.
+ * @param prefilter: Classifier, or NULL to parse every line. Not owned by the client.
+ **/
+void irc_set_prefilter(irc_t *irc, prefilter_t *prefilter) {
+  irc->prefilter = prefilter;
+}
+
+/**
+ * Hands everything sent through the client to a function instead of the socket.
+ *
+ * @param irc: IRC client.
+ * @param outbound: Function taking raw outgoing lines, or NULL to use the socket again.
+ * @param context: Passed to the function.
+ **/
+void irc_set_outbound(irc_t *irc, irc_outbound_t outbound, void *context) {
+  irc->outbound = outbound;
+  irc->outbound_context = context;
+}
+
+/**
+ * Returns the name of a known command.
+ *
+ * @param id: Command id.
+ *
+ * @return: Static string, or NULL for IRC_CMD_OTHER.
+ **/
+const char *irc_command_name(irc_command_id_t id) {
+  return id > IRC_CMD_OTHER && id < IRC_COMMANDS ? COMMAND_NAMES[id] : NULL;
+}
+
+/**
+ * Starts recording raw data received by the client into a capture segment, as
+ * a new connection.
+ *
+ * @param irc: IRC client.
+ * @param capture: Capture writer, or NULL to stop recording. Not owned by the client.
+ **/
+void irc_set_capture(irc_t *irc, capture_t *capture) {
+  if (capture != NULL) {
+    irc->capture_connection = capture_start(capture);
+  }
+  irc->capture = capture;
 }
 
 /**
@@ -229,6 +855,9 @@ irc_message_t *irc_next_message(irc_t *irc) {
  **/
 void irc_free(irc_t *irc) {
   close(irc->socket_fd);
+  free(irc->channel);
+  pthread_mutex_destroy(&irc->send_lock);
+  arena_free(irc->arena);
   free(irc);
 }
 
@@ -248,15 +877,33 @@ int irc_get_fd(irc_t *irc) {
 }
 
 /**
- * Deallocates message structure.
+ * Deallocates message structure. Drops a reference for pooled messages, and
+ * does nothing for arena ones.
  *
  * @param message: Message to deallocate.
  **/
 void irc_message_free(irc_message_t *message) {
+  // Arena messages go away all at once when the arena is reset.
+  if (message->origin == IRC_MESSAGE_ARENA) {
+    return;
+  }
+
+  // Pooled messages are a single block holding the fields too.
+  if (message->origin == IRC_MESSAGE_POOL) {
+    if (atomic_fetch_sub_explicit(&message->refs, 1, memory_order_acq_rel) == 1) {
+      free(atomic_load(&message->cache));
+      release_annotations(message);
+      message_pool_put(message);
+    }
+    return;
+  }
+
   if (message->sender != NULL) { free(message->sender); }
-  if (message->command != NULL) { free(message->command); }
-  if (message->recipient != NULL) { free(message->recipient); }
+  if (message->command != NULL && !(message->interned & IRC_INTERNED_COMMAND)) { free(message->command); }
+  if (message->recipient != NULL && !(message->interned & IRC_INTERNED_RECIPIENT)) { free(message->recipient); }
   if (message->message != NULL) { free(message->message); }
   if (message->tags != NULL) { free(message->tags); }
+  free(atomic_load(&message->cache));
+  release_annotations(message);
   free(message);
 }
@@ -1,9 +1,54 @@
 #ifndef IRC_HEADER
 #define IRC_HEADER
 
+#include <stdatomic.h>
+
+#include "capture.h"
+#include "arena.h"
+
 /* IRC client instance */
 typedef struct irc_t irc_t;
 
+/* Raw line classifier, see prefilter.h. */
+typedef struct prefilter_t prefilter_t;
+
+/* Takes outgoing data in place of the socket, see irc_set_outbound(). Returns bytes taken, or -1. */
+typedef int (*irc_outbound_t)(void *context, const char *data, int size);
+
+/* Where the memory of a message comes from. */
+typedef enum {
+  IRC_MESSAGE_HEAP = 0,   /* Separate heap allocations, freed by irc_message_free. */
+  IRC_MESSAGE_ARENA,      /* Client's arena, valid until irc_reset_arena. */
+  IRC_MESSAGE_POOL        /* Refcounted pool block, released by the last irc_message_free. */
+} irc_message_origin_t;
+
+/* Commands the relay looks at, so they can be checked without comparing strings. */
+typedef enum {
+  IRC_CMD_OTHER = 0,
+  IRC_CMD_PRIVMSG,
+  IRC_CMD_PING,
+  IRC_CMD_PONG,
+  IRC_CMD_JOIN,
+  IRC_CMD_PART,
+  IRC_CMD_CAP,
+  IRC_CMD_NOTICE,
+  IRC_CMD_USERNOTICE,
+  IRC_CMD_CLEARCHAT,
+  IRC_CMD_CLEARMSG,
+  IRC_CMD_ROOMSTATE,
+  IRC_CMD_USERSTATE,
+  IRC_CMD_GLOBALUSERSTATE,
+  IRC_CMD_WHISPER,
+  IRC_CMD_RECONNECT,
+  IRC_CMD_WELCOME,          /* 001 */
+  IRC_CMD_NAMES_END,        /* 366 */
+  IRC_COMMANDS
+} irc_command_id_t;
+
+/* Message fields pointing to shared interned strings, see intern.h. */
+#define IRC_INTERNED_COMMAND 2
+#define IRC_INTERNED_RECIPIENT 4
+
 /* IRC message data structure */
 typedef struct irc_message_t {
   char *tags;
@@ -11,12 +56,20 @@ typedef struct irc_message_t {
   char *command;
   char *recipient;
   char *message;
+  char *annotations;        /* Relay's own "key=value;..." notes, see irc_message_annotate(). */
+  irc_command_id_t command_id;
+  int interned;             /* IRC_INTERNED_* flags of fields that must not be freed. */
+  irc_message_origin_t origin;
+  atomic_int refs;
+  message_arena_t *arena;   /* Owning arena of IRC_MESSAGE_ARENA messages. */
+  void *_Atomic cache;      /* Data decoded from the message on demand, see irc_message_cache(). */
 } irc_message_t;
 
 /**
  * Creates a new IRC client instance.
  *
- * @param connection: Socket file descriptor.
+ * @param connection: Socket file descriptor, or -1 for an offline client that
+ * is only fed through irc_feed() and drops outgoing commands.
  *
  * @return: A new client instance.
  **/
@@ -57,10 +110,34 @@ int irc_send_literal(irc_t *irc, char *str);
  *
  * @param irc: IRC client.
  *
- * @return: Pointer to a new message, or NULL in case of an error.
+ * @return: Pointer to a new message, or NULL in case of an error or if the connection is lost.
  */
 irc_message_t *irc_wait_for_next_message(irc_t *irc);
 
+/**
+ * Starts logging in and joining a channel, without waiting for the replies.
+ * Drive the rest of it with irc_handshake() whenever the socket is readable.
+ *
+ * @param irc: IRC client.
+ * @param user: Login.
+ * @param password: OAuth token, with the "oauth:" prefix.
+ * @param channel: Channel to join, without the '#'.
+ *
+ * @return: 0 on success, -1 if the commands can't be sent.
+ **/
+int irc_start_handshake(irc_t *irc, const char *user, const char *password, const char *channel);
+
+/**
+ * Reads what the socket has without blocking and moves the handshake along.
+ * Lines after the end of the handshake stay in the buffer.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: 1 once the channel is joined, 0 while replies are pending, -1 if
+ * the server refused the login or the connection is lost.
+ **/
+int irc_handshake(irc_t *irc);
+
 /**
  * Reads new data from IRC connection and checks if there's a new message ready in the buffer.
  *
@@ -70,6 +147,186 @@ irc_message_t *irc_wait_for_next_message(irc_t *irc);
  */
 irc_message_t *irc_next_message(irc_t *irc);
 
+/**
+ * Reads whatever data is available in the socket into the client's buffer without blocking.
+ * A line that doesn't fit into the buffer is dropped.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Number of bytes read, 0 if there was nothing to read, -1 if connection is lost.
+ **/
+int irc_receive(irc_t *irc);
+
+/**
+ * Extracts the next complete raw line from the client's buffer, if there is one.
+ *
+ * @param irc: IRC client.
+ * @param line: Buffer to copy the line into, without the trailing newline.
+ * @param size: Size of the line buffer. Longer lines are truncated.
+ *
+ * @return: Length of the line, or -1 if the buffer holds no complete line.
+ **/
+int irc_pop_line(irc_t *irc, char *line, int size);
+
+/**
+ * Appends raw data to the client's buffer without touching the socket.
+ *
+ * @param irc: IRC client.
+ * @param data: Raw IRC data.
+ * @param size: Size of the data.
+ *
+ * @return: Number of bytes actually appended. Can be less than size if the buffer is full.
+ **/
+int irc_feed(irc_t *irc, const char *data, int size);
+
+/**
+ * Drops the incomplete line held in the client's buffer, and the rest of it
+ * up to the next newline once it arrives. Use it when the buffer is full
+ * without a complete line.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Number of bytes dropped from the buffer.
+ **/
+int irc_discard_partial(irc_t *irc);
+
+/**
+ * Extracts the next complete message from the client's buffer, if there is one.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: Pointer to a new message, or NULL if the buffer holds no complete line.
+ **/
+irc_message_t *irc_pop_message(irc_t *irc);
+
+/**
+ * Parses a single raw IRC line into a message structure.
+ *
+ * @param line: Raw line, not including the trailing newline.
+ * @param size: Length of the line in bytes.
+ *
+ * @return: Pointer to a newly allocated IRC message.
+ **/
+irc_message_t *irc_parse_message(char *line, int size);
+
+/**
+ * Parses a single raw IRC line into a message allocated from an arena.
+ * Command and recipient point to shared interned strings when possible, see
+ * intern.h.
+ *
+ * @param line: Raw line, not including the trailing newline.
+ * @param size: Length of the line in bytes.
+ * @param arena: Arena to allocate from, or NULL to allocate on the heap.
+ *
+ * @return: Pointer to the parsed IRC message.
+ **/
+irc_message_t *irc_parse_message_in(char *line, int size, message_arena_t *arena);
+
+/**
+ * Makes messages popped from the client come from a per-connection arena.
+ * Such messages stay valid until irc_reset_arena() is called, and
+ * irc_message_free() is a no-op for them. Use irc_message_clone() to keep a
+ * message for longer.
+ *
+ * @param irc: IRC client.
+ *
+ * @return: 0 on success, -1 if the arena can't be allocated.
+ **/
+int irc_use_arena(irc_t *irc);
+
+/**
+ * Releases all arena messages popped from the client since the last reset.
+ * Does nothing if the client doesn't use an arena.
+ *
+ * @param irc: IRC client.
+ **/
+void irc_reset_arena(irc_t *irc);
+
+/**
+ * Copies a message into a single refcounted pool block, which is independent
+ * from any arena and can be passed to other threads. Interned fields are
+ * shared instead of copied.
+ *
+ * @param message: Message to copy.
+ *
+ * @return: Pointer to the copy with one reference, or NULL if memory can't be allocated.
+ **/
+irc_message_t *irc_message_clone(irc_message_t *message);
+
+/**
+ * Takes another reference to a message. Arena and heap messages are cloned,
+ * since they can't be shared.
+ *
+ * @param message: Message to reference.
+ *
+ * @return: Message to release with irc_message_free once done.
+ **/
+irc_message_t *irc_message_ref(irc_message_t *message);
+
+/**
+ * Attaches a note to the message, e.g. a filter verdict, that outputs include
+ * next to the message fields. The memory comes from the same place as the
+ * message's own.
+ *
+ * @param message: Message to annotate.
+ * @param key: Note name.
+ * @param value: Note value. ';' and '=' are replaced with spaces.
+ *
+ * @return: 0 on success, -1 if memory can't be allocated.
+ **/
+int irc_message_annotate(irc_message_t *message, const char *key, const char *value);
+
+/**
+ * Returns data derived from the message, building it on the first call. The
+ * data lives as long as the message and is allocated together with it: from
+ * the same arena for arena messages, or on the heap otherwise. Only one kind
+ * of data can be cached per message.
+ *
+ * @param message: Message.
+ * @param size: Number of bytes to allocate on the first call.
+ * @param fill: Builds the data into the allocated memory.
+ *
+ * @return: Cached data, or NULL if memory can't be allocated.
+ **/
+void *irc_message_cache(irc_message_t *message, size_t size, void (*fill)(irc_message_t *message, void *data));
+
+/**
+ * Makes the client drop raw lines the classifier rejects, before they're
+ * parsed. Applies to irc_pop_message() and irc_pop_line().
+ *
+ * @param irc: IRC client.
+ * @param prefilter: Classifier, or NULL to parse every line. Not owned by the client.
+ **/
+void irc_set_prefilter(irc_t *irc, prefilter_t *prefilter);
+
+/**
+ * Hands everything sent through the client to a function instead of the
+ * socket, e.g. to spread commands over several connections.
+ *
+ * @param irc: IRC client.
+ * @param outbound: Function taking raw outgoing lines, or NULL to use the socket again.
+ * @param context: Passed to the function.
+ **/
+void irc_set_outbound(irc_t *irc, irc_outbound_t outbound, void *context);
+
+/**
+ * Returns the name of a known command.
+ *
+ * @param id: Command id.
+ *
+ * @return: Static string, or NULL for IRC_CMD_OTHER.
+ **/
+const char *irc_command_name(irc_command_id_t id);
+
+/**
+ * Starts recording raw data received by the client into a capture segment, as
+ * a new connection.
+ *
+ * @param irc: IRC client.
+ * @param capture: Capture writer, or NULL to stop recording. Not owned by the client.
+ **/
+void irc_set_capture(irc_t *irc, capture_t *capture);
+
 /**
  * Disconnects the IRC client and frees the memory occupied by it.
  *
@@ -78,7 +335,8 @@ irc_message_t *irc_next_message(irc_t *irc);
 void irc_free(irc_t *irc);
 
 /**
- * Deallocates message structure.
+ * Deallocates message structure. Drops a reference for pooled messages, and
+ * does nothing for arena ones.
  *
  * @param message: Message to deallocate.
  **/
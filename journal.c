@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "utils.h"
+
+/* Max number of segments looked at when picking one to read or delete. */
+#define JOURNAL_MAX_SEGMENTS 4096
+
+/* How often the writer looks for segments past their age. */
+#define JOURNAL_RETENTION_CHECK_MS 60000
+
+/* Records start at 8-byte boundaries, so their size can be stored atomically. */
+#define JOURNAL_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+struct journal_t {
+  char dir[PATH_MAX];
+  journal_config_t config;
+  int fd;
+  char *data;
+  size_t size;
+  size_t offset;                    /* Where the next record goes. */
+  size_t synced;                    /* Records before this offset were handed to msync(). */
+  uint64_t next_seq;
+  int64_t retained_at;
+};
+
+/* Read-only mapping of a segment. */
+typedef struct {
+  char *data;
+  size_t size;
+} mapping_t;
+
+struct journal_reader_t {
+  char dir[PATH_MAX];
+  char cursor_path[PATH_MAX];
+  char *data;                       /* Current segment, NULL until there is one. */
+  size_t size;
+  size_t offset;
+  mapping_t *retired;               /* Segments read past, their entries are valid until the next commit. */
+  int retired_count;
+  int retired_capacity;
+  uint64_t first;                   /* First sequence number of the current segment. */
+  uint64_t next_seq;                /* Next record to return, 0 for the oldest one there is. */
+  uint64_t skipped;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/** Private **/
+
+static void crc_init() {
+  for (uint32_t idx = 0; idx < 256; idx++) {
+    uint32_t crc = idx;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    crc_table[idx] = crc;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t idx = 0; idx < size; idx++) {
+    crc = crc_table[(crc ^ bytes[idx]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+/**
+ * Checksum of a record: seq and timestamp from the header, then the data.
+ **/
+static uint32_t record_crc(journal_record_t *record, const char *data, size_t size) {
+  pthread_once(&crc_once, crc_init);
+
+  uint32_t crc = crc_update(0xFFFFFFFF, &record->seq, sizeof(record->seq) + sizeof(record->timestamp));
+  return crc_update(crc, data, size) ^ 0xFFFFFFFF;
+}
+
+static int64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int segment_filter(const struct dirent *entry) {
+  size_t length = strlen(entry->d_name);
+  return length > 4 && strcmp(entry->d_name + length - 4, ".jnl") == 0;
+}
+
+/**
+ * Lists segments, oldest first.
+ *
+ * @param dir: Journal directory.
+ * @param firsts: Array to hold first sequence numbers of the segments.
+ * @param max: Size of the array. The newest segments are kept if there are more.
+ *
+ * @return: Number of segments, or -1 in case of an error.
+ **/
+static int list_segments(const char *dir, uint64_t *firsts, int max) {
+  struct dirent **entries;
+
+  // Names are zero-padded, so sorting them sorts the sequence numbers.
+  int count = scandir(dir, &entries, segment_filter, alphasort);
+  if (count < 0) {
+    return -1;
+  }
+
+  int listed = 0;
+  for (int idx = 0; idx < count; idx++) {
+    if (idx >= count - max) {
+      firsts[listed++] = strtoull(entries[idx]->d_name, NULL, 10);
+    }
+    free(entries[idx]);
+  }
+  free(entries);
+  return listed;
+}
+
+static void segment_path(const char *dir, uint64_t first, char *path, size_t size) {
+  snprintf(path, size, "%s/%020llu.jnl", dir, (unsigned long long)first);
+}
+
+/**
+ * Reads the record header at given offset of a segment, checking that the
+ * record is complete and intact.
+ *
+ * @return: 1 for a valid record, 0 if nothing was written there yet,
+ *   JOURNAL_END at the end of the segment, -1 for a damaged record.
+ **/
+static int64_t check_record(const char *data, size_t size, size_t offset, journal_record_t *record) {
+  if (offset + sizeof(journal_record_t) > size) {
+    return JOURNAL_END;
+  }
+
+  // Size is stored last, once it's there the rest of the record is too.
+  uint32_t record_size = __atomic_load_n((uint32_t *)(data + offset), __ATOMIC_ACQUIRE);
+  if (record_size == 0 || record_size == JOURNAL_END) {
+    return record_size;
+  }
+  memcpy(record, data + offset, sizeof(journal_record_t));
+  record->size = record_size;
+
+  const char *payload = data + offset + sizeof(journal_record_t);
+  if (offset + sizeof(journal_record_t) + record->size > size || record_crc(record, payload, record->size) != record->crc) {
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * Deletes the oldest segments while they take more than the size limit or
+ * are past their age. The current segment is always kept.
+ **/
+static void apply_retention(journal_t *journal) {
+  uint64_t firsts[JOURNAL_MAX_SEGMENTS];
+  char path[PATH_MAX + 32];
+  struct stat st;
+  uint64_t total = 0;
+
+  if (journal->config.max_size == 0 && journal->config.max_age == 0) {
+    return;
+  }
+
+  int count = list_segments(journal->dir, firsts, JOURNAL_MAX_SEGMENTS);
+  for (int idx = 0; idx < count; idx++) {
+    segment_path(journal->dir, firsts[idx], path, sizeof(path));
+    if (stat(path, &st) == 0) {
+      // Segments are sparse until filled, count what they take on disk.
+      total += (uint64_t)st.st_blocks * 512;
+    }
+  }
+
+  time_t oldest = time(NULL) - journal->config.max_age;
+  for (int idx = 0; idx < count - 1; idx++) {
+    segment_path(journal->dir, firsts[idx], path, sizeof(path));
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+
+    int too_big = journal->config.max_size > 0 && total > journal->config.max_size;
+    int too_old = journal->config.max_age > 0 && st.st_mtime < oldest;
+    if (!too_big && !too_old) {
+      break;
+    }
+    if (unlink(path) == 0) {
+      total -= (uint64_t)st.st_blocks * 512;
+    }
+  }
+}
+
+static int segment_create(journal_t *journal) {
+  char path[PATH_MAX + 32];
+
+  segment_path(journal->dir, journal->next_seq, path, sizeof(path));
+  journal->fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (journal->fd == -1) {
+    return -1;
+  }
+  if (ftruncate(journal->fd, journal->config.segment_size) != 0) {
+    close(journal->fd);
+    return -1;
+  }
+
+  journal->data = mmap(NULL, journal->config.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  if (journal->data == MAP_FAILED) {
+    journal->data = NULL;
+    close(journal->fd);
+    return -1;
+  }
+  journal->size = journal->config.segment_size;
+
+  memcpy(journal->data, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+  journal->offset = strlen(JOURNAL_MAGIC);
+  journal->synced = 0;
+  return 0;
+}
+
+/**
+ * Marks the end of the current segment, writes it to disk and unmaps it.
+ **/
+static void segment_close(journal_t *journal) {
+  if (journal->data == NULL) {
+    return;
+  }
+
+  if (journal->offset + sizeof(journal_record_t) <= journal->size) {
+    __atomic_store_n((uint32_t *)(journal->data + journal->offset), JOURNAL_END, __ATOMIC_RELEASE);
+  }
+  msync(journal->data, journal->size, MS_SYNC);
+  munmap(journal->data, journal->size);
+  close(journal->fd);
+  journal->data = NULL;
+}
+
+/**
+ * Finds the end of the last segment after a restart. A damaged record and
+ * everything after it is cleared.
+ *
+ * @return: 1 if the segment can take more records, 0 if it was closed, -1 in case of an error.
+ **/
+static int segment_recover(journal_t *journal, uint64_t first) {
+  char path[PATH_MAX + 32];
+  journal_record_t record;
+  struct stat st;
+
+  segment_path(journal->dir, first, path, sizeof(path));
+  journal->fd = open(path, O_RDWR);
+  if (journal->fd == -1) {
+    return -1;
+  }
+  if (fstat(journal->fd, &st) != 0 || (size_t)st.st_size < strlen(JOURNAL_MAGIC)) {
+    close(journal->fd);
+    return -1;
+  }
+
+  journal->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  if (journal->data == MAP_FAILED) {
+    journal->data = NULL;
+    close(journal->fd);
+    return -1;
+  }
+  journal->size = st.st_size;
+
+  journal->offset = strlen(JOURNAL_MAGIC);
+  journal->next_seq = first;
+  int64_t status;
+  while ((status = check_record(journal->data, journal->size, journal->offset, &record)) == 1 && record.seq == journal->next_seq) {
+    journal->offset += JOURNAL_ALIGN(sizeof(journal_record_t) + record.size);
+    journal->next_seq++;
+  }
+
+  if (status != 0 && status != JOURNAL_END) {
+    fprintf(stderr, "JOURNAL: Dropping a damaged tail of %s after record %llu\n", path, (unsigned long long)journal->next_seq - 1);
+    memset(journal->data + journal->offset, 0, journal->size - journal->offset);
+    status = 0;
+  }
+
+  // Segments of another size are closed rather than continued.
+  if (status == 0 && journal->size != journal->config.segment_size) {
+    segment_close(journal);
+    return 0;
+  }
+  if (status == JOURNAL_END) {
+    munmap(journal->data, journal->size);
+    close(journal->fd);
+    journal->data = NULL;
+    return 0;
+  }
+
+  journal->synced = journal->offset;
+  return 1;
+}
+
+/**
+ * Leaves the current segment. It's unmapped on the next commit, the consumer
+ * may still be holding its entries.
+ **/
+static void reader_retire(journal_reader_t *reader) {
+  if (reader->data == NULL) {
+    return;
+  }
+
+  if (reader->retired_count == reader->retired_capacity) {
+    int capacity = reader->retired_capacity == 0 ? 4 : reader->retired_capacity * 2;
+    mapping_t *retired = realloc(reader->retired, capacity * sizeof(mapping_t));
+    if (retired == NULL) {
+      // Better to leak the mapping than to pull it from under the consumer.
+      reader->data = NULL;
+      return;
+    }
+    reader->retired = retired;
+    reader->retired_capacity = capacity;
+  }
+
+  reader->retired[reader->retired_count].data = reader->data;
+  reader->retired[reader->retired_count].size = reader->size;
+  reader->retired_count++;
+  reader->data = NULL;
+}
+
+static void reader_release(journal_reader_t *reader) {
+  for (int idx = 0; idx < reader->retired_count; idx++) {
+    munmap(reader->retired[idx].data, reader->retired[idx].size);
+  }
+  reader->retired_count = 0;
+}
+
+/**
+ * Maps a segment for reading, positioned at its first record.
+ *
+ * @return: 1 if the segment was mapped, 0 if it can't be read yet.
+ **/
+static int reader_map(journal_reader_t *reader, uint64_t first) {
+  char path[PATH_MAX + 32];
+  struct stat st;
+
+  segment_path(reader->dir, first, path, sizeof(path));
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < strlen(JOURNAL_MAGIC)) {
+    // Still being created.
+    close(fd);
+    return 0;
+  }
+
+  reader->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (reader->data == MAP_FAILED) {
+    reader->data = NULL;
+    return 0;
+  }
+
+  reader->size = st.st_size;
+  reader->offset = strlen(JOURNAL_MAGIC);
+  reader->first = first;
+  return 1;
+}
+
+/**
+ * Moves to the next segment if `after` is given, otherwise to the segment
+ * holding the reader's next record, or the oldest one.
+ *
+ * @return: 1 if a segment was mapped, 0 if there's none yet.
+ **/
+static int reader_seek(journal_reader_t *reader, int after) {
+  uint64_t firsts[JOURNAL_MAX_SEGMENTS];
+
+  int count = list_segments(reader->dir, firsts, JOURNAL_MAX_SEGMENTS);
+  if (count <= 0) {
+    return 0;
+  }
+
+  int index = 0;
+  if (after) {
+    while (index < count && firsts[index] <= reader->first) {
+      index++;
+    }
+    if (index == count) {
+      return 0;
+    }
+  } else {
+    while (index + 1 < count && firsts[index + 1] <= reader->next_seq) {
+      index++;
+    }
+  }
+
+  // Records the consumer hasn't seen were already deleted.
+  if (reader->next_seq < firsts[index]) {
+    reader->skipped += reader->next_seq > 0 ? firsts[index] - reader->next_seq : 0;
+    reader->next_seq = firsts[index];
+  }
+
+  reader_retire(reader);
+  return reader_map(reader, firsts[index]);
+}
+
+/** Writer **/
+
+journal_t *journal_open(const char *dir, journal_config_t *config) {
+  uint64_t firsts[1];
+  char cursors[PATH_MAX + 16];
+
+  snprintf(cursors, sizeof(cursors), "%s/cursors", dir);
+  if ((mkdir(dir, S_IRWXU) != 0 && errno != EEXIST) || (mkdir(cursors, S_IRWXU) != 0 && errno != EEXIST)) {
+    return NULL;
+  }
+
+  journal_t *journal = calloc(1, sizeof(journal_t));
+  if (journal == NULL) {
+    return NULL;
+  }
+  snprintf(journal->dir, sizeof(journal->dir), "%s", dir);
+  journal->config = *config;
+  journal->next_seq = 1;
+  journal->retained_at = monotonic_ms();
+
+  // Continue the last segment, or start a new one after it.
+  int count = list_segments(dir, firsts, 1);
+  int status = count > 0 ? segment_recover(journal, firsts[0]) : 0;
+  if (status == 0) {
+    status = segment_create(journal) == 0 ? 1 : -1;
+  }
+  if (status == -1) {
+    free(journal);
+    return NULL;
+  }
+
+  apply_retention(journal);
+  return journal;
+}
+
+uint64_t journal_append(journal_t *journal, const char *data, size_t size) {
+  size_t needed = JOURNAL_ALIGN(sizeof(journal_record_t) + size);
+
+  // There's always room left for the end marker.
+  if (size == 0 || size >= JOURNAL_END || strlen(JOURNAL_MAGIC) + needed + sizeof(journal_record_t) > journal->config.segment_size) {
+    return 0;
+  }
+  if (journal->data != NULL && journal->offset + needed + sizeof(journal_record_t) > journal->size) {
+    segment_close(journal);
+    apply_retention(journal);
+  }
+  if (journal->data == NULL && segment_create(journal) != 0) {
+    perror("Failed to create a journal segment");
+    return 0;
+  }
+
+  journal_record_t record = {
+    .size = 0,
+    .seq = journal->next_seq,
+    .timestamp = now_ms()
+  };
+  record.crc = record_crc(&record, data, size);
+
+  char *target = journal->data + journal->offset;
+  memcpy(target, &record, sizeof(record));
+  memcpy(target + sizeof(record), data, size);
+  __atomic_store_n((uint32_t *)target, (uint32_t)size, __ATOMIC_RELEASE);
+
+  journal->offset += needed;
+  return journal->next_seq++;
+}
+
+void journal_flush(journal_t *journal) {
+  if (journal->data != NULL && journal->offset > journal->synced) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = journal->synced / page * page;
+    msync(journal->data + from, journal->offset - from, MS_ASYNC);
+    journal->synced = journal->offset;
+  }
+
+  if (journal->config.max_age > 0 && monotonic_ms() - journal->retained_at > JOURNAL_RETENTION_CHECK_MS) {
+    apply_retention(journal);
+    journal->retained_at = monotonic_ms();
+  }
+}
+
+void journal_close(journal_t *journal) {
+  if (journal == NULL) {
+    return;
+  }
+
+  // The segment stays open for appending after a restart.
+  if (journal->data != NULL) {
+    msync(journal->data, journal->size, MS_SYNC);
+    munmap(journal->data, journal->size);
+    close(journal->fd);
+  }
+  free(journal);
+}
+
+/** Reader **/
+
+journal_reader_t *journal_reader_open(const char *dir, const char *consumer) {
+  journal_reader_t *reader = calloc(1, sizeof(journal_reader_t));
+  if (reader == NULL) {
+    return NULL;
+  }
+
+  snprintf(reader->dir, sizeof(reader->dir), "%s", dir);
+  snprintf(reader->cursor_path, sizeof(reader->cursor_path), "%s/cursors/%s", dir, consumer);
+
+  FILE *cursor = fopen(reader->cursor_path, "r");
+  if (cursor != NULL) {
+    unsigned long long seq;
+    if (fscanf(cursor, "%llu", &seq) == 1) {
+      reader->next_seq = seq + 1;
+    }
+    fclose(cursor);
+  } else if (errno != ENOENT) {
+    free(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+int journal_reader_next(journal_reader_t *reader, journal_entry_t *entry) {
+  journal_record_t record;
+
+  if (reader->data == NULL && !reader_seek(reader, 0)) {
+    return 0;
+  }
+
+  for (;;) {
+    int64_t status = check_record(reader->data, reader->size, reader->offset, &record);
+    if (status == 0) {
+      return 0;
+    }
+    if (status == -1) {
+      return -1;
+    }
+
+    if (status == JOURNAL_END) {
+      // Next segment may not be there yet, the end is checked again on the next call.
+      if (!reader_seek(reader, 1)) {
+        return 0;
+      }
+      continue;
+    }
+
+    const char *data = reader->data + reader->offset + sizeof(journal_record_t);
+    reader->offset += JOURNAL_ALIGN(sizeof(journal_record_t) + record.size);
+    if (record.seq < reader->next_seq) {
+      continue;
+    }
+
+    entry->seq = record.seq;
+    entry->timestamp = record.timestamp;
+    entry->data = data;
+    entry->size = record.size;
+    reader->next_seq = record.seq + 1;
+    return 1;
+  }
+}
+
+int journal_reader_commit(journal_reader_t *reader, uint64_t seq) {
+  char tmp_path[PATH_MAX + 8];
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", reader->cursor_path);
+  FILE *cursor = fopen(tmp_path, "w");
+  if (cursor == NULL) {
+    return -1;
+  }
+
+  // Cursor is replaced at once, a crash leaves either the old or the new one.
+  fprintf(cursor, "%llu\n", (unsigned long long)seq);
+  if (fclose(cursor) != 0 || rename(tmp_path, reader->cursor_path) != 0) {
+    return -1;
+  }
+
+  reader_release(reader);
+  return 0;
+}
+
+uint64_t journal_reader_skipped(journal_reader_t *reader) {
+  return reader->skipped;
+}
+
+void journal_reader_close(journal_reader_t *reader) {
+  if (reader == NULL) {
+    return;
+  }
+
+  reader_retire(reader);
+  reader_release(reader);
+  free(reader->retired);
+  free(reader);
+}
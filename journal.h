@@ -0,0 +1,146 @@
+#ifndef JOURNAL_HEADER
+#define JOURNAL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Durable output journal with consumer cursors.
+ *
+ * Output records are appended to memory-mapped segment files:
+ *
+ *   <dir>/<first-seq>.jnl   JOURNAL_MAGIC, then records: journal_record_t + data, padded to 8 bytes.
+ *   <dir>/cursors/<name>    Sequence number of the last record the consumer committed.
+ *
+ * Segments are created at full size and filled through the mapping, so a
+ * record is on its way to disk as soon as it's appended, and survives the
+ * relay crashing. A record becomes visible to readers once its size is
+ * stored, which happens last. The last record of a segment is followed by a
+ * JOURNAL_END marker, after which readers move on to the next segment.
+ *
+ * Sequence numbers increase by one from record to record, across segments
+ * and restarts.
+ **/
+
+#define JOURNAL_MAGIC "TWJNL001"
+
+/* Size of the record marking the end of a segment. */
+#define JOURNAL_END UINT32_MAX
+
+/* Segment record header. */
+typedef struct __attribute__((packed)) journal_record_t {
+  uint32_t size;         // Size of the data following the header, 0 if nothing was written yet.
+  uint32_t crc;          // CRC-32 of the seq, timestamp and data.
+  uint64_t seq;
+  int64_t timestamp;     // Append time, milliseconds since epoch.
+} journal_record_t;
+
+/* Writer settings. */
+typedef struct journal_config_t {
+  size_t segment_size;   // Size of each segment file.
+  size_t max_size;       // Older segments are deleted once all of them take more than this. 0 for no limit.
+  int64_t max_age;       // Segments last written longer ago than this many seconds are deleted. 0 for no limit.
+} journal_config_t;
+
+/* Record as returned by readers. Data points into the mapped segment. */
+typedef struct journal_entry_t {
+  uint64_t seq;
+  int64_t timestamp;
+  const char *data;
+  uint32_t size;
+} journal_entry_t;
+
+/* Journal writer. */
+typedef struct journal_t journal_t;
+
+/* Journal reader of a named consumer. */
+typedef struct journal_reader_t journal_reader_t;
+
+/**
+ * Opens a journal for appending. Creates the directory if needed and
+ * continues after the last valid record of an existing journal.
+ *
+ * @param dir: Journal directory.
+ * @param config: Writer settings. Copied.
+ *
+ * @return: Journal writer, or NULL in case of an error.
+ **/
+journal_t *journal_open(const char *dir, journal_config_t *config);
+
+/**
+ * Appends a record.
+ *
+ * @param journal: Journal writer.
+ * @param data: Record data.
+ * @param size: Size of the data. Must fit into a segment with the header.
+ *
+ * @return: Sequence number of the record, or 0 in case of an error.
+ **/
+uint64_t journal_append(journal_t *journal, const char *data, size_t size);
+
+/**
+ * Asks the kernel to start writing appended records to disk, and deletes
+ * segments past their age.
+ *
+ * @param journal: Journal writer.
+ **/
+void journal_flush(journal_t *journal);
+
+/**
+ * Syncs and unmaps the current segment and frees the writer.
+ *
+ * @param journal: Journal writer.
+ **/
+void journal_close(journal_t *journal);
+
+/**
+ * Opens a reader positioned after the consumer's last committed record, or
+ * at the oldest record if the consumer has none.
+ *
+ * @param dir: Journal directory.
+ * @param consumer: Consumer name, used as the cursor file name.
+ *
+ * @return: Journal reader, or NULL in case of an error.
+ **/
+journal_reader_t *journal_reader_open(const char *dir, const char *consumer);
+
+/**
+ * Reads the next record. Nothing is copied, the entry points into the mapped
+ * segment and stays valid until the next commit.
+ *
+ * @param reader: Journal reader.
+ * @param entry: Entry to fill.
+ *
+ * @return: 1 if a record was read, 0 if there's none yet, -1 if the journal is damaged.
+ **/
+int journal_reader_next(journal_reader_t *reader, journal_entry_t *entry);
+
+/**
+ * Stores the consumer's cursor. After a restart, reading resumes after the
+ * given record. Entries read so far may become invalid.
+ *
+ * @param reader: Journal reader.
+ * @param seq: Sequence number of the last record the consumer is done with.
+ *
+ * @return: 0 on success, -1 in case of an error.
+ **/
+int journal_reader_commit(journal_reader_t *reader, uint64_t seq);
+
+/**
+ * Returns how many records were skipped because their segments were already
+ * deleted when the reader got to them.
+ *
+ * @param reader: Journal reader.
+ *
+ * @return: Number of skipped records.
+ **/
+uint64_t journal_reader_skipped(journal_reader_t *reader);
+
+/**
+ * Unmaps the current segment and frees the reader. The cursor is not committed.
+ *
+ * @param reader: Journal reader.
+ **/
+void journal_reader_close(journal_reader_t *reader);
+
+#endif
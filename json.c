@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+#include "utils.h"
+
+/* Space reserved for annotation fields. */
+#define JSON_ANNOTATIONS_SIZE 256
+
+/**
+ * Turns "key=value;..." annotations into extra JSON fields.
+ *
+ * @param annotations: Message annotations.
+ * @param buffer: Output buffer.
+ * @param size: Size of the output buffer.
+ *
+ * @return: Length of the output. Fields that don't fit are left out.
+ **/
+static int serialize_annotations(const char *annotations, char *buffer, int size) {
+  char copy[JSON_ANNOTATIONS_SIZE], escaped[JSON_ANNOTATIONS_SIZE];
+  char *pointer = copy, *token;
+  int len = 0;
+
+  strncpy(copy, annotations, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = '\0';
+  buffer[0] = '\0';
+
+  while ((token = strsep(&pointer, ";")) != NULL) {
+    char *value = strchr(token, '=');
+    if (value == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+
+    string_quote_escape(value, escaped, sizeof(escaped));
+    int field = snprintf(buffer + len, size - len, ",\"%s\":\"%s\"", token, escaped);
+    if (field >= size - len) {
+      buffer[len] = '\0';
+      break;
+    }
+    len += field;
+  }
+
+  return len;
+}
+
+void serialize_message(irc_message_t *message, char *buffer) {
+  char escaped_message[JSON_BUFFER_SIZE] = { 0 };
+  char annotations[JSON_ANNOTATIONS_SIZE] = { 0 };
+  int annotations_len = 0;
+
+  if (message->sender == NULL || message->tags == NULL || message->message == NULL) {
+    return;
+  }
+
+  int len = sprintf(buffer, "{\"tags\":\"%s\",\"sender\":\"%s\"", message->tags, message->sender);
+  if (message->command != NULL)
+    len = len + sprintf(buffer+len, ",\"command\":\"%s\"", message->command);
+
+  if (message->annotations != NULL) {
+    annotations_len = serialize_annotations(message->annotations, annotations, sizeof(annotations));
+  }
+
+  // Quote-escape message first, then append it to the output.
+  string_quote_escape(message->message, escaped_message, JSON_BUFFER_SIZE - 14 - len - annotations_len);
+  sprintf(buffer+len, ",\"message\":\"%s\"%s}\n", escaped_message, annotations);
+}
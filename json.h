@@ -0,0 +1,18 @@
+#ifndef JSON_HEADER
+#define JSON_HEADER
+
+#include "irc.h"
+
+/* Size of the buffer expected by serialize_message. */
+#define JSON_BUFFER_SIZE 2048
+
+/**
+ * Serializes IRC message into a single-line JSON record terminated by a newline.
+ * Messages without sender, tags or text are skipped, leaving the buffer untouched.
+ *
+ * @param message: Message to serialize.
+ * @param buffer: Output buffer, at least JSON_BUFFER_SIZE bytes long.
+ **/
+void serialize_message(irc_message_t *message, char *buffer);
+
+#endif
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+
+#include "pipeline.h"
+#include "spsc.h"
+#include "arena.h"
+#include "debug.h"
+#include "utils.h"
+
+/* Max number of items handed over in one batch. */
+#define PIPELINE_BATCH 64
+
+/* Max length of a raw IRC line. */
+#define PIPELINE_LINE_SIZE 2048
+
+/* Size of the ring raw lines are copied into for the parser. Must be a power of two. */
+#define PIPELINE_LINE_RING (4 * 1024 * 1024)
+
+/* How long the reader waits for socket data before checking for stop, in ms. */
+#define PIPELINE_POLL_MS 100
+
+/* How long an idle stage sleeps before checking its queue again, in ms. */
+#define PIPELINE_PARK_MS 50
+
+/* How often the sink stage calls the tick callback, in ms. */
+#define PIPELINE_TICK_MS 1000
+
+/* Raw line passed from reader to parser, in the line ring. */
+typedef struct {
+  uint64_t end;                     /* Ring position right after the line, released once it's parsed. */
+  int size;
+  char data[];
+} pipeline_line_t;
+
+/* Lines are written by the reader and released by the parser in the same order. */
+typedef struct {
+  char *data;
+  uint64_t head;                    /* Reader only. */
+  _Atomic uint64_t released;
+} line_ring_t;
+
+/* Per-queue counters. Written by the producer, read by anyone. */
+typedef struct {
+  atomic_ulong items;
+  atomic_ulong batches;
+  atomic_int peak;
+} queue_stats_t;
+
+/* Lets an idle consumer sleep until its producer hands over a batch. */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_int waiting;
+} parking_t;
+
+struct pipeline_t {
+  irc_t *irc;
+  pipeline_config_t config;
+
+  spsc_t *lines;
+  spsc_t *messages;
+  line_ring_t line_ring;
+  message_arena_t *arena;
+  queue_stats_t lines_stats;
+  queue_stats_t messages_stats;
+  parking_t parser_parking;
+  parking_t sink_parking;
+
+  pthread_t threads[PIPELINE_STAGES];
+  atomic_int stop;
+  atomic_int connected;
+  atomic_int reader_done;
+  atomic_int parser_done;
+};
+
+/** Private **/
+
+static void pin_thread(int cpu) {
+  if (cpu < 0) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    LOG(LOG_LEVEL_ERROR, "Failed to pin pipeline stage to CPU %d\n", cpu);
+  }
+}
+
+/**
+ * Waits a bit when a queue is empty or full. Spins first, then yields, then sleeps.
+ *
+ * @param attempt: Number of consecutive unsuccessful attempts.
+ **/
+static void backoff(int attempt) {
+  if (attempt < 64) {
+    return;
+  } else if (attempt < 128) {
+    sched_yield();
+  } else {
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000 };
+    nanosleep(&pause, NULL);
+  }
+}
+
+static void parking_init(parking_t *parking) {
+  pthread_mutex_init(&parking->lock, NULL);
+  pthread_cond_init(&parking->cond, NULL);
+  atomic_init(&parking->waiting, 0);
+}
+
+static void parking_destroy(parking_t *parking) {
+  pthread_mutex_destroy(&parking->lock);
+  pthread_cond_destroy(&parking->cond);
+}
+
+/**
+ * Waits for items in an empty queue. Spins and yields for a while, then sleeps
+ * until woken by the producer or until PIPELINE_PARK_MS passes.
+ *
+ * @param parking: Consumer's parking spot.
+ * @param queue: Queue to wait on.
+ * @param attempt: Number of consecutive empty pops.
+ **/
+static void wait_for_items(parking_t *parking, spsc_t *queue, int attempt) {
+  if (attempt < 256) {
+    backoff(attempt);
+    return;
+  }
+
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += PIPELINE_PARK_MS * 1000000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec += 1;
+    until.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&parking->lock);
+  atomic_store(&parking->waiting, 1);
+  // Producer might have pushed between the empty pop and raising the flag.
+  if (spsc_size(queue) == 0) {
+    pthread_cond_timedwait(&parking->cond, &parking->lock, &until);
+  }
+  atomic_store(&parking->waiting, 0);
+  pthread_mutex_unlock(&parking->lock);
+}
+
+static void wake_consumer(parking_t *parking) {
+  if (atomic_load(&parking->waiting)) {
+    pthread_mutex_lock(&parking->lock);
+    pthread_cond_signal(&parking->cond);
+    pthread_mutex_unlock(&parking->lock);
+  }
+}
+
+/**
+ * Pushes the whole batch, waiting for room if needed, and wakes the consumer.
+ **/
+static void push_batch(spsc_t *queue, queue_stats_t *stats, parking_t *parking, void **items, int count) {
+  int pushed = 0, attempt = 0;
+
+  while (pushed < count) {
+    int now = spsc_push(queue, items + pushed, count - pushed);
+    if (now == 0) {
+      backoff(attempt++);
+      continue;
+    }
+    pushed += now;
+    attempt = 0;
+  }
+
+  int size = spsc_size(queue);
+  if (size > atomic_load_explicit(&stats->peak, memory_order_relaxed)) {
+    atomic_store_explicit(&stats->peak, size, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&stats->items, count, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->batches, 1, memory_order_relaxed);
+
+  wake_consumer(parking);
+}
+
+/**
+ * Takes room for a line from the ring. Reader only. Lines don't wrap around,
+ * the rest of the ring is skipped instead.
+ *
+ * @return: Line to fill, or NULL if the ring is full.
+ **/
+static pipeline_line_t *ring_reserve(line_ring_t *ring, int size) {
+  uint64_t needed = (sizeof(pipeline_line_t) + size + 7) & ~(uint64_t)7;
+  uint64_t offset = ring->head & (PIPELINE_LINE_RING - 1);
+  uint64_t skipped = PIPELINE_LINE_RING - offset < needed ? PIPELINE_LINE_RING - offset : 0;
+  uint64_t released = atomic_load_explicit(&ring->released, memory_order_acquire);
+
+  if (PIPELINE_LINE_RING - (ring->head - released) < skipped + needed) {
+    return NULL;
+  }
+
+  ring->head += skipped;
+  pipeline_line_t *line = (pipeline_line_t *)(ring->data + (ring->head & (PIPELINE_LINE_RING - 1)));
+  ring->head += needed;
+  line->end = ring->head;
+  return line;
+}
+
+static void *reader_stage(void *data) {
+  pipeline_t *pipeline = data;
+  char line[PIPELINE_LINE_SIZE];
+  void *batch[PIPELINE_BATCH];
+  struct pollfd pfd = { .fd = irc_get_fd(pipeline->irc), .events = POLLIN };
+
+  pin_thread(pipeline->config.cpus[PIPELINE_READER]);
+
+  while (!atomic_load(&pipeline->stop)) {
+    int ready = poll(&pfd, 1, PIPELINE_POLL_MS);
+    if (ready <= 0) {
+      continue;
+    }
+
+    if (irc_receive(pipeline->irc) < 0) {
+      atomic_store(&pipeline->connected, 0);
+      break;
+    }
+
+    int count = 0, size;
+    while ((size = irc_pop_line(pipeline->irc, line, sizeof(line))) >= 0) {
+      pipeline_line_t *item = ring_reserve(&pipeline->line_ring, size);
+      if (item == NULL) {
+        // The parser frees room as it works through what it's been handed.
+        if (count > 0) {
+          push_batch(pipeline->lines, &pipeline->lines_stats, &pipeline->parser_parking, batch, count);
+          count = 0;
+        }
+        for (int attempt = 0; (item = ring_reserve(&pipeline->line_ring, size)) == NULL; attempt++) {
+          backoff(attempt);
+        }
+      }
+      item->size = size;
+      memcpy(item->data, line, size);
+      batch[count++] = item;
+
+      if (count == PIPELINE_BATCH) {
+        push_batch(pipeline->lines, &pipeline->lines_stats, &pipeline->parser_parking, batch, count);
+        count = 0;
+      }
+    }
+
+    if (count > 0) {
+      push_batch(pipeline->lines, &pipeline->lines_stats, &pipeline->parser_parking, batch, count);
+    }
+  }
+
+  atomic_store(&pipeline->reader_done, 1);
+  return NULL;
+}
+
+static void *parser_stage(void *data) {
+  pipeline_t *pipeline = data;
+  void *lines[PIPELINE_BATCH], *messages[PIPELINE_BATCH];
+  int attempt = 0;
+
+  pin_thread(pipeline->config.cpus[PIPELINE_PARSER]);
+
+  while (1) {
+    int count = spsc_pop(pipeline->lines, lines, PIPELINE_BATCH);
+    if (count == 0) {
+      if (atomic_load(&pipeline->reader_done) && spsc_size(pipeline->lines) == 0) {
+        break;
+      }
+      wait_for_items(&pipeline->parser_parking, pipeline->lines, attempt++);
+      continue;
+    }
+    attempt = 0;
+
+    int dispatched = 0;
+    for (int idx = 0; idx < count; idx++) {
+      pipeline_line_t *line = lines[idx];
+      irc_message_t *message = irc_parse_message_in(line->data, line->size, pipeline->arena);
+      atomic_store_explicit(&pipeline->line_ring.released, line->end, memory_order_release);
+
+      // Only messages crossing over to the sink need a copy of their own.
+      if (pipeline->config.dispatch(pipeline->irc, message, pipeline->config.context)) {
+        irc_message_t *copy = irc_message_clone(message);
+        if (copy != NULL) {
+          messages[dispatched++] = copy;
+        } else {
+          LOG(LOG_LEVEL_ERROR, "Failed to copy message for the sink, dropping it\n");
+        }
+      }
+    }
+    arena_reset(pipeline->arena);
+
+    if (dispatched > 0) {
+      push_batch(pipeline->messages, &pipeline->messages_stats, &pipeline->sink_parking, messages, dispatched);
+    }
+  }
+
+  atomic_store(&pipeline->parser_done, 1);
+  return NULL;
+}
+
+static void *sink_stage(void *data) {
+  pipeline_t *pipeline = data;
+  void *messages[PIPELINE_BATCH];
+  int attempt = 0;
+  int64_t ticked_at = monotonic_ms();
+
+  pin_thread(pipeline->config.cpus[PIPELINE_SINK]);
+
+  while (1) {
+    // Parking is bounded by PIPELINE_PARK_MS, so ticks keep coming without messages.
+    if (pipeline->config.tick != NULL && monotonic_ms() - ticked_at >= PIPELINE_TICK_MS) {
+      pipeline->config.tick(pipeline->config.context);
+      ticked_at = monotonic_ms();
+    }
+
+    int count = spsc_pop(pipeline->messages, messages, PIPELINE_BATCH);
+    if (count == 0) {
+      if (atomic_load(&pipeline->parser_done) && spsc_size(pipeline->messages) == 0) {
+        break;
+      }
+      wait_for_items(&pipeline->sink_parking, pipeline->messages, attempt++);
+      continue;
+    }
+    attempt = 0;
+
+    for (int idx = 0; idx < count; idx++) {
+      pipeline->config.sink(messages[idx], pipeline->config.context);
+      irc_message_free(messages[idx]);
+    }
+
+    if (pipeline->config.flush != NULL) {
+      pipeline->config.flush(pipeline->config.context);
+    }
+  }
+
+  return NULL;
+}
+
+static void report_queue(FILE *file, const char *name, spsc_t *queue, queue_stats_t *stats) {
+  unsigned long items = atomic_load(&stats->items);
+  unsigned long batches = atomic_load(&stats->batches);
+
+  fprintf(
+    file,
+    " %s=%d/%d peak=%d items=%lu avg_batch=%.1f",
+    name,
+    spsc_size(queue),
+    spsc_capacity(queue),
+    atomic_load(&stats->peak),
+    items,
+    batches > 0 ? (double)items / batches : 0.0
+  );
+}
+
+/** Public **/
+
+pipeline_t *pipeline_start(irc_t *irc, pipeline_config_t *config) {
+  void *(*stages[PIPELINE_STAGES])(void *) = { reader_stage, parser_stage, sink_stage };
+
+  pipeline_t *pipeline = calloc(1, sizeof(pipeline_t));
+  if (pipeline == NULL) {
+    return NULL;
+  }
+
+  pipeline->irc = irc;
+  pipeline->config = *config;
+  pipeline->lines = spsc_init(config->queue_capacity);
+  pipeline->messages = spsc_init(config->queue_capacity);
+  pipeline->line_ring.data = malloc(PIPELINE_LINE_RING);
+  atomic_init(&pipeline->line_ring.released, 0);
+  pipeline->arena = arena_init();
+  atomic_init(&pipeline->stop, 0);
+  atomic_init(&pipeline->connected, 1);
+  atomic_init(&pipeline->reader_done, 0);
+  atomic_init(&pipeline->parser_done, 0);
+
+  if (pipeline->lines == NULL || pipeline->messages == NULL || pipeline->line_ring.data == NULL || pipeline->arena == NULL) {
+    spsc_free(pipeline->lines);
+    spsc_free(pipeline->messages);
+    free(pipeline->line_ring.data);
+    arena_free(pipeline->arena);
+    free(pipeline);
+    return NULL;
+  }
+
+  parking_init(&pipeline->parser_parking);
+  parking_init(&pipeline->sink_parking);
+
+  for (int idx = 0; idx < PIPELINE_STAGES; idx++) {
+    if (pthread_create(&pipeline->threads[idx], NULL, stages[idx], pipeline) != 0) {
+      // Unwind whatever was started. Later stages exit once earlier ones are done.
+      atomic_store(&pipeline->stop, 1);
+      atomic_store(&pipeline->reader_done, 1);
+      atomic_store(&pipeline->parser_done, 1);
+      for (int started = 0; started < idx; started++) {
+        pthread_join(pipeline->threads[started], NULL);
+      }
+      spsc_free(pipeline->lines);
+      spsc_free(pipeline->messages);
+      free(pipeline->line_ring.data);
+      arena_free(pipeline->arena);
+      parking_destroy(&pipeline->parser_parking);
+      parking_destroy(&pipeline->sink_parking);
+      free(pipeline);
+      return NULL;
+    }
+  }
+
+  return pipeline;
+}
+
+int pipeline_is_running(pipeline_t *pipeline) {
+  return atomic_load(&pipeline->connected);
+}
+
+void pipeline_report(pipeline_t *pipeline, FILE *file) {
+  fprintf(file, "PIPELINE");
+  report_queue(file, "lines", pipeline->lines, &pipeline->lines_stats);
+  report_queue(file, "messages", pipeline->messages, &pipeline->messages_stats);
+  fprintf(file, "\n");
+}
+
+void pipeline_stop(pipeline_t *pipeline) {
+  if (pipeline == NULL) {
+    return;
+  }
+
+  atomic_store(&pipeline->stop, 1);
+  for (int idx = 0; idx < PIPELINE_STAGES; idx++) {
+    pthread_join(pipeline->threads[idx], NULL);
+  }
+
+  spsc_free(pipeline->lines);
+  spsc_free(pipeline->messages);
+  free(pipeline->line_ring.data);
+  arena_free(pipeline->arena);
+  parking_destroy(&pipeline->parser_parking);
+  parking_destroy(&pipeline->sink_parking);
+  free(pipeline);
+}
@@ -0,0 +1,79 @@
+#ifndef PIPELINE_HEADER
+#define PIPELINE_HEADER
+
+#include <stdio.h>
+
+#include "irc.h"
+
+/**
+ * Threaded message pipeline.
+ *
+ * Three stages connected by bounded SPSC queues:
+ *   reader: reads the socket and splits data into raw lines;
+ *   parser: parses lines and dispatches them (PINGs, commands);
+ *   sink:   serializes and writes messages to the outputs.
+ * A slow sink only fills the queues, the socket keeps being read.
+ **/
+typedef struct pipeline_t pipeline_t;
+
+/* Pipeline stages, used as indexes into pipeline_config_t.cpus. */
+typedef enum {
+  PIPELINE_READER,
+  PIPELINE_PARSER,
+  PIPELINE_SINK,
+  PIPELINE_STAGES
+} pipeline_stage_t;
+
+typedef struct pipeline_config_t {
+  // Called on the parser stage for every message. Returns 1 to pass the message to the sink.
+  int (*dispatch)(irc_t *irc, irc_message_t *message, void *context);
+  // Called on the sink stage for every dispatched message. The message is released afterwards,
+  // take a reference with irc_message_ref() to keep it.
+  void (*sink)(irc_message_t *message, void *context);
+  // Called on the sink stage after each batch. Optional.
+  void (*flush)(void *context);
+  // Called on the sink stage about once a second, busy or idle. Optional.
+  void (*tick)(void *context);
+  void *context;
+  // CPU to pin each stage to, or -1 to leave it to the scheduler.
+  int cpus[PIPELINE_STAGES];
+  // Capacity of each queue.
+  int queue_capacity;
+} pipeline_config_t;
+
+/**
+ * Starts pipeline threads for given connection.
+ *
+ * @param irc: IRC client to read from. Nothing else should read from it while the pipeline runs.
+ * @param config: Pipeline configuration. Copied.
+ *
+ * @return: Running pipeline, or NULL in case of an error.
+ **/
+pipeline_t *pipeline_start(irc_t *irc, pipeline_config_t *config);
+
+/**
+ * Checks whether the reader stage is still receiving data.
+ *
+ * @param pipeline: Pipeline.
+ *
+ * @return: 0 if the connection was lost, 1 otherwise.
+ **/
+int pipeline_is_running(pipeline_t *pipeline);
+
+/**
+ * Prints queue occupancy and throughput counters.
+ *
+ * @param pipeline: Pipeline.
+ * @param file: Stream to print to.
+ **/
+void pipeline_report(pipeline_t *pipeline, FILE *file);
+
+/**
+ * Stops reading, lets the queued messages drain through the remaining stages,
+ * joins the threads and frees the pipeline.
+ *
+ * @param pipeline: Pipeline to stop.
+ **/
+void pipeline_stop(pipeline_t *pipeline);
+
+#endif
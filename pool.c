@@ -0,0 +1,543 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "utils.h"
+#include "debug.h"
+
+/* Max length of a queued line, the IRC limit. */
+#define POOL_LINE_SIZE 512
+
+/* Delay before reconnecting a lost sender, doubling up to the max while attempts fail. */
+#define POOL_RETRY_MIN_MS 1000
+#define POOL_RETRY_MAX_MS 60000
+
+/* How long a sender may take to log in and join before the attempt counts as failed. */
+#define POOL_HANDSHAKE_MS 10000
+
+typedef enum {
+  ACCOUNT_DOWN = 0,                 /* No connection, the next attempt is due at retry_at. */
+  ACCOUNT_CONNECTING,               /* Login handshake in progress, driven by pool_handle_fds(). */
+  ACCOUNT_UP
+} account_state_t;
+
+typedef struct {
+  char *login;
+  char *password;
+  irc_t *irc;                       /* NULL while disconnected. */
+  account_state_t state;
+  int64_t handshake_until;
+  int64_t retry_at;
+  int retry_delay;
+  int64_t *sent_at;                 /* Ring of the send times within the rate window. */
+  int sent_first;
+  int sent_count;
+  int64_t limited_until;            /* Server said the account is rate limited. */
+  uint64_t sent;
+} account_t;
+
+typedef struct {
+  char *line;                       /* Without the line break. */
+  uint32_t channel;                 /* Hash of the channel, for affinity. */
+} pool_line_t;
+
+struct pool_t {
+  pool_config_t config;
+  pthread_mutex_t lock;
+  irc_t *front;
+  int accounts_count;
+  account_t accounts[POOL_MAX_ACCOUNTS];
+  pool_line_t *queue;               /* Oldest first. */
+  int queue_count;
+  uint64_t dropped;
+  uint64_t reported_sent;
+  uint64_t reported_dropped;
+};
+
+/** Private **/
+
+static uint32_t hash_channel(const char *line) {
+  // "COMMAND #channel ...", lines without a channel all hash the same.
+  const char *channel = strchr(line, ' ');
+  if (channel == NULL || channel[1] != '#') {
+    return 0;
+  }
+
+  uint32_t hash = 2166136261u;
+  for (channel++; *channel != '\0' && *channel != ' '; channel++) {
+    hash ^= (unsigned char)*channel;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Skips the tags and the prefix of a raw line.
+ *
+ * @return: Start of the command.
+ **/
+static const char *skip_prefix(const char *line) {
+  for (int field = 0; field < 2 && (*line == '@' || *line == ':'); field++) {
+    const char *space = strchr(line, ' ');
+    if (space == NULL) {
+      return line + strlen(line);
+    }
+    line = space + 1;
+  }
+  return line;
+}
+
+static int is_connected(account_t *account) {
+  return account->state == ACCOUNT_UP && irc_is_connected(account->irc);
+}
+
+/**
+ * Forgets send times that left the rate window.
+ **/
+static void expire_sends(pool_t *pool, account_t *account, int64_t now) {
+  while (account->sent_count > 0 && account->sent_at[account->sent_first] + pool->config.rate_period_ms <= now) {
+    account->sent_first = (account->sent_first + 1) % pool->config.rate;
+    account->sent_count--;
+  }
+}
+
+static int has_budget(pool_t *pool, account_t *account, int64_t now) {
+  if (!is_connected(account) || now < account->limited_until) {
+    return 0;
+  }
+
+  expire_sends(pool, account, now);
+  return account->sent_count < pool->config.rate;
+}
+
+/**
+ * Returns when the account can send its next line, INT64_MAX if it's disconnected.
+ **/
+static int64_t budget_at(pool_t *pool, account_t *account, int64_t now) {
+  if (!is_connected(account)) {
+    return INT64_MAX;
+  }
+
+  expire_sends(pool, account, now);
+  int64_t at = account->sent_count < pool->config.rate
+    ? now
+    : account->sent_at[account->sent_first] + pool->config.rate_period_ms;
+  return at > account->limited_until ? at : account->limited_until;
+}
+
+/**
+ * Schedules the next attempt after a failed one, backing off further each time.
+ **/
+static void fail_attempt(account_t *account, int64_t now) {
+  if (account->irc != NULL) {
+    irc_free(account->irc);
+    account->irc = NULL;
+  }
+  account->state = ACCOUNT_DOWN;
+  account->retry_delay = account->retry_delay > 0 ? account->retry_delay * 2 : POOL_RETRY_MIN_MS;
+  if (account->retry_delay > POOL_RETRY_MAX_MS) {
+    account->retry_delay = POOL_RETRY_MAX_MS;
+  }
+  account->retry_at = now + account->retry_delay;
+  LOG(LOG_LEVEL_ERROR, "Sender %s failed to connect, retrying in %d ms\n", account->login, account->retry_delay);
+}
+
+static void drop_connection(account_t *account, int64_t now) {
+  // Lost during the handshake, the account may not be able to log in at all.
+  if (account->state == ACCOUNT_CONNECTING) {
+    fail_attempt(account, now);
+    return;
+  }
+
+  LOG(LOG_LEVEL_ERROR, "Sender %s disconnected\n", account->login);
+  irc_free(account->irc);
+  account->irc = NULL;
+  account->state = ACCOUNT_DOWN;
+  account->retry_delay = POOL_RETRY_MIN_MS;
+  account->retry_at = now + account->retry_delay;
+}
+
+/**
+ * Picks the account for a line.
+ *
+ * @return: Account with budget to send the line now, or NULL if it has to wait.
+ **/
+static account_t *pick_account(pool_t *pool, pool_line_t *line, int64_t now) {
+  if (pool->config.strategy == POOL_AFFINITY) {
+    // The channel's account, or the next connected one while it's down.
+    int start = line->channel % pool->accounts_count;
+    for (int idx = 0; idx < pool->accounts_count; idx++) {
+      account_t *account = &pool->accounts[(start + idx) % pool->accounts_count];
+      if (is_connected(account)) {
+        return has_budget(pool, account, now) ? account : NULL;
+      }
+    }
+    return NULL;
+  }
+
+  account_t *best = NULL;
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    account_t *account = &pool->accounts[idx];
+    if (has_budget(pool, account, now) && (best == NULL || account->sent_count < best->sent_count)) {
+      best = account;
+    }
+  }
+  return best;
+}
+
+/**
+ * Sends a line on an account and counts it against the account's budget.
+ *
+ * @return: 0 on success, -1 if the connection is lost.
+ **/
+static int send_line(pool_t *pool, account_t *account, pool_line_t *line, int64_t now) {
+  if (irc_command(account->irc, "%s", line->line) == -1) {
+    drop_connection(account, now);
+    return -1;
+  }
+
+  account->sent_at[(account->sent_first + account->sent_count) % pool->config.rate] = now;
+  account->sent_count++;
+  account->sent++;
+  return 0;
+}
+
+/**
+ * Sends whatever queued lines the budgets allow, keeping the rest in order.
+ * Expects the lock to be held.
+ **/
+static void dispatch(pool_t *pool) {
+  int64_t now = monotonic_ms();
+  int kept = 0, idx = 0;
+
+  for (; idx < pool->queue_count; idx++) {
+    pool_line_t *line = &pool->queue[idx];
+    account_t *account;
+    int sent = 0;
+
+    // A failed send disconnects the account, so this ends.
+    while (!sent && (account = pick_account(pool, line, now)) != NULL) {
+      sent = send_line(pool, account, line, now) == 0;
+    }
+
+    if (sent) {
+      free(line->line);
+      continue;
+    }
+
+    pool->queue[kept++] = *line;
+
+    // Without affinity every line can use every account, so none of the later ones can go either.
+    if (pool->config.strategy != POOL_AFFINITY) {
+      idx++;
+      break;
+    }
+  }
+
+  for (; idx < pool->queue_count; idx++) {
+    pool->queue[kept++] = pool->queue[idx];
+  }
+  pool->queue_count = kept;
+}
+
+/**
+ * Takes data sent through the front client: queues its lines and sends what it can.
+ **/
+static int submit(void *context, const char *data, int size) {
+  pool_t *pool = context;
+  const char *end = data + size;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (const char *start = data; start < end; ) {
+    const char *stop = start;
+    while (stop < end && *stop != '\r' && *stop != '\n') {
+      stop++;
+    }
+
+    int length = stop - start < POOL_LINE_SIZE ? stop - start : POOL_LINE_SIZE - 1;
+    if (length > 0) {
+      char *copy = strndup(start, length);
+      if (copy == NULL) {
+        break;
+      }
+
+      if (pool->queue_count == pool->config.queue_limit) {
+        free(pool->queue[0].line);
+        memmove(pool->queue, pool->queue + 1, (pool->queue_count - 1) * sizeof(pool_line_t));
+        pool->queue_count--;
+        pool->dropped++;
+      }
+      pool->queue[pool->queue_count++] = (pool_line_t){ .line = copy, .channel = hash_channel(copy) };
+    }
+
+    start = stop + 1;
+  }
+
+  dispatch(pool);
+  pthread_mutex_unlock(&pool->lock);
+  return size;
+}
+
+static int load_accounts(pool_t *pool, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open senders file");
+    return -1;
+  }
+
+  char line[512], login[128], password[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#' || sscanf(line, "%127s %255s", login, password) != 2) {
+      continue;
+    }
+    if (pool->accounts_count == POOL_MAX_ACCOUNTS) {
+      fprintf(stderr, "Too many senders, using the first %d\n", POOL_MAX_ACCOUNTS);
+      break;
+    }
+
+    account_t *account = &pool->accounts[pool->accounts_count];
+    account->login = strdup(login);
+    account->password = strdup(password);
+    account->sent_at = calloc(pool->config.rate, sizeof(int64_t));
+    pool->accounts_count++;
+    if (account->login == NULL || account->password == NULL || account->sent_at == NULL) {
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+
+  if (pool->accounts_count == 0) {
+    fprintf(stderr, "No senders in %s, expected \"<login> <password>\" lines\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/** Public **/
+
+pool_t *pool_init(pool_config_t *config) {
+  pool_t *pool = calloc(1, sizeof(pool_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->config = *config;
+  pool->config.accounts_path = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  pool->queue = calloc(config->queue_limit, sizeof(pool_line_t));
+  pool->front = irc_init(-1);
+  if (pool->queue == NULL || pool->front == NULL || load_accounts(pool, config->accounts_path) == -1) {
+    pool_free(pool);
+    return NULL;
+  }
+
+  irc_set_outbound(pool->front, submit, pool);
+  return pool;
+}
+
+int pool_strategy_parse(const char *name) {
+  if (strcmp(name, "least-loaded") == 0) {
+    return POOL_LEAST_LOADED;
+  } else if (strcmp(name, "affinity") == 0) {
+    return POOL_AFFINITY;
+  }
+  return -1;
+}
+
+irc_t *pool_client(pool_t *pool) {
+  return pool->front;
+}
+
+int pool_due_account(pool_t *pool, const char **login, const char **password) {
+  int64_t now = monotonic_ms();
+  int index = -1;
+
+  pthread_mutex_lock(&pool->lock);
+  for (int idx = 0; idx < pool->accounts_count && index == -1; idx++) {
+    account_t *account = &pool->accounts[idx];
+    if (account->irc != NULL && !irc_is_connected(account->irc)) {
+      drop_connection(account, now);
+    } else if (account->state == ACCOUNT_CONNECTING && now >= account->handshake_until) {
+      LOG(LOG_LEVEL_ERROR, "Sender %s didn't finish logging in\n", account->login);
+      fail_attempt(account, now);
+    }
+    if (account->irc == NULL && now >= account->retry_at) {
+      *login = account->login;
+      *password = account->password;
+      index = idx;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return index;
+}
+
+void pool_set_connection(pool_t *pool, int index, irc_t *irc) {
+  pthread_mutex_lock(&pool->lock);
+
+  account_t *account = &pool->accounts[index];
+  if (irc != NULL) {
+    account->irc = irc;
+    account->state = ACCOUNT_CONNECTING;
+    account->handshake_until = monotonic_ms() + POOL_HANDSHAKE_MS;
+  } else {
+    fail_attempt(account, monotonic_ms());
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_dispatch(pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  dispatch(pool);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_wait_ms(pool_t *pool) {
+  int64_t now = monotonic_ms();
+  int64_t at = INT64_MAX;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queue_count == 0) {
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+  }
+
+  // Earliest budget of any account, waking up early only costs a dispatch.
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    int64_t account_at = budget_at(pool, &pool->accounts[idx], now);
+    if (account_at < at) {
+      at = account_at;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (at == INT64_MAX) {
+    return POOL_RETRY_MIN_MS;
+  }
+  return at > now ? (int)(at - now) : 0;
+}
+
+int pool_fill_fds(pool_t *pool, fd_set *readfds) {
+  int maxfd = -1;
+
+  pthread_mutex_lock(&pool->lock);
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    account_t *account = &pool->accounts[idx];
+    int fd = account->irc != NULL ? irc_get_fd(account->irc) : -1;
+    if (fd >= 0) {
+      FD_SET(fd, readfds);
+      maxfd = fd > maxfd ? fd : maxfd;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return maxfd;
+}
+
+void pool_handle_fds(pool_t *pool, fd_set *readfds) {
+  int64_t now = monotonic_ms();
+  char line[2048];
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    account_t *account = &pool->accounts[idx];
+    int fd = account->irc != NULL ? irc_get_fd(account->irc) : -1;
+    if (fd < 0 || !FD_ISSET(fd, readfds)) {
+      continue;
+    }
+
+    // The handshake reads the socket itself, lines after its end are handled below.
+    if (account->state == ACCOUNT_CONNECTING) {
+      int joined = irc_handshake(account->irc);
+      if (joined == -1) {
+        fail_attempt(account, now);
+        continue;
+      } else if (joined == 0) {
+        continue;
+      }
+      LOG(LOG_LEVEL_DEBUG, "DEBUG: Sender %s connected\n", account->login);
+      account->state = ACCOUNT_UP;
+      account->retry_delay = 0;
+    } else if (irc_receive(account->irc) < 0) {
+      drop_connection(account, now);
+      continue;
+    }
+
+    // Chat is relayed from the reader connection, senders only keep themselves alive.
+    int length, reconnect = 0;
+    while ((length = irc_pop_line(account->irc, line, sizeof(line) - 1)) >= 0) {
+      line[length] = '\0';
+      const char *command = skip_prefix(line);
+      if (strncmp(command, "PING", 4) == 0) {
+        irc_command(account->irc, "PONG%s", command + 4);
+      } else if (strncmp(command, "NOTICE ", 7) == 0 && strncmp(line, "@msg-id=msg_ratelimit", 21) == 0) {
+        LOG(LOG_LEVEL_ERROR, "Sender %s is rate limited, resting it\n", account->login);
+        account->limited_until = now + pool->config.rate_period_ms;
+      } else if (strncmp(command, "RECONNECT", 9) == 0) {
+        reconnect = 1;
+      }
+    }
+    if (reconnect) {
+      drop_connection(account, now);
+    }
+  }
+
+  dispatch(pool);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_report(pool_t *pool, FILE *file) {
+  char counts[POOL_MAX_ACCOUNTS * 32] = { 0 };
+  uint64_t sent = 0;
+  int length = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    sent += pool->accounts[idx].sent;
+    length += snprintf(counts + length, sizeof(counts) - length, "%s%lu%s", idx > 0 ? "," : "",
+      (unsigned long)pool->accounts[idx].sent, is_connected(&pool->accounts[idx]) ? "" : "(down)");
+  }
+
+  if (sent != pool->reported_sent || pool->dropped != pool->reported_dropped) {
+    fprintf(file, "POOL sent=%s queued=%d dropped=%lu\n", counts, pool->queue_count, (unsigned long)pool->dropped);
+    pool->reported_sent = sent;
+    pool->reported_dropped = pool->dropped;
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(pool_t *pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  for (int idx = 0; idx < pool->accounts_count; idx++) {
+    account_t *account = &pool->accounts[idx];
+    if (account->irc != NULL) {
+      irc_free(account->irc);
+    }
+    free(account->login);
+    free(account->password);
+    free(account->sent_at);
+  }
+
+  for (int idx = 0; idx < pool->queue_count; idx++) {
+    free(pool->queue[idx].line);
+  }
+  free(pool->queue);
+  if (pool->front != NULL) {
+    irc_free(pool->front);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
@@ -0,0 +1,153 @@
+#ifndef POOL_HEADER
+#define POOL_HEADER
+
+#include <stdio.h>
+#include <sys/select.h>
+
+#include "irc.h"
+
+/**
+ * Outbound commands spread over several sender accounts, each with its own
+ * connection and rate budget, while chat is read from the relay's own
+ * connection.
+ *
+ * Commands are handed to the pool through a front client, see pool_client():
+ * anything sent through it is split into lines and queued. A line goes out on
+ * an account that still has budget left in the sliding rate window:
+ *
+ *   - least-loaded: the account that sent the fewest lines within the window;
+ *   - affinity: the account picked by the hash of the line's channel, so a
+ *     channel always hears from the same account, in order.
+ *
+ * Lines wait in a bounded queue while no suitable account has budget, the
+ * oldest are dropped when it's full. An account Twitch reports as rate
+ * limited gets no lines for a full window.
+ *
+ * Senders join the channel but their incoming lines are only read to answer
+ * PINGs. Lost senders are reconnected by the caller, see pool_due_account(),
+ * and log in within the pool's socket handling, so an account that can't log
+ * in only gets retried later, with a growing delay.
+ *
+ * Submitting can happen on other threads than the socket handling.
+ **/
+typedef struct pool_t pool_t;
+
+/* Max number of sender accounts. */
+#define POOL_MAX_ACCOUNTS 16
+
+typedef enum {
+  POOL_LEAST_LOADED = 0,
+  POOL_AFFINITY
+} pool_strategy_t;
+
+/* Pool settings. */
+typedef struct pool_config_t {
+  const char *accounts_path;    // File with a "<login> <password>" line per account.
+  pool_strategy_t strategy;
+  int rate;                     // Max lines per account within the rate period.
+  int rate_period_ms;
+  int queue_limit;              // Max number of lines waiting for budget.
+} pool_config_t;
+
+/**
+ * Creates a pool and reads its accounts. Accounts start disconnected.
+ *
+ * @param config: Settings. Copied, the file is read during the call.
+ *
+ * @return: A new pool, or NULL if the accounts file can't be read or lists no accounts.
+ **/
+pool_t *pool_init(pool_config_t *config);
+
+/**
+ * Parses a strategy name: least-loaded or affinity.
+ *
+ * @param name: Strategy name.
+ *
+ * @return: Strategy, or -1 if the name is unknown.
+ **/
+int pool_strategy_parse(const char *name);
+
+/**
+ * Returns the front client whose commands go through the pool.
+ *
+ * @param pool: Pool.
+ *
+ * @return: Client owned by the pool.
+ **/
+irc_t *pool_client(pool_t *pool);
+
+/**
+ * Finds an account that needs connecting: never connected, or lost and past
+ * its retry delay. Handshakes that take too long are given up on first.
+ *
+ * @param pool: Pool.
+ * @param login: Set to the account's login.
+ * @param password: Set to the account's password.
+ *
+ * @return: Index of the account, or -1 if all are connected or waiting.
+ **/
+int pool_due_account(pool_t *pool, const char **login, const char **password);
+
+/**
+ * Hands a connected client to an account, or records a failed attempt. The
+ * account sends nothing until pool_handle_fds() sees the handshake through.
+ *
+ * @param pool: Pool.
+ * @param index: Account index from pool_due_account().
+ * @param irc: Client that started its handshake with irc_start_handshake(),
+ * owned by the pool from now on, or NULL if connecting failed.
+ **/
+void pool_set_connection(pool_t *pool, int index, irc_t *irc);
+
+/**
+ * Sends queued lines on accounts that have budget again.
+ *
+ * @param pool: Pool.
+ **/
+void pool_dispatch(pool_t *pool);
+
+/**
+ * Returns how long until queued lines can be sent.
+ *
+ * @param pool: Pool.
+ *
+ * @return: Milliseconds to wait, or -1 if nothing is queued.
+ **/
+int pool_wait_ms(pool_t *pool);
+
+/**
+ * Adds sender sockets to the set for select().
+ *
+ * @param pool: Pool.
+ * @param readfds: Set of descriptors to check for reading.
+ *
+ * @return: Largest descriptor added, or -1.
+ **/
+int pool_fill_fds(pool_t *pool, fd_set *readfds);
+
+/**
+ * Reads sender sockets that select() marked as ready, moving handshakes
+ * along, answering PINGs and noticing lost connections and rate limits.
+ *
+ * @param pool: Pool.
+ * @param readfds: Descriptors ready for reading.
+ **/
+void pool_handle_fds(pool_t *pool, fd_set *readfds);
+
+/**
+ * Prints lines sent per account and dropped lines, if anything was sent or
+ * dropped since the last report.
+ *
+ * @param pool: Pool.
+ * @param file: Stream to print to.
+ **/
+void pool_report(pool_t *pool, FILE *file);
+
+/**
+ * Disconnects the senders and frees the pool. Queued lines are dropped.
+ *
+ * @param pool: Pool to free.
+ **/
+void pool_free(pool_t *pool);
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "prefilter.h"
+
+/* Slots of the command name table. Must be a power of two above the number of commands. */
+#define PREFILTER_TABLE_SIZE 64
+
+/* Max number of kept USERNOTICE types, and length of their names. */
+#define PREFILTER_MAX_NOTICES 32
+#define PREFILTER_NOTICE_SIZE 32
+
+/* Bloom filter bits per blocked user and number of probes, about 1% false positives. */
+#define PREFILTER_BLOOM_BITS 10
+#define PREFILTER_BLOOM_PROBES 7
+
+typedef struct {
+  const char *name;                 /* NULL for an empty slot. */
+  size_t length;
+  irc_command_id_t id;
+} command_slot_t;
+
+struct prefilter_t {
+  command_slot_t commands[PREFILTER_TABLE_SIZE];
+  uint32_t drop;                    /* Bitset of dropped irc_command_id_t. */
+  int notices_count;
+  char notices[PREFILTER_MAX_NOTICES][PREFILTER_NOTICE_SIZE];
+  uint64_t *bloom;
+  uint64_t bloom_mask;              /* Number of bits minus one. */
+  uint64_t *blocked;                /* Sorted blocked user ids. */
+  size_t blocked_count;
+  atomic_uint_fast64_t passed;
+  atomic_uint_fast64_t dropped;
+  atomic_uint_fast64_t dropped_users;
+  uint64_t reported_dropped;
+  uint64_t reported_users;
+};
+
+/* Commands the connection needs to stay up. */
+static const irc_command_id_t PROTECTED_COMMANDS[] = {
+  IRC_CMD_PING,
+  IRC_CMD_CAP,
+  IRC_CMD_RECONNECT,
+  IRC_CMD_WELCOME,
+  IRC_CMD_NAMES_END
+};
+
+/** Private **/
+
+static uint32_t hash_name(const char *name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)name[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint64_t mix_id(uint64_t id) {
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdull;
+  id ^= id >> 33;
+  id *= 0xc4ceb9fe1a85ec53ull;
+  id ^= id >> 33;
+  return id;
+}
+
+static irc_command_id_t find_command(prefilter_t *prefilter, const char *name, size_t length) {
+  uint32_t mask = PREFILTER_TABLE_SIZE - 1;
+  for (uint32_t idx = hash_name(name, length) & mask;; idx = (idx + 1) & mask) {
+    command_slot_t *slot = &prefilter->commands[idx];
+    if (slot->name == NULL) {
+      return IRC_CMD_OTHER;
+    }
+    if (slot->length == length && memcmp(slot->name, name, length) == 0) {
+      return slot->id;
+    }
+  }
+}
+
+/**
+ * Finds a tag value in raw tags.
+ *
+ * @param tags: Tags, without the leading '@'.
+ * @param end: End of the tags.
+ * @param key: Tag name.
+ * @param length: Set to the length of the value.
+ *
+ * @return: Start of the value, not terminated, or NULL if there's no such tag.
+ **/
+static const char *find_tag(const char *tags, const char *end, const char *key, size_t *length) {
+  size_t key_length = strlen(key);
+
+  for (const char *at = tags; at < end; ) {
+    const char *next = memchr(at, ';', end - at);
+    if (next == NULL) {
+      next = end;
+    }
+    if ((size_t)(next - at) > key_length && memcmp(at, key, key_length) == 0 && at[key_length] == '=') {
+      *length = next - at - key_length - 1;
+      return at + key_length + 1;
+    }
+    at = next + 1;
+  }
+
+  return NULL;
+}
+
+static int is_kept_notice(prefilter_t *prefilter, const char *type, size_t length) {
+  for (int idx = 0; idx < prefilter->notices_count; idx++) {
+    if (strlen(prefilter->notices[idx]) == length && memcmp(prefilter->notices[idx], type, length) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int is_blocked(prefilter_t *prefilter, const char *value, size_t length) {
+  uint64_t id = 0;
+  for (size_t idx = 0; idx < length; idx++) {
+    if (value[idx] < '0' || value[idx] > '9') {
+      return 0;
+    }
+    id = id * 10 + (value[idx] - '0');
+  }
+
+  uint64_t hash = mix_id(id);
+  uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+  for (int probe = 0; probe < PREFILTER_BLOOM_PROBES; probe++) {
+    uint64_t bit = (h1 + probe * h2) & prefilter->bloom_mask;
+    if (!(prefilter->bloom[bit / 64] & (1ull << (bit % 64)))) {
+      return 0;
+    }
+  }
+
+  // Possibly blocked, the sorted list tells false positives apart.
+  size_t low = 0, high = prefilter->blocked_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (prefilter->blocked[middle] < id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low < prefilter->blocked_count && prefilter->blocked[low] == id;
+}
+
+static int compare_ids(const void *first, const void *second) {
+  uint64_t a = *(const uint64_t *)first, b = *(const uint64_t *)second;
+  return a < b ? -1 : a > b;
+}
+
+static int load_blocked(prefilter_t *prefilter, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open blocked users file");
+    return -1;
+  }
+
+  char line[64];
+  size_t capacity = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *end;
+    uint64_t id = strtoull(line, &end, 10);
+    if (end == line || id == 0) {
+      continue;
+    }
+
+    if (prefilter->blocked_count == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 1024;
+      uint64_t *blocked = realloc(prefilter->blocked, capacity * sizeof(uint64_t));
+      if (blocked == NULL) {
+        fclose(file);
+        return -1;
+      }
+      prefilter->blocked = blocked;
+    }
+    prefilter->blocked[prefilter->blocked_count++] = id;
+  }
+  fclose(file);
+
+  qsort(prefilter->blocked, prefilter->blocked_count, sizeof(uint64_t), compare_ids);
+
+  uint64_t bits = 1024;
+  while (bits < prefilter->blocked_count * PREFILTER_BLOOM_BITS) {
+    bits *= 2;
+  }
+  prefilter->bloom = calloc(bits / 64, sizeof(uint64_t));
+  if (prefilter->bloom == NULL) {
+    return -1;
+  }
+  prefilter->bloom_mask = bits - 1;
+
+  for (size_t idx = 0; idx < prefilter->blocked_count; idx++) {
+    uint64_t hash = mix_id(prefilter->blocked[idx]);
+    uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+    for (int probe = 0; probe < PREFILTER_BLOOM_PROBES; probe++) {
+      uint64_t bit = (h1 + probe * h2) & prefilter->bloom_mask;
+      prefilter->bloom[bit / 64] |= 1ull << (bit % 64);
+    }
+  }
+
+  return 0;
+}
+
+static int parse_drop(prefilter_t *prefilter, const char *list) {
+  char copy[256], *pointer = copy, *name;
+
+  snprintf(copy, sizeof(copy), "%s", list);
+  while ((name = strsep(&pointer, ",")) != NULL) {
+    if (name[0] == '\0') {
+      continue;
+    }
+
+    irc_command_id_t id = find_command(prefilter, name, strlen(name));
+    if (id == IRC_CMD_OTHER) {
+      fprintf(stderr, "Unknown command to drop: %s\n", name);
+      return -1;
+    }
+    for (size_t idx = 0; idx < sizeof(PROTECTED_COMMANDS) / sizeof(PROTECTED_COMMANDS[0]); idx++) {
+      if (PROTECTED_COMMANDS[idx] == id) {
+        fprintf(stderr, "The connection needs %s, it can't be dropped\n", name);
+        return -1;
+      }
+    }
+
+    prefilter->drop |= 1u << id;
+  }
+
+  return 0;
+}
+
+static int parse_notices(prefilter_t *prefilter, const char *list) {
+  char copy[1024], *pointer = copy, *type;
+
+  snprintf(copy, sizeof(copy), "%s", list);
+  while ((type = strsep(&pointer, ",")) != NULL) {
+    if (type[0] == '\0') {
+      continue;
+    }
+    if (prefilter->notices_count == PREFILTER_MAX_NOTICES || strlen(type) >= PREFILTER_NOTICE_SIZE) {
+      fprintf(stderr, "Too many or too long USERNOTICE types\n");
+      return -1;
+    }
+    strcpy(prefilter->notices[prefilter->notices_count++], type);
+  }
+
+  return 0;
+}
+
+/** Public **/
+
+prefilter_t *prefilter_init(prefilter_config_t *config) {
+  prefilter_t *prefilter = calloc(1, sizeof(prefilter_t));
+  if (prefilter == NULL) {
+    return NULL;
+  }
+
+  for (irc_command_id_t id = IRC_CMD_OTHER + 1; id < IRC_COMMANDS; id++) {
+    const char *name = irc_command_name(id);
+    size_t length = strlen(name);
+    uint32_t mask = PREFILTER_TABLE_SIZE - 1;
+    uint32_t idx = hash_name(name, length) & mask;
+    while (prefilter->commands[idx].name != NULL) {
+      idx = (idx + 1) & mask;
+    }
+    prefilter->commands[idx] = (command_slot_t){ .name = name, .length = length, .id = id };
+  }
+
+  if ((config->drop != NULL && parse_drop(prefilter, config->drop) == -1)
+      || (config->usernotice != NULL && parse_notices(prefilter, config->usernotice) == -1)
+      || (config->blocked_path != NULL && load_blocked(prefilter, config->blocked_path) == -1)) {
+    prefilter_free(prefilter);
+    return NULL;
+  }
+
+  return prefilter;
+}
+
+int prefilter_accept(prefilter_t *prefilter, const char *line, int size) {
+  const char *at = line, *end = line + size;
+  const char *tags = NULL, *tags_end = NULL;
+
+  // Tags and prefix are skipped whole, up to the space ending them.
+  if (at < end && *at == '@') {
+    tags = at + 1;
+    tags_end = memchr(at, ' ', end - at);
+    if (tags_end == NULL) {
+      return 1;
+    }
+    at = tags_end + 1;
+  }
+  if (at < end && *at == ':') {
+    at = memchr(at, ' ', end - at);
+    if (at == NULL) {
+      return 1;
+    }
+    at++;
+  }
+
+  const char *command = at;
+  while (at < end && *at != ' ' && *at != '\r') {
+    at++;
+  }
+  irc_command_id_t id = find_command(prefilter, command, at - command);
+
+  if (prefilter->drop & (1u << id)) {
+    atomic_fetch_add_explicit(&prefilter->dropped, 1, memory_order_relaxed);
+    return 0;
+  }
+
+  if (tags != NULL && id == IRC_CMD_USERNOTICE && prefilter->notices_count > 0) {
+    size_t length = 0;
+    const char *type = find_tag(tags, tags_end, "msg-id", &length);
+    if (type == NULL || !is_kept_notice(prefilter, type, length)) {
+      atomic_fetch_add_explicit(&prefilter->dropped, 1, memory_order_relaxed);
+      return 0;
+    }
+  }
+
+  if (tags != NULL && prefilter->blocked_count > 0) {
+    size_t length = 0;
+    const char *user_id = find_tag(tags, tags_end, "user-id", &length);
+    if (user_id != NULL && is_blocked(prefilter, user_id, length)) {
+      atomic_fetch_add_explicit(&prefilter->dropped_users, 1, memory_order_relaxed);
+      return 0;
+    }
+  }
+
+  atomic_fetch_add_explicit(&prefilter->passed, 1, memory_order_relaxed);
+  return 1;
+}
+
+void prefilter_report(prefilter_t *prefilter, FILE *file) {
+  uint64_t passed = atomic_load_explicit(&prefilter->passed, memory_order_relaxed);
+  uint64_t dropped = atomic_load_explicit(&prefilter->dropped, memory_order_relaxed);
+  uint64_t users = atomic_load_explicit(&prefilter->dropped_users, memory_order_relaxed);
+
+  if (dropped == prefilter->reported_dropped && users == prefilter->reported_users) {
+    return;
+  }
+
+  fprintf(
+    file,
+    "PREFILTER passed=%lu dropped=%lu blocked_users=%lu\n",
+    (unsigned long)passed,
+    (unsigned long)dropped,
+    (unsigned long)users
+  );
+  prefilter->reported_dropped = dropped;
+  prefilter->reported_users = users;
+}
+
+void prefilter_free(prefilter_t *prefilter) {
+  if (prefilter == NULL) {
+    return;
+  }
+
+  free(prefilter->bloom);
+  free(prefilter->blocked);
+  free(prefilter);
+}
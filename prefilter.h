@@ -0,0 +1,69 @@
+#ifndef PREFILTER_HEADER
+#define PREFILTER_HEADER
+
+#include <stdio.h>
+
+#include "irc.h"
+
+/**
+ * Raw line classifier that drops unwanted lines before they're parsed.
+ *
+ * The command is found by skipping the tags and the prefix to the next space,
+ * and resolved through a small table of the known command names, without
+ * copying the line. Lines can be dropped:
+ *
+ *   - by command, e.g. JOIN, PART, ROOMSTATE;
+ *   - for USERNOTICE, by `msg-id` tag, keeping only the listed types;
+ *   - by `user-id` tag, for blocked users. A Bloom filter rules out most
+ *     senders at once, a sorted list of the ids confirms the rest.
+ *
+ * Commands the connection itself relies on (PING, CAP, RECONNECT, 001, 366)
+ * can't be dropped. Can be shared by connections on different threads.
+ **/
+typedef struct prefilter_t prefilter_t;
+
+/* Classifier settings. */
+typedef struct prefilter_config_t {
+  const char *drop;           // Comma-separated commands to drop, or NULL.
+  const char *usernotice;     // Comma-separated USERNOTICE msg-ids to keep, or NULL to keep all.
+  const char *blocked_path;   // File with a blocked user id per line, or NULL.
+} prefilter_config_t;
+
+/**
+ * Creates a classifier.
+ *
+ * @param config: Settings. Strings are read during the call only.
+ *
+ * @return: A new classifier, or NULL if a command is unknown or can't be dropped,
+ * or the blocked users file can't be read. The reason is printed to stderr.
+ **/
+prefilter_t *prefilter_init(prefilter_config_t *config);
+
+/**
+ * Classifies a raw line.
+ *
+ * @param prefilter: Classifier.
+ * @param line: Raw line, not NUL-terminated.
+ * @param size: Length of the line, without the trailing newline.
+ *
+ * @return: 1 if the line should be parsed, 0 if it should be dropped.
+ **/
+int prefilter_accept(prefilter_t *prefilter, const char *line, int size);
+
+/**
+ * Prints the number of passed and dropped lines, if anything was dropped
+ * since the last report.
+ *
+ * @param prefilter: Classifier.
+ * @param file: Stream to print to.
+ **/
+void prefilter_report(prefilter_t *prefilter, FILE *file);
+
+/**
+ * Frees the classifier.
+ *
+ * @param prefilter: Classifier to free.
+ **/
+void prefilter_free(prefilter_t *prefilter);
+
+#endif
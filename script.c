@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "script.h"
+#include "debug.h"
+
+#ifdef WITH_LUAJIT
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <luajit.h>
+
+#include "commands/tags.h"
+
+/* Budget of the script's top-level code, in handler budgets. Leaves room for building tables. */
+#define SCRIPT_LOAD_BUDGET_SCALE 100
+
+/* Standard libraries scripts get. */
+static const luaL_Reg SCRIPT_LIBRARIES[] = {
+  { "", luaopen_base },
+  { LUA_STRLIBNAME, luaopen_string },
+  { LUA_TABLIBNAME, luaopen_table },
+  { LUA_MATHLIBNAME, luaopen_math },
+  { NULL, NULL }
+};
+
+/* Lua state of one load of the script. */
+typedef struct {
+  lua_State *state;
+  int commands;                     /* Registry reference of the trigger -> handler table. */
+  int on_message;                   /* Registry reference of the catch-all handler, or LUA_NOREF. */
+  int message_view;                 /* Registry references of the message and tags views. */
+  int tags_view;
+  irc_t *irc;                       /* Message being handled, NULL outside of handler calls. */
+  irc_message_t *message;
+} runtime_t;
+
+struct script_t {
+  char *path;
+  int budget;
+  pthread_mutex_t lock;
+  runtime_t *runtime;
+};
+
+/** Private **/
+
+static runtime_t *get_runtime(lua_State *state) {
+  return lua_touserdata(state, lua_upvalueindex(1));
+}
+
+static irc_message_t *current_message(lua_State *state, runtime_t *runtime) {
+  if (runtime->message == NULL) {
+    luaL_error(state, "the message is only available while its handler runs");
+  }
+  return runtime->message;
+}
+
+/**
+ * Gives a single-line argument, so a script can't smuggle in extra IRC commands.
+ **/
+static const char *check_line(lua_State *state, int index) {
+  const char *line = luaL_checkstring(state, index);
+  if (strpbrk(line, "\r\n") != NULL) {
+    luaL_error(state, "line breaks are not allowed");
+  }
+  return line;
+}
+
+static int message_index(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  irc_message_t *message = current_message(state, runtime);
+  const char *key = luaL_checkstring(state, 2);
+
+  const char *value = NULL;
+  if (strcmp(key, "text") == 0) {
+    value = message->message;
+  } else if (strcmp(key, "sender") == 0) {
+    value = message->sender;
+  } else if (strcmp(key, "channel") == 0) {
+    value = message->recipient;
+  } else if (strcmp(key, "command") == 0) {
+    value = message->command;
+  } else if (strcmp(key, "tags") == 0) {
+    lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->tags_view);
+    return 1;
+  }
+
+  if (value != NULL) {
+    lua_pushstring(state, value);
+  } else {
+    lua_pushnil(state);
+  }
+  return 1;
+}
+
+static int tags_index(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  irc_message_t *message = current_message(state, runtime);
+  const char *value = tags_value(message, luaL_checkstring(state, 2));
+
+  if (value != NULL) {
+    lua_pushstring(state, value);
+  } else {
+    lua_pushnil(state);
+  }
+  return 1;
+}
+
+static int read_only(lua_State *state) {
+  return luaL_error(state, "the message is read-only");
+}
+
+static int relay_reply(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  irc_message_t *message = current_message(state, runtime);
+  irc_command(runtime->irc, "PRIVMSG %s :%s", message->recipient, check_line(state, 1));
+  return 0;
+}
+
+static int relay_send(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  current_message(state, runtime);
+  irc_command(runtime->irc, "%s", check_line(state, 1));
+  return 0;
+}
+
+static int relay_command(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  luaL_checkstring(state, 1);
+  luaL_checktype(state, 2, LUA_TFUNCTION);
+
+  lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->commands);
+  lua_pushvalue(state, 1);
+  lua_pushvalue(state, 2);
+  lua_rawset(state, -3);
+  return 0;
+}
+
+static int relay_on_message(lua_State *state) {
+  runtime_t *runtime = get_runtime(state);
+  luaL_checktype(state, 1, LUA_TFUNCTION);
+
+  luaL_unref(state, LUA_REGISTRYINDEX, runtime->on_message);
+  lua_pushvalue(state, 1);
+  runtime->on_message = luaL_ref(state, LUA_REGISTRYINDEX);
+  return 0;
+}
+
+static int relay_log(lua_State *state) {
+  LOG(LOG_LEVEL_ERROR, "Script: %s\n", luaL_checkstring(state, 1));
+  return 0;
+}
+
+static const luaL_Reg RELAY_FUNCTIONS[] = {
+  { "reply", relay_reply },
+  { "send", relay_send },
+  { "command", relay_command },
+  { "on_message", relay_on_message },
+  { "log", relay_log },
+  { NULL, NULL }
+};
+
+static void budget_hook(lua_State *state, lua_Debug *debug) {
+  luaL_error(state, "instruction budget exceeded");
+}
+
+/**
+ * Creates an empty userdata whose fields are read through the given function.
+ *
+ * @return: Registry reference of the view.
+ **/
+static int make_view(lua_State *state, runtime_t *runtime, lua_CFunction index) {
+  lua_newuserdata(state, 0);
+  lua_newtable(state);
+  lua_pushlightuserdata(state, runtime);
+  lua_pushcclosure(state, index, 1);
+  lua_setfield(state, -2, "__index");
+  lua_pushcfunction(state, read_only);
+  lua_setfield(state, -2, "__newindex");
+  lua_pushboolean(state, 0);
+  lua_setfield(state, -2, "__metatable");
+  lua_setmetatable(state, -2);
+  return luaL_ref(state, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Calls the function on top of the stack with the message view, within the budget.
+ *
+ * @return: 0 on success, -1 if the call failed.
+ **/
+static int call_protected(runtime_t *runtime, int arguments, int budget) {
+  lua_State *state = runtime->state;
+  lua_sethook(state, budget_hook, LUA_MASKCOUNT, budget);
+  int error = lua_pcall(state, arguments, 0, 0);
+  lua_sethook(state, NULL, 0, 0);
+
+  if (error != 0) {
+    const char *reason = lua_tostring(state, -1);
+    LOG(LOG_LEVEL_ERROR, "Script error: %s\n", reason != NULL ? reason : "(not a string)");
+    lua_pop(state, 1);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void free_runtime(runtime_t *runtime) {
+  if (runtime == NULL) {
+    return;
+  }
+
+  lua_close(runtime->state);
+  free(runtime);
+}
+
+/**
+ * Creates a Lua state with the relay API and runs the script file in it.
+ *
+ * @return: Runtime with the script's handlers, or NULL if the script failed to load.
+ **/
+static runtime_t *load_runtime(script_t *script) {
+  runtime_t *runtime = calloc(1, sizeof(runtime_t));
+  if (runtime == NULL) {
+    return NULL;
+  }
+
+  lua_State *state = luaL_newstate();
+  if (state == NULL) {
+    free(runtime);
+    return NULL;
+  }
+  runtime->state = state;
+  runtime->on_message = LUA_NOREF;
+
+  // No os, io or package: the count hook doesn't stop a blocking C call, and
+  // a stalled handler holds up the parser. dofile and loadfile read files too.
+  for (const luaL_Reg *library = SCRIPT_LIBRARIES; library->func != NULL; library++) {
+    lua_pushcfunction(state, library->func);
+    lua_pushstring(state, library->name);
+    lua_call(state, 1, 0);
+  }
+  lua_pushnil(state);
+  lua_setglobal(state, "dofile");
+  lua_pushnil(state);
+  lua_setglobal(state, "loadfile");
+
+  // Compiled traces skip the count hook, which would make the budget unenforceable.
+  luaJIT_setmode(state, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+
+  lua_newtable(state);
+  runtime->commands = luaL_ref(state, LUA_REGISTRYINDEX);
+  runtime->message_view = make_view(state, runtime, message_index);
+  runtime->tags_view = make_view(state, runtime, tags_index);
+
+  lua_newtable(state);
+  for (const luaL_Reg *function = RELAY_FUNCTIONS; function->name != NULL; function++) {
+    lua_pushlightuserdata(state, runtime);
+    lua_pushcclosure(state, function->func, 1);
+    lua_setfield(state, -2, function->name);
+  }
+  lua_setglobal(state, "relay");
+
+  if (luaL_loadfile(state, script->path) != 0) {
+    fprintf(stderr, "Failed to load script %s: %s\n", script->path, lua_tostring(state, -1));
+    free_runtime(runtime);
+    return NULL;
+  }
+
+  if (call_protected(runtime, 0, script->budget * SCRIPT_LOAD_BUDGET_SCALE) == -1) {
+    fprintf(stderr, "Failed to run script %s\n", script->path);
+    free_runtime(runtime);
+    return NULL;
+  }
+
+  return runtime;
+}
+
+/** Public **/
+
+script_t *script_init(const char *path, int budget) {
+  script_t *script = calloc(1, sizeof(script_t));
+  if (script == NULL) {
+    return NULL;
+  }
+
+  script->path = strdup(path);
+  script->budget = budget;
+  pthread_mutex_init(&script->lock, NULL);
+
+  script->runtime = load_runtime(script);
+  if (script->runtime == NULL) {
+    script_free(script);
+    return NULL;
+  }
+
+  return script;
+}
+
+int script_reload(script_t *script) {
+  // Load outside the lock, handlers keep running on the old state meanwhile.
+  runtime_t *runtime = load_runtime(script);
+  if (runtime == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&script->lock);
+  runtime_t *old = script->runtime;
+  script->runtime = runtime;
+  pthread_mutex_unlock(&script->lock);
+
+  free_runtime(old);
+  return 0;
+}
+
+int script_handle_message(script_t *script, irc_t *irc, irc_message_t *message) {
+  int found = 0;
+
+  if (message->message == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&script->lock);
+
+  runtime_t *runtime = script->runtime;
+  lua_State *state = runtime->state;
+  runtime->irc = irc;
+  runtime->message = message;
+
+  // Command registered for the first word.
+  lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->commands);
+  lua_pushlstring(state, message->message, strcspn(message->message, " "));
+  lua_rawget(state, -2);
+  if (lua_isfunction(state, -1)) {
+    lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->message_view);
+    call_protected(runtime, 1, script->budget);
+    found = 1;
+  } else {
+    lua_pop(state, 1);
+  }
+  lua_pop(state, 1);
+
+  if (runtime->on_message != LUA_NOREF) {
+    lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->on_message);
+    lua_rawgeti(state, LUA_REGISTRYINDEX, runtime->message_view);
+    call_protected(runtime, 1, script->budget);
+  }
+
+  runtime->irc = NULL;
+  runtime->message = NULL;
+
+  pthread_mutex_unlock(&script->lock);
+  return found;
+}
+
+void script_free(script_t *script) {
+  if (script == NULL) {
+    return;
+  }
+
+  free_runtime(script->runtime);
+  pthread_mutex_destroy(&script->lock);
+  free(script->path);
+  free(script);
+}
+
+#else
+
+/* Built without LuaJIT, scripts can't be loaded. */
+struct script_t {
+  int unused;
+};
+
+script_t *script_init(const char *path, int budget) {
+  fprintf(stderr, "Scripts are not supported by this build, rebuild with WITH_LUAJIT=1\n");
+  errno = ENOTSUP;
+  return NULL;
+}
+
+int script_reload(script_t *script) {
+  return -1;
+}
+
+int script_handle_message(script_t *script, irc_t *irc, irc_message_t *message) {
+  return 0;
+}
+
+void script_free(script_t *script) {
+}
+
+#endif
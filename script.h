@@ -0,0 +1,74 @@
+#ifndef SCRIPT_HEADER
+#define SCRIPT_HEADER
+
+#include "irc.h"
+
+/**
+ * Chat commands written in Lua, run inside the relay by an embedded LuaJIT.
+ *
+ * A script registers its handlers through the global `relay` table:
+ *
+ *   relay.command("$dice", function(msg)
+ *     relay.reply(msg.tags["display-name"] .. " rolled " .. math.random(6))
+ *   end)
+ *
+ *   relay.on_message(function(msg) ... end)   -- every chat message
+ *
+ * Handlers get a read-only view of the parsed message: `msg.text`,
+ * `msg.sender`, `msg.channel`, `msg.command` and `msg.tags[name]` with
+ * unescaped tag values. Nothing is copied until a field is read, and the view
+ * is only valid during the call. `relay.reply(text)` answers in the message's
+ * channel, `relay.send(line)` sends a raw IRC command, both straight through
+ * irc_command(). `relay.log(text)` writes to the relay's log.
+ *
+ * Every call runs with an instruction budget; a handler that exceeds it is
+ * aborted with an error. LuaJIT only counts instructions in its interpreter,
+ * so the JIT compiler is off for scripts.
+ *
+ * Reloading loads the file into a fresh Lua state and swaps it in if it
+ * loads without errors, otherwise the old handlers stay.
+ *
+ * Only available when built with WITH_LUAJIT defined.
+ **/
+typedef struct script_t script_t;
+
+/**
+ * Loads a script.
+ *
+ * @param path: Path to the Lua file.
+ * @param budget: Max number of Lua instructions per handler call.
+ *
+ * @return: A new script, or NULL if it fails to load.
+ **/
+script_t *script_init(const char *path, int budget);
+
+/**
+ * Loads the script file again and replaces the handlers if it succeeds.
+ * Safe to call while another thread handles messages.
+ *
+ * @param script: Script.
+ *
+ * @return: 0 on success, -1 if the old handlers were kept.
+ **/
+int script_reload(script_t *script);
+
+/**
+ * Runs the handlers of the script for a chat message: the command registered
+ * for the first word of the message, if any, and the on_message handler.
+ *
+ * @param script: Script.
+ * @param irc: IRC client to reply through.
+ * @param message: Message to handle.
+ *
+ * @return: 1 if a command handler matched the message, 0 otherwise.
+ **/
+int script_handle_message(script_t *script, irc_t *irc, irc_message_t *message);
+
+/**
+ * Closes the Lua state and frees the script.
+ *
+ * @param script: Script to free.
+ **/
+void script_free(script_t *script);
+
+#endif
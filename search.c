@@ -0,0 +1,521 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "search.h"
+#include "utils.h"
+
+/* Size of the memory chunks segments allocate tokens and posting blocks from. */
+#define SEARCH_CHUNK_SIZE (64 * 1024)
+
+/* Initial number of token slots in a segment's table. Must be a power of two. */
+#define SEARCH_TABLE_SIZE 1024
+
+/* Payload size of the first posting block of a token, doubling up to the max for the next ones. */
+#define SEARCH_BLOCK_MIN 16
+#define SEARCH_BLOCK_MAX 1024
+
+#define SEARCH_MINUTE_MS 60000
+
+/* Part of a posting list: varint-encoded sequence number deltas. */
+typedef struct block_t {
+  struct block_t *next;
+  uint32_t used;
+  uint32_t size;
+  unsigned char data[];
+} block_t;
+
+typedef struct {
+  char *token;                      /* NULL for an empty slot. Not terminated, see length. */
+  uint32_t hash;
+  uint32_t length;
+  block_t *head;
+  block_t *tail;
+  uint64_t last;                    /* Last sequence number in the list, deltas start from it. */
+  uint32_t count;
+} posting_t;
+
+typedef struct chunk_t {
+  struct chunk_t *next;
+  size_t used;
+  size_t size;
+  char data[];
+} chunk_t;
+
+/* Tokens of the records added during one minute. */
+typedef struct {
+  int64_t minute;
+  posting_t *table;                 /* Open addressing, capacity is a power of two. */
+  uint32_t capacity;
+  uint32_t count;
+  chunk_t *chunks;                  /* Tokens and posting blocks, newest chunk first. */
+  size_t memory;
+  uint64_t postings;
+} segment_t;
+
+struct search_t {
+  search_config_t config;
+  pthread_mutex_t lock;
+  segment_t *segments;              /* Ring of config.window segments, oldest first. */
+  int first;
+  int count;
+  size_t memory;
+  uint64_t evicted;
+  uint64_t skipped;
+  search_stats_t reported;          /* Counters at the last report. */
+};
+
+/** Private **/
+
+static uint32_t hash_token(const char *token, int length) {
+  uint32_t hash = 2166136261u;
+  for (int idx = 0; idx < length; idx++) {
+    hash ^= (unsigned char)token[idx];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int is_token_char(unsigned char c) {
+  return c >= 0x80 || c == '_' || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/**
+ * Reads the next token of a text, lowercased and cut to SEARCH_MAX_TOKEN bytes.
+ *
+ * @param cursor: Position in the text, moved past the token.
+ * @param token: Buffer of SEARCH_MAX_TOKEN bytes. Not terminated.
+ *
+ * @return: Length of the token, 0 at the end of the text.
+ **/
+static int next_token(const char **cursor, char *token) {
+  const unsigned char *at = (const unsigned char *)*cursor;
+
+  while (*at != '\0') {
+    while (*at != '\0' && !is_token_char(*at)) {
+      at++;
+    }
+
+    int length = 0;
+    while (is_token_char(*at)) {
+      if (length < SEARCH_MAX_TOKEN) {
+        token[length++] = *at >= 'A' && *at <= 'Z' ? *at + ('a' - 'A') : *at;
+      }
+      at++;
+    }
+
+    if (length >= SEARCH_MIN_TOKEN) {
+      *cursor = (const char *)at;
+      return length;
+    }
+  }
+
+  *cursor = (const char *)at;
+  return 0;
+}
+
+static void *segment_alloc(search_t *search, segment_t *segment, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+
+  chunk_t *chunk = segment->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    size_t chunk_size = size > SEARCH_CHUNK_SIZE ? size : SEARCH_CHUNK_SIZE;
+    chunk = malloc(sizeof(chunk_t) + chunk_size);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = segment->chunks;
+    chunk->used = 0;
+    chunk->size = chunk_size;
+    segment->chunks = chunk;
+    segment->memory += sizeof(chunk_t) + chunk_size;
+    search->memory += sizeof(chunk_t) + chunk_size;
+  }
+
+  void *pointer = chunk->data + chunk->used;
+  chunk->used += size;
+  return pointer;
+}
+
+/**
+ * Finds the slot of a token: the one holding it, or the empty one it goes into.
+ **/
+static posting_t *find_slot(segment_t *segment, const char *token, int length, uint32_t hash) {
+  uint32_t mask = segment->capacity - 1;
+  for (uint32_t idx = hash & mask;; idx = (idx + 1) & mask) {
+    posting_t *posting = &segment->table[idx];
+    if (posting->token == NULL
+        || (posting->hash == hash && posting->length == (uint32_t)length && memcmp(posting->token, token, length) == 0)) {
+      return posting;
+    }
+  }
+}
+
+static int grow_table(search_t *search, segment_t *segment) {
+  uint32_t capacity = segment->capacity * 2;
+  posting_t *table = calloc(capacity, sizeof(posting_t));
+  if (table == NULL) {
+    return -1;
+  }
+
+  posting_t *old = segment->table;
+  uint32_t old_capacity = segment->capacity;
+  segment->table = table;
+  segment->capacity = capacity;
+  for (uint32_t idx = 0; idx < old_capacity; idx++) {
+    if (old[idx].token != NULL) {
+      *find_slot(segment, old[idx].token, old[idx].length, old[idx].hash) = old[idx];
+    }
+  }
+  free(old);
+
+  segment->memory += (capacity - old_capacity) * sizeof(posting_t);
+  search->memory += (capacity - old_capacity) * sizeof(posting_t);
+  return 0;
+}
+
+static void drop_oldest(search_t *search) {
+  segment_t *segment = &search->segments[search->first];
+  while (segment->chunks != NULL) {
+    chunk_t *next = segment->chunks->next;
+    free(segment->chunks);
+    segment->chunks = next;
+  }
+  free(segment->table);
+  search->memory -= segment->memory;
+
+  search->first = (search->first + 1) % search->config.window;
+  search->count--;
+}
+
+/**
+ * Drops segments that left the window.
+ **/
+static void advance(search_t *search, int64_t minute) {
+  while (search->count > 0 && search->segments[search->first].minute <= minute - search->config.window) {
+    drop_oldest(search);
+  }
+}
+
+static segment_t *open_segment(search_t *search, int64_t minute) {
+  if (search->count == search->config.window) {
+    drop_oldest(search);
+  }
+
+  segment_t *segment = &search->segments[(search->first + search->count) % search->config.window];
+  memset(segment, 0, sizeof(segment_t));
+  segment->minute = minute;
+  segment->capacity = SEARCH_TABLE_SIZE;
+  segment->table = calloc(segment->capacity, sizeof(posting_t));
+  if (segment->table == NULL) {
+    return NULL;
+  }
+  segment->memory = segment->capacity * sizeof(posting_t);
+  search->memory += segment->memory;
+
+  search->count++;
+  return segment;
+}
+
+/**
+ * Adds a sequence number to a token's list, once per record.
+ *
+ * @return: 0 on success, -1 if memory can't be allocated.
+ **/
+static int append_posting(search_t *search, segment_t *segment, posting_t *posting, uint64_t seq) {
+  if (posting->count > 0 && posting->last == seq) {
+    return 0;
+  }
+
+  unsigned char bytes[10];
+  int length = 0;
+  uint64_t delta = seq - posting->last;
+  do {
+    bytes[length++] = (delta & 0x7f) | (delta >= 0x80 ? 0x80 : 0);
+    delta >>= 7;
+  } while (delta != 0);
+
+  // Varints never straddle blocks, the rest of a full block stays unused.
+  block_t *tail = posting->tail;
+  if (tail == NULL || tail->size - tail->used < (uint32_t)length) {
+    uint32_t size = tail == NULL ? SEARCH_BLOCK_MIN : tail->size * 2 < SEARCH_BLOCK_MAX ? tail->size * 2 : SEARCH_BLOCK_MAX;
+    block_t *block = segment_alloc(search, segment, sizeof(block_t) + size);
+    if (block == NULL) {
+      return -1;
+    }
+    block->next = NULL;
+    block->used = 0;
+    block->size = size;
+
+    if (tail != NULL) {
+      tail->next = block;
+    } else {
+      posting->head = block;
+    }
+    posting->tail = tail = block;
+  }
+
+  memcpy(tail->data + tail->used, bytes, length);
+  tail->used += length;
+  posting->last = seq;
+  posting->count++;
+  segment->postings++;
+  return 0;
+}
+
+/**
+ * Decodes a posting list into an array of `count` sequence numbers.
+ **/
+static void decode_posting(posting_t *posting, uint64_t *seqs) {
+  uint64_t seq = 0;
+  int count = 0;
+
+  for (block_t *block = posting->head; block != NULL; block = block->next) {
+    uint32_t at = 0;
+    while (at < block->used) {
+      uint64_t delta = 0;
+      int shift = 0;
+      unsigned char byte;
+      do {
+        byte = block->data[at++];
+        delta |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+      } while (byte & 0x80);
+
+      seq += delta;
+      seqs[count++] = seq;
+    }
+  }
+}
+
+/**
+ * Keeps the sequence numbers of `seqs` that are also in `other`. Both are sorted.
+ *
+ * @return: Number of sequence numbers kept.
+ **/
+static int intersect(uint64_t *seqs, int count, const uint64_t *other, int other_count) {
+  int kept = 0, at = 0;
+  for (int idx = 0; idx < count; idx++) {
+    while (at < other_count && other[at] < seqs[idx]) {
+      at++;
+    }
+    if (at < other_count && other[at] == seqs[idx]) {
+      seqs[kept++] = seqs[idx];
+    }
+  }
+  return kept;
+}
+
+/** Public **/
+
+search_t *search_init(search_config_t *config) {
+  search_t *search = calloc(1, sizeof(search_t));
+  if (search == NULL) {
+    return NULL;
+  }
+
+  search->config = *config;
+  search->segments = calloc(config->window, sizeof(segment_t));
+  if (search->segments == NULL) {
+    free(search);
+    return NULL;
+  }
+
+  pthread_mutex_init(&search->lock, NULL);
+  return search;
+}
+
+void search_add(search_t *search, uint64_t seq, const char *text) {
+  if (text == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&search->lock);
+
+  int64_t minute = monotonic_ms() / SEARCH_MINUTE_MS;
+  advance(search, minute);
+
+  segment_t *segment = NULL;
+  if (search->count > 0) {
+    segment = &search->segments[(search->first + search->count - 1) % search->config.window];
+  }
+  if (segment == NULL || segment->minute != minute) {
+    segment = open_segment(search, minute);
+  }
+
+  // Older minutes make room for the current one.
+  while (search->memory > search->config.max_memory && search->count > 1) {
+    drop_oldest(search);
+    search->evicted++;
+  }
+
+  if (segment == NULL || search->memory > search->config.max_memory) {
+    search->skipped++;
+    pthread_mutex_unlock(&search->lock);
+    return;
+  }
+
+  char token[SEARCH_MAX_TOKEN];
+  int length;
+  while ((length = next_token(&text, token)) > 0) {
+    if (segment->count * 2 >= segment->capacity && grow_table(search, segment) == -1) {
+      break;
+    }
+
+    uint32_t hash = hash_token(token, length);
+    posting_t *posting = find_slot(segment, token, length, hash);
+    if (posting->token == NULL) {
+      char *copy = segment_alloc(search, segment, length);
+      if (copy == NULL) {
+        break;
+      }
+      memcpy(copy, token, length);
+      posting->token = copy;
+      posting->hash = hash;
+      posting->length = length;
+      segment->count++;
+    }
+
+    if (append_posting(search, segment, posting, seq) == -1) {
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&search->lock);
+}
+
+int search_query(search_t *search, const char *query, int minutes, uint64_t *seqs, int max) {
+  char terms[SEARCH_MAX_TERMS][SEARCH_MAX_TOKEN];
+  int lengths[SEARCH_MAX_TERMS];
+  uint32_t hashes[SEARCH_MAX_TERMS];
+  int terms_count = 0;
+
+  while (terms_count < SEARCH_MAX_TERMS && (lengths[terms_count] = next_token(&query, terms[terms_count])) > 0) {
+    hashes[terms_count] = hash_token(terms[terms_count], lengths[terms_count]);
+    terms_count++;
+  }
+  if (terms_count == 0 || max <= 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&search->lock);
+
+  int64_t minute = monotonic_ms() / SEARCH_MINUTE_MS;
+  advance(search, minute);
+
+  // Matches go into a ring, so only the newest `max` are kept.
+  uint64_t total = 0;
+  for (int idx = 0; idx < search->count; idx++) {
+    segment_t *segment = &search->segments[(search->first + idx) % search->config.window];
+    if (minutes > 0 && segment->minute <= minute - minutes) {
+      continue;
+    }
+
+    posting_t *lists[SEARCH_MAX_TERMS];
+    posting_t *shortest = NULL;
+    int found = 1;
+    for (int term = 0; term < terms_count && found; term++) {
+      lists[term] = find_slot(segment, terms[term], lengths[term], hashes[term]);
+      found = lists[term]->token != NULL;
+      if (found && (shortest == NULL || lists[term]->count < shortest->count)) {
+        shortest = lists[term];
+      }
+    }
+    if (!found) {
+      continue;
+    }
+
+    // Start from the shortest list and keep what every other list has too.
+    uint64_t *matches = malloc(shortest->count * sizeof(uint64_t));
+    uint64_t *other = malloc(segment->postings * sizeof(uint64_t));
+    if (matches == NULL || other == NULL) {
+      free(matches);
+      free(other);
+      continue;
+    }
+
+    decode_posting(shortest, matches);
+    int count = shortest->count;
+    for (int term = 0; term < terms_count && count > 0; term++) {
+      if (lists[term] != shortest) {
+        decode_posting(lists[term], other);
+        count = intersect(matches, count, other, lists[term]->count);
+      }
+    }
+
+    for (int match = 0; match < count; match++) {
+      seqs[total++ % max] = matches[match];
+    }
+    free(matches);
+    free(other);
+  }
+
+  pthread_mutex_unlock(&search->lock);
+
+  if (total <= (uint64_t)max) {
+    return (int)total;
+  }
+
+  // The oldest kept match is where the next one would have gone.
+  uint64_t *ordered = malloc(max * sizeof(uint64_t));
+  if (ordered == NULL) {
+    return -1;
+  }
+  int start = total % max;
+  memcpy(ordered, seqs + start, (max - start) * sizeof(uint64_t));
+  memcpy(ordered + max - start, seqs, start * sizeof(uint64_t));
+  memcpy(seqs, ordered, max * sizeof(uint64_t));
+  free(ordered);
+  return max;
+}
+
+void search_stats(search_t *search, search_stats_t *stats) {
+  memset(stats, 0, sizeof(search_stats_t));
+
+  pthread_mutex_lock(&search->lock);
+  for (int idx = 0; idx < search->count; idx++) {
+    segment_t *segment = &search->segments[(search->first + idx) % search->config.window];
+    stats->tokens += segment->count;
+    stats->postings += segment->postings;
+  }
+  stats->segments = search->count;
+  stats->memory = search->memory;
+  stats->evicted = search->evicted;
+  stats->skipped = search->skipped;
+  pthread_mutex_unlock(&search->lock);
+}
+
+void search_report(search_t *search, FILE *file) {
+  search_stats_t stats;
+  search_stats(search, &stats);
+
+  if (stats.evicted == search->reported.evicted && stats.skipped == search->reported.skipped) {
+    return;
+  }
+
+  fprintf(
+    file,
+    "SEARCH segments=%d tokens=%lu postings=%lu memory=%zu/%zu evicted=%lu skipped=%lu\n",
+    stats.segments,
+    stats.tokens,
+    stats.postings,
+    stats.memory,
+    search->config.max_memory,
+    stats.evicted,
+    stats.skipped
+  );
+  search->reported = stats;
+}
+
+void search_free(search_t *search) {
+  if (search == NULL) {
+    return;
+  }
+
+  while (search->count > 0) {
+    drop_oldest(search);
+  }
+  pthread_mutex_destroy(&search->lock);
+  free(search->segments);
+  free(search);
+}
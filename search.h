@@ -0,0 +1,106 @@
+#ifndef SEARCH_HEADER
+#define SEARCH_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Rolling inverted index over recent chat, for finding records by the words
+ * in them.
+ *
+ * Message text is split into tokens: runs of letters, digits, underscores and
+ * non-ASCII bytes, lowercased, at least SEARCH_MIN_TOKEN bytes long and cut
+ * at SEARCH_MAX_TOKEN. Each token maps to a posting list of the sequence
+ * numbers of the records it appears in, stored as varint-encoded deltas.
+ *
+ * The index is split into one segment per minute. A segment's tokens, lists
+ * and strings live in its own memory chunks, so segments leaving the window
+ * are dropped at once without touching their contents. When the index takes
+ * more than its memory limit, the oldest minutes are dropped early; if the
+ * current minute alone is over it, new records aren't indexed until the next
+ * minute.
+ *
+ * Adding and querying can happen on different threads.
+ **/
+typedef struct search_t search_t;
+
+/* Token length bounds, in bytes. */
+#define SEARCH_MIN_TOKEN 2
+#define SEARCH_MAX_TOKEN 32
+
+/* Max number of words in a query. */
+#define SEARCH_MAX_TERMS 8
+
+/* Index settings. */
+typedef struct search_config_t {
+  int window;            // Minutes of chat kept in the index.
+  size_t max_memory;     // Oldest minutes are dropped once the index takes more than this many bytes.
+} search_config_t;
+
+/* Index counters. */
+typedef struct search_stats_t {
+  int segments;
+  uint64_t tokens;       // Distinct tokens, summed over segments.
+  uint64_t postings;
+  size_t memory;
+  uint64_t evicted;      // Segments dropped for the memory limit before leaving the window.
+  uint64_t skipped;      // Records not indexed because of the memory limit.
+} search_stats_t;
+
+/**
+ * Creates an empty index.
+ *
+ * @param config: Index settings. Copied.
+ *
+ * @return: A new index, or NULL if memory can't be allocated.
+ **/
+search_t *search_init(search_config_t *config);
+
+/**
+ * Indexes the text of a record.
+ *
+ * @param search: Index.
+ * @param seq: Sequence number of the record. Must increase from call to call.
+ * @param text: Message text.
+ **/
+void search_add(search_t *search, uint64_t seq, const char *text);
+
+/**
+ * Finds records containing all words of a query.
+ *
+ * @param search: Index.
+ * @param query: Words to look for, tokenized like message text.
+ * @param minutes: How far back to look, 0 for the whole window.
+ * @param seqs: Array for the sequence numbers of matching records, in increasing order.
+ * @param max: Size of the array. The newest matches are kept if there are more.
+ *
+ * @return: Number of matches stored, or -1 if the query has no words.
+ **/
+int search_query(search_t *search, const char *query, int minutes, uint64_t *seqs, int max);
+
+/**
+ * Reads the index counters.
+ *
+ * @param search: Index.
+ * @param stats: Counters to fill.
+ **/
+void search_stats(search_t *search, search_stats_t *stats);
+
+/**
+ * Prints the index size and counters, if the memory limit dropped or skipped
+ * anything since the last report.
+ *
+ * @param search: Index.
+ * @param file: Stream to print to.
+ **/
+void search_report(search_t *search, FILE *file);
+
+/**
+ * Frees the index.
+ *
+ * @param search: Index to free.
+ **/
+void search_free(search_t *search);
+
+#endif
@@ -0,0 +1,491 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "sink.h"
+#include "utils.h"
+
+/* How long SINK_BLOCK waits between checks, and how long sink_free() waits for a reader that stopped reading. */
+#define SINK_POLL_MS 1000
+#define SINK_DRAIN_MS 1000
+
+static const char *POLICY_NAMES[SINK_POLICIES] = {
+  "drop-oldest",
+  "drop-newest",
+  "block",
+  "spill"
+};
+
+/**
+ * Queue is a ring holding bytes [head, tail) of the endless stream of
+ * records, positions are taken modulo the capacity. Overflow file holds bytes
+ * [spill_head, spill_tail) of `spill`, records that came after everything in
+ * the queue.
+ **/
+struct sink_t {
+  int fd;
+  int fd_flags;
+  sink_policy_t policy;
+  pthread_mutex_t lock;
+  char *data;
+  size_t capacity;
+  size_t head;
+  size_t tail;
+  int partial;                      /* Record at head was written in part, it can't be dropped. */
+  int spill_fd;
+  char *spill;
+  size_t spill_size;
+  size_t spill_head;
+  size_t spill_tail;
+  int error;                        /* Descriptor failed, everything is dropped from then on. */
+  sink_stats_t stats;
+  sink_stats_t reported;
+};
+
+/** Private **/
+
+static unsigned long count_records(const char *data, size_t length) {
+  unsigned long count = 0;
+  const char *end = data + length;
+  while (data < end && (data = memchr(data, '\n', end - data)) != NULL) {
+    count++;
+    data++;
+  }
+  return count;
+}
+
+/**
+ * Splits queue positions [from, to) into at most two contiguous parts of the ring.
+ *
+ * @return: Number of parts.
+ **/
+static int ring_parts(sink_t *sink, size_t from, size_t to, struct iovec *parts) {
+  size_t offset = from % sink->capacity;
+  size_t contiguous = sink->capacity - offset < to - from ? sink->capacity - offset : to - from;
+
+  parts[0].iov_base = sink->data + offset;
+  parts[0].iov_len = contiguous;
+  parts[1].iov_base = sink->data;
+  parts[1].iov_len = to - from - contiguous;
+  return parts[1].iov_len > 0 ? 2 : 1;
+}
+
+/**
+ * Finds the first newline in queue positions [from, to).
+ *
+ * @return: Its position, or `to` if there's none.
+ **/
+static size_t find_newline(sink_t *sink, size_t from, size_t to) {
+  struct iovec parts[2];
+  int count = ring_parts(sink, from, to, parts);
+
+  for (int idx = 0; idx < count; idx++) {
+    char *newline = memchr(parts[idx].iov_base, '\n', parts[idx].iov_len);
+    if (newline != NULL) {
+      return from + (newline - (char *)parts[idx].iov_base);
+    }
+    from += parts[idx].iov_len;
+  }
+  return to;
+}
+
+/**
+ * Counts records in the queue and the overflow file.
+ **/
+static unsigned long count_queued(sink_t *sink) {
+  struct iovec parts[2];
+  unsigned long count = 0;
+
+  int parts_count = sink->head < sink->tail ? ring_parts(sink, sink->head, sink->tail, parts) : 0;
+  for (int idx = 0; idx < parts_count; idx++) {
+    count += count_records(parts[idx].iov_base, parts[idx].iov_len);
+  }
+  if (sink->spill != NULL) {
+    count += count_records(sink->spill + sink->spill_head, sink->spill_tail - sink->spill_head);
+  }
+  return count;
+}
+
+/**
+ * Checks the result of a write. A full descriptor isn't an error.
+ *
+ * @return: Number of bytes written, or -1 if the descriptor failed.
+ **/
+static ssize_t check_written(sink_t *sink, ssize_t written) {
+  if (written >= 0) {
+    return written;
+  }
+  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+    return 0;
+  }
+
+  sink->error = errno;
+  fprintf(stderr, "SINK: Failed to write the output, dropping records: %s\n", strerror(errno));
+  return -1;
+}
+
+static void reset_spill(sink_t *sink) {
+  sink->spill_head = 0;
+  sink->spill_tail = 0;
+
+  // Give the disk blocks back, the mapping stays valid.
+  if (ftruncate(sink->spill_fd, 0) == -1 || ftruncate(sink->spill_fd, sink->spill_size) == -1) {
+    perror("SINK: Failed to truncate the overflow file");
+  }
+}
+
+static int is_pending(sink_t *sink) {
+  return sink->head < sink->tail || sink->spill_head < sink->spill_tail;
+}
+
+/**
+ * Writes the queue, then the overflow file, until the descriptor stops taking data.
+ **/
+static void flush_locked(sink_t *sink) {
+  while (sink->error == 0 && sink->head < sink->tail) {
+    struct iovec parts[2];
+    int count = ring_parts(sink, sink->head, sink->tail, parts);
+
+    ssize_t written = check_written(sink, writev(sink->fd, parts, count));
+    if (written <= 0) {
+      break;
+    }
+    sink->head += written;
+    sink->partial = sink->data[(sink->head - 1) % sink->capacity] != '\n';
+  }
+
+  if (sink->head == sink->tail) {
+    sink->head = 0;
+    sink->tail = 0;
+    sink->partial = 0;
+  }
+
+  while (sink->error == 0 && sink->head == sink->tail && sink->spill_head < sink->spill_tail) {
+    ssize_t written = check_written(sink, write(sink->fd, sink->spill + sink->spill_head, sink->spill_tail - sink->spill_head));
+    if (written <= 0) {
+      break;
+    }
+    sink->spill_head += written;
+    if (sink->spill_head == sink->spill_tail) {
+      reset_spill(sink);
+    }
+  }
+
+  // Nothing will be written anymore.
+  if (sink->error != 0 && is_pending(sink)) {
+    sink->stats.dropped_oldest += count_queued(sink);
+    sink->head = sink->tail = 0;
+    sink->spill_head = sink->spill_tail = 0;
+  }
+}
+
+/**
+ * Drops the oldest whole record. A record written in part is kept, the one
+ * after it is dropped instead.
+ *
+ * @return: 1 if a record was dropped, 0 if there was none to drop.
+ **/
+static int drop_oldest(sink_t *sink) {
+  size_t start = sink->head;
+  if (sink->partial) {
+    start = find_newline(sink, sink->head, sink->tail);
+    if (start == sink->tail) {
+      return 0;
+    }
+    start++;
+  }
+  if (start == sink->tail) {
+    return 0;
+  }
+
+  size_t stop = find_newline(sink, start, sink->tail);
+  stop = stop < sink->tail ? stop + 1 : stop;
+
+  // Slide the rest of the partial record over the dropped one, from its end since they can overlap.
+  size_t kept = start - sink->head;
+  for (size_t idx = kept; idx > 0; idx--) {
+    sink->data[(stop - kept + idx - 1) % sink->capacity] = sink->data[(sink->head + idx - 1) % sink->capacity];
+  }
+  sink->head = stop - kept;
+  sink->stats.dropped_oldest++;
+  return 1;
+}
+
+/**
+ * Makes sure `length` more bytes fit into the queue, dropping old records if
+ * the policy allows it.
+ *
+ * @return: 1 if they fit, 0 otherwise.
+ **/
+static int make_room(sink_t *sink, size_t length) {
+  if (length > sink->capacity) {
+    return 0;
+  }
+
+  while (sink->capacity - (sink->tail - sink->head) < length) {
+    if (sink->policy != SINK_DROP_OLDEST || !drop_oldest(sink)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Waits for the descriptor to become writable, without holding the lock.
+ **/
+static void wait_writable(sink_t *sink, int timeout) {
+  struct pollfd pollfd = { .fd = sink->fd, .events = POLLOUT };
+
+  pthread_mutex_unlock(&sink->lock);
+  poll(&pollfd, 1, timeout);
+  pthread_mutex_lock(&sink->lock);
+}
+
+static int spill_record(sink_t *sink, const char *record, size_t length) {
+  if (sink->spill_tail + length > sink->spill_size) {
+    sink->stats.dropped_newest++;
+    return -1;
+  }
+
+  memcpy(sink->spill + sink->spill_tail, record, length);
+  sink->spill_tail += length;
+  sink->stats.spilled++;
+  return 0;
+}
+
+static int queue_record(sink_t *sink, const char *record, size_t length) {
+  // Once records go to the overflow file, the rest follows them there to keep the order.
+  if (sink->spill_head < sink->spill_tail) {
+    return spill_record(sink, record, length);
+  }
+
+  if (!make_room(sink, length)) {
+    if (sink->policy == SINK_SPILL) {
+      return spill_record(sink, record, length);
+    }
+    if (sink->policy != SINK_BLOCK || length > sink->capacity) {
+      sink->stats.dropped_newest++;
+      return -1;
+    }
+
+    sink->stats.waits++;
+    do {
+      wait_writable(sink, SINK_POLL_MS);
+      flush_locked(sink);
+      if (sink->error != 0) {
+        sink->stats.dropped_newest++;
+        return -1;
+      }
+    } while (!make_room(sink, length));
+  }
+
+  struct iovec parts[2];
+  int count = ring_parts(sink, sink->tail, sink->tail + length, parts);
+  for (int idx = 0; idx < count; idx++) {
+    memcpy(parts[idx].iov_base, record, parts[idx].iov_len);
+    record += parts[idx].iov_len;
+  }
+  sink->tail += length;
+  return 0;
+}
+
+/** Public **/
+
+sink_t *sink_init(int fd, size_t capacity, sink_policy_t policy, const char *spill_path, size_t spill_size) {
+  sink_t *sink = calloc(1, sizeof(sink_t));
+  if (sink == NULL) {
+    return NULL;
+  }
+
+  sink->fd = fd;
+  sink->policy = policy;
+  sink->capacity = capacity;
+  sink->spill_fd = -1;
+  pthread_mutex_init(&sink->lock, NULL);
+
+  sink->data = malloc(capacity);
+  if (sink->data == NULL) {
+    goto error;
+  }
+
+  // Overflow file is only reached through the mapping, so it's unlinked right away.
+  if (policy == SINK_SPILL) {
+    sink->spill_fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (sink->spill_fd == -1) {
+      goto error;
+    }
+    unlink(spill_path);
+    if (ftruncate(sink->spill_fd, spill_size) == -1) {
+      goto error;
+    }
+    sink->spill = mmap(NULL, spill_size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->spill_fd, 0);
+    if (sink->spill == MAP_FAILED) {
+      sink->spill = NULL;
+      goto error;
+    }
+    sink->spill_size = spill_size;
+  }
+
+  sink->fd_flags = fcntl(fd, F_GETFL);
+  if (sink->fd_flags == -1 || fcntl(fd, F_SETFL, sink->fd_flags | O_NONBLOCK) == -1) {
+    goto error;
+  }
+
+  return sink;
+
+error:
+  if (sink->spill != NULL) {
+    munmap(sink->spill, spill_size);
+  }
+  if (sink->spill_fd != -1) {
+    close(sink->spill_fd);
+  }
+  pthread_mutex_destroy(&sink->lock);
+  free(sink->data);
+  free(sink);
+  return NULL;
+}
+
+int sink_policy_parse(const char *name) {
+  for (int idx = 0; idx < SINK_POLICIES; idx++) {
+    if (strcmp(POLICY_NAMES[idx], name) == 0) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+int sink_write(sink_t *sink, const char *record, size_t length) {
+  int result = 0;
+
+  pthread_mutex_lock(&sink->lock);
+  sink->stats.records++;
+
+  // A record larger than the queue could be left half written with no room for the rest.
+  if (sink->error != 0 || length > sink->capacity) {
+    sink->stats.dropped_newest++;
+    result = -1;
+  } else if (!is_pending(sink)) {
+    // Reader keeps up, skip the queue.
+    ssize_t written = check_written(sink, write(sink->fd, record, length));
+    if (written == -1) {
+      sink->stats.dropped_newest++;
+      result = -1;
+    } else if ((size_t)written < length) {
+      result = queue_record(sink, record + written, length - written);
+      sink->partial = written > 0 && result == 0;
+    }
+  } else {
+    result = queue_record(sink, record, length);
+  }
+
+  pthread_mutex_unlock(&sink->lock);
+  return result;
+}
+
+int sink_flush(sink_t *sink) {
+  pthread_mutex_lock(&sink->lock);
+  flush_locked(sink);
+  int pending = is_pending(sink);
+  pthread_mutex_unlock(&sink->lock);
+  return pending;
+}
+
+int sink_wants_write(sink_t *sink) {
+  pthread_mutex_lock(&sink->lock);
+  int pending = is_pending(sink);
+  pthread_mutex_unlock(&sink->lock);
+  return pending;
+}
+
+int sink_get_fd(sink_t *sink) {
+  return sink->fd;
+}
+
+void sink_stats(sink_t *sink, sink_stats_t *stats) {
+  pthread_mutex_lock(&sink->lock);
+  *stats = sink->stats;
+  stats->queued = sink->tail - sink->head;
+  stats->spill_queued = sink->spill_tail - sink->spill_head;
+  pthread_mutex_unlock(&sink->lock);
+}
+
+void sink_report(sink_t *sink, FILE *file) {
+  sink_stats_t stats;
+  sink_stats(sink, &stats);
+
+  if (stats.queued == 0
+    && stats.spill_queued == 0
+    && stats.dropped_oldest == sink->reported.dropped_oldest
+    && stats.dropped_newest == sink->reported.dropped_newest
+    && stats.spilled == sink->reported.spilled
+    && stats.waits == sink->reported.waits) {
+    return;
+  }
+
+  fprintf(
+    file,
+    "SINK policy=%s records=%lu queued=%zu/%zu spill=%zu spilled=%lu dropped_oldest=%lu dropped_newest=%lu waits=%lu\n",
+    POLICY_NAMES[sink->policy],
+    stats.records,
+    stats.queued,
+    sink->capacity,
+    stats.spill_queued,
+    stats.spilled,
+    stats.dropped_oldest,
+    stats.dropped_newest,
+    stats.waits
+  );
+  sink->reported = stats;
+}
+
+void sink_free(sink_t *sink) {
+  if (sink == NULL) {
+    return;
+  }
+
+  // Last chance for the reader to catch up, as long as it keeps reading.
+  pthread_mutex_lock(&sink->lock);
+  int64_t deadline = monotonic_ms() + SINK_DRAIN_MS;
+  flush_locked(sink);
+  while (is_pending(sink) && sink->error == 0 && monotonic_ms() < deadline) {
+    size_t head = sink->head, spill_head = sink->spill_head;
+    int64_t timeout = deadline - monotonic_ms();
+    wait_writable(sink, timeout > 0 ? timeout : 0);
+    flush_locked(sink);
+    if (sink->head != head || sink->spill_head != spill_head) {
+      deadline = monotonic_ms() + SINK_DRAIN_MS;
+    }
+  }
+
+  sink->stats.dropped_oldest += count_queued(sink);
+  pthread_mutex_unlock(&sink->lock);
+
+  if (sink->stats.dropped_oldest > 0 || sink->stats.dropped_newest > 0 || sink->stats.spilled > 0) {
+    fprintf(
+      stderr,
+      "SINK: Dropped %lu records (%lu oldest, %lu newest), spilled %lu, the output was not keeping up.\n",
+      sink->stats.dropped_oldest + sink->stats.dropped_newest,
+      sink->stats.dropped_oldest,
+      sink->stats.dropped_newest,
+      sink->stats.spilled
+    );
+  }
+
+  fcntl(sink->fd, F_SETFL, sink->fd_flags);
+  if (sink->spill != NULL) {
+    munmap(sink->spill, sink->spill_size);
+    close(sink->spill_fd);
+  }
+  pthread_mutex_destroy(&sink->lock);
+  free(sink->data);
+  free(sink);
+}
@@ -0,0 +1,127 @@
+#ifndef SINK_HEADER
+#define SINK_HEADER
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Non-blocking output with a bounded queue.
+ *
+ * Records are written straight to the descriptor while it keeps up. Whatever
+ * it doesn't take is queued in memory and written once the descriptor becomes
+ * writable again, so a slow reader never stalls the caller. What happens when
+ * the queue is full depends on the policy. Records must end with a newline and
+ * contain no other newlines, dropped records are always whole.
+ *
+ * All functions can be called from different threads.
+ **/
+typedef struct sink_t sink_t;
+
+/* What to do with a record that doesn't fit into the queue. */
+typedef enum {
+  SINK_DROP_OLDEST,   /* Drop queued records to make room, except the one being written. */
+  SINK_DROP_NEWEST,   /* Drop the new record. */
+  SINK_BLOCK,         /* Wait until the reader makes room, like a blocking write. */
+  SINK_SPILL,         /* Append to an overflow file, written out after the queue. */
+  SINK_POLICIES
+} sink_policy_t;
+
+/* Counters since the sink was created. */
+typedef struct {
+  unsigned long records;          /* Records accepted, including spilled ones. */
+  unsigned long dropped_oldest;
+  unsigned long dropped_newest;
+  unsigned long spilled;          /* Records that went through the overflow file. */
+  unsigned long waits;            /* Times SINK_BLOCK had to wait for the reader. */
+  size_t queued;                  /* Bytes in the queue now. */
+  size_t spill_queued;            /* Bytes in the overflow file now. */
+} sink_stats_t;
+
+/**
+ * Creates a sink. Sets the descriptor to non-blocking mode, the original mode
+ * is restored by sink_free().
+ *
+ * @param fd: Descriptor to write to. Not owned by the sink.
+ * @param capacity: Size of the queue in bytes.
+ * @param policy: What to do when the queue is full.
+ * @param spill_path: Overflow file for SINK_SPILL, ignored otherwise. Existing file is replaced.
+ * @param spill_size: Max size of the overflow file. Records that don't fit are dropped.
+ *
+ * @return: A new sink, or NULL in case of an error.
+ **/
+sink_t *sink_init(int fd, size_t capacity, sink_policy_t policy, const char *spill_path, size_t spill_size);
+
+/**
+ * Looks up a policy by name.
+ *
+ * @param name: "drop-oldest", "drop-newest", "block" or "spill".
+ *
+ * @return: The policy, or -1 if the name is unknown.
+ **/
+int sink_policy_parse(const char *name);
+
+/**
+ * Writes a record, or queues it if the descriptor doesn't take it right away.
+ * Records larger than the queue are dropped.
+ *
+ * @param sink: Sink.
+ * @param record: Record, ending with a newline.
+ * @param length: Length of the record.
+ *
+ * @return: 0 if the record was written or queued, -1 if it was dropped.
+ **/
+int sink_write(sink_t *sink, const char *record, size_t length);
+
+/**
+ * Writes queued records without blocking.
+ *
+ * @param sink: Sink.
+ *
+ * @return: 1 if records are still queued, 0 otherwise.
+ **/
+int sink_flush(sink_t *sink);
+
+/**
+ * Checks whether queued records are waiting for the descriptor to become writable.
+ *
+ * @param sink: Sink.
+ *
+ * @return: 1 if so, 0 otherwise.
+ **/
+int sink_wants_write(sink_t *sink);
+
+/**
+ * Returns the descriptor the sink writes to.
+ *
+ * @param sink: Sink.
+ *
+ * @return: Descriptor.
+ **/
+int sink_get_fd(sink_t *sink);
+
+/**
+ * Copies the counters.
+ *
+ * @param sink: Sink.
+ * @param stats: Counters to fill.
+ **/
+void sink_stats(sink_t *sink, sink_stats_t *stats);
+
+/**
+ * Prints queue occupancy and drop counters, if anything was queued, dropped
+ * or spilled since the last report.
+ *
+ * @param sink: Sink.
+ * @param file: Stream to print to.
+ **/
+void sink_report(sink_t *sink, FILE *file);
+
+/**
+ * Writes what the descriptor takes without blocking, reports records left
+ * behind as dropped, restores the descriptor mode and frees the sink.
+ *
+ * @param sink: Sink to free.
+ **/
+void sink_free(sink_t *sink);
+
+#endif
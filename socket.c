@@ -6,36 +6,132 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 
-int sock_connect(char *host, int port) {
-	int return_value = -1, error, fd = -1;
-	struct addrinfo hints, *res = NULL, *rp;
+#include "dns.h"
+#include "utils.h"
+
+/* How long to wait for the resolver when the host isn't cached. */
+#define RESOLVE_TIMEOUT_MS 5000
 
-	char port_string[16];
-	sprintf(port_string, "%d", port);
+/* Delay before trying the next address while earlier attempts are still pending (RFC 8305). */
+#define CONNECT_ATTEMPT_DELAY_MS 250
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;		 /* allow IPv4 or IPv6 */
-	hints.ai_flags = AI_NUMERICSERV; /* avoid name lookup for port */
-	hints.ai_socktype = SOCK_STREAM;
+/* How long to wait for any of the addresses to accept. */
+#define CONNECT_TIMEOUT_MS 10000
+
+int sock_connect(char *host, int port) {
+	dns_address_t found[DNS_MAX_ADDRESSES], addresses[DNS_MAX_ADDRESSES];
+	struct pollfd fds[DNS_MAX_ADDRESSES];
+	int count, started = 0, active = 0, polled = 0, fd = -1, last_error = ECONNREFUSED;
 
-	if ((error = getaddrinfo(host, port_string, &hints, &res))) {
+	if ((count = dns_resolve(host, port, found, DNS_MAX_ADDRESSES, RESOLVE_TIMEOUT_MS)) <= 0) {
 		return -1;
 	}
 
-	for (rp = res; rp; rp = rp->ai_next) {
-		if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1)
-			continue;
+	/* Alternate between families, starting with the one the resolver put first */
+	dns_address_t *families[2][DNS_MAX_ADDRESSES];
+	int sizes[2] = {0, 0}, taken[2] = {0, 0};
+	for (int idx = 0; idx < count; idx++) {
+		int other = found[idx].family != found[0].family;
+		families[other][sizes[other]++] = &found[idx];
+	}
+	for (int idx = 0; idx < count; idx++) {
+		int other = idx % 2;
+		if (taken[other] == sizes[other])
+			other = !other;
+		addresses[idx] = *families[other][taken[other]++];
+	}
 
-		if ((return_value = connect(fd, res->ai_addr, res->ai_addrlen) == -1)) {
-			close(fd);
-			fd = -1;
+	int64_t now = monotonic_ms();
+	int64_t deadline = now + CONNECT_TIMEOUT_MS, next_attempt = now;
+
+	while (fd == -1) {
+		now = monotonic_ms();
+
+		/* Start the next attempt if it's due, or right away if nothing is in flight */
+		if (started < count && (active == 0 || now >= next_attempt)) {
+			dns_address_t *address = &addresses[started++];
+			next_attempt = now + CONNECT_ATTEMPT_DELAY_MS;
+
+			int attempt = socket(address->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if (attempt == -1) {
+				last_error = errno;
+				continue;
+			}
+
+			if (connect(attempt, (struct sockaddr *)&address->address, address->length) == 0) {
+				fd = attempt;
+			} else if (errno == EINPROGRESS) {
+				fds[polled].fd = attempt;
+				fds[polled].events = POLLOUT;
+				fds[polled].revents = 0;
+				polled++;
+				active++;
+			} else {
+				last_error = errno;
+				close(attempt);
+			}
 			continue;
 		}
 
-		break;
+		if (active == 0) {
+			break;
+		}
+
+		if (now >= deadline) {
+			last_error = ETIMEDOUT;
+			break;
+		}
+
+		int64_t wait = deadline - now;
+		if (started < count && next_attempt - now < wait)
+			wait = next_attempt - now;
+
+		if (poll(fds, polled, wait) == -1) {
+			if (errno == EINTR)
+				continue;
+			last_error = errno;
+			break;
+		}
+
+		/* First handshake to complete wins, failed ones make room for the next attempt */
+		for (int idx = 0; idx < polled && fd == -1; idx++) {
+			if (fds[idx].fd == -1 || !fds[idx].revents)
+				continue;
+
+			int error = 0;
+			socklen_t length = sizeof(error);
+			if (getsockopt(fds[idx].fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1)
+				error = errno;
+
+			if (error == 0) {
+				fd = fds[idx].fd;
+			} else {
+				last_error = error;
+				close(fds[idx].fd);
+				active--;
+				next_attempt = now;
+			}
+			fds[idx].fd = -1;
+		}
+	}
+
+	for (int idx = 0; idx < polled; idx++) {
+		if (fds[idx].fd != -1)
+			close(fds[idx].fd);
+	}
+
+	if (fd == -1) {
+		/* None of the addresses work, they may have moved */
+		dns_invalidate(host);
+		errno = last_error;
+		return -1;
 	}
 
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 	return fd;
 }
 
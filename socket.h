@@ -2,12 +2,16 @@
 #define SOCKET_HEADER
 
 /**
- * Opens a socket connection to given server:port.
+ * Opens a socket connection to given server:port. The host name is resolved
+ * through the DNS cache, and its addresses are tried concurrently, alternating
+ * between IPv6 and IPv4 with a short delay between attempts. The first
+ * connection to be established is used and the others are closed.
  *
  * @param host: Host name.
  * @param port: Port number.
  *
- * @return: A file descriptor if connection is opened.
+ * @return: A file descriptor if connection is opened, -1 otherwise. Check
+ * errno for the error of the last attempt.
  **/
 int sock_connect(char *host, int port);
 
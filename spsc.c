@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "spsc.h"
+
+#define CACHE_LINE 64
+
+struct spsc_t {
+  // Written by the producer.
+  _Alignas(CACHE_LINE) atomic_size_t tail;
+  size_t cached_head;
+
+  // Written by the consumer.
+  _Alignas(CACHE_LINE) atomic_size_t head;
+  size_t cached_tail;
+
+  _Alignas(CACHE_LINE) size_t mask;
+  void **items;
+};
+
+spsc_t *spsc_init(int capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  spsc_t *queue = aligned_alloc(CACHE_LINE, sizeof(spsc_t));
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  queue->items = calloc(size, sizeof(void *));
+  if (queue->items == NULL) {
+    free(queue);
+    return NULL;
+  }
+
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  queue->cached_head = 0;
+  queue->cached_tail = 0;
+  queue->mask = size - 1;
+  return queue;
+}
+
+int spsc_push(spsc_t *queue, void **items, int count) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t capacity = queue->mask + 1;
+
+  // Only look at the consumer's index when the cached one says we're full.
+  if (tail - queue->cached_head + count > capacity) {
+    queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  }
+
+  size_t room = capacity - (tail - queue->cached_head);
+  if (count > room) {
+    count = room;
+  }
+
+  for (int idx = 0; idx < count; idx++) {
+    queue->items[(tail + idx) & queue->mask] = items[idx];
+  }
+
+  atomic_store_explicit(&queue->tail, tail + count, memory_order_release);
+  return count;
+}
+
+int spsc_pop(spsc_t *queue, void **items, int max) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  if (queue->cached_tail - head < max) {
+    queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  }
+
+  size_t available = queue->cached_tail - head;
+  int count = available < max ? available : max;
+
+  for (int idx = 0; idx < count; idx++) {
+    items[idx] = queue->items[(head + idx) & queue->mask];
+  }
+
+  atomic_store_explicit(&queue->head, head + count, memory_order_release);
+  return count;
+}
+
+int spsc_size(spsc_t *queue) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  return tail - head;
+}
+
+int spsc_capacity(spsc_t *queue) {
+  return queue->mask + 1;
+}
+
+void spsc_free(spsc_t *queue) {
+  if (queue == NULL) {
+    return;
+  }
+
+  free(queue->items);
+  free(queue);
+}
@@ -0,0 +1,70 @@
+#ifndef SPSC_HEADER
+#define SPSC_HEADER
+
+/**
+ * Bounded lock-free single-producer single-consumer queue of pointers.
+ *
+ * Exactly one thread may push and exactly one thread may pop. Both sides work
+ * in batches, so the shared indexes are touched once per batch rather than
+ * once per item.
+ **/
+typedef struct spsc_t spsc_t;
+
+/**
+ * Creates a new queue.
+ *
+ * @param capacity: Max number of items, rounded up to a power of two.
+ *
+ * @return: A new queue, or NULL if memory can't be allocated.
+ **/
+spsc_t *spsc_init(int capacity);
+
+/**
+ * Pushes as many items as there is room for. Producer side only.
+ *
+ * @param queue: Queue.
+ * @param items: Items to push.
+ * @param count: Number of items.
+ *
+ * @return: Number of items pushed.
+ **/
+int spsc_push(spsc_t *queue, void **items, int count);
+
+/**
+ * Pops up to `max` items. Consumer side only.
+ *
+ * @param queue: Queue.
+ * @param items: Array to hold popped items.
+ * @param max: Size of the array.
+ *
+ * @return: Number of items popped.
+ **/
+int spsc_pop(spsc_t *queue, void **items, int max);
+
+/**
+ * Returns the number of items currently in the queue. Safe to call from any thread,
+ * but the value is only a snapshot.
+ *
+ * @param queue: Queue.
+ *
+ * @return: Number of queued items.
+ **/
+int spsc_size(spsc_t *queue);
+
+/**
+ * Returns the max number of items the queue can hold.
+ *
+ * @param queue: Queue.
+ *
+ * @return: Queue capacity.
+ **/
+int spsc_capacity(spsc_t *queue);
+
+/**
+ * Frees the queue. Items still in the queue are not freed.
+ *
+ * @param queue: Queue to free.
+ **/
+void spsc_free(spsc_t *queue);
+
+#endif
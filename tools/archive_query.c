@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../archive.h"
+#include "../utils.h"
+
+/**
+ * Prints messages from a chat archive written with `--archive`.
+ *
+ * Usage: archive-query <dir> <room-id> [--user <user-id>] [--from <ms>] [--to <ms>]
+ **/
+
+static void print_usage() {
+  fprintf(
+    stderr,
+    "Usage: archive-query <dir> <room-id> [--user <user-id>] [--from <ms>] [--to <ms>]\n"
+    "  Prints archived messages as JSON lines. Timestamps are tmi-sent-ts milliseconds.\n"
+  );
+}
+
+static void print_entry(archive_entry_t *entry, void *context) {
+  char text[2048], escaped[4096];
+
+  int size = entry->text_size < sizeof(text) - 1 ? entry->text_size : sizeof(text) - 1;
+  memcpy(text, entry->text, size);
+  text[size] = '\0';
+  string_quote_escape(text, escaped, sizeof(escaped));
+
+  printf(
+    "{\"ts\":%lld,\"room-id\":\"%llu\",\"user-id\":\"%llu\",\"sender\":\"%.*s\",\"command\":\"%.*s\",\"message\":\"%s\"}\n",
+    (long long)entry->timestamp,
+    (unsigned long long)entry->room_id,
+    (unsigned long long)entry->user_id,
+    entry->sender_size,
+    entry->sender,
+    entry->command_size,
+    entry->command,
+    escaped
+  );
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    print_usage();
+    return 1;
+  }
+
+  archive_query_t query = {
+    .room_id = strtoull(argv[2], NULL, 10),
+    .user_id = 0,
+    .from = INT64_MIN,
+    .to = INT64_MAX
+  };
+
+  for (int idx = 3; idx < argc; idx++) {
+    if (strcmp("--user", argv[idx]) == 0 && idx + 1 < argc) {
+      query.user_id = strtoull(argv[++idx], NULL, 10);
+    } else if (strcmp("--from", argv[idx]) == 0 && idx + 1 < argc) {
+      query.from = strtoll(argv[++idx], NULL, 10);
+    } else if (strcmp("--to", argv[idx]) == 0 && idx + 1 < argc) {
+      query.to = strtoll(argv[++idx], NULL, 10);
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  int found = archive_query(argv[1], &query, print_entry, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  if (found < 0) {
+    perror("Failed to query the archive");
+    return 1;
+  }
+
+  double elapsed = (finished.tv_sec - started.tv_sec) * 1e3 + (finished.tv_nsec - started.tv_nsec) / 1e6;
+  fprintf(stderr, "%d messages in %.3f ms\n", found, elapsed);
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../journal.h"
+
+/**
+ * Reads an output journal written with `--journal` as a named consumer.
+ *
+ * Usage: journal-read <dir> <consumer> [--follow] [--batch <n>]
+ **/
+
+/* Max number of records written out, and committed, at once. */
+#define MAX_BATCH 1024
+
+/* How long to wait for new records when following. */
+#define FOLLOW_SLEEP_NS 10000000
+
+static volatile int terminate = 0;
+
+static void signal_handler(int signal) {
+  terminate = 1;
+}
+
+static void print_usage() {
+  fprintf(
+    stderr,
+    "Usage: journal-read <dir> <consumer> [--follow] [--batch <n>]\n"
+    "  Prints records after the consumer's cursor and commits the cursor once they're written.\n"
+    "  --follow: Keep waiting for new records instead of stopping at the end.\n"
+    "  --batch <n>: Commit after every n records, 256 by default.\n"
+  );
+}
+
+/**
+ * Writes records straight from the mapped segments.
+ *
+ * @return: 0 on success, -1 if the output failed.
+ **/
+static int write_batch(struct iovec *parts, int count) {
+  int done = 0;
+  while (done < count) {
+    ssize_t written = writev(STDOUT_FILENO, parts + done, count - done);
+    if (written < 0) {
+      return -1;
+    }
+    while (done < count && (size_t)written >= parts[done].iov_len) {
+      written -= parts[done].iov_len;
+      done++;
+    }
+    if (done < count) {
+      parts[done].iov_base = (char *)parts[done].iov_base + written;
+      parts[done].iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int follow = 0, batch = 256;
+
+  if (argc < 3) {
+    print_usage();
+    return 1;
+  }
+
+  for (int idx = 3; idx < argc; idx++) {
+    if (strcmp("--follow", argv[idx]) == 0) {
+      follow = 1;
+    } else if (strcmp("--batch", argv[idx]) == 0 && idx + 1 < argc) {
+      batch = atoi(argv[++idx]);
+      if (batch < 1 || batch > MAX_BATCH) {
+        fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_BATCH);
+        return 1;
+      }
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+
+  journal_reader_t *reader = journal_reader_open(argv[1], argv[2]);
+  if (reader == NULL) {
+    perror("Failed to open the journal");
+    return 1;
+  }
+
+  struct iovec parts[MAX_BATCH];
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = FOLLOW_SLEEP_NS };
+  journal_entry_t entry;
+  unsigned long records = 0;
+  int count = 0, status = 0, result = 0;
+  uint64_t last = 0;
+
+  while (!terminate) {
+    status = journal_reader_next(reader, &entry);
+    if (status == 1) {
+      parts[count].iov_base = (void *)entry.data;
+      parts[count].iov_len = entry.size;
+      last = entry.seq;
+      count++;
+      records++;
+    }
+
+    // Records are only committed once they're out, a crash in between repeats them.
+    if (count == batch || (status != 1 && count > 0)) {
+      if (write_batch(parts, count) == -1) {
+        perror("Failed to write records");
+        result = 1;
+        break;
+      }
+      if (journal_reader_commit(reader, last) == -1) {
+        perror("Failed to commit the cursor");
+        result = 1;
+        break;
+      }
+      count = 0;
+    }
+
+    if (status == -1) {
+      fprintf(stderr, "Journal is damaged after record %llu\n", (unsigned long long)last);
+      result = 1;
+      break;
+    }
+    if (status == 0) {
+      if (!follow) {
+        break;
+      }
+      nanosleep(&pause, NULL);
+    }
+  }
+
+  if (journal_reader_skipped(reader) > 0) {
+    fprintf(stderr, "%llu records were deleted before they were read\n", (unsigned long long)journal_reader_skipped(reader));
+  }
+  fprintf(stderr, "%lu records\n", records);
+
+  journal_reader_close(reader);
+  return result;
+}
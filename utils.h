@@ -1,6 +1,8 @@
 #ifndef UTILS_H_
 #define UTILS_H
 
+#include <stdint.h>
+
 /**
  * Returns max of a list of int pointers.
  *
@@ -21,5 +23,19 @@ int var_max_int(int *first, ...);
  */
 void string_quote_escape(char *in, char *out, int outsize);
 
+/**
+ * Returns current time of the monotonic clock.
+ *
+ * @return: Milliseconds since an arbitrary point in the past.
+ */
+int64_t monotonic_ms();
+
+/**
+ * Returns current time of the wall clock.
+ *
+ * @return: Milliseconds since the epoch.
+ */
+int64_t realtime_ms();
+
 
 #endif